@@ -0,0 +1,115 @@
+/**
+ * Copyright (c) 2014 Derek Simkowiak
+ */
+
+// A plaintext backend for benchmarking the tunnel: it echoes every byte
+// back ("echo", the default), or reads and discards them ("sink").
+//
+// One blocking thread per connection.  That is fine for a few hundred
+// connections, and keeps the backend's own costs out of the tunnel's way.
+//
+//   ./backend -p 9269 [-m echo|sink]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#define BACKEND_BUFFER_SIZE 65536
+
+static int echo_mode = 1;
+
+static int write_all(int socket_fd, const char *buffer, size_t size)
+{
+    ssize_t result;
+
+    while (size > 0) {
+        result = write(socket_fd, buffer, size);
+        if (result < 0 && errno == EINTR) { continue; }
+        if (result <= 0) { return -1; }
+        buffer += result;
+        size -= result;
+    }
+    return 0;
+}
+
+static void *connection_task(void *arg)
+{
+    int socket_fd = (int)(long)arg;
+    char *buffer = malloc(BACKEND_BUFFER_SIZE);
+    ssize_t read_result;
+
+    while (buffer != NULL) {
+        read_result = read(socket_fd, buffer, BACKEND_BUFFER_SIZE);
+        if (read_result < 0 && errno == EINTR) { continue; }
+        if (read_result <= 0) { break; }
+
+        if (echo_mode && write_all(socket_fd, buffer, read_result) != 0) {
+            break;
+        }
+    }
+
+    free(buffer);
+    close(socket_fd);
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    struct sockaddr_in bind_address;
+    int listen_fd, socket_fd, option, port = 9269;
+    int one = 1;
+    pthread_t thread;
+    pthread_attr_t attributes;
+
+    while ((option = getopt(argc, argv, "p:m:")) != -1) {
+        switch (option) {
+        case 'p': port = atoi(optarg); break;
+        case 'm': echo_mode = (strcmp(optarg, "sink") != 0); break;
+        default:
+            fprintf(stderr, "usage: %s [-p port] [-m echo|sink]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    memset(&bind_address, 0, sizeof(bind_address));
+    bind_address.sin_family = AF_INET;
+    bind_address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    bind_address.sin_port = htons(port);
+
+    if (bind(listen_fd, (struct sockaddr *)&bind_address, sizeof(bind_address)) < 0 ||
+        listen(listen_fd, 1024) < 0) {
+        perror("bind()/listen()");
+        return 1;
+    }
+
+    pthread_attr_init(&attributes);
+    pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED);
+    pthread_attr_setstacksize(&attributes, 256 * 1024);
+
+    for (;;) {
+        socket_fd = accept(listen_fd, NULL, NULL);
+        if (socket_fd < 0) {
+            if (errno == EINTR) { continue; }
+            perror("accept()");
+            return 1;
+        }
+        setsockopt(socket_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        if (pthread_create(&thread, &attributes, connection_task,
+                           (void *)(long)socket_fd) != 0) {
+            close(socket_fd);
+        }
+    }
+}
@@ -0,0 +1,515 @@
+/**
+ * Copyright (c) 2014 Derek Simkowiak
+ */
+
+// A TLS load generator for the tunnel.  It runs N client threads, each
+// with one blocking CyaSSL connection at a time, against a tunnel whose
+// destination is ./backend in echo mode.  After the run it prints one JSON
+// object with the results (see run_matrix.sh).
+//
+// Modes:
+//
+//   handshake   Connect, handshake, close, repeat.  Reports handshakes/s
+//               and the connect+handshake latency.
+//   latency     One connection per client; send a message_size request,
+//               wait for the echo, repeat.  Reports requests/s and the
+//               round-trip latency.
+//   throughput  One connection per client; send message_size chunks and
+//               read the echo.  Reports bytes/s (one direction).
+//   storm       The latency clients, plus a reconnect storm: starting a
+//               quarter of the way into the run, storm_rate new connections
+//               per second handshake and close, for storm_sec seconds.
+//               Reports the storm's handshakes and failures, and how long
+//               the established clients took to get their latency back.
+//
+//   ./loadgen -p 9443 -c 32 -d 10 -m latency -s 64
+//   ./loadgen -p 9443 -c 32 -d 20 -m storm -r 2000 -S 3
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include <cyassl/options.h>
+#include <cyassl/ssl.h>
+
+// Per-client latency samples kept for the percentiles:
+#define MAX_SAMPLES_PER_CLIENT 20000
+
+// A blocking read that takes longer than this counts as an error:
+#define IO_TIMEOUT_SEC 5
+
+// Storm mode: latency is "recovered" once every RECOVERY_WINDOW_USEC window
+// has its p90 under RECOVERY_FACTOR times the p90 from before the storm.
+// (One slow window on its own is treated as noise.)
+#define RECOVERY_WINDOW_USEC 250000
+#define RECOVERY_FACTOR 2
+
+typedef enum { MODE_HANDSHAKE, MODE_LATENCY, MODE_THROUGHPUT, MODE_STORM,
+               MODE_COUNT } Mode;
+
+static const char *mode_names[] = {"handshake", "latency", "throughput", "storm"};
+
+typedef struct {
+    const char *host;
+    const char *port;
+    const char *cipher_list;
+    Mode mode;
+    int clients;
+    int duration_sec;
+    size_t message_size;
+    int storm_rate;         // New connections per second
+    int storm_sec;
+    int storm_threads;      // Threads making the storm's connections
+} Options;
+
+typedef struct {
+    uint64_t end_usec;      // When the operation finished, since start_usec
+    uint64_t usec;          // How long it took
+} Sample;
+
+typedef struct {
+    pthread_t thread;
+    uint64_t operations;    // Handshakes or round trips
+    uint64_t bytes;         // Payload bytes sent (and echoed back)
+    uint64_t errors;
+    Sample *samples;
+    size_t sample_count;
+} Client;
+
+static Options options = {
+    .host = "127.0.0.1",
+    .port = "8443",
+    .cipher_list = NULL,
+    .mode = MODE_LATENCY,
+    .clients = 32,
+    .duration_sec = 10,
+    .message_size = 64,
+    .storm_rate = 1000,
+    .storm_sec = 2,
+    .storm_threads = 128,
+};
+
+static CYASSL_CTX *cyassl_ctx;
+static volatile int running = 1;
+static uint64_t start_usec;
+
+// Storm mode: when it runs (since start_usec), and the next connection:
+static uint64_t storm_start_usec, storm_end_usec;
+static uint64_t storm_next_connection = 0;
+
+
+static uint64_t now_usec(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static void add_sample(Client *client, uint64_t begin_usec)
+{
+    uint64_t end_usec = now_usec();
+
+    if (client->sample_count < MAX_SAMPLES_PER_CLIENT) {
+        client->samples[client->sample_count].end_usec = end_usec - start_usec;
+        client->samples[client->sample_count].usec = end_usec - begin_usec;
+        client->sample_count++;
+    }
+}
+
+static int tcp_connect(void)
+{
+    struct addrinfo hints, *result;
+    struct timeval timeout = {IO_TIMEOUT_SEC, 0};
+    int socket_fd, one = 1;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(options.host, options.port, &hints, &result) != 0) {
+        return -1;
+    }
+
+    socket_fd = socket(result->ai_family, result->ai_socktype, result->ai_protocol);
+    if (socket_fd >= 0 &&
+        connect(socket_fd, result->ai_addr, result->ai_addrlen) != 0) {
+        close(socket_fd);
+        socket_fd = -1;
+    }
+    freeaddrinfo(result);
+
+    if (socket_fd >= 0) {
+        setsockopt(socket_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        setsockopt(socket_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(socket_fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    }
+    return socket_fd;
+}
+
+// Connect and handshake.  Returns NULL on failure:
+static CYASSL *tls_connect(int *socket_fd)
+{
+    CYASSL *cyassl;
+
+    *socket_fd = tcp_connect();
+    if (*socket_fd < 0) { return NULL; }
+
+    cyassl = CyaSSL_new(cyassl_ctx);
+    if (cyassl == NULL) {
+        close(*socket_fd);
+        return NULL;
+    }
+    CyaSSL_set_fd(cyassl, *socket_fd);
+
+    if (CyaSSL_connect(cyassl) != SSL_SUCCESS) {
+        CyaSSL_free(cyassl);
+        close(*socket_fd);
+        return NULL;
+    }
+    return cyassl;
+}
+
+static void tls_close(CYASSL *cyassl, int socket_fd)
+{
+    CyaSSL_shutdown(cyassl);
+    CyaSSL_free(cyassl);
+    close(socket_fd);
+}
+
+// Send 'size' bytes and read back the echo.  Returns 0 on success:
+static int round_trip(CYASSL *cyassl, char *buffer, size_t size)
+{
+    size_t received = 0;
+    int result;
+
+    if (CyaSSL_write(cyassl, buffer, size) != (int)size) { return -1; }
+
+    while (received < size) {
+        result = CyaSSL_read(cyassl, buffer + received, size - received);
+        if (result <= 0) { return -1; }
+        received += result;
+    }
+    return 0;
+}
+
+static void *client_task(void *arg)
+{
+    Client *client = (Client *)arg;
+    CYASSL *cyassl = NULL;
+    int socket_fd = -1;
+    uint64_t start;
+    char *buffer = calloc(1, options.message_size);
+
+    if (buffer == NULL) { return NULL; }
+
+    while (running) {
+        if (cyassl == NULL) {
+            start = now_usec();
+            cyassl = tls_connect(&socket_fd);
+            if (cyassl == NULL) {
+                client->errors++;
+                usleep(10000);
+                continue;
+            }
+            if (options.mode == MODE_HANDSHAKE) {
+                add_sample(client, start);
+                client->operations++;
+                tls_close(cyassl, socket_fd);
+                cyassl = NULL;
+                continue;
+            }
+        }
+
+        start = now_usec();
+        if (round_trip(cyassl, buffer, options.message_size) != 0) {
+            client->errors++;
+            tls_close(cyassl, socket_fd);
+            cyassl = NULL;
+            continue;
+        }
+        add_sample(client, start);
+        client->operations++;
+        client->bytes += options.message_size;
+    }
+
+    if (cyassl != NULL) { tls_close(cyassl, socket_fd); }
+    free(buffer);
+    return NULL;
+}
+
+// Storm mode: connect, handshake and close on the storm's schedule:
+static void *storm_task(void *arg)
+{
+    Client *client = (Client *)arg;
+    CYASSL *cyassl;
+    int socket_fd;
+    uint64_t connection, due_usec, start;
+
+    while (running) {
+        connection = __atomic_fetch_add(&storm_next_connection, 1, __ATOMIC_RELAXED);
+        due_usec = storm_start_usec + connection * 1000000 / options.storm_rate;
+        if (due_usec >= storm_end_usec) { break; }
+
+        // If we're behind schedule, go right away:
+        start = now_usec();
+        if (start_usec + due_usec > start) {
+            usleep(start_usec + due_usec - start);
+            start = now_usec();
+        }
+
+        cyassl = tls_connect(&socket_fd);
+        if (cyassl == NULL) {
+            client->errors++;
+            continue;
+        }
+        add_sample(client, start);
+        client->operations++;
+        tls_close(cyassl, socket_fd);
+    }
+    return NULL;
+}
+
+static int compare_latency(const void *a, const void *b)
+{
+    uint64_t left = ((const Sample *)a)->usec, right = ((const Sample *)b)->usec;
+    return (left > right) - (left < right);
+}
+
+static int compare_end(const void *a, const void *b)
+{
+    uint64_t left = ((const Sample *)a)->end_usec, right = ((const Sample *)b)->end_usec;
+    return (left > right) - (left < right);
+}
+
+// Gather the samples of 'count' clients into one array (which the caller
+// frees), and add up their totals:
+static Sample *collect(Client *clients, int count, size_t *sample_count,
+                       uint64_t *operations, uint64_t *bytes, uint64_t *errors)
+{
+    Sample *samples = malloc((count * MAX_SAMPLES_PER_CLIENT + 1) * sizeof(Sample));
+    int index;
+
+    *sample_count = *operations = *bytes = *errors = 0;
+    if (samples == NULL) { return NULL; }
+
+    for (index = 0; index < count; index++) {
+        *operations += clients[index].operations;
+        *bytes += clients[index].bytes;
+        *errors += clients[index].errors;
+        memcpy(&samples[*sample_count], clients[index].samples,
+               clients[index].sample_count * sizeof(Sample));
+        *sample_count += clients[index].sample_count;
+    }
+    return samples;
+}
+
+// The latency at 'fraction' (0.0 to 1.0) of samples sorted by latency:
+static uint64_t percentile(Sample *samples, size_t count, double fraction)
+{
+    return count ? samples[(size_t)((count - 1) * fraction)].usec : 0;
+}
+
+// Storm mode: seconds from the start of the storm until the established
+// clients' latency recovered, or -1 if it never did.  'samples' must be
+// sorted by end_usec:
+static double time_to_recover(Sample *samples, size_t count,
+                              uint64_t baseline_p90, uint64_t end_usec)
+{
+    uint64_t window, window_end, recovered_usec = storm_start_usec;
+    uint64_t threshold = RECOVERY_FACTOR * baseline_p90;
+    size_t first = 0, last, index;
+    int slow, previous_slow = 1;
+    Sample *window_samples = malloc((count + 1) * sizeof(Sample));
+
+    if (window_samples == NULL) { return -1; }
+
+    // Skip to the storm:
+    while (first < count && samples[first].end_usec < storm_start_usec) { first++; }
+
+    for (window = storm_start_usec; window + RECOVERY_WINDOW_USEC <= end_usec;
+         window += RECOVERY_WINDOW_USEC) {
+        window_end = window + RECOVERY_WINDOW_USEC;
+        for (last = first; last < count && samples[last].end_usec < window_end; last++) {}
+
+        // A window with nothing finished is as bad as it gets:
+        for (index = first; index < last; index++) {
+            window_samples[index - first] = samples[index];
+        }
+        qsort(window_samples, last - first, sizeof(Sample), compare_latency);
+        slow = (last == first ||
+                percentile(window_samples, last - first, 0.9) > threshold);
+        if (slow && previous_slow) {
+            recovered_usec = window_end;
+        }
+        previous_slow = slow;
+        first = last;
+    }
+    free(window_samples);
+
+    // Still slow at the end; it never recovered:
+    if (previous_slow && recovered_usec + RECOVERY_WINDOW_USEC > end_usec) {
+        return -1;
+    }
+
+    return (recovered_usec - storm_start_usec) / 1e6;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+        "usage: %s [-h host] [-p port] [-c clients] [-d seconds]\n"
+        "          [-m handshake|latency|throughput|storm] [-s message_size]\n"
+        "          [-C cipher_list] [-r storm_rate] [-S storm_sec]\n"
+        "          [-T storm_threads]\n", name);
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    Client *clients, *storm_clients = NULL;
+    Sample *samples, *storm_samples;
+    uint64_t operations, bytes, errors;
+    uint64_t storm_operations, storm_bytes, storm_errors, baseline_p90 = 0;
+    size_t sample_count, storm_sample_count, baseline_count;
+    double elapsed, recover_sec = 0;
+    int option, index, storm_count = 0;
+
+    while ((option = getopt(argc, argv, "h:p:c:d:m:s:C:r:S:T:")) != -1) {
+        switch (option) {
+        case 'h': options.host = optarg; break;
+        case 'p': options.port = optarg; break;
+        case 'c': options.clients = atoi(optarg); break;
+        case 'd': options.duration_sec = atoi(optarg); break;
+        case 's': options.message_size = (size_t)atol(optarg); break;
+        case 'C': options.cipher_list = optarg; break;
+        case 'r': options.storm_rate = atoi(optarg); break;
+        case 'S': options.storm_sec = atoi(optarg); break;
+        case 'T': options.storm_threads = atoi(optarg); break;
+        case 'm':
+            for (index = 0; index < MODE_COUNT; index++) {
+                if (strcmp(optarg, mode_names[index]) == 0) { break; }
+            }
+            if (index == MODE_COUNT) { usage(argv[0]); }
+            options.mode = index;
+            break;
+        default: usage(argv[0]);
+        }
+    }
+    if (options.clients < 1 || options.message_size < 1 ||
+        options.storm_rate < 1 || options.storm_threads < 1) {
+        usage(argv[0]);
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    CyaSSL_Init();
+    cyassl_ctx = CyaSSL_CTX_new(CyaTLSv1_2_client_method());
+    if (cyassl_ctx == NULL) { return 1; }
+    // This is a benchmark against our own test certificate:
+    CyaSSL_CTX_set_verify(cyassl_ctx, SSL_VERIFY_NONE, 0);
+    if (options.cipher_list != NULL &&
+        CyaSSL_CTX_set_cipher_list(cyassl_ctx, options.cipher_list) != SSL_SUCCESS) {
+        fprintf(stderr, "No usable cipher suites in \"%s\".\n", options.cipher_list);
+        return 1;
+    }
+
+    // The storm starts a quarter of the way in, after a baseline:
+    if (options.mode == MODE_STORM) {
+        storm_count = options.storm_threads;
+        storm_start_usec = (uint64_t)options.duration_sec * 1000000 / 4;
+        storm_end_usec = storm_start_usec + (uint64_t)options.storm_sec * 1000000;
+    }
+
+    clients = calloc(options.clients + storm_count, sizeof(*clients));
+    if (clients == NULL) { return 1; }
+    storm_clients = &clients[options.clients];
+
+    start_usec = now_usec();
+    for (index = 0; index < options.clients + storm_count; index++) {
+        clients[index].samples = malloc(MAX_SAMPLES_PER_CLIENT * sizeof(Sample));
+        if (clients[index].samples == NULL ||
+            pthread_create(&clients[index].thread, NULL,
+                           index < options.clients ? client_task : storm_task,
+                           &clients[index]) != 0) {
+            fprintf(stderr, "Can't start client %d.\n", index);
+            return 1;
+        }
+    }
+
+    sleep(options.duration_sec);
+    running = 0;
+
+    for (index = 0; index < options.clients + storm_count; index++) {
+        pthread_join(clients[index].thread, NULL);
+    }
+    elapsed = (now_usec() - start_usec) / 1e6;
+
+    samples = collect(clients, options.clients, &sample_count,
+                      &operations, &bytes, &errors);
+    if (samples == NULL) { return 1; }
+
+    if (options.mode == MODE_STORM) {
+        // The baseline is everything that finished before the storm:
+        qsort(samples, sample_count, sizeof(Sample), compare_end);
+        for (baseline_count = 0; baseline_count < sample_count &&
+             samples[baseline_count].end_usec < storm_start_usec; baseline_count++) {}
+
+        storm_samples = malloc((baseline_count + 1) * sizeof(Sample));
+        if (storm_samples == NULL) { return 1; }
+        memcpy(storm_samples, samples, baseline_count * sizeof(Sample));
+        qsort(storm_samples, baseline_count, sizeof(Sample), compare_latency);
+        baseline_p90 = percentile(storm_samples, baseline_count, 0.9);
+        free(storm_samples);
+
+        recover_sec = time_to_recover(samples, sample_count, baseline_p90,
+                                      (uint64_t)options.duration_sec * 1000000);
+    }
+    qsort(samples, sample_count, sizeof(Sample), compare_latency);
+
+    printf("{\"mode\":\"%s\",\"clients\":%d,\"duration_sec\":%.3f,"
+           "\"message_size\":%zu,\"operations\":%lu,\"operations_per_sec\":%.1f,"
+           "\"bytes_per_sec\":%.1f,\"errors\":%lu,"
+           "\"latency_usec\":{\"p50\":%lu,\"p90\":%lu,\"p99\":%lu,\"max\":%lu}",
+           mode_names[options.mode], options.clients, elapsed,
+           options.message_size, operations, operations / elapsed,
+           bytes / elapsed, errors,
+           percentile(samples, sample_count, 0.5),
+           percentile(samples, sample_count, 0.9),
+           percentile(samples, sample_count, 0.99),
+           percentile(samples, sample_count, 1.0));
+
+    if (options.mode == MODE_STORM) {
+        storm_samples = collect(storm_clients, storm_count, &storm_sample_count,
+                                &storm_operations, &storm_bytes, &storm_errors);
+        if (storm_samples == NULL) { return 1; }
+        qsort(storm_samples, storm_sample_count, sizeof(Sample), compare_latency);
+
+        printf(",\"storm\":{\"rate\":%d,\"seconds\":%d,\"handshakes\":%lu,"
+               "\"errors\":%lu,\"handshake_usec\":{\"p50\":%lu,\"p99\":%lu},"
+               "\"baseline_p90_usec\":%lu,\"time_to_recover_sec\":%.1f}",
+               options.storm_rate, options.storm_sec, storm_operations,
+               storm_errors, percentile(storm_samples, storm_sample_count, 0.5),
+               percentile(storm_samples, storm_sample_count, 0.99),
+               baseline_p90, recover_sec);
+        free(storm_samples);
+    }
+    printf("}\n");
+
+    for (index = 0; index < options.clients + storm_count; index++) {
+        free(clients[index].samples);
+    }
+    free(samples);
+    free(clients);
+    CyaSSL_CTX_free(cyassl_ctx);
+    CyaSSL_Cleanup();
+    return 0;
+}
@@ -0,0 +1,602 @@
+/**
+ * Copyright (c) 2014 Derek Simkowiak
+ */
+
+// A microbenchmark for ../src/fifo.c and the plaintext relay loops, with
+// no TLS and no libevent in the way.
+//
+// A producer thread writes into one socketpair (or pipe), a consumer thread
+// drains another, and the main thread relays between them with a
+// buffer_size FIFO, using the same read()/write() loops and FIFO
+// bookkeeping as on_read_dest() and on_write_dest() in tunnel_client.c.
+// The relay sockets are non-blocking and poll() stands in for libevent.
+//
+// With "-e uring", the relay thread does the same FIFO bookkeeping but
+// moves the bytes with io_uring instead: one read and one write in flight
+// at a time (into and out of the FIFO's free and used regions, registered
+// once as a fixed buffer), and one io_uring_enter() per pass to submit
+// both and wait for either.  That is a prototype of an io_uring engine for
+// the worker threads, to see what it would save before restructuring them
+// around completions.
+//
+// For each engine, transport and buffer size it prints one JSON object:
+// the relay thread's CPU cycles (TSC) per byte, its syscalls per MB, and
+// the throughput.
+//
+//   ./relaybench [-e poll|uring|both] [-t socketpair|pipe|both]
+//                [-b 4096,16384,65536] [-m MB]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+#ifdef __NR_io_uring_setup
+  #include <linux/io_uring.h>
+  #define HAVE_IO_URING 1
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+  #include <x86intrin.h>
+#endif
+
+#include "../src/fifo.h"
+
+#define DEFAULT_BUFFER_SIZES "4096,16384,65536,262144"
+#define DEFAULT_MEGABYTES 512
+#define MAX_BUFFER_SIZES 32
+
+// The producer's and consumer's own read()/write() size:
+#define ENDPOINT_CHUNK_SIZE 65536
+
+typedef enum { TRANSPORT_SOCKETPAIR, TRANSPORT_PIPE } Transport;
+
+static const char *transport_names[] = {"socketpair", "pipe"};
+
+typedef enum { ENGINE_POLL, ENGINE_URING } Engine;
+
+static const char *engine_names[] = {"poll", "uring"};
+
+typedef struct {
+    int fd;
+    uint64_t byte_count;
+} Endpoint;
+
+typedef struct {
+    uint64_t reads;
+    uint64_t writes;
+    uint64_t polls;
+    uint64_t enters;        // io_uring_enter() calls ("-e uring" only)
+    uint64_t stalls;        // FIFO full when the source was readable
+} RelayCounts;
+
+
+static uint64_t now_nsec(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// TSC cycles where we have them, otherwise nanoseconds:
+static uint64_t now_cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return now_nsec();
+#endif
+}
+
+static uint64_t thread_cpu_nsec(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static void *producer_task(void *arg)
+{
+    Endpoint *endpoint = (Endpoint *)arg;
+    char *chunk = calloc(1, ENDPOINT_CHUNK_SIZE);
+    uint64_t remaining = endpoint->byte_count;
+    ssize_t result;
+
+    while (chunk != NULL && remaining > 0) {
+        result = write(endpoint->fd, chunk,
+                       remaining < ENDPOINT_CHUNK_SIZE ? remaining : ENDPOINT_CHUNK_SIZE);
+        if (result < 0 && errno == EINTR) { continue; }
+        if (result <= 0) { break; }
+        remaining -= result;
+    }
+    free(chunk);
+    close(endpoint->fd);
+    return NULL;
+}
+
+static void *consumer_task(void *arg)
+{
+    Endpoint *endpoint = (Endpoint *)arg;
+    char *chunk = malloc(ENDPOINT_CHUNK_SIZE);
+    ssize_t result;
+
+    endpoint->byte_count = 0;
+    while (chunk != NULL) {
+        result = read(endpoint->fd, chunk, ENDPOINT_CHUNK_SIZE);
+        if (result < 0 && errno == EINTR) { continue; }
+        if (result <= 0) { break; }
+        endpoint->byte_count += result;
+    }
+    free(chunk);
+    return NULL;
+}
+
+// The read loop from on_read_dest().  Returns the last read() result:
+static ssize_t relay_read(int fd, FIFO *fifo, char *buffer, RelayCounts *counts)
+{
+    ssize_t read_result;
+
+    do {
+        read_result = read(fd, &buffer[fifo_write_index(fifo)],
+                           fifo_write_size(fifo));
+        counts->reads++;
+        if (read_result > 0) {
+            fifo_write(fifo, read_result);
+        }
+    } while ((read_result > 0) && fifo_bytes_free(fifo) > 0);
+
+    return read_result;
+}
+
+// The write loop from on_write_dest().  Returns the last write() result:
+static ssize_t relay_write(int fd, FIFO *fifo, char *buffer, RelayCounts *counts)
+{
+    ssize_t write_result;
+
+    do {
+        write_result = write(fd, &buffer[fifo_read_index(fifo)],
+                             fifo_read_size(fifo));
+        counts->writes++;
+        if (write_result > 0) {
+            fifo_read(fifo, write_result);
+        }
+    } while ((write_result > 0) && (fifo_bytes_used(fifo) > 0));
+
+    return write_result;
+}
+
+// Relay everything from source_fd to sink_fd until the source closes and
+// the FIFO is drained.  Returns 0 on success:
+static int relay(int source_fd, int sink_fd, size_t buffer_size,
+                 RelayCounts *counts)
+{
+    FIFO *fifo = fifo_new(buffer_size);
+    char *buffer = malloc(buffer_size);
+    struct pollfd poll_fds[2];
+    int source_open = 1;
+    ssize_t result;
+
+    if (fifo == NULL || buffer == NULL) {
+        fifo_free(fifo);
+        free(buffer);
+        return -1;
+    }
+
+    while (source_open || fifo_bytes_used(fifo) > 0) {
+        // Like the tunnel, only wait for readiness we can act on:
+        poll_fds[0].fd = (source_open && fifo_bytes_free(fifo) > 0) ? source_fd : -1;
+        poll_fds[0].events = POLLIN;
+        poll_fds[1].fd = (fifo_bytes_used(fifo) > 0) ? sink_fd : -1;
+        poll_fds[1].events = POLLOUT;
+
+        if (source_open && fifo_bytes_free(fifo) == 0) { counts->stalls++; }
+
+        counts->polls++;
+        if (poll(poll_fds, 2, -1) < 0) {
+            if (errno == EINTR) { continue; }
+            break;
+        }
+
+        if (poll_fds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+            result = relay_read(source_fd, fifo, buffer, counts);
+            if (result == 0 || (result < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+                source_open = 0;
+            }
+        }
+        if (poll_fds[1].revents & (POLLOUT | POLLHUP | POLLERR)) {
+            result = relay_write(sink_fd, fifo, buffer, counts);
+            if (result < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+                break;
+            }
+        }
+    }
+
+    result = (source_open || fifo_bytes_used(fifo) > 0) ? -1 : 0;
+    fifo_free(fifo);
+    free(buffer);
+    return result;
+}
+
+#ifdef HAVE_IO_URING
+
+// Just enough of an io_uring (no liburing) for relay_uring():
+typedef struct {
+    int fd;
+    unsigned *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size, sqes_size;
+    unsigned to_submit;
+} Ring;
+
+#define RING_ENTRIES 4
+
+// user_data for the two kinds of request:
+#define RING_READ  1
+#define RING_WRITE 2
+
+static void ring_close(Ring *ring)
+{
+    if (ring->sqes != NULL) { munmap(ring->sqes, ring->sqes_size); }
+    if (ring->cq_ring != NULL) { munmap(ring->cq_ring, ring->cq_ring_size); }
+    if (ring->sq_ring != NULL) { munmap(ring->sq_ring, ring->sq_ring_size); }
+    if (ring->fd >= 0) { close(ring->fd); }
+}
+
+static void *ring_map(Ring *ring, size_t size, off_t offset)
+{
+    void *map = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, ring->fd, offset);
+    return (map == MAP_FAILED) ? NULL : map;
+}
+
+static int ring_open(Ring *ring, unsigned entries)
+{
+    struct io_uring_params params;
+    char *sq_ring, *cq_ring;
+
+    memset(ring, 0, sizeof(*ring));
+    memset(&params, 0, sizeof(params));
+
+    ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0) { return -1; }
+
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes +
+                         params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    ring->sq_ring = ring_map(ring, ring->sq_ring_size, IORING_OFF_SQ_RING);
+    ring->cq_ring = ring_map(ring, ring->cq_ring_size, IORING_OFF_CQ_RING);
+    ring->sqes = ring_map(ring, ring->sqes_size, IORING_OFF_SQES);
+    if (ring->sq_ring == NULL || ring->cq_ring == NULL || ring->sqes == NULL) {
+        ring_close(ring);
+        return -1;
+    }
+
+    sq_ring = ring->sq_ring;
+    ring->sq_tail = (unsigned *)(sq_ring + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)(sq_ring + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq_ring + params.sq_off.array);
+    cq_ring = ring->cq_ring;
+    ring->cq_head = (unsigned *)(cq_ring + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq_ring + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)(cq_ring + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq_ring + params.cq_off.cqes);
+    return 0;
+}
+
+// Queue a request; it goes to the kernel with the next ring_enter():
+static void ring_queue(Ring *ring, int opcode, int fd, char *data, size_t size,
+                       uint64_t user_data)
+{
+    unsigned tail = *ring->sq_tail;
+    unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t)data;
+    sqe->len = size;
+    sqe->buf_index = 0;         // The one registered buffer, for *_FIXED
+    sqe->user_data = user_data;
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->to_submit++;
+}
+
+// Submit everything queued and wait for at least one completion:
+static int ring_enter(Ring *ring, RelayCounts *counts)
+{
+    int result;
+
+    counts->enters++;
+    result = syscall(__NR_io_uring_enter, ring->fd, ring->to_submit, 1,
+                     IORING_ENTER_GETEVENTS, NULL, 0);
+    if (result < 0) { return -1; }
+    ring->to_submit -= result;
+    return 0;
+}
+
+// Take the next completion, if there is one.  Returns 0 if not:
+static int ring_reap(Ring *ring, uint64_t *user_data, int *result)
+{
+    unsigned head = *ring->cq_head;
+    struct io_uring_cqe *cqe;
+
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) { return 0; }
+
+    cqe = &ring->cqes[head & *ring->cq_mask];
+    *user_data = cqe->user_data;
+    *result = cqe->res;
+    __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+// relay(), but with io_uring.  A read into the FIFO's free region and a
+// write out of its used region can be in flight at once, since they never
+// overlap; the FIFO counts only move when they complete.  The sockets are
+// blocking here: io_uring waits for readiness itself, but a non-blocking
+// socket would hand us back -EAGAIN instead.
+static int relay_uring(int source_fd, int sink_fd, size_t buffer_size,
+                       RelayCounts *counts)
+{
+    FIFO *fifo = fifo_new(buffer_size);
+    char *buffer = malloc(buffer_size);
+    struct iovec buffer_iov;
+    Ring ring;
+    int source_open = 1, sink_open = 1, reading = 0, writing = 0;
+    int read_opcode = IORING_OP_READ_FIXED, write_opcode = IORING_OP_WRITE_FIXED;
+    uint64_t user_data;
+    int result;
+
+    if (fifo == NULL || buffer == NULL) {
+        fifo_free(fifo);
+        free(buffer);
+        return -1;
+    }
+    if (ring_open(&ring, RING_ENTRIES) != 0) {
+        perror("io_uring_setup()");
+        fifo_free(fifo);
+        free(buffer);
+        return -1;
+    }
+
+    // Register the FIFO's buffer once, so the kernel doesn't have to pin
+    // its pages for every request.  (Without it, plain reads and writes.)
+    buffer_iov.iov_base = buffer;
+    buffer_iov.iov_len = buffer_size;
+    if (syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_BUFFERS,
+                &buffer_iov, 1) != 0) {
+        read_opcode = IORING_OP_READ;
+        write_opcode = IORING_OP_WRITE;
+    }
+
+    while (sink_open && (source_open || fifo_bytes_used(fifo) > 0)) {
+        if (source_open && !reading) {
+            if (fifo_bytes_free(fifo) > 0) {
+                ring_queue(&ring, read_opcode, source_fd,
+                           &buffer[fifo_write_index(fifo)], fifo_write_size(fifo),
+                           RING_READ);
+                reading = 1;
+            } else {
+                counts->stalls++;
+            }
+        }
+        if (!writing && fifo_bytes_used(fifo) > 0) {
+            ring_queue(&ring, write_opcode, sink_fd,
+                       &buffer[fifo_read_index(fifo)], fifo_read_size(fifo),
+                       RING_WRITE);
+            writing = 1;
+        }
+
+        // Both go in with one syscall, which also waits for either:
+        if (ring_enter(&ring, counts) != 0) {
+            if (errno == EINTR) { continue; }
+            break;
+        }
+
+        while (ring_reap(&ring, &user_data, &result)) {
+            if (user_data == RING_READ) {
+                reading = 0;
+                counts->reads++;
+                if (result > 0) {
+                    fifo_write(fifo, result);
+                } else if (result != -EINTR && result != -EAGAIN) {
+                    source_open = 0;
+                }
+            } else {
+                writing = 0;
+                counts->writes++;
+                if (result > 0) {
+                    fifo_read(fifo, result);
+                } else if (result != -EINTR && result != -EAGAIN) {
+                    sink_open = 0;
+                }
+            }
+        }
+    }
+
+    result = (source_open || fifo_bytes_used(fifo) > 0) ? -1 : 0;
+    // (Closing the ring cancels anything still in flight, before the
+    // buffer goes.)
+    ring_close(&ring);
+    fifo_free(fifo);
+    free(buffer);
+    return result;
+}
+
+#else
+
+static int relay_uring(int source_fd, int sink_fd, size_t buffer_size,
+                       RelayCounts *counts)
+{
+    fprintf(stderr, "io_uring isn't available on this platform.\n");
+    return -1;
+}
+
+#endif  // HAVE_IO_URING
+
+// fds[0] is the read end, fds[1] the write end:
+static int make_pair(Transport transport, int fds[2])
+{
+    if (transport == TRANSPORT_PIPE) {
+        return pipe(fds);
+    }
+    return socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+}
+
+static int run(Engine engine, Transport transport, size_t buffer_size,
+               uint64_t byte_count)
+{
+    int in_fds[2], out_fds[2];
+    Endpoint producer, consumer;
+    pthread_t producer_thread, consumer_thread;
+    RelayCounts counts;
+    uint64_t start_nsec, start_cycles, start_cpu;
+    uint64_t relay_nsec, elapsed_nsec, cycles, cpu_nsec, syscalls;
+    double megabytes = byte_count / 1048576.0;
+    int result;
+
+    memset(&counts, 0, sizeof(counts));
+
+    if (make_pair(transport, in_fds) != 0 || make_pair(transport, out_fds) != 0) {
+        perror("make_pair()");
+        return -1;
+    }
+    if (engine == ENGINE_POLL) {
+        fcntl(in_fds[0], F_SETFL, O_NONBLOCK);
+        fcntl(out_fds[1], F_SETFL, O_NONBLOCK);
+    }
+
+    producer.fd = in_fds[1];
+    producer.byte_count = byte_count;
+    consumer.fd = out_fds[0];
+
+    start_nsec = now_nsec();
+    start_cycles = now_cycles();
+    start_cpu = thread_cpu_nsec();
+
+    pthread_create(&producer_thread, NULL, producer_task, &producer);
+    pthread_create(&consumer_thread, NULL, consumer_task, &consumer);
+
+    if (engine == ENGINE_URING) {
+        result = relay_uring(in_fds[0], out_fds[1], buffer_size, &counts);
+    } else {
+        result = relay(in_fds[0], out_fds[1], buffer_size, &counts);
+    }
+
+    // The relay thread's share only; the endpoints run on their own cores:
+    cpu_nsec = thread_cpu_nsec() - start_cpu;
+    cycles = now_cycles() - start_cycles;
+    relay_nsec = now_nsec() - start_nsec;
+    close(out_fds[1]);
+    pthread_join(producer_thread, NULL);
+    pthread_join(consumer_thread, NULL);
+    elapsed_nsec = now_nsec() - start_nsec;
+
+    close(in_fds[0]);
+    close(out_fds[0]);
+
+    if (result != 0 || consumer.byte_count != byte_count) {
+        fprintf(stderr, "%s/%s/%zu: relayed %lu of %lu bytes.\n",
+                engine_names[engine], transport_names[transport], buffer_size,
+                consumer.byte_count, byte_count);
+        return -1;
+    }
+
+    // Scale the wall-clock TSC cycles by the relay thread's CPU share, so
+    // time spent blocked in poll() (or io_uring_enter()) doesn't count:
+    if (relay_nsec > cpu_nsec) {
+        cycles = (uint64_t)((double)cycles * cpu_nsec / relay_nsec);
+    }
+
+    // With io_uring, the reads and writes are requests, not syscalls:
+    syscalls = (engine == ENGINE_URING) ? counts.enters
+             : counts.reads + counts.writes + counts.polls;
+
+    printf("{\"engine\":\"%s\",\"transport\":\"%s\",\"buffer_size\":%zu,"
+           "\"bytes\":%lu,\"cycles_per_byte\":%.3f,\"syscalls_per_mb\":%.1f,"
+           "\"reads_per_mb\":%.1f,\"writes_per_mb\":%.1f,\"polls_per_mb\":%.1f,"
+           "\"enters_per_mb\":%.1f,\"fifo_full_stalls\":%lu,"
+           "\"relay_cpu_sec\":%.3f,\"mb_per_sec\":%.1f}\n",
+           engine_names[engine], transport_names[transport], buffer_size,
+           byte_count, (double)cycles / byte_count, syscalls / megabytes,
+           counts.reads / megabytes, counts.writes / megabytes,
+           counts.polls / megabytes, counts.enters / megabytes, counts.stalls,
+           cpu_nsec / 1e9, megabytes / (elapsed_nsec / 1e9));
+    fflush(stdout);
+    return 0;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+        "usage: %s [-e poll|uring|both] [-t socketpair|pipe|both]\n"
+        "       [-b size,size,...] [-m megabytes]\n",
+        name);
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    const char *engine_name = "poll", *transport_name = "both";
+    char *size_list = DEFAULT_BUFFER_SIZES, *size_name, *save;
+    size_t buffer_sizes[MAX_BUFFER_SIZES];
+    uint64_t byte_count = (uint64_t)DEFAULT_MEGABYTES * 1048576;
+    int option, engine, transport, index, size_count = 0, failures = 0;
+
+    while ((option = getopt(argc, argv, "e:t:b:m:")) != -1) {
+        switch (option) {
+        case 'e': engine_name = optarg; break;
+        case 't': transport_name = optarg; break;
+        case 'b': size_list = optarg; break;
+        case 'm': byte_count = (uint64_t)atol(optarg) * 1048576; break;
+        default: usage(argv[0]);
+        }
+    }
+    if (byte_count == 0) { usage(argv[0]); }
+
+    size_list = strdup(size_list);
+    for (size_name = strtok_r(size_list, ",", &save);
+         size_name != NULL && size_count < MAX_BUFFER_SIZES;
+         size_name = strtok_r(NULL, ",", &save)) {
+        buffer_sizes[size_count] = (size_t)atol(size_name);
+        if (buffer_sizes[size_count] == 0) { usage(argv[0]); }
+        size_count++;
+    }
+    free(size_list);
+
+    for (engine = ENGINE_POLL; engine <= ENGINE_URING; engine++) {
+        if (strcmp(engine_name, "both") != 0 &&
+            strcmp(engine_name, engine_names[engine]) != 0) {
+            continue;
+        }
+        for (transport = TRANSPORT_SOCKETPAIR; transport <= TRANSPORT_PIPE; transport++) {
+            if (strcmp(transport_name, "both") != 0 &&
+                strcmp(transport_name, transport_names[transport]) != 0) {
+                continue;
+            }
+            for (index = 0; index < size_count; index++) {
+                if (run(engine, transport, buffer_sizes[index], byte_count) != 0) {
+                    failures++;
+                }
+            }
+        }
+    }
+
+    return failures ? 1 : 0;
+}
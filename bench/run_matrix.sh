@@ -0,0 +1,141 @@
+#!/bin/bash
+#
+# Benchmark the tunnel across a matrix of io_engine x thread_count x
+# buffer_size.
+#
+# For each combination this starts ./backend (echo) and ../tunnel with a
+# generated .ini, runs ./loadgen in handshake, latency and throughput
+# modes, and prints one JSON object per run (JSON lines) to stdout:
+#
+#   {"io_engine":"libevent","thread_count":4,"buffer_size":4096,"rss_kb_idle":...,
+#    "rss_kb_loaded":...,"rss_kb_per_connection":...,"loadgen":{...}}
+#
+# Build first: "make" in ../src and in this directory.  Then e.g.:
+#
+#   THREAD_COUNTS="1 4" BUFFER_SIZES="4096 65536" ./run_matrix.sh > results.jsonl
+#
+# IO_ENGINES="libevent io_uring" compares the two (see io_engine in
+# tunnel.ini); the io_uring runs also report the thread's io_uring_enter()
+# calls and the requests they completed, from the admin socket.
+#
+set -e
+cd "$(dirname "$0")"
+BENCH_DIR=$(pwd)
+
+IO_ENGINES=${IO_ENGINES:-"libevent"}
+THREAD_COUNTS=${THREAD_COUNTS:-"1 2 4"}
+BUFFER_SIZES=${BUFFER_SIZES:-"4096 65536 524288"}
+CLIENTS=${CLIENTS:-32}
+DURATION=${DURATION:-10}
+PORT=${PORT:-9443}
+BACKEND_PORT=${BACKEND_PORT:-9269}
+TUNNEL=${TUNNEL:-$BENCH_DIR/../tunnel}
+# "mode:message_size" pairs to run for each combination:
+RUNS=${RUNS:-"handshake:64 latency:64 throughput:16384"}
+
+WORK_DIR=$(mktemp -d)
+BACKEND_PID=
+TUNNEL_PID=
+
+cleanup() {
+    [ -n "$TUNNEL_PID" ] && kill -KILL $TUNNEL_PID 2>/dev/null || true
+    [ -n "$BACKEND_PID" ] && kill $BACKEND_PID 2>/dev/null || true
+    rm -rf "$WORK_DIR"
+}
+trap cleanup EXIT
+
+wait_for_port() {
+    for i in $(seq 1 100); do
+        (exec 3<>/dev/tcp/127.0.0.1/$1) 2>/dev/null && return 0
+        sleep 0.1
+    done
+    echo "Nothing listening on port $1." >&2
+    return 1
+}
+
+stop_tunnel() {
+    kill -INT $TUNNEL_PID
+    for i in $(seq 1 20); do
+        kill -0 $TUNNEL_PID 2>/dev/null || break
+        sleep 0.1
+    done
+    kill -KILL $TUNNEL_PID 2>/dev/null || true
+    wait $TUNNEL_PID 2>/dev/null || true
+    TUNNEL_PID=
+}
+
+rss_kb() {
+    awk '/^VmRSS:/ { print $2 }' /proc/$1/status
+}
+
+# A counter from the admin socket, summed over the threads:
+counter() {
+    curl -s --unix-socket "$WORK_DIR/admin.sock" http://localhost/metrics |
+        awk -v name="tunnel_$1_total{" 'index($1, name) == 1 { sum += $2 }
+                                         END { print sum + 0 }'
+}
+
+./backend -p $BACKEND_PORT -m echo &
+BACKEND_PID=$!
+wait_for_port $BACKEND_PORT
+
+for IO_ENGINE in $IO_ENGINES; do
+for THREAD_COUNT in $THREAD_COUNTS; do
+    for BUFFER_SIZE in $BUFFER_SIZES; do
+        # The tunnel.ini in the top directory, with our settings.  The
+        # backend goes in a [backends] section, in place of the [main]
+        # destination_name/destination_port:
+        sed -e "s/^ssl_server_port = .*/ssl_server_port = $PORT/" \
+            -e "/^destination_name = /d" \
+            -e "/^destination_port = /d" \
+            -e "s/^;\[backends\]/[backends]\nbackend = 127.0.0.1:$BACKEND_PORT/" \
+            -e "s/^thread_count = .*/thread_count = $THREAD_COUNT/" \
+            -e "s/^buffer_size = .*/buffer_size = $BUFFER_SIZE/" \
+            -e "s/^io_engine = .*/io_engine = $IO_ENGINE/" \
+            -e "s/^log_level = .*/log_level = warning/" \
+            -e "s|^admin_socket = .*|admin_socket = $WORK_DIR/admin.sock|" \
+            -e "s/^upgrade_socket = .*//" \
+            ../tunnel.ini > "$WORK_DIR/tunnel.ini"
+
+        # The .ini refers to the certificates relative to the top directory:
+        (cd .. && exec "$TUNNEL" "$WORK_DIR/tunnel.ini") &
+        TUNNEL_PID=$!
+        wait_for_port $PORT
+        RSS_IDLE=$(rss_kb $TUNNEL_PID)
+
+        # Both admin formats must come back whole:
+        for ADMIN_PATH in /metrics /json; do
+            curl -sf --unix-socket "$WORK_DIR/admin.sock" \
+                 http://localhost$ADMIN_PATH > /dev/null ||
+                { echo "The admin socket failed on $ADMIN_PATH." >&2; exit 1; }
+        done
+
+        for RUN in $RUNS; do
+            MODE=${RUN%%:*}
+            MESSAGE_SIZE=${RUN##*:}
+            SUBMITS=$(counter uring_submits)
+            COMPLETIONS=$(counter uring_completions)
+
+            ./loadgen -p $PORT -c $CLIENTS -d $DURATION -m $MODE \
+                      -s $MESSAGE_SIZE > "$WORK_DIR/loadgen.json" &
+            LOADGEN_PID=$!
+
+            # Sample the RSS mid-run, with all the connections open:
+            sleep $(( (DURATION + 1) / 2 ))
+            RSS_LOADED=$(rss_kb $TUNNEL_PID)
+            wait $LOADGEN_PID
+
+            echo "{\"io_engine\":\"$IO_ENGINE\"," \
+                 "\"thread_count\":$THREAD_COUNT,\"buffer_size\":$BUFFER_SIZE," \
+                 "\"rss_kb_idle\":$RSS_IDLE,\"rss_kb_loaded\":$RSS_LOADED," \
+                 "\"rss_kb_per_connection\":$(( (RSS_LOADED - RSS_IDLE) / CLIENTS ))," \
+                 "\"uring_submits\":$(( $(counter uring_submits) - SUBMITS ))," \
+                 "\"uring_completions\":$(( $(counter uring_completions) - COMPLETIONS ))," \
+                 "\"loadgen\":$(cat "$WORK_DIR/loadgen.json")}" | tr -d '\n' | sed 's/, "/,"/g'
+            echo
+        done
+
+        stop_tunnel
+    done
+done
+done
@@ -0,0 +1,130 @@
+/**
+ * Copyright (c) 2014 Derek Simkowiak
+ */
+#include "client_hello.h"
+
+// See RFC 5246, sections 6.2.1 and 7.4.1.2:
+#define RECORD_HEADER_SIZE     5
+#define HANDSHAKE_HEADER_SIZE  4
+#define CONTENT_TYPE_HANDSHAKE 0x16
+#define HANDSHAKE_CLIENT_HELLO 0x01
+
+// See RFC 6066, section 3:
+#define EXTENSION_SERVER_NAME  0x0000
+#define SERVER_NAME_HOST_NAME  0x00
+
+static uint16_t get_uint16(const unsigned char *bytes)
+{
+    return (uint16_t)((bytes[0] << 8) | bytes[1]);
+}
+
+int client_hello_parse(const unsigned char *buffer, size_t size,
+                       ClientHello *hello)
+{
+    const unsigned char *cursor, *end;
+    size_t record_length, length;
+
+    if (size < RECORD_HEADER_SIZE) { return CLIENT_HELLO_INCOMPLETE; }
+
+    // The TLS record header.  (SSLv2-style hellos are not supported.)
+    if (buffer[0] != CONTENT_TYPE_HANDSHAKE || buffer[1] != 0x03) {
+        return CLIENT_HELLO_INVALID;
+    }
+    record_length = get_uint16(&buffer[3]);
+    if (size < RECORD_HEADER_SIZE + record_length) {
+        return CLIENT_HELLO_INCOMPLETE;
+    }
+
+    cursor = &buffer[RECORD_HEADER_SIZE];
+    end = cursor + record_length;
+
+    // The handshake header.  The hello must fit in this one record:
+    if (end - cursor < HANDSHAKE_HEADER_SIZE ||
+        cursor[0] != HANDSHAKE_CLIENT_HELLO) {
+        return CLIENT_HELLO_INVALID;
+    }
+    length = (cursor[1] << 16) | (cursor[2] << 8) | cursor[3];
+    cursor += HANDSHAKE_HEADER_SIZE;
+    if (length > (size_t)(end - cursor)) { return CLIENT_HELLO_INVALID; }
+    end = cursor + length;
+
+    // client_version and random:
+    if (end - cursor < 2 + 32) { return CLIENT_HELLO_INVALID; }
+    hello->version = get_uint16(cursor);
+    cursor += 2 + 32;
+
+    // session_id:
+    if (end - cursor < 1) { return CLIENT_HELLO_INVALID; }
+    length = cursor[0];
+    cursor += 1;
+    if (length > (size_t)(end - cursor)) { return CLIENT_HELLO_INVALID; }
+    cursor += length;
+
+    // cipher_suites:
+    if (end - cursor < 2) { return CLIENT_HELLO_INVALID; }
+    length = get_uint16(cursor);
+    cursor += 2;
+    if (length > (size_t)(end - cursor) || (length & 0x1)) {
+        return CLIENT_HELLO_INVALID;
+    }
+    hello->cipher_suites = cursor;
+    hello->cipher_suite_count = length / 2;
+    cursor += length;
+
+    // compression_methods:
+    if (end - cursor < 1) { return CLIENT_HELLO_INVALID; }
+    length = cursor[0];
+    cursor += 1;
+    if (length > (size_t)(end - cursor)) { return CLIENT_HELLO_INVALID; }
+    cursor += length;
+
+    // extensions (optional):
+    hello->extensions = NULL;
+    hello->extensions_size = 0;
+    if (end - cursor >= 2) {
+        length = get_uint16(cursor);
+        cursor += 2;
+        if (length > (size_t)(end - cursor)) { return CLIENT_HELLO_INVALID; }
+        hello->extensions = cursor;
+        hello->extensions_size = length;
+    }
+
+    hello->record_size = RECORD_HEADER_SIZE + record_length;
+    return CLIENT_HELLO_OK;
+}
+
+size_t client_hello_server_name(const ClientHello *hello, const char **name)
+{
+    const unsigned char *cursor = hello->extensions;
+    const unsigned char *end = cursor + hello->extensions_size;
+    size_t length;
+    uint16_t type;
+
+    if (cursor == NULL) { return 0; }
+
+    // Each extension is a type, a length, and that many bytes:
+    while (end - cursor >= 4) {
+        type = get_uint16(cursor);
+        length = get_uint16(cursor + 2);
+        cursor += 4;
+        if (length > (size_t)(end - cursor)) { return 0; }
+
+        if (type == EXTENSION_SERVER_NAME) {
+            end = cursor + length;
+
+            // The server_name_list, of which we only look at the first
+            // entry.  (Clients only ever send one host_name.)
+            if (end - cursor < 2 + 1 + 2) { return 0; }
+            cursor += 2;
+            if (cursor[0] != SERVER_NAME_HOST_NAME) { return 0; }
+            length = get_uint16(cursor + 1);
+            cursor += 3;
+            if (length > (size_t)(end - cursor)) { return 0; }
+
+            *name = (const char *)cursor;
+            return length;
+        }
+        cursor += length;
+    }
+    return 0;
+}
@@ -0,0 +1,48 @@
+/**
+ * Copyright (c) 2014 Derek Simkowiak
+ */
+#ifndef CLIENT_HELLO_H
+#define CLIENT_HELLO_H
+
+// A minimal, read-only parser for the TLS ClientHello.
+//
+// This lets us look at what a client is asking for (by peek()ing at the
+// socket) before we hand the connection to CyaSSL_accept().  The parsed
+// fields point into the caller's buffer; nothing is allocated or copied.
+//
+// Only a ClientHello that fits in the first TLS record is parsed.  That
+// covers practically every client.  If the record hasn't all arrived yet
+// (a big hello comes in several TCP segments), the result is
+// CLIENT_HELLO_INCOMPLETE, and the caller should peek again once more
+// bytes are in.  Anything else is CLIENT_HELLO_INVALID, and the caller
+// should fall back to its defaults.
+
+#include <stdlib.h>
+#include <stdint.h>
+
+// Return values for client_hello_parse():
+#define CLIENT_HELLO_OK           0
+#define CLIENT_HELLO_INCOMPLETE  -1  // Need more bytes
+#define CLIENT_HELLO_INVALID     -2  // Not a TLS ClientHello we understand
+
+typedef struct {
+    uint16_t version;                    // client_version, e.g. 0x0303
+
+    const unsigned char *cipher_suites;  // Two bytes per suite
+    size_t cipher_suite_count;
+
+    const unsigned char *extensions;     // The raw extensions block, or NULL
+    size_t extensions_size;
+
+    size_t record_size;                  // Bytes used, incl. record header
+} ClientHello;
+
+int client_hello_parse(const unsigned char *buffer, size_t size,
+                       ClientHello *hello);
+
+// Find the host_name in the server_name (SNI) extension.  Sets 'name' to
+// point into the hello (it is not NUL-terminated) and returns its length,
+// or returns 0 if the client sent none:
+size_t client_hello_server_name(const ClientHello *hello, const char **name);
+
+#endif  // CLIENT_HELLO_H
@@ -2,41 +2,45 @@
 #include <signal.h>
 #include "tunnel.h"
 
-// This server instance is accessible from the sighandler:
-TunnelServer *server;
-
-static void sighandler(int signal)
-{
-    tunnel_server_shutdown(server);
-}
-
 int main(int argc, char **argv)
 {
     // Initialize CyaSSL:
     CyaSSL_Init();
     
     // Initialize syslog:
-    setlogmask(LOG_UPTO(LOG_NOTICE));
+    tunnel_log_set_level(LOG_NOTICE);
     openlog("tunnel", LOG_CONS | LOG_PID | LOG_NDELAY, LOG_LOCAL1);
 
+    // Move syslog() calls off the worker threads:
+    tunnel_log_start();
+
     // Initialize libevent in debug mode (optional):
     event_enable_debug_mode();
     evthread_enable_lock_debuging();
 
-    // Register signal handlers:
+    // SIGINT, SIGTERM and SIGHUP are handled on the server's event_base
+    // (see tunnel_server_serve_forever()).
     sigset_t signal_set;
     sigemptyset(&signal_set);
-    struct sigaction action = {
-        .sa_handler = sighandler,
+
+    // A peer that closes while we write() to it must not kill the
+    // process; the write() fails with EPIPE instead:
+    struct sigaction ignore_action = {
+        .sa_handler = SIG_IGN,
         .sa_mask = signal_set,
-        .sa_flags = SA_RESTART,
     };
-    sigaction(SIGINT, &action, NULL);
-    sigaction(SIGTERM, &action, NULL);
+    sigaction(SIGPIPE, &ignore_action, NULL);
 
 
-    // Instantiate a new tunnel server:
-    server = tunnel_server_new("./tunnel.ini");
+    // Instantiate a new tunnel server, with the .ini file given on the
+    // command line (if any):
+    TunnelServer *server = tunnel_server_new((argc > 1) ? argv[1] : "./tunnel.ini");
+    if (server == NULL) {
+        syslog(LOG_ERR, "Can't start the TunnelServer; see the log above.");
+        tunnel_log_stop();
+        closelog();
+        return 1;
+    }
 
     // This blocks until a shutdown signal:
     tunnel_server_serve_forever(server);
@@ -44,7 +48,8 @@ int main(int argc, char **argv)
     // We're back!  Do cleanup.  First, free the TunnerServer instance:
     tunnel_server_unref(server);
 
-    // Close syslog:
+    // Flush the log rings and close syslog:
+    tunnel_log_stop();
     closelog();
 
     // Cleanup CyaSSL:
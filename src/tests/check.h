@@ -0,0 +1,33 @@
+/**
+ * Copyright (c) 2014 Derek Simkowiak
+ */
+#ifndef CHECK_H
+#define CHECK_H
+
+// Just enough of a test harness for the tests in this directory: CHECK()
+// reports a failed condition and carries on, and each test program exits
+// with check_result().
+
+#include <stdio.h>
+
+static int check_failures = 0;
+
+#define CHECK(condition) do {                                              \
+    if (!(condition)) {                                                    \
+        fprintf(stderr, "%s:%d: CHECK(%s) failed.\n", __FILE__, __LINE__, \
+                #condition);                                               \
+        check_failures++;                                                  \
+    }                                                                      \
+} while (0)
+
+static int check_result(const char *name)
+{
+    if (check_failures > 0) {
+        fprintf(stderr, "%s: %d check(s) failed.\n", name, check_failures);
+        return 1;
+    }
+    printf("%s: OK\n", name);
+    return 0;
+}
+
+#endif  // CHECK_H
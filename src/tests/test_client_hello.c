@@ -0,0 +1,171 @@
+/**
+ * Copyright (c) 2014 Derek Simkowiak
+ */
+
+// Tests for the ClientHello parser in ../client_hello.c, on hellos built
+// here byte by byte: a whole one, every truncation of it (as a peek() would
+// see a hello that comes in several TCP segments), and some that aren't
+// ClientHellos at all.
+
+#include <string.h>
+#include "check.h"
+#include "client_hello.h"
+
+#define SERVER_NAME "www.example.com"
+
+static void put_uint16(unsigned char *out, size_t value)
+{
+    out[0] = (value >> 8) & 0xff;
+    out[1] = value & 0xff;
+}
+
+// Build a TLS 1.2 ClientHello record with two cipher suites, 'padding'
+// bytes of a padding extension, and an SNI extension for 'server_name' (if
+// it's not NULL).  Returns its size:
+static size_t make_hello(unsigned char *buffer, const char *server_name,
+                         size_t padding)
+{
+    unsigned char *out = buffer + 5 + 4;    // Past the two headers
+    unsigned char *extensions;
+    size_t name_length, size;
+
+    put_uint16(out, 0x0303);                // client_version
+    memset(out + 2, 0xab, 32);              // random
+    out += 2 + 32;
+    *out++ = 0;                             // session_id
+    put_uint16(out, 4);                     // cipher_suites
+    memcpy(out + 2, "\x00\x2f\x00\x35", 4);
+    out += 2 + 4;
+    *out++ = 1;                             // compression_methods
+    *out++ = 0;
+
+    extensions = out;
+    out += 2;
+    if (padding > 0) {
+        put_uint16(out, 0x0015);
+        put_uint16(out + 2, padding);
+        memset(out + 4, 0, padding);
+        out += 4 + padding;
+    }
+    if (server_name != NULL) {
+        name_length = strlen(server_name);
+        put_uint16(out, 0x0000);            // server_name
+        put_uint16(out + 2, 2 + 1 + 2 + name_length);
+        put_uint16(out + 4, 1 + 2 + name_length);
+        out[6] = 0;                         // host_name
+        put_uint16(out + 7, name_length);
+        memcpy(out + 9, server_name, name_length);
+        out += 9 + name_length;
+    }
+    put_uint16(extensions, out - extensions - 2);
+
+    size = out - buffer;
+    buffer[0] = 0x16;                       // handshake
+    put_uint16(buffer + 1, 0x0301);
+    put_uint16(buffer + 3, size - 5);
+    buffer[5] = 0x01;                       // client_hello
+    buffer[6] = 0;
+    put_uint16(buffer + 7, size - 9);
+    return size;
+}
+
+static void test_whole_hello(void)
+{
+    unsigned char buffer[1024];
+    ClientHello hello;
+    const char *name = NULL;
+    size_t size;
+
+    size = make_hello(buffer, SERVER_NAME, 0);
+    CHECK(client_hello_parse(buffer, size, &hello) == CLIENT_HELLO_OK);
+    CHECK(hello.version == 0x0303);
+    CHECK(hello.cipher_suite_count == 2);
+    CHECK(memcmp(hello.cipher_suites, "\x00\x2f\x00\x35", 4) == 0);
+    CHECK(hello.record_size == size);
+    CHECK(client_hello_server_name(&hello, &name) == strlen(SERVER_NAME));
+    CHECK(name != NULL && memcmp(name, SERVER_NAME, strlen(SERVER_NAME)) == 0);
+
+    // The next record (say, the start of early data) is left alone:
+    memset(buffer + size, 0x17, 10);
+    CHECK(client_hello_parse(buffer, size + 10, &hello) == CLIENT_HELLO_OK);
+    CHECK(hello.record_size == size);
+
+    // No SNI:
+    size = make_hello(buffer, NULL, 0);
+    CHECK(client_hello_parse(buffer, size, &hello) == CLIENT_HELLO_OK);
+    CHECK(client_hello_server_name(&hello, &name) == 0);
+
+    // The SNI after another extension:
+    size = make_hello(buffer, SERVER_NAME, 16);
+    CHECK(client_hello_parse(buffer, size, &hello) == CLIENT_HELLO_OK);
+    CHECK(client_hello_server_name(&hello, &name) == strlen(SERVER_NAME));
+}
+
+// A hello bigger than one TCP segment (a long padding extension, as some
+// browsers send) shows up a piece at a time.  Every prefix must be
+// INCOMPLETE, never INVALID, so the caller peeks again:
+static void test_hello_in_segments(void)
+{
+    unsigned char buffer[4096];
+    ClientHello hello;
+    const char *name = NULL;
+    size_t size, prefix;
+    int incomplete = 1;
+
+    size = make_hello(buffer, SERVER_NAME, 2000);
+    for (prefix = 0; prefix < size; prefix++) {
+        if (client_hello_parse(buffer, prefix, &hello) != CLIENT_HELLO_INCOMPLETE) {
+            incomplete = 0;
+        }
+    }
+    CHECK(incomplete);
+
+    CHECK(client_hello_parse(buffer, size, &hello) == CLIENT_HELLO_OK);
+    CHECK(hello.record_size == size);
+    CHECK(client_hello_server_name(&hello, &name) == strlen(SERVER_NAME));
+    CHECK(name != NULL && memcmp(name, SERVER_NAME, strlen(SERVER_NAME)) == 0);
+}
+
+static void test_not_a_hello(void)
+{
+    unsigned char buffer[1024];
+    ClientHello hello;
+    size_t size;
+
+    // Plaintext HTTP on the TLS port:
+    CHECK(client_hello_parse((const unsigned char *)"GET / HTTP/1.1\r\n\r\n", 18,
+                             &hello) == CLIENT_HELLO_INVALID);
+
+    // An alert record:
+    size = make_hello(buffer, SERVER_NAME, 0);
+    buffer[0] = 0x15;
+    CHECK(client_hello_parse(buffer, size, &hello) == CLIENT_HELLO_INVALID);
+
+    // A ServerHello:
+    size = make_hello(buffer, SERVER_NAME, 0);
+    buffer[5] = 0x02;
+    CHECK(client_hello_parse(buffer, size, &hello) == CLIENT_HELLO_INVALID);
+
+    // A hello that goes on into a second record isn't parsed:
+    size = make_hello(buffer, SERVER_NAME, 0);
+    put_uint16(buffer + 3, size - 5 - 10);
+    CHECK(client_hello_parse(buffer, size, &hello) == CLIENT_HELLO_INVALID);
+
+    // Lengths that run past the end of the hello:
+    size = make_hello(buffer, SERVER_NAME, 0);
+    buffer[5 + 4 + 2 + 32] = 200;           // session_id
+    CHECK(client_hello_parse(buffer, size, &hello) == CLIENT_HELLO_INVALID);
+
+    size = make_hello(buffer, SERVER_NAME, 0);
+    put_uint16(buffer + 5 + 4 + 2 + 32 + 1, 3);    // An odd cipher_suites
+    CHECK(client_hello_parse(buffer, size, &hello) == CLIENT_HELLO_INVALID);
+}
+
+int main(int argc, char **argv)
+{
+    test_whole_hello();
+    test_hello_in_segments();
+    test_not_a_hello();
+
+    return check_result("test_client_hello");
+}
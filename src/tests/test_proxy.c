@@ -0,0 +1,244 @@
+/**
+ * Copyright (c) 2014 Derek Simkowiak
+ */
+
+// Tests for the PROXY protocol headers in ../tunnel_proxy.c: v1 and v2, for
+// IPv4, IPv6 and IPv4-mapped addresses, and a v2 server name that sits in
+// the same buffer the header is written to.
+
+#include <string.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include "check.h"
+#include "tunnel_proxy.h"
+
+static const unsigned char v2_signature[12] = {
+    0x0D, 0x0A, 0x0D, 0x0A, 0x00, 0x0D, 0x0A, 0x51, 0x55, 0x49, 0x54, 0x0A
+};
+
+#define PP2_TYPE_AUTHORITY        0x02
+#define PP2_TYPE_SSL              0x20
+#define PP2_SUBTYPE_SSL_VERSION   0x21
+#define PP2_SUBTYPE_SSL_CIPHER    0x23
+
+#define TLS_VERSION "TLSv1.2"
+#define CIPHER "AES128-GCM-SHA256"
+#define SERVER_NAME "www.example.com"
+
+static struct sockaddr_storage make_address(const char *ip, int port)
+{
+    struct sockaddr_storage address;
+    struct sockaddr_in *address4 = (struct sockaddr_in *)&address;
+    struct sockaddr_in6 *address6 = (struct sockaddr_in6 *)&address;
+
+    memset(&address, 0, sizeof(address));
+    if (inet_pton(AF_INET, ip, &address4->sin_addr) == 1) {
+        address4->sin_family = AF_INET;
+        address4->sin_port = htons(port);
+    } else if (inet_pton(AF_INET6, ip, &address6->sin6_addr) == 1) {
+        address6->sin6_family = AF_INET6;
+        address6->sin6_port = htons(port);
+    }
+    return address;
+}
+
+// A header for a connection from source_ip:51234 to destination_ip:443:
+static size_t make_header(char *buffer, size_t buffer_size, int version,
+                          const char *source_ip, const char *destination_ip,
+                          const char *server_name, size_t server_name_size)
+{
+    struct sockaddr_storage source = make_address(source_ip, 51234);
+    struct sockaddr_storage destination = make_address(destination_ip, 443);
+
+    return tunnel_proxy_header(buffer, buffer_size, version,
+                               (struct sockaddr *)&source,
+                               (struct sockaddr *)&destination,
+                               server_name, server_name_size,
+                               TLS_VERSION, CIPHER);
+}
+
+// Find the TLV of 'type' between 'cursor' and 'end'.  Returns its value
+// and sets 'length', or returns NULL:
+static const unsigned char *find_tlv(const unsigned char *cursor,
+                                     const unsigned char *end, int type,
+                                     size_t *length)
+{
+    size_t tlv_length;
+
+    while (end - cursor >= 3) {
+        tlv_length = (cursor[1] << 8) | cursor[2];
+        if (cursor + 3 + tlv_length > end) { return NULL; }
+        if (cursor[0] == type) {
+            *length = tlv_length;
+            return cursor + 3;
+        }
+        cursor += 3 + tlv_length;
+    }
+    return NULL;
+}
+
+// Check a v2 header's fixed part and its TLVs.  Returns the address block:
+static const unsigned char *check_v2(const unsigned char *buffer, size_t size,
+                                     int family, const char *server_name)
+{
+    size_t address_size = (family == 0x11) ? 12 : (family == 0x21) ? 36 : 0;
+    const unsigned char *tlvs = buffer + 16 + address_size;
+    const unsigned char *value, *ssl;
+    size_t length, ssl_length;
+
+    CHECK(size >= 16 + address_size);
+    if (size < 16 + address_size) { return buffer + 16; }
+
+    CHECK(memcmp(buffer, v2_signature, sizeof(v2_signature)) == 0);
+    CHECK(buffer[12] == 0x21);
+    CHECK(buffer[13] == family);
+    CHECK((size_t)((buffer[14] << 8) | buffer[15]) == size - 16);
+
+    value = find_tlv(tlvs, buffer + size, PP2_TYPE_AUTHORITY, &length);
+    if (server_name == NULL) {
+        CHECK(value == NULL);
+    } else {
+        CHECK(value != NULL && length == strlen(server_name) &&
+              memcmp(value, server_name, length) == 0);
+    }
+
+    ssl = find_tlv(tlvs, buffer + size, PP2_TYPE_SSL, &ssl_length);
+    CHECK(ssl != NULL && ssl_length >= 5);
+    if (ssl == NULL || ssl_length < 5) { return buffer + 16; }
+
+    CHECK(ssl[0] == 0x01);                                  // PP2_CLIENT_SSL
+    CHECK(memcmp(ssl + 1, "\x00\x00\x00\x01", 4) == 0);     // verify
+    value = find_tlv(ssl + 5, ssl + ssl_length, PP2_SUBTYPE_SSL_VERSION, &length);
+    CHECK(value != NULL && length == strlen(TLS_VERSION) &&
+          memcmp(value, TLS_VERSION, length) == 0);
+    value = find_tlv(ssl + 5, ssl + ssl_length, PP2_SUBTYPE_SSL_CIPHER, &length);
+    CHECK(value != NULL && length == strlen(CIPHER) &&
+          memcmp(value, CIPHER, length) == 0);
+
+    return buffer + 16;
+}
+
+static void test_v1(void)
+{
+    char buffer[TUNNEL_PROXY_HEADER_MAX];
+    size_t size;
+
+    size = make_header(buffer, sizeof(buffer), TUNNEL_PROXY_V1,
+                       "192.0.2.1", "198.51.100.2", NULL, 0);
+    CHECK(size == strlen("PROXY TCP4 192.0.2.1 198.51.100.2 51234 443\r\n"));
+    CHECK(memcmp(buffer, "PROXY TCP4 192.0.2.1 198.51.100.2 51234 443\r\n",
+                 size) == 0);
+
+    size = make_header(buffer, sizeof(buffer), TUNNEL_PROXY_V1,
+                       "2001:db8::1", "2001:db8::2", NULL, 0);
+    CHECK(size == strlen("PROXY TCP6 2001:db8::1 2001:db8::2 51234 443\r\n"));
+    CHECK(memcmp(buffer, "PROXY TCP6 2001:db8::1 2001:db8::2 51234 443\r\n",
+                 size) == 0);
+
+    // IPv4-mapped addresses (from a dual-stack listener) go out as IPv4:
+    size = make_header(buffer, sizeof(buffer), TUNNEL_PROXY_V1,
+                       "::ffff:192.0.2.1", "::ffff:198.51.100.2", NULL, 0);
+    CHECK(size == strlen("PROXY TCP4 192.0.2.1 198.51.100.2 51234 443\r\n"));
+    CHECK(memcmp(buffer, "PROXY TCP4 192.0.2.1 198.51.100.2 51234 443\r\n",
+                 size) == 0);
+
+    // Two families can't be said in one line:
+    size = make_header(buffer, sizeof(buffer), TUNNEL_PROXY_V1,
+                       "192.0.2.1", "2001:db8::2", NULL, 0);
+    CHECK(size == strlen("PROXY UNKNOWN\r\n"));
+    CHECK(memcmp(buffer, "PROXY UNKNOWN\r\n", size) == 0);
+
+    // Too small a buffer:
+    size = make_header(buffer, 20, TUNNEL_PROXY_V1,
+                       "192.0.2.1", "198.51.100.2", NULL, 0);
+    CHECK(size == 0);
+}
+
+static void test_v2(void)
+{
+    unsigned char buffer[TUNNEL_PROXY_HEADER_MAX];
+    const unsigned char *addresses;
+    unsigned char ip[16];
+    char long_name[300];
+    size_t size, length;
+
+    size = make_header((char *)buffer, sizeof(buffer), TUNNEL_PROXY_V2,
+                       "192.0.2.1", "198.51.100.2",
+                       SERVER_NAME, strlen(SERVER_NAME));
+    addresses = check_v2(buffer, size, 0x11, SERVER_NAME);
+    inet_pton(AF_INET, "192.0.2.1", ip);
+    CHECK(memcmp(addresses, ip, 4) == 0);
+    inet_pton(AF_INET, "198.51.100.2", ip);
+    CHECK(memcmp(addresses + 4, ip, 4) == 0);
+    CHECK(memcmp(addresses + 8, "\xc8\x22\x01\xbb", 4) == 0);   // 51234, 443
+
+    size = make_header((char *)buffer, sizeof(buffer), TUNNEL_PROXY_V2,
+                       "2001:db8::1", "2001:db8::2",
+                       SERVER_NAME, strlen(SERVER_NAME));
+    addresses = check_v2(buffer, size, 0x21, SERVER_NAME);
+    inet_pton(AF_INET6, "2001:db8::1", ip);
+    CHECK(memcmp(addresses, ip, 16) == 0);
+    inet_pton(AF_INET6, "2001:db8::2", ip);
+    CHECK(memcmp(addresses + 16, ip, 16) == 0);
+    CHECK(memcmp(addresses + 32, "\xc8\x22\x01\xbb", 4) == 0);
+
+    size = make_header((char *)buffer, sizeof(buffer), TUNNEL_PROXY_V2,
+                       "::ffff:192.0.2.1", "::ffff:198.51.100.2", NULL, 0);
+    addresses = check_v2(buffer, size, 0x11, NULL);
+    inet_pton(AF_INET, "192.0.2.1", ip);
+    CHECK(memcmp(addresses, ip, 4) == 0);
+
+    // Mixed families: no addresses (AF_UNSPEC), but the TLVs still go:
+    size = make_header((char *)buffer, sizeof(buffer), TUNNEL_PROXY_V2,
+                       "192.0.2.1", "2001:db8::2",
+                       SERVER_NAME, strlen(SERVER_NAME));
+    check_v2(buffer, size, 0x00, SERVER_NAME);
+
+    // Server names are cut at 255 bytes:
+    memset(long_name, 'a', sizeof(long_name));
+    size = make_header((char *)buffer, sizeof(buffer), TUNNEL_PROXY_V2,
+                       "2001:db8::1", "2001:db8::2", long_name, sizeof(long_name));
+    CHECK(size > 0 && size <= TUNNEL_PROXY_HEADER_MAX);
+    CHECK(find_tlv(buffer + 16 + 36, buffer + size, PP2_TYPE_AUTHORITY,
+                   &length) != NULL && length == 255);
+
+    // Too small a buffer:
+    size = make_header((char *)buffer, 40, TUNNEL_PROXY_V2,
+                       "192.0.2.1", "198.51.100.2",
+                       SERVER_NAME, strlen(SERVER_NAME));
+    CHECK(size == 0);
+}
+
+// The tunnel passes the server name where it found it: in the peeked
+// ClientHello, at the front of the same buffer the header goes into.
+// Wherever it starts, before, across or after where its TLV goes, it must
+// come out intact:
+static void test_v2_overlapping_server_name(void)
+{
+    char buffer[TUNNEL_PROXY_HEADER_MAX];
+    size_t size, offset;
+
+    for (offset = 0; offset < 200; offset++) {
+        memset(buffer, 0, sizeof(buffer));
+        memcpy(buffer + offset, SERVER_NAME, strlen(SERVER_NAME));
+
+        size = make_header(buffer, sizeof(buffer), TUNNEL_PROXY_V2,
+                           "192.0.2.1", "198.51.100.2",
+                           buffer + offset, strlen(SERVER_NAME));
+        check_v2((unsigned char *)buffer, size, 0x11, SERVER_NAME);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    CHECK(tunnel_proxy_version_from_name("off") == TUNNEL_PROXY_OFF);
+    CHECK(tunnel_proxy_version_from_name("V1") == TUNNEL_PROXY_V1);
+    CHECK(tunnel_proxy_version_from_name("2") == TUNNEL_PROXY_V2);
+    CHECK(tunnel_proxy_version_from_name("v3") == -1);
+
+    test_v1();
+    test_v2();
+    test_v2_overlapping_server_name();
+
+    return check_result("test_proxy");
+}
@@ -0,0 +1,92 @@
+/**
+ * Copyright (c) 2014 Derek Simkowiak
+ */
+#include "timer_wheel.h"
+#include <stdlib.h>
+
+// Make 'head' an empty list:
+static void slot_init(TimerWheelEntry *head)
+{
+    head->next = head;
+    head->prev = head;
+}
+
+// Link 'entry' in right before 'head', i.e. at the end of its list:
+static void slot_insert(TimerWheelEntry *head, TimerWheelEntry *entry)
+{
+    entry->next = head;
+    entry->prev = head->prev;
+    head->prev->next = entry;
+    head->prev = entry;
+}
+
+TimerWheel *timer_wheel_new(void)
+{
+    TimerWheel *wheel = calloc(1, sizeof(*wheel));
+    int slot;
+
+    if (wheel == NULL) { return NULL; }
+
+    for (slot = 0; slot < TIMER_WHEEL_SLOTS; slot++) {
+        slot_init(&wheel->slots[slot]);
+    }
+    return wheel;
+}
+
+void timer_wheel_free(TimerWheel *wheel)
+{
+    if (wheel == NULL) { return; }
+    free(wheel);
+}
+
+void timer_wheel_schedule(TimerWheel *wheel, TimerWheelEntry *entry,
+                          uint64_t ticks)
+{
+    timer_wheel_cancel(entry);
+
+    entry->expire_tick = wheel->tick + (ticks > 0 ? ticks : 1);
+    slot_insert(&wheel->slots[entry->expire_tick % TIMER_WHEEL_SLOTS], entry);
+}
+
+void timer_wheel_cancel(TimerWheelEntry *entry)
+{
+    if (!timer_wheel_is_scheduled(entry)) { return; }
+
+    entry->prev->next = entry->next;
+    entry->next->prev = entry->prev;
+    entry->next = NULL;
+    entry->prev = NULL;
+}
+
+void timer_wheel_advance(TimerWheel *wheel, TimerWheelCallback callback,
+                         void *arg)
+{
+    TimerWheelEntry *slot, expiring, *entry;
+
+    wheel->tick++;
+    slot = &wheel->slots[wheel->tick % TIMER_WHEEL_SLOTS];
+
+    // Move this slot's entries to a private list first.  The callbacks
+    // may schedule entries right back into this slot (a full lap later),
+    // and may cancel any entry on either list:
+    slot_init(&expiring);
+    if (slot->next != slot) {
+        expiring.next = slot->next;
+        expiring.prev = slot->prev;
+        expiring.next->prev = &expiring;
+        expiring.prev->next = &expiring;
+        slot_init(slot);
+    }
+
+    while (expiring.next != &expiring) {
+        entry = expiring.next;
+        timer_wheel_cancel(entry);
+
+        if (entry->expire_tick > wheel->tick) {
+            // Not this lap:
+            slot_insert(slot, entry);
+            continue;
+        }
+        callback(entry, arg);
+    }
+}
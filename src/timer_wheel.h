@@ -0,0 +1,60 @@
+/**
+ * Copyright (c) 2014 Derek Simkowiak
+ */
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+// A hashed timer wheel, for timeouts on thousands of connections without
+// an event (and a heap operation) per connection.
+//
+// Time is counted in ticks: the owner calls timer_wheel_advance() once per
+// tick (e.g. once a second).  Entries are kept in TIMER_WHEEL_SLOTS lists by
+// expire_tick % TIMER_WHEEL_SLOTS, so scheduling and cancelling are O(1),
+// and timeouts longer than one lap just stay put until their lap comes up.
+//
+// The entries are embedded in the caller's structs; the wheel never
+// allocates them.  For timeouts that are pushed back on every bit of
+// activity (idle timeouts), don't reschedule on each one: record the tick
+// of the activity, and when the entry fires, schedule it again for the
+// remainder.
+//
+// This is not inherently threadsafe; the caller must do their own mutexing.
+
+#include <stdint.h>
+
+#define TIMER_WHEEL_SLOTS 256
+
+typedef struct TimerWheelEntry {
+    struct TimerWheelEntry *next;   // NULL when not scheduled
+    struct TimerWheelEntry *prev;
+    uint64_t expire_tick;
+    void *user_data;
+} TimerWheelEntry;
+
+typedef struct TimerWheel {
+    uint64_t tick;   // Ticks since timer_wheel_new()
+    TimerWheelEntry slots[TIMER_WHEEL_SLOTS];   // List heads
+} TimerWheel;
+
+// Called with each expired entry, which is unscheduled first.  It may
+// schedule or cancel any entry, including this one:
+typedef void (*TimerWheelCallback)(TimerWheelEntry *entry, void *arg);
+
+TimerWheel *timer_wheel_new(void);
+void timer_wheel_free(TimerWheel *wheel);
+
+// (Re)schedule 'entry' to expire 'ticks' from now (at least one):
+void timer_wheel_schedule(TimerWheel *wheel, TimerWheelEntry *entry,
+                          uint64_t ticks);
+
+// Unschedule 'entry', if it is scheduled:
+void timer_wheel_cancel(TimerWheelEntry *entry);
+
+// Move the wheel one tick ahead, and call 'callback' for each entry that
+// expires:
+void timer_wheel_advance(TimerWheel *wheel, TimerWheelCallback callback,
+                         void *arg);
+
+#define timer_wheel_is_scheduled(entry) ((entry)->next != NULL)
+
+#endif  // TIMER_WHEEL_H
@@ -23,13 +23,16 @@
 
 #include <syslog.h>
 
+// The build options of the installed CyaSSL (CYASSL_AESNI, HAVE_AESGCM, ...):
+#include <cyassl/options.h>
 #include <cyassl/ssl.h>
 #include <cyassl/error-ssl.h>
 
 
 #ifdef __linux__
-  // Get the Linux LWP id, which is more useful than the opaque pthread ID:
-  #define get_thread_id() syscall(SYS_gettid)
+  // Get the Linux LWP id, which is more useful than the opaque pthread ID.
+  // (It's cached per thread; see tunnel_log.h.)
+  #define get_thread_id() tunnel_log_thread_id()
 #else
   // Use the more generic pthread ID:
   #define get_thread_id() pthread_self()
@@ -53,27 +56,64 @@
 #endif
 
 
+#include "tunnel_log.h"
+
+// Log lines are key=value pairs, with the free-form message last:
+//
+//   tid=1234 src=tunnel_client.c:604 fn=on_read_dest conn=17 peer=10.0.0.5:51234 msg=...
+//
+// Levels above TUNNEL_LOG_LEVEL or tunnel_log_level cost one compare (see
+// tunnel_log.h).
+
 // Used for standard application-level syslog errors:
 #define log(level, fmt, args...)  do { \
-    syslog(level, "[%ld]%s:%d:%s(): "fmt, get_thread_id(), __FILE__, __LINE__, __func__ , ##args); \
+    if ((level) <= TUNNEL_LOG_LEVEL && (level) <= tunnel_log_level) { \
+        tunnel_log_write(level, "tid=%ld src=%s:%d fn=%s msg="fmt, (long)get_thread_id(), __FILE__, __LINE__, __func__ , ##args); \
+    } \
 } while (0)
 
 // Used for system errors reported with errno:
 #define log_err(fmt, args...)  do { \
     char strerror_buffer[256]; \
     strerror_r(errno, strerror_buffer, sizeof(strerror_buffer)); \
-    syslog(LOG_ERR, "[%ld]%s:%d:%s(): %s. " fmt, get_thread_id(), __FILE__, __LINE__, __func__, strerror_buffer , ##args); \
+    tunnel_log_write(LOG_ERR, "tid=%ld src=%s:%d fn=%s msg=%s. " fmt, (long)get_thread_id(), __FILE__, __LINE__, __func__, strerror_buffer , ##args); \
+} while (0)
+
+// The same, for events on one TunnelClient connection.  Adds its id and
+// peer address so one client's events can be grepped out of the log:
+#define log_client(level, client, fmt, args...)  do { \
+    if ((level) <= TUNNEL_LOG_LEVEL && (level) <= tunnel_log_level) { \
+        tunnel_log_write(level, "tid=%ld src=%s:%d fn=%s conn=%lu peer=%s msg="fmt, (long)get_thread_id(), __FILE__, __LINE__, __func__, (unsigned long)(client)->id, (client)->peer_name , ##args); \
+    } \
+} while (0)
+
+#define log_client_err(client, fmt, args...)  do { \
+    char strerror_buffer[256]; \
+    strerror_r(errno, strerror_buffer, sizeof(strerror_buffer)); \
+    tunnel_log_write(LOG_ERR, "tid=%ld src=%s:%d fn=%s conn=%lu peer=%s msg=%s. " fmt, (long)get_thread_id(), __FILE__, __LINE__, __func__, (unsigned long)(client)->id, (client)->peer_name, strerror_buffer , ##args); \
 } while (0)
 
 // Utilities:
 #include "list.h"
 #include "fifo.h"
+#include "timer_wheel.h"
+#include "client_hello.h"
 
 // Tunnel API:
+#include "tunnel_proxy.h"
+#include "tunnel_socket.h"
+#include "tunnel_io.h"
 #include "tunnel_config.h"
+#include "tunnel_backend.h"
+#include "tunnel_context.h"
+#include "tunnel_metrics.h"
+#include "tunnel_trace.h"
+#include "tunnel_uring.h"
 #include "tunnel_client.h"
 #include "tunnel_thread.h"
 #include "tunnel_server.h"
+#include "tunnel_admin.h"
+#include "tunnel_upgrade.h"
 
 
 #endif  /* TUNNEL_H */
@@ -0,0 +1,814 @@
+/**
+ * Copyright (c) 2014 Derek Simkowiak
+ */
+
+#include "tunnel_admin.h"
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <event2/buffer.h>
+
+// How long an admin client has to send its request before we reply anyway:
+#define ADMIN_REQUEST_TIMEOUT_SEC 1
+
+// What a request asks for:
+typedef enum {
+    ADMIN_PROMETHEUS,
+    ADMIN_JSON,
+    ADMIN_TRACE,
+    ADMIN_NOT_FOUND,
+} AdminRequest;
+
+// One connected admin client:
+typedef struct {
+    int socket_fd;
+    struct event *on_read_event;
+    struct event *on_write_event;
+    struct evbuffer *output;
+    TunnelAdmin *admin;
+} AdminConnection;
+
+static void on_admin_accept(int socket_fd, short event, void *arg);
+static void on_admin_read(int socket_fd, short event, void *arg);
+static void on_admin_write(int socket_fd, short event, void *arg);
+static void admin_connection_free(AdminConnection *connection);
+
+static void write_prometheus(TunnelServer *server, struct evbuffer *output);
+static void write_json(TunnelServer *server, struct evbuffer *output);
+static void write_trace(TunnelServer *server, struct evbuffer *output);
+static AdminRequest parse_request(char *request, int *is_http);
+
+
+TunnelAdmin *tunnel_admin_new(TunnelServer *server, const char *socket_path)
+{
+    TunnelAdmin *admin;
+    struct sockaddr_un bind_address;
+    struct stat socket_stat;
+    int result;
+
+    if (strlen(socket_path) >= sizeof(bind_address.sun_path)) {
+        log(LOG_ERR, "admin_socket path is too long: %s", socket_path);
+        return NULL;
+    }
+
+    admin = calloc(1, sizeof(*admin));
+    if (admin == NULL) { return NULL; }
+
+    admin->server = server;
+    admin->listen_fd = -1;
+
+    admin->socket_path = strdup(socket_path);
+    if (admin->socket_path == NULL) {
+        tunnel_admin_free(admin);
+        return NULL;
+    }
+
+    admin->listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (admin->listen_fd < 0) {
+        log_err("socket() failed.");
+        tunnel_admin_free(admin);
+        return NULL;
+    }
+    evutil_make_socket_nonblocking(admin->listen_fd);
+
+    // Remove a stale socket file left by a previous run:
+    unlink(admin->socket_path);
+
+    memset(&bind_address, 0, sizeof(bind_address));
+    bind_address.sun_family = AF_UNIX;
+    strcpy(bind_address.sun_path, admin->socket_path);
+
+    result = bind(admin->listen_fd, (struct sockaddr *)&bind_address,
+                  sizeof(bind_address));
+    if (result < 0 || stat(admin->socket_path, &socket_stat) != 0) {
+        log_err("bind() failed for %s.", admin->socket_path);
+        tunnel_admin_free(admin);
+        return NULL;
+    }
+    admin->socket_inode = socket_stat.st_ino;
+
+    result = listen(admin->listen_fd, 16);
+    if (result < 0) {
+        log_err("listen() failed for %s.", admin->socket_path);
+        tunnel_admin_free(admin);
+        return NULL;
+    }
+
+    admin->on_accept_event =
+     event_new(server->libevent_base, admin->listen_fd, EV_READ | EV_PERSIST,
+               on_admin_accept, admin);
+    if (admin->on_accept_event == NULL) {
+        tunnel_admin_free(admin);
+        return NULL;
+    }
+    event_add(admin->on_accept_event, NULL);
+
+    log(LOG_NOTICE, "Admin endpoint listening on %s.", admin->socket_path);
+    return admin;
+}
+
+
+void tunnel_admin_free(TunnelAdmin *admin)
+{
+    struct stat socket_stat;
+
+    if (admin == NULL) { return; }
+
+    if (admin->on_accept_event != NULL) { event_free(admin->on_accept_event); }
+
+    if (admin->listen_fd >= 0) {
+        close(admin->listen_fd);
+
+        // After an upgrade, the file belongs to the new process:
+        if (stat(admin->socket_path, &socket_stat) == 0 &&
+            socket_stat.st_ino == admin->socket_inode) {
+            unlink(admin->socket_path);
+        }
+    }
+
+    if (admin->socket_path != NULL) { free(admin->socket_path); }
+    free(admin);
+}
+
+
+static void on_admin_accept(int socket_fd, short event, void *arg)
+{
+    TunnelAdmin *admin = (TunnelAdmin *)arg;
+    AdminConnection *connection;
+    struct timeval timeout = {ADMIN_REQUEST_TIMEOUT_SEC, 0};
+
+    int client_socket_fd = accept(socket_fd, NULL, NULL);
+    if (client_socket_fd < 0) {
+        log_err("accept() failed.");
+        return;
+    }
+    evutil_make_socket_nonblocking(client_socket_fd);
+
+    connection = calloc(1, sizeof(*connection));
+    if (connection == NULL) {
+        close(client_socket_fd);
+        return;
+    }
+    connection->socket_fd = client_socket_fd;
+    connection->admin = admin;
+
+    connection->output = evbuffer_new();
+    connection->on_read_event =
+     event_new(admin->server->libevent_base, client_socket_fd, EV_READ,
+               on_admin_read, connection);
+    connection->on_write_event =
+     event_new(admin->server->libevent_base, client_socket_fd,
+               EV_WRITE | EV_PERSIST, on_admin_write, connection);
+
+    if (connection->output == NULL || connection->on_read_event == NULL ||
+        connection->on_write_event == NULL) {
+        admin_connection_free(connection);
+        return;
+    }
+
+    // Wait (briefly) for the request, so we know which format to use:
+    event_add(connection->on_read_event, &timeout);
+}
+
+
+static void on_admin_read(int socket_fd, short event, void *arg)
+{
+    AdminConnection *connection = (AdminConnection *)arg;
+    TunnelServer *server = connection->admin->server;
+    struct evbuffer *body;
+    char request[1024];
+    ssize_t read_result = 0;
+    AdminRequest request_type;
+    int is_http;
+
+    // On EV_TIMEOUT there is no request; we just send the default format.
+    if (event & EV_READ) {
+        read_result = read(socket_fd, request, sizeof(request) - 1);
+    }
+    request[MAX(read_result, 0)] = '\0';
+
+    request_type = parse_request(request, &is_http);
+
+    body = evbuffer_new();
+    if (body == NULL) {
+        admin_connection_free(connection);
+        return;
+    }
+
+    switch (request_type) {
+    case ADMIN_PROMETHEUS:
+        write_prometheus(server, body);
+        break;
+    case ADMIN_JSON:
+        write_json(server, body);
+        break;
+    case ADMIN_TRACE:
+        write_trace(server, body);
+        break;
+    case ADMIN_NOT_FOUND:
+        evbuffer_add_printf(body, "Not found; try /metrics, /json or /trace.\n");
+        break;
+    }
+
+    if (is_http) {
+        evbuffer_add_printf(connection->output,
+            "HTTP/1.0 %s\r\n"
+            "Content-Type: %s\r\n"
+            "Content-Length: %zu\r\n"
+            "\r\n",
+            (request_type == ADMIN_NOT_FOUND) ? "404 Not Found" : "200 OK",
+            (request_type == ADMIN_JSON || request_type == ADMIN_TRACE)
+             ? "application/json" : "text/plain; version=0.0.4",
+            evbuffer_get_length(body));
+    }
+    evbuffer_add_buffer(connection->output, body);
+    evbuffer_free(body);
+
+    event_add(connection->on_write_event, NULL);
+}
+
+
+// Find the path in "GET /json HTTP/1.1\r\n..." (is_http is set), or in a
+// bare request line like "json\n".  The query string, if any, is ignored.
+// No request at all, "/" and "/metrics" get the Prometheus format:
+static AdminRequest parse_request(char *request, int *is_http)
+{
+    char *path = request;
+
+    *is_http = (strncmp(request, "GET ", 4) == 0);
+    if (*is_http) { path += 4; }
+
+    path[strcspn(path, " ?\r\n")] = '\0';
+    if (path[0] == '/') { path++; }
+
+    if (path[0] == '\0' || strcmp(path, "metrics") == 0) {
+        return ADMIN_PROMETHEUS;
+    } else if (strcmp(path, "json") == 0) {
+        return ADMIN_JSON;
+    } else if (strcmp(path, "trace") == 0) {
+        return ADMIN_TRACE;
+    }
+    return ADMIN_NOT_FOUND;
+}
+
+
+static void on_admin_write(int socket_fd, short event, void *arg)
+{
+    AdminConnection *connection = (AdminConnection *)arg;
+    int write_result;
+
+    write_result = evbuffer_write(connection->output, socket_fd);
+    if (write_result < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return;  // Try again on the next EV_WRITE.
+    }
+
+    if (write_result < 0 || evbuffer_get_length(connection->output) == 0) {
+        // Done (or the admin client went away):
+        admin_connection_free(connection);
+    }
+}
+
+
+static void admin_connection_free(AdminConnection *connection)
+{
+    if (connection->on_read_event != NULL) { event_free(connection->on_read_event); }
+    if (connection->on_write_event != NULL) { event_free(connection->on_write_event); }
+    if (connection->output != NULL) { evbuffer_free(connection->output); }
+    close(connection->socket_fd);
+    free(connection);
+}
+
+
+//
+// Snapshot formatting.
+//
+
+// Strings from the config (server and backend names, the cipher_list...)
+// can hold anything, so they're escaped.  A Prometheus label value escapes
+// backslashes, double quotes and newlines.  An unset (NULL) one is empty:
+static void add_label_value(struct evbuffer *output, const char *value)
+{
+    if (value == NULL) { return; }
+
+    for (; *value != '\0'; value++) {
+        switch (*value) {
+        case '\\':
+            evbuffer_add(output, "\\\\", 2);
+            break;
+        case '"':
+            evbuffer_add(output, "\\\"", 2);
+            break;
+        case '\n':
+            evbuffer_add(output, "\\n", 2);
+            break;
+        default:
+            evbuffer_add(output, value, 1);
+            break;
+        }
+    }
+}
+
+// A JSON string, with its quotes.  Control characters become \u00XX.  An
+// unset (NULL) one is null:
+static void add_json_string(struct evbuffer *output, const char *value)
+{
+    const unsigned char *next = (const unsigned char *)value;
+
+    if (value == NULL) {
+        evbuffer_add(output, "null", 4);
+        return;
+    }
+
+    evbuffer_add(output, "\"", 1);
+    for (; *next != '\0'; next++) {
+        if (*next == '"' || *next == '\\') {
+            evbuffer_add_printf(output, "\\%c", *next);
+        } else if (*next < 0x20) {
+            evbuffer_add_printf(output, "\\u%04x", *next);
+        } else {
+            evbuffer_add(output, next, 1);
+        }
+    }
+    evbuffer_add(output, "\"", 1);
+}
+
+// The upper bound of the histogram bucket that holds the given fraction of
+// all samples.  (Bucket N holds values below 2^N.)
+static uint64_t histogram_percentile(const TunnelHistogram *histogram,
+                                     double fraction)
+{
+    uint64_t target = (uint64_t)(histogram->count * fraction);
+    uint64_t seen = 0;
+    int bucket;
+
+    if (histogram->count == 0) { return 0; }
+
+    for (bucket = 0; bucket < METRICS_HISTOGRAM_BUCKETS; bucket++) {
+        seen += histogram->buckets[bucket];
+        if (seen > target) { break; }
+    }
+    return (bucket == 0) ? 0 : (1ULL << bucket) - 1;
+}
+
+static uint64_t active_connections(const TunnelMetrics *metrics)
+{
+    return metrics->counters[METRIC_CONNECTIONS_ACCEPTED] -
+           metrics->counters[METRIC_CONNECTIONS_CLOSED];
+}
+
+// The clients' buffers, which only exist once a client has sent something:
+static uint64_t buffer_bytes(const TunnelMetrics *metrics)
+{
+    return metrics->counters[METRIC_BUFFER_BYTES_ALLOCATED] -
+           metrics->counters[METRIC_BUFFER_BYTES_FREED];
+}
+
+static double uptime_seconds(TunnelServer *server)
+{
+    return (tunnel_metrics_now_usec() - server->start_usec) / 1e6;
+}
+
+static const double percentiles[] = {0.5, 0.9, 0.99};
+#define PERCENTILE_COUNT (sizeof(percentiles) / sizeof(percentiles[0]))
+
+
+// Take a snapshot of one thread's metrics:
+static void thread_snapshot(TunnelThread *thread, TunnelMetrics *snapshot)
+{
+    memset(snapshot, 0x0, sizeof(*snapshot));
+    tunnel_metrics_sum(snapshot, thread->metrics);
+}
+
+static void write_pool_gauges(TunnelBackendPool *pool, const char *listener_name,
+                              const char *host_name, struct evbuffer *output,
+                              const char *name, int active_connections)
+{
+    TunnelBackend *backend;
+    int index;
+
+    for (index = 0; index < pool->backend_count; index++) {
+        backend = &pool->backends[index];
+        evbuffer_add_printf(output, "%s{listener=\"", name);
+        add_label_value(output, listener_name);
+        evbuffer_add_printf(output, "\",host=\"");
+        add_label_value(output, host_name);
+        evbuffer_add_printf(output, "\",backend=\"");
+        add_label_value(output, backend->name);
+        evbuffer_add_printf(output, "\"} %d\n",
+            active_connections
+             ? __atomic_load_n(&backend->active_connections, __ATOMIC_RELAXED)
+             : __atomic_load_n(&backend->healthy, __ATOMIC_RELAXED));
+    }
+}
+
+// One gauge per backend: up, or active_connections.  The default pool is
+// listener="main",host="*".  A [host] pool serves every listener, so it's
+// listener="*"; a [listener] pool is host="*":
+static void write_backend_gauges(TunnelContext *context, struct evbuffer *output,
+                                 const char *name, int active_connections)
+{
+    TunnelHost *host;
+    size_t bucket;
+    int index;
+
+    write_pool_gauges(context->backends, "main", "*", output, name,
+                      active_connections);
+
+    for (bucket = 0; bucket < context->host_bucket_count; bucket++) {
+        for (host = context->host_buckets[bucket]; host != NULL; host = host->next) {
+            if (host->owns_backends) {
+                write_pool_gauges(host->backends, "*", host->config->server_name,
+                                  output, name, active_connections);
+            }
+        }
+    }
+
+    for (index = 0; index < context->listener_count; index++) {
+        host = context->listeners[index];
+        if (host->owns_backends) {
+            write_pool_gauges(host->backends, host->config->server_name, "*",
+                              output, name, active_connections);
+        }
+    }
+}
+
+// For tunnel_socket_foreach(): one socket option of one side, as a gauge
+// line or a JSON member:
+typedef struct {
+    struct evbuffer *output;
+    const char *side;
+    int count;
+} SocketOptionWriter;
+
+static void write_socket_gauge(const char *name, int value, void *arg)
+{
+    SocketOptionWriter *writer = (SocketOptionWriter *)arg;
+
+    evbuffer_add_printf(writer->output,
+        "tunnel_socket_option{side=\"%s\",option=\"%s\"} %d\n",
+        writer->side, name, value);
+}
+
+static void write_json_socket_option(const char *name, int value, void *arg)
+{
+    SocketOptionWriter *writer = (SocketOptionWriter *)arg;
+
+    evbuffer_add_printf(writer->output, "%s\"%s\":%d",
+        (writer->count++ == 0) ? "" : ",", name, value);
+}
+
+static void write_prometheus(TunnelServer *server, struct evbuffer *output)
+{
+    TunnelConfig *config = server->config;
+    TunnelMetrics *total, *snapshot;
+    const char *name, *listener_name, *address;
+    uint16_t port;
+    List *list;
+    int index, bucket, thread_index;
+    uint64_t cumulative;
+    size_t percentile;
+
+    total = tunnel_metrics_new();
+    snapshot = tunnel_metrics_new();
+    if (total == NULL || snapshot == NULL) {
+        tunnel_metrics_free(total);
+        tunnel_metrics_free(snapshot);
+        return;
+    }
+
+    evbuffer_add_printf(output,
+        "# TYPE tunnel_uptime_seconds gauge\n"
+        "tunnel_uptime_seconds %.3f\n", uptime_seconds(server));
+
+    evbuffer_add_printf(output,
+        "# TYPE tunnel_draining gauge\n"
+        "tunnel_draining %d\n", server->draining);
+
+    evbuffer_add_printf(output,
+        "# TYPE tunnel_config_info gauge\n"
+        "tunnel_config_info{ssl_server_name=\"");
+    add_label_value(output, config->ssl_server_name);
+    evbuffer_add_printf(output, "\",ssl_server_port=\"%u\"",
+        config->ssl_server_port);
+    // (A config with only [backends] has no destination:)
+    if (config->destination_name != NULL && config->destination_port != NULL) {
+        evbuffer_add_printf(output, ",destination=\"");
+        add_label_value(output, config->destination_name);
+        evbuffer_add_printf(output, ":");
+        add_label_value(output, config->destination_port);
+        evbuffer_add_printf(output, "\"");
+    }
+    evbuffer_add_printf(output,
+        ",thread_count=\"%d\",buffer_size=\"%zu\","
+        "ssl_io_buffer_size=\"%zu\",edge_triggered=\"%d\",cipher_list=\"",
+        config->thread_count, config->buffer_size, config->ssl_io_buffer_size,
+        config->edge_triggered);
+    add_label_value(output, config->cipher_list);
+    evbuffer_add_printf(output, "\"} 1\n");
+
+    evbuffer_add_printf(output, "# TYPE tunnel_listener_info gauge\n");
+    for (index = 0; index < server->listener_count; index++) {
+        tunnel_config_listener_address(config, index, &listener_name,
+                                       &address, &port);
+        evbuffer_add_printf(output, "tunnel_listener_info{listener=\"");
+        add_label_value(output, listener_name);
+        evbuffer_add_printf(output, "\",address=\"");
+        add_label_value(output, address);
+        evbuffer_add_printf(output, ":%u\"} %d\n", port,
+            server->listeners[index].listen_fd != -1);
+    }
+
+    // The socket options as the kernel took them (see tunnel_socket.h):
+    evbuffer_add_printf(output, "# TYPE tunnel_socket_option gauge\n");
+    SocketOptionWriter client_writer = {output, "client", 0};
+    tunnel_socket_foreach(&server->context->client_socket, write_socket_gauge,
+                          &client_writer);
+    SocketOptionWriter backend_writer = {output, "backend", 0};
+    tunnel_socket_foreach(&server->context->backend_socket, write_socket_gauge,
+                          &backend_writer);
+
+    // Backend health, as of the current context's pools:
+    evbuffer_add_printf(output, "# TYPE tunnel_backend_up gauge\n");
+    write_backend_gauges(server->context, output, "tunnel_backend_up", 0);
+    evbuffer_add_printf(output,
+        "# TYPE tunnel_backend_active_connections gauge\n");
+    write_backend_gauges(server->context, output,
+                         "tunnel_backend_active_connections", 1);
+
+    // Per-thread client counts and buffer usage:
+    evbuffer_add_printf(output, "# TYPE tunnel_thread_clients gauge\n");
+    for (list = server->thread_list, thread_index = 0; list != NULL;
+         list = list_next(list), thread_index++) {
+        thread_snapshot(list_user_data(list), snapshot);
+        evbuffer_add_printf(output, "tunnel_thread_clients{thread=\"%d\"} %lu\n",
+            thread_index, active_connections(snapshot));
+    }
+
+    evbuffer_add_printf(output, "# TYPE tunnel_thread_buffer_bytes gauge\n");
+    for (list = server->thread_list, thread_index = 0; list != NULL;
+         list = list_next(list), thread_index++) {
+        thread_snapshot(list_user_data(list), snapshot);
+        evbuffer_add_printf(output, "tunnel_thread_buffer_bytes{thread=\"%d\"} %lu\n",
+            thread_index, buffer_bytes(snapshot));
+    }
+
+    // Counters, per thread.  (Use sum() for the totals.)
+    for (index = 0; index < METRIC_COUNTER_COUNT; index++) {
+        name = tunnel_metrics_counter_name(index);
+        evbuffer_add_printf(output, "# TYPE tunnel_%s_total counter\n", name);
+
+        for (list = server->thread_list, thread_index = 0; list != NULL;
+             list = list_next(list), thread_index++) {
+            thread_snapshot(list_user_data(list), snapshot);
+            evbuffer_add_printf(output, "tunnel_%s_total{thread=\"%d\"} %lu\n",
+                name, thread_index, snapshot->counters[index]);
+        }
+    }
+
+    // Histograms, across all threads:
+    for (list = server->thread_list; list != NULL; list = list_next(list)) {
+        TunnelThread *thread = list_user_data(list);
+        tunnel_metrics_sum(total, thread->metrics);
+    }
+
+    for (index = 0; index < METRIC_HISTOGRAM_COUNT; index++) {
+        const TunnelHistogram *histogram = &total->histograms[index];
+        name = tunnel_metrics_histogram_name(index);
+
+        evbuffer_add_printf(output, "# TYPE tunnel_%s histogram\n", name);
+        cumulative = 0;
+        for (bucket = 0; bucket < METRICS_HISTOGRAM_BUCKETS - 1; bucket++) {
+            cumulative += histogram->buckets[bucket];
+            evbuffer_add_printf(output, "tunnel_%s_bucket{le=\"%llu\"} %lu\n",
+                name, (bucket == 0) ? 0ULL : (1ULL << bucket) - 1, cumulative);
+        }
+        evbuffer_add_printf(output,
+            "tunnel_%s_bucket{le=\"+Inf\"} %lu\n"
+            "tunnel_%s_sum %lu\n"
+            "tunnel_%s_count %lu\n",
+            name, histogram->count, name, histogram->sum, name,
+            histogram->count);
+
+        // Precomputed percentiles, for scrapers that can't do
+        // histogram_quantile() themselves:
+        evbuffer_add_printf(output, "# TYPE tunnel_%s_percentile gauge\n", name);
+        for (percentile = 0; percentile < PERCENTILE_COUNT; percentile++) {
+            evbuffer_add_printf(output,
+                "tunnel_%s_percentile{quantile=\"%g\"} %lu\n", name,
+                percentiles[percentile],
+                histogram_percentile(histogram, percentiles[percentile]));
+        }
+    }
+
+    tunnel_metrics_free(total);
+    tunnel_metrics_free(snapshot);
+}
+
+
+static void write_json_counters(struct evbuffer *output,
+                                const TunnelMetrics *metrics)
+{
+    int index;
+
+    evbuffer_add_printf(output, "{");
+    for (index = 0; index < METRIC_COUNTER_COUNT; index++) {
+        evbuffer_add_printf(output, "%s\"%s\":%lu", (index == 0) ? "" : ",",
+            tunnel_metrics_counter_name(index), metrics->counters[index]);
+    }
+    evbuffer_add_printf(output, "}");
+}
+
+static void write_json_pool(struct evbuffer *output, TunnelBackendPool *pool)
+{
+    TunnelBackend *backend;
+    int index;
+
+    for (index = 0; index < pool->backend_count; index++) {
+        backend = &pool->backends[index];
+
+        evbuffer_add_printf(output, "%s{\"backend\":", (index == 0) ? "" : ",");
+        add_json_string(output, backend->name);
+        evbuffer_add_printf(output,
+            ",\"weight\":%d,\"up\":%d,"
+            "\"active_connections\":%d,\"connect_usec_ewma\":%lu}",
+            backend->weight,
+            __atomic_load_n(&backend->healthy, __ATOMIC_RELAXED),
+            __atomic_load_n(&backend->active_connections, __ATOMIC_RELAXED),
+            __atomic_load_n(&backend->connect_usec_ewma, __ATOMIC_RELAXED));
+    }
+}
+
+static void write_json(TunnelServer *server, struct evbuffer *output)
+{
+    TunnelConfig *config = server->config;
+    TunnelHost *host;
+    size_t bucket;
+    int host_index;
+    const char *listener_name, *address;
+    uint16_t port;
+    TunnelMetrics *total, *snapshot;
+    List *list;
+    int index, thread_index;
+    size_t percentile;
+    double uptime = uptime_seconds(server);
+
+    total = tunnel_metrics_new();
+    snapshot = tunnel_metrics_new();
+    if (total == NULL || snapshot == NULL) {
+        tunnel_metrics_free(total);
+        tunnel_metrics_free(snapshot);
+        return;
+    }
+
+    evbuffer_add_printf(output,
+        "{\"uptime_seconds\":%.3f,"
+        "\"draining\":%d,"
+        "\"config\":{\"ssl_server_name\":",
+        uptime, server->draining);
+    add_json_string(output, config->ssl_server_name);
+    evbuffer_add_printf(output, ",\"ssl_server_port\":%u,\"destination_name\":",
+        config->ssl_server_port);
+    add_json_string(output, config->destination_name);
+    evbuffer_add_printf(output, ",\"destination_port\":");
+    add_json_string(output, config->destination_port);
+    evbuffer_add_printf(output,
+        ",\"thread_count\":%d,\"buffer_size\":%zu,"
+        "\"ssl_io_buffer_size\":%zu,\"edge_triggered\":%d,\"cipher_list\":",
+        config->thread_count, config->buffer_size, config->ssl_io_buffer_size,
+        config->edge_triggered);
+    add_json_string(output, config->cipher_list ? config->cipher_list : "");
+    evbuffer_add_printf(output, "},\"backends\":[");
+
+    write_json_pool(output, server->context->backends);
+
+    // The listeners, with their own backends if they have any:
+    evbuffer_add_printf(output, "],\"listeners\":[");
+    for (index = 0; index < server->listener_count; index++) {
+        tunnel_config_listener_address(config, index, &listener_name,
+                                       &address, &port);
+        evbuffer_add_printf(output, "%s{\"listener\":", (index == 0) ? "" : ",");
+        add_json_string(output, listener_name);
+        evbuffer_add_printf(output, ",\"address\":");
+        add_json_string(output, address);
+        evbuffer_add_printf(output, ",\"port\":%u,\"open\":%d,\"backends\":[",
+            port, server->listeners[index].listen_fd != -1);
+        host = tunnel_context_listener(server->context, index);
+        if (host != NULL && host->owns_backends) {
+            write_json_pool(output, host->backends);
+        }
+        evbuffer_add_printf(output, "]}");
+    }
+
+    // The [host] sections, with their own backends if they have any:
+    evbuffer_add_printf(output, "],\"hosts\":[");
+    host_index = 0;
+    for (bucket = 0; bucket < server->context->host_bucket_count; bucket++) {
+        for (host = server->context->host_buckets[bucket]; host != NULL;
+             host = host->next) {
+            evbuffer_add_printf(output, "%s{\"host\":",
+                (host_index++ == 0) ? "" : ",");
+            add_json_string(output, host->config->server_name);
+            evbuffer_add_printf(output, ",\"backends\":[");
+            if (host->owns_backends) { write_json_pool(output, host->backends); }
+            evbuffer_add_printf(output, "]}");
+        }
+    }
+
+    SocketOptionWriter client_writer = {output, "client", 0};
+    SocketOptionWriter backend_writer = {output, "backend", 0};
+    evbuffer_add_printf(output, "],\"sockets\":{\"client\":{");
+    tunnel_socket_foreach(&server->context->client_socket,
+                          write_json_socket_option, &client_writer);
+    evbuffer_add_printf(output, "},\"backend\":{");
+    tunnel_socket_foreach(&server->context->backend_socket,
+                          write_json_socket_option, &backend_writer);
+    evbuffer_add_printf(output, "}},\"threads\":[");
+
+    for (list = server->thread_list, thread_index = 0; list != NULL;
+         list = list_next(list), thread_index++) {
+        thread_snapshot(list_user_data(list), snapshot);
+        tunnel_metrics_sum(total, snapshot);
+
+        evbuffer_add_printf(output,
+            "%s{\"thread\":%d,\"clients\":%lu,\"buffer_bytes\":%lu,"
+            "\"counters\":",
+            (thread_index == 0) ? "" : ",", thread_index,
+            active_connections(snapshot),
+            buffer_bytes(snapshot));
+        write_json_counters(output, snapshot);
+        evbuffer_add_printf(output, "}");
+    }
+
+    evbuffer_add_printf(output, "],\"totals\":");
+    write_json_counters(output, total);
+
+    evbuffer_add_printf(output, ",\"handshakes_per_second\":%.3f",
+        (uptime > 0) ? total->counters[METRIC_HANDSHAKES_COMPLETED] / uptime : 0);
+
+    evbuffer_add_printf(output, ",\"histograms\":{");
+    for (index = 0; index < METRIC_HISTOGRAM_COUNT; index++) {
+        const TunnelHistogram *histogram = &total->histograms[index];
+
+        evbuffer_add_printf(output, "%s\"%s\":{\"count\":%lu,\"sum\":%lu",
+            (index == 0) ? "" : ",", tunnel_metrics_histogram_name(index),
+            histogram->count, histogram->sum);
+        for (percentile = 0; percentile < PERCENTILE_COUNT; percentile++) {
+            evbuffer_add_printf(output, ",\"p%g\":%lu",
+                percentiles[percentile] * 100,
+                histogram_percentile(histogram, percentiles[percentile]));
+        }
+        evbuffer_add_printf(output, "}");
+    }
+    evbuffer_add_printf(output, "}}\n");
+
+    tunnel_metrics_free(total);
+    tunnel_metrics_free(snapshot);
+}
+
+
+// Chrome trace-event format: one "process" per TunnelThread, and one
+// "thread" (timeline row) per traced connection, labeled by its id.
+static void write_trace(TunnelServer *server, struct evbuffer *output)
+{
+    TraceEvent *events;
+    TunnelThread *thread;
+    List *list;
+    size_t count, index;
+    int thread_index;
+    const char *separator = "";
+
+    events = malloc(TUNNEL_TRACE_RING_SIZE * sizeof(*events));
+    if (events == NULL) { return; }
+
+    evbuffer_add_printf(output, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+
+    for (list = server->thread_list, thread_index = 0; list != NULL;
+         list = list_next(list), thread_index++) {
+        thread = list_user_data(list);
+        if (thread->trace == NULL) { continue; }
+
+        evbuffer_add_printf(output,
+            "%s{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,"
+            "\"args\":{\"name\":\"TunnelThread %d\"}}",
+            separator, thread_index, thread_index);
+        separator = ",\n";
+
+        count = tunnel_trace_snapshot(thread->trace, events);
+        for (index = 0; index < count; index++) {
+            TraceEvent *event = &events[index];
+            char phase = tunnel_trace_event_phase(event->type);
+
+            // Timestamps are microseconds since serve_forever():
+            evbuffer_add_printf(output,
+                ",\n{\"name\":\"%s\",\"cat\":\"tunnel\",\"ph\":\"%c\","
+                "\"ts\":%ld,\"pid\":%d,\"tid\":%lu,%s"
+                "\"args\":{\"arg\":%d}}",
+                tunnel_trace_event_name(event->type), phase,
+                (long)(event->usec - server->start_usec), thread_index,
+                event->client_id, (phase == 'i') ? "\"s\":\"t\"," : "",
+                event->arg);
+        }
+    }
+
+    evbuffer_add_printf(output, "]}\n");
+    free(events);
+}
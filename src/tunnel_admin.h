@@ -0,0 +1,49 @@
+/**
+ * Copyright (c) 2014 Derek Simkowiak
+ */
+#ifndef TUNNEL_ADMIN_H
+#define TUNNEL_ADMIN_H
+
+// A local stats endpoint on a Unix domain socket (config->admin_socket).
+//
+// It runs entirely in the main thread, on the TunnelServer's libevent_base;
+// the worker threads only ever update their own TunnelMetrics.  Each
+// connection gets one snapshot and is then closed:
+//
+//   - Prometheus text exposition format for "/metrics", "/", or no
+//     request at all.
+//   - JSON for "/json".
+//   - The sampled connection traces as Chrome trace-event JSON for
+//     "/trace" (see tunnel_trace.h).
+//   - Requests starting with "GET " get an HTTP/1.0 response, so it can be
+//     scraped directly (e.g. curl --unix-socket), and a 404 for any other
+//     path.  Anything else is taken as a bare path ("json\n"; the slash is
+//     optional) and gets the bare body, so "socat - UNIX-CONNECT:<path>"
+//     works too.
+
+#include "tunnel.h"
+#include <sys/types.h>   // for ino_t
+
+struct TunnelServer;
+
+typedef struct TunnelAdmin {
+    int listen_fd;
+    char *socket_path;
+    ino_t socket_inode;     // So we only unlink() our own socket file
+
+    // The event that notifies us of new admin connections:
+    struct event *on_accept_event;
+
+    struct TunnelServer *server;
+} TunnelAdmin;
+
+
+// Bind and listen on 'socket_path'.  Returns NULL on failure:
+TunnelAdmin *tunnel_admin_new(struct TunnelServer *server,
+                              const char *socket_path);
+
+// Stop listening, remove the socket file (unless a newer process replaced
+// it; see tunnel_upgrade.h), and free:
+void tunnel_admin_free(TunnelAdmin *admin);
+
+#endif  // TUNNEL_ADMIN_H
@@ -0,0 +1,513 @@
+/**
+ * Copyright (c) 2014 Derek Simkowiak
+ */
+
+#include "tunnel_backend.h"
+
+// Points on the hash ring per unit of weight.  More points spread the
+// clients more evenly; 64 keeps each backend within a few percent:
+#define RING_POINTS_PER_WEIGHT 64
+
+// The EWMA weight of each new connect latency sample, as a shift (1/8):
+#define EWMA_SHIFT 3
+
+static void on_health_check(int socket_fd, short event, void *arg);
+static void on_health_check_result(int socket_fd, short event, void *arg);
+
+
+// 64-bit FNV-1a:
+static uint64_t hash_bytes(const void *bytes, size_t size, uint64_t hash)
+{
+    const unsigned char *byte = bytes;
+
+    while (size-- > 0) {
+        hash ^= *byte++;
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+#define HASH_SEED 0xcbf29ce484222325ULL
+
+static int compare_ring_points(const void *a, const void *b)
+{
+    const TunnelRingPoint *point_a = a, *point_b = b;
+
+    if (point_a->hash < point_b->hash) { return -1; }
+    return (point_a->hash > point_b->hash) ? 1 : 0;
+}
+
+// Parse "host:port [weight]" (or "[v6 address]:port [weight]"):
+static int parse_backend(TunnelBackend *backend, const char *spec)
+{
+    char *copy, *host, *port, *weight, *save;
+
+    copy = strdup(spec);
+    if (copy == NULL) { return -1; }
+
+    host = strtok_r(copy, " \t", &save);
+    weight = strtok_r(NULL, " \t", &save);
+    port = (host != NULL) ? strrchr(host, ':') : NULL;
+
+    if (port == NULL || port == host || port[1] == '\0') {
+        log(LOG_ERR, "Backend \"%s\" isn't host:port [weight].", spec);
+        free(copy);
+        return -1;
+    }
+    *port++ = '\0';
+
+    // Strip the brackets from an IPv6 address:
+    if (host[0] == '[' && host[strlen(host) - 1] == ']') {
+        host[strlen(host) - 1] = '\0';
+        host++;
+    }
+
+    backend->host = strdup(host);
+    backend->port = strdup(port);
+    backend->name = strdup(spec);
+    backend->weight = (weight != NULL) ? atoi(weight) : 1;
+    free(copy);
+
+    if (backend->host == NULL || backend->port == NULL || backend->name == NULL) {
+        return -1;
+    }
+
+    // The name is the spec without the weight:
+    backend->name[strcspn(backend->name, " \t")] = '\0';
+
+    if (backend->weight < 1) {
+        log(LOG_ERR, "Backend \"%s\" needs a weight of at least 1.", spec);
+        return -1;
+    }
+    return 0;
+}
+
+static int resolve_backend(TunnelBackend *backend)
+{
+    struct addrinfo hints;
+    int result;
+
+    memset(&hints, 0x0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;      // IPv6, IPv4, whatevah
+    hints.ai_socktype = SOCK_STREAM;  // TCP only
+
+    result = getaddrinfo(backend->host, backend->port, &hints,
+                         &backend->addresses);
+    if (result != 0) {
+        log(LOG_ERR, "Can't resolve backend %s: %s", backend->name,
+            gai_strerror(result));
+        backend->addresses = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+static int build_ring(TunnelBackendPool *pool)
+{
+    int index, point, ring_index = 0;
+    TunnelBackend *backend;
+
+    for (index = 0; index < pool->backend_count; index++) {
+        pool->ring_size += pool->backends[index].weight * RING_POINTS_PER_WEIGHT;
+    }
+    pool->ring = calloc(pool->ring_size, sizeof(*pool->ring));
+    if (pool->ring == NULL) { return -1; }
+
+    for (index = 0; index < pool->backend_count; index++) {
+        backend = &pool->backends[index];
+
+        for (point = 0; point < backend->weight * RING_POINTS_PER_WEIGHT; point++) {
+            uint64_t hash = hash_bytes(backend->name, strlen(backend->name), HASH_SEED);
+
+            pool->ring[ring_index].hash = hash_bytes(&point, sizeof(point), hash);
+            pool->ring[ring_index].index = index;
+            ring_index++;
+        }
+    }
+    qsort(pool->ring, pool->ring_size, sizeof(*pool->ring), compare_ring_points);
+    return 0;
+}
+
+TunnelBackendPool *tunnel_backend_pool_new(TunnelConfig *config,
+                                           List *backend_list,
+                                           const char *balance)
+{
+    TunnelBackendPool *pool;
+    TunnelBackend *backend;
+    List *link;
+    char *single_backend = NULL;
+    int count = 0;
+
+    pool = calloc(1, sizeof(*pool));
+    if (pool == NULL) { return NULL; }
+
+    pool->eject_after = config->eject_after;
+    pool->health_check_interval = config->health_check_interval;
+
+    if (balance == NULL || strcmp(balance, "least_conn") == 0) {
+        pool->balance = BALANCE_LEAST_CONN;
+    } else if (strcmp(balance, "hash") == 0) {
+        pool->balance = BALANCE_HASH;
+    } else if (strcmp(balance, "ewma") == 0) {
+        pool->balance = BALANCE_EWMA;
+    } else {
+        log(LOG_ERR, "Unknown balance \"%s\".", balance);
+        tunnel_backend_pool_free(pool);
+        return NULL;
+    }
+
+    // Without a [backends] section, the [main] destination is the only one:
+    if (backend_list == NULL) {
+        if (config->destination_name == NULL || config->destination_port == NULL) {
+            log(LOG_ERR, "No [backends], and no destination_name/destination_port.");
+            tunnel_backend_pool_free(pool);
+            return NULL;
+        }
+        single_backend = malloc(strlen(config->destination_name) +
+                                strlen(config->destination_port) + 2);
+        if (single_backend == NULL) {
+            tunnel_backend_pool_free(pool);
+            return NULL;
+        }
+        sprintf(single_backend, "%s:%s", config->destination_name,
+                config->destination_port);
+        count = 1;
+    }
+    for (link = backend_list; link != NULL; link = list_next(link)) {
+        count++;
+    }
+    if (count > TUNNEL_BACKEND_MAX) {
+        log(LOG_ERR, "Too many backends (%d); the most is %d.", count,
+            TUNNEL_BACKEND_MAX);
+        tunnel_backend_pool_free(pool);
+        return NULL;
+    }
+
+    pool->backends = calloc(count, sizeof(*pool->backends));
+    if (pool->backends == NULL) {
+        free(single_backend);
+        tunnel_backend_pool_free(pool);
+        return NULL;
+    }
+
+    link = backend_list;
+    for (pool->backend_count = 0; pool->backend_count < count; pool->backend_count++) {
+        backend = &pool->backends[pool->backend_count];
+        backend->pool = pool;
+        backend->check_fd = -1;
+        backend->healthy = 1;
+
+        if (parse_backend(backend, single_backend ? single_backend
+                                                  : list_user_data(link)) != 0 ||
+            resolve_backend(backend) != 0) {
+            pool->backend_count++;   // So it gets freed
+            free(single_backend);
+            tunnel_backend_pool_free(pool);
+            return NULL;
+        }
+        if (link != NULL) { link = list_next(link); }
+    }
+    free(single_backend);
+
+    if (pool->balance == BALANCE_HASH && build_ring(pool) != 0) {
+        tunnel_backend_pool_free(pool);
+        return NULL;
+    }
+
+    return pool;
+}
+
+void tunnel_backend_pool_free(TunnelBackendPool *pool)
+{
+    TunnelBackend *backend;
+    int index;
+
+    if (pool == NULL) { return; }
+
+    tunnel_backend_pool_stop_health_checks(pool);
+
+    for (index = 0; index < pool->backend_count; index++) {
+        backend = &pool->backends[index];
+        if (backend->addresses != NULL) { freeaddrinfo(backend->addresses); }
+        free(backend->name);
+        free(backend->host);
+        free(backend->port);
+    }
+    free(pool->backends);
+    free(pool->ring);
+    free(pool);
+}
+
+
+// Usable for a new connection?
+static int is_up(TunnelBackend *backend, uint64_t now_usec)
+{
+    if (__atomic_load_n(&backend->healthy, __ATOMIC_RELAXED)) { return 1; }
+
+    // Without health checks, nothing else would ever bring it back:
+    return backend->pool->health_check_interval == 0 &&
+           now_usec - __atomic_load_n(&backend->ejected_usec, __ATOMIC_RELAXED)
+            >= (uint64_t)TUNNEL_BACKEND_RETRY_SEC * 1000000;
+}
+
+static TunnelBackend *pick_from_ring(TunnelBackendPool *pool,
+                                     const struct sockaddr *client_address,
+                                     uint64_t tried_mask, uint64_t now_usec)
+{
+    TunnelBackend *backend, *fallback = NULL;
+    uint64_t hash = HASH_SEED;
+    int low = 0, high = pool->ring_size, middle, step;
+
+    if (client_address->sa_family == AF_INET) {
+        const struct sockaddr_in *address = (const struct sockaddr_in *)client_address;
+        hash = hash_bytes(&address->sin_addr, sizeof(address->sin_addr), hash);
+    } else if (client_address->sa_family == AF_INET6) {
+        const struct sockaddr_in6 *address = (const struct sockaddr_in6 *)client_address;
+        hash = hash_bytes(&address->sin6_addr, sizeof(address->sin6_addr), hash);
+    }
+
+    // The first point at or after the client's hash:
+    while (low < high) {
+        middle = (low + high) / 2;
+        if (pool->ring[middle].hash < hash) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+
+    // Then on around the ring, past backends that are down or tried:
+    for (step = 0; step < pool->ring_size; step++) {
+        int index = pool->ring[(low + step) % pool->ring_size].index;
+
+        if (tried_mask & (1ULL << index)) { continue; }
+        backend = &pool->backends[index];
+        if (is_up(backend, now_usec)) { return backend; }
+        if (fallback == NULL) { fallback = backend; }
+    }
+    return fallback;
+}
+
+TunnelBackend *tunnel_backend_pool_pick(TunnelBackendPool *pool,
+                                        const struct sockaddr *client_address,
+                                        uint64_t tried_mask)
+{
+    TunnelBackend *backend, *best = NULL, *fallback = NULL;
+    uint64_t now_usec = tunnel_metrics_now_usec();
+    double cost, best_cost = 0;
+    unsigned int start;
+    int step, index, active;
+
+    if (pool->balance == BALANCE_HASH) {
+        return pick_from_ring(pool, client_address, tried_mask, now_usec);
+    }
+
+    start = __atomic_fetch_add(&pool->next_index, 1, __ATOMIC_RELAXED);
+
+    for (step = 0; step < pool->backend_count; step++) {
+        index = (start + step) % pool->backend_count;
+        if (tried_mask & (1ULL << index)) { continue; }
+
+        backend = &pool->backends[index];
+        if (!is_up(backend, now_usec)) {
+            if (fallback == NULL) { fallback = backend; }
+            continue;
+        }
+
+        active = __atomic_load_n(&backend->active_connections, __ATOMIC_RELAXED);
+        cost = (double)(active + 1) / backend->weight;
+        if (pool->balance == BALANCE_EWMA) {
+            // Unmeasured backends cost 1us, so they get measured:
+            cost *= MAX(__atomic_load_n(&backend->connect_usec_ewma,
+                                        __ATOMIC_RELAXED), 1);
+        }
+
+        if (best == NULL || cost < best_cost) {
+            best = backend;
+            best_cost = cost;
+        }
+    }
+    return (best != NULL) ? best : fallback;
+}
+
+
+// One good connect (or health check) puts a backend back in rotation:
+static void backend_succeeded(TunnelBackend *backend)
+{
+    __atomic_store_n(&backend->failures, 0, __ATOMIC_RELAXED);
+    if (__atomic_exchange_n(&backend->healthy, 1, __ATOMIC_RELAXED) == 0) {
+        log(LOG_NOTICE, "Backend %s is back up.", backend->name);
+    }
+}
+
+void tunnel_backend_connected(TunnelBackend *backend, uint64_t connect_usec)
+{
+    uint64_t ewma = __atomic_load_n(&backend->connect_usec_ewma, __ATOMIC_RELAXED);
+
+    __atomic_add_fetch(&backend->active_connections, 1, __ATOMIC_RELAXED);
+
+    // Racing updates from other threads may lose a sample; that's fine:
+    ewma = (ewma == 0) ? connect_usec
+                       : ewma - (ewma >> EWMA_SHIFT) + (connect_usec >> EWMA_SHIFT);
+    __atomic_store_n(&backend->connect_usec_ewma, MAX(ewma, 1), __ATOMIC_RELAXED);
+
+    backend_succeeded(backend);
+}
+
+void tunnel_backend_failed(TunnelBackend *backend)
+{
+    int failures = __atomic_add_fetch(&backend->failures, 1, __ATOMIC_RELAXED);
+
+    if (failures < backend->pool->eject_after) { return; }
+
+    __atomic_store_n(&backend->ejected_usec, tunnel_metrics_now_usec(),
+                     __ATOMIC_RELAXED);
+    if (__atomic_exchange_n(&backend->healthy, 0, __ATOMIC_RELAXED) == 1) {
+        log(LOG_WARNING, "Backend %s is down after %d failed connects.",
+            backend->name, failures);
+    }
+}
+
+void tunnel_backend_release(TunnelBackend *backend)
+{
+    __atomic_sub_fetch(&backend->active_connections, 1, __ATOMIC_RELAXED);
+}
+
+
+int tunnel_backend_pool_start_health_checks(TunnelBackendPool *pool,
+                                            struct event_base *base)
+{
+    struct timeval interval = {pool->health_check_interval, 0};
+
+    if (pool->health_check_interval == 0 || pool->health_check_event != NULL) {
+        return 0;
+    }
+
+    pool->libevent_base = base;
+    pool->health_check_event =
+     event_new(base, -1 /* dummy fd */, EV_PERSIST, on_health_check, pool);
+    if (pool->health_check_event == NULL) { return -1; }
+
+    event_add(pool->health_check_event, &interval);
+    return 0;
+}
+
+static void end_health_check(TunnelBackend *backend)
+{
+    if (backend->check_event != NULL) {
+        event_free(backend->check_event);
+        backend->check_event = NULL;
+    }
+    if (backend->check_fd != -1) {
+        close(backend->check_fd);
+        backend->check_fd = -1;
+    }
+}
+
+void tunnel_backend_pool_stop_health_checks(TunnelBackendPool *pool)
+{
+    int index;
+
+    if (pool->health_check_event == NULL) { return; }
+
+    event_free(pool->health_check_event);
+    pool->health_check_event = NULL;
+
+    for (index = 0; index < pool->backend_count; index++) {
+        end_health_check(&pool->backends[index]);
+    }
+}
+
+// Check the backend's addresses from 'address' on.  Each one gets an equal
+// share of the interval to answer in:
+static void start_health_check(TunnelBackend *backend, struct addrinfo *address)
+{
+    TunnelBackendPool *pool = backend->pool;
+    struct addrinfo *next_address;
+    struct timeval timeout;
+    uint64_t timeout_usec;
+    int address_count = 0, result;
+
+    for (next_address = backend->addresses; next_address != NULL;
+         next_address = next_address->ai_next) {
+        address_count++;
+    }
+    timeout_usec = (uint64_t)pool->health_check_interval * 1000000 /
+                   MAX(address_count, 1);
+    timeout.tv_sec = timeout_usec / 1000000;
+    timeout.tv_usec = timeout_usec % 1000000;
+
+    for (; address != NULL; address = address->ai_next) {
+        backend->check_address = address;
+        backend->check_fd = socket(address->ai_family, SOCK_STREAM,
+                                   address->ai_protocol);
+        if (backend->check_fd == -1) {
+            log_err("socket() failed for the health check of %s.", backend->name);
+            continue;
+        }
+        evutil_make_socket_nonblocking(backend->check_fd);
+
+        result = connect(backend->check_fd, address->ai_addr, address->ai_addrlen);
+        if (result == 0) {
+            end_health_check(backend);
+            backend_succeeded(backend);
+            return;
+        }
+        if (errno != EINPROGRESS) {
+            end_health_check(backend);
+            continue;
+        }
+
+        backend->check_event =
+         event_new(pool->libevent_base, backend->check_fd, EV_WRITE,
+                   on_health_check_result, backend);
+        if (backend->check_event == NULL) {
+            end_health_check(backend);
+            return;
+        }
+        event_add(backend->check_event, &timeout);
+        return;
+    }
+
+    log(LOG_DEBUG, "Health check of %s failed.", backend->name);
+    tunnel_backend_failed(backend);
+}
+
+static void on_health_check(int socket_fd, short event, void *arg)
+{
+    TunnelBackendPool *pool = (TunnelBackendPool *)arg;
+    TunnelBackend *backend;
+    int index;
+
+    for (index = 0; index < pool->backend_count; index++) {
+        backend = &pool->backends[index];
+
+        // The last check never finished (its timeouts add up to the
+        // interval, so this is rare):
+        if (backend->check_fd != -1) {
+            end_health_check(backend);
+            tunnel_backend_failed(backend);
+        }
+        start_health_check(backend, backend->addresses);
+    }
+}
+
+static void on_health_check_result(int socket_fd, short event, void *arg)
+{
+    TunnelBackend *backend = (TunnelBackend *)arg;
+    struct addrinfo *address = backend->check_address;
+    int error = -1;
+    socklen_t error_size = sizeof(error);
+
+    if (!(event & EV_TIMEOUT)) {
+        getsockopt(socket_fd, SOL_SOCKET, SO_ERROR, &error, &error_size);
+    }
+    end_health_check(backend);
+
+    if (error == 0) {
+        backend_succeeded(backend);
+    } else {
+        // Any of its addresses will do:
+        start_health_check(backend, address->ai_next);
+    }
+}
@@ -0,0 +1,119 @@
+/**
+ * Copyright (c) 2014 Derek Simkowiak
+ */
+#ifndef TUNNEL_BACKEND_H
+#define TUNNEL_BACKEND_H
+
+// The plaintext servers to tunnel to (the [backends] section or a [host]
+// section's backends, or the single destination_name:destination_port),
+// and how to pick one for each new connection.
+//
+// A pool belongs to a TunnelContext, so a reload starts a fresh one.  The
+// worker threads pick from it and report on their connects; the counters
+// they share are atomic.  The main thread runs the active health checks on
+// its own event_base: every config->health_check_interval seconds it tries
+// a non-blocking TCP connect to each backend, address by address in the
+// order the clients' connects use them, until one answers.  Active and
+// passive checks feed the same count of failures in a row:
+// config->eject_after of them take a backend out of rotation, and one
+// success puts it back.  (With no health checks, an ejected backend is
+// given another try after TUNNEL_BACKEND_RETRY_SEC.)
+//
+// If every backend is down, tunnel_backend_pool_pick() picks among all of
+// them anyway; a connect that might work beats a certain failure.
+
+#include "tunnel.h"
+#include <netdb.h>
+
+// Backends are tracked in a uint64_t mask per connect:
+#define TUNNEL_BACKEND_MAX 64
+
+#define TUNNEL_BACKEND_RETRY_SEC 10
+
+typedef enum {
+    BALANCE_LEAST_CONN,     // Fewest active connections per unit of weight
+    BALANCE_HASH,           // Consistent hash of the client's IP address
+    BALANCE_EWMA,           // Least (active + 1) * connect latency EWMA / weight
+} TunnelBalance;
+
+struct TunnelConfig;
+struct TunnelBackendPool;
+
+typedef struct TunnelBackend {
+    char *name;                    // "host:port", for logs and metrics
+    char *host;
+    char *port;
+    int weight;
+    struct addrinfo *addresses;    // Resolved once, by tunnel_backend_pool_new()
+
+    // Shared by all threads (atomic):
+    int healthy;
+    int failures;                  // Failed connects in a row
+    int active_connections;
+    uint64_t connect_usec_ewma;    // 0 until the first connect
+    uint64_t ejected_usec;         // When it last went down
+
+    // The health check in progress, if any.  Main thread only:
+    int check_fd;
+    struct addrinfo *check_address;    // The one check_fd is connecting to
+    struct event *check_event;
+
+    struct TunnelBackendPool *pool;
+} TunnelBackend;
+
+// One point on the consistent hash ring:
+typedef struct {
+    uint64_t hash;
+    int index;
+} TunnelRingPoint;
+
+typedef struct TunnelBackendPool {
+    TunnelBackend *backends;
+    int backend_count;
+    TunnelBalance balance;
+    int eject_after;
+
+    // For BALANCE_HASH; sorted by hash:
+    TunnelRingPoint *ring;
+    int ring_size;
+
+    // Where the next scan starts, so ties are spread out (atomic):
+    unsigned int next_index;
+
+    // Fires every health_check_interval seconds, or NULL:
+    int health_check_interval;
+    struct event_base *libevent_base;
+    struct event *health_check_event;
+} TunnelBackendPool;
+
+
+// Parse and resolve the "host:port [weight]" strings in 'backend_list', or
+// config's destination_name:destination_port if it's NULL.  The health
+// check settings come from 'config'; 'balance' may be NULL for least_conn.
+// Returns NULL (having logged why) on any error:
+TunnelBackendPool *tunnel_backend_pool_new(struct TunnelConfig *config,
+                                           List *backend_list,
+                                           const char *balance);
+void tunnel_backend_pool_free(TunnelBackendPool *pool);
+
+// Start (or stop) the active health checks on 'base'.  Main thread only;
+// stop them before the pool's context can be freed:
+int tunnel_backend_pool_start_health_checks(TunnelBackendPool *pool,
+                                            struct event_base *base);
+void tunnel_backend_pool_stop_health_checks(TunnelBackendPool *pool);
+
+// Pick a backend for a client at 'client_address', skipping those whose
+// index bit is set in 'tried_mask'.  Returns NULL if all were tried:
+TunnelBackend *tunnel_backend_pool_pick(TunnelBackendPool *pool,
+                                        const struct sockaddr *client_address,
+                                        uint64_t tried_mask);
+
+// Report a connect to 'backend': connected after 'connect_usec' (and now
+// holding a connection, until tunnel_backend_release()), or failed:
+void tunnel_backend_connected(TunnelBackend *backend, uint64_t connect_usec);
+void tunnel_backend_failed(TunnelBackend *backend);
+void tunnel_backend_release(TunnelBackend *backend);
+
+#define tunnel_backend_index(backend) ((int)((backend) - (backend)->pool->backends))
+
+#endif  // TUNNEL_BACKEND_H
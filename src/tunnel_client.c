@@ -3,12 +3,20 @@
  */
 
 #include "tunnel_client.h"
+#include <fcntl.h>
 
 static void on_read_ssl(int socket_fd, short event, void *arg);
 static void on_write_ssl(int socket_fd, short event, void *arg);
 
 static void on_read_dest(int socket_fd, short event, void *arg);
 static void on_write_dest(int socket_fd, short event, void *arg);
+static void on_connect_dest(int socket_fd, short event, void *arg);
+
+// The same, with thread->uring (see start_dest_read()):
+static void on_dest_read_complete(TunnelUringOp *op, int result);
+static void on_dest_write_complete(TunnelUringOp *op, int result);
+static void start_dest_read(TunnelClient *client);
+static void start_dest_write(TunnelClient *client);
 
 // These timeout callbacks re-enable the read/write events.
 static void on_read_ssl_timeout(int socket_fd, short event, void *arg);
@@ -16,7 +24,20 @@ static void on_write_ssl_timeout(int socket_fd, short event, void *arg);
 static void on_read_dest_timeout(int socket_fd, short event, void *arg);
 static void on_write_dest_timeout(int socket_fd, short event, void *arg);
 
-static void handle_ssl_accept(TunnelClient *client);
+static int handle_ssl_accept(TunnelClient *client);
+static int finish_connect(TunnelClient *client);
+static void queue_proxy_header(TunnelClient *client);
+static int start_session(TunnelClient *client);
+static int handle_client_hello(TunnelClient *client);
+static void set_peer_name(TunnelClient *client, int socket_fd);
+static void mark_active(TunnelClient *client);
+static void schedule_write(TunnelClient *client, struct event *write_event);
+static void schedule_dest_write(TunnelClient *client);
+static void pause_read(TunnelClient *client, struct event *read_event,
+                       struct event *timeout_event);
+
+// The last TunnelClient id handed out (shared by all threads):
+static uint64_t last_client_id = 0;
 
 
 void tunnel_client_disconnect_and_free(TunnelClient *client) 
@@ -25,6 +46,17 @@ void tunnel_client_disconnect_and_free(TunnelClient *client)
     tunnel_client_free(client);    
 }
 
+void tunnel_client_close(TunnelClient *client)
+{
+    // Non-blocking: this sends our close_notify, and doesn't wait for the
+    // client's.  Either way the client sees a clean TLS close, not a reset:
+    if (client->ssl_accept_state == SSL_SUCCESS && client->ssl_socket_fd != -1) {
+        CyaSSL_shutdown(client->cyassl);
+        if (client->ssl_io != NULL) { tunnel_io_flush(client->ssl_io); }
+    }
+    tunnel_client_disconnect_and_free(client);
+}
+
 void tunnel_client_disconnect(TunnelClient *client) 
 {
     tunnel_client_disconnect_dest(client);
@@ -34,14 +66,28 @@ void tunnel_client_disconnect(TunnelClient *client)
 void tunnel_client_disconnect_dest(TunnelClient *client) 
 {
     if (client == NULL) { return; }
-    
-    // Close the socket:
-    if (client->dest_socket_fd > 0) {
-        close(client->dest_socket_fd);
-        client->dest_socket_fd = -1;
+
+    // io_uring requests in flight hold the socket open; cancel them.  (The
+    // ones still queued name its fd, so they go to the kernel before the
+    // fd can be reused.)  If the ring is too full to take a cancel, shut
+    // the socket down instead, which ends them just the same.
+    // tunnel_client_free() waits for them:
+    if (client->thread != NULL && client->thread->uring != NULL &&
+        (client->dest_read_op.in_flight || client->dest_write_op.in_flight)) {
+        if (tunnel_uring_cancel(client->thread->uring, &client->dest_read_op) != 0 ||
+            tunnel_uring_cancel(client->thread->uring, &client->dest_write_op) != 0) {
+            shutdown(client->dest_socket_fd, SHUT_RDWR);
+        }
+        tunnel_uring_submit(client->thread->uring);
     }
     
-    // Unschedule the events event_add()ed for this connection:
+    // Unschedule the events event_add()ed for this connection.  (Before
+    // the close: libevent removes an edge-triggered event from epoll by
+    // its fd.)
+    if (client->connect_dest_event != NULL) {
+        event_free(client->connect_dest_event);
+        client->connect_dest_event = NULL;
+    }
     if (client->on_read_dest_event != NULL) { 
         event_del(client->on_read_dest_event); 
         event_free(client->on_read_dest_event);
@@ -53,6 +99,12 @@ void tunnel_client_disconnect_dest(TunnelClient *client)
         client->on_write_dest_event = NULL;
     }
 
+    // Close the socket:
+    if (client->dest_socket_fd > 0) {
+        close(client->dest_socket_fd);
+        client->dest_socket_fd = -1;
+    }
+
     // Unlink us from the parent thread's client_list:
     if (client->link != NULL) {
         client->thread->client_list =
@@ -66,13 +118,8 @@ void tunnel_client_disconnect_ssl(TunnelClient *client)
 
     if (client == NULL) { return; }
     
-    // Close the socket:
-    if (client->ssl_socket_fd > 0) {
-        close(client->ssl_socket_fd);
-        client->ssl_socket_fd = -1;
-    }
-    
-    // Unschedule the events event_add()ed for this connection:
+    // Unschedule the events event_add()ed for this connection (before the
+    // close, as in tunnel_client_disconnect_dest()):
     if (client->on_read_ssl_event != NULL) { 
         event_del(client->on_read_ssl_event); 
         event_free(client->on_read_ssl_event);
@@ -84,6 +131,12 @@ void tunnel_client_disconnect_ssl(TunnelClient *client)
         client->on_write_ssl_event = NULL;
     }
 
+    // Close the socket:
+    if (client->ssl_socket_fd > 0) {
+        close(client->ssl_socket_fd);
+        client->ssl_socket_fd = -1;
+    }
+
     // Unlink us from the parent thread's client_list:
     if (client->link != NULL) {
         client->thread->client_list =
@@ -96,6 +149,35 @@ void tunnel_client_free(TunnelClient *client)
 {    
     if (client == NULL) { return; }
 
+    timer_wheel_cancel(&client->timeout_entry);
+
+    // io_uring requests still in flight use our buffers (disconnecting
+    // cancelled them).  The last one to complete frees us:
+    if (client->dest_read_op.in_flight || client->dest_write_op.in_flight) {
+        client->free_pending = 1;
+        return;
+    }
+
+    if (client->thread != NULL) {
+        if (client->handshake_pending) {
+            tunnel_thread_end_handshake(client->thread);
+        }
+        tunnel_metrics_add(client->thread->metrics, METRIC_CONNECTIONS_CLOSED, 1);
+        tunnel_trace(client, TRACE_CLOSE, 0);
+
+        if (client->connect_usec != 0) {
+            uint64_t lifetime_usec = tunnel_metrics_now_usec() - client->connect_usec;
+
+            tunnel_metrics_observe(client->thread->metrics,
+                                   METRIC_CONNECTION_LIFETIME_MSEC,
+                                   lifetime_usec / 1000);
+            log_client(LOG_INFO, client, "Connection closed after %lu ms.  "
+                "bytes_from_ssl: %lu, bytes_from_dest: %lu",
+                lifetime_usec / 1000, client->bytes_from_ssl,
+                client->bytes_from_dest);
+        }
+    }
+
     if (client->read_ssl_timeout_event != NULL) {
         event_free(client->read_ssl_timeout_event);
     }
@@ -109,12 +191,26 @@ void tunnel_client_free(TunnelClient *client)
         event_free(client->write_dest_timeout_event);
     }
     
+    if (client->from_ssl_buffer != NULL && client->thread != NULL) {
+        tunnel_metrics_add(client->thread->metrics, METRIC_BUFFER_BYTES_FREED,
+                           2 * client->buffer_size);
+    }
+    if (client->ssl_io != NULL && client->thread != NULL) {
+        tunnel_metrics_add(client->thread->metrics, METRIC_BUFFER_BYTES_FREED,
+                           2 * client->ssl_io->buffer_size);
+    }
+    if (client->uring_buffer_pair >= 0) {
+        tunnel_uring_unregister(client->thread->uring, client->uring_buffer_pair);
+    }
     if (client->cyassl != NULL) { CyaSSL_free(client->cyassl); }
+    tunnel_io_free(client->ssl_io);
     if (client->from_ssl_buffer != NULL) { free(client->from_ssl_buffer); }
     if (client->from_dest_buffer != NULL) { free(client->from_dest_buffer); }
 
     tunnel_thread_unref(client->thread);
     tunnel_server_unref(client->server);
+    if (client->backend != NULL) { tunnel_backend_release(client->backend); }
+    tunnel_context_unref(client->context);
     
     fifo_free(client->from_ssl_fifo);
     fifo_free(client->from_dest_fifo);
@@ -122,43 +218,48 @@ void tunnel_client_free(TunnelClient *client)
     free(client);
 }
 
-TunnelClient *tunnel_client_new(TunnelThread *thread, TunnelServer *server)
+TunnelClient *tunnel_client_new(TunnelThread *thread, TunnelServer *server,
+                                TunnelContext *context, int listener_index)
 {
 
     TunnelClient *client;
     
-    if (thread == NULL || server == NULL) { return NULL; }
+    if (thread == NULL || server == NULL || context == NULL) { return NULL; }
 
     client = calloc(1, sizeof(*client));
     if (client == NULL) { return NULL; }
+
+    client->context = context;
+    tunnel_context_ref(context);
+
+    client->id = __atomic_add_fetch(&last_client_id, 1, __ATOMIC_RELAXED);
+    client->timeout_entry.user_data = client;
+    client->dest_read_op.callback = on_dest_read_complete;
+    client->dest_read_op.arg = client;
+    client->dest_write_op.callback = on_dest_write_complete;
+    client->dest_write_op.arg = client;
+    client->uring_buffer_pair = -1;
+    strcpy(client->peer_name, "-");
+    client->traced = (thread->trace != NULL &&
+                      client->id % context->config->trace_sample_rate == 0);
     
-    // New CYALSSL * for this connection:
-    client->cyassl = CyaSSL_new(server->cyassl_ctx);
-    if (client->cyassl == NULL) {
-        tunnel_client_free(client);
-        return NULL;
-    }
-    
-    // Allocate the buffers and FIFO for read/writes:
-    client->from_ssl_buffer = calloc(1, server->config->buffer_size);
-    if (client->from_ssl_buffer == NULL) {
-        tunnel_client_free(client);
-        return NULL;
-    }
-    
-    client->from_dest_buffer = calloc(1, server->config->buffer_size);
-    if (client->from_dest_buffer == NULL) {
-        tunnel_client_free(client);
-        return NULL;
-    }
-    
-    client->from_ssl_fifo = fifo_new(server->config->buffer_size);
+    client->listener = tunnel_context_listener(context, listener_index);
+    client->buffer_size = (client->listener && client->listener->buffer_size)
+                          ? client->listener->buffer_size
+                          : context->config->buffer_size;
+    client->proxy_protocol = (client->listener && client->listener->proxy_protocol >= 0)
+                             ? client->listener->proxy_protocol
+                             : context->config->proxy_protocol;
+
+    // The CYASSL and the buffers wait for the client's first byte (see
+    // start_session()).  The FIFOs are just counters:
+    client->from_ssl_fifo = fifo_new(client->buffer_size);
     if (client->from_ssl_fifo == NULL) {
         tunnel_client_free(client);
         return NULL;
     }
     
-    client->from_dest_fifo = fifo_new(server->config->buffer_size);
+    client->from_dest_fifo = fifo_new(client->buffer_size);
     if (client->from_dest_fifo == NULL) {
         tunnel_client_free(client);
         return NULL;
@@ -221,118 +322,271 @@ TunnelClient *tunnel_client_new(TunnelThread *thread, TunnelServer *server)
 }
 
 
-// socket_fd must be the client socket back returned by accept().
-int tunnel_client_connect(TunnelClient *client, int socket_fd, List *link)
+// The backend connect.  connect_backend() starts a non-blocking connect()
+// to the backend the balancer picks, and on_connect_dest() finishes it.  A
+// backend that fails (or takes connect_timeout seconds) is reported, and
+// we try its next address, or the next backend, once each.  The handshake
+// waits meanwhile: we want to be sure of a backend before we accept the
+// SSL connection.
+
+// Start connecting to 'address'.  Returns 0 if the connect is under way
+// (or done), -1 (having logged why) if it failed right away, or less if
+// we can't go on at all:
+static int start_connect(TunnelClient *client, struct addrinfo *address)
 {
+    TunnelConfig *config = client->context->config;
+    struct timeval timeout = {config->connect_timeout, 0};
     int result;
-    
-    // First, we connect to the destination server.  We want to make sure
-    // we can connect before we accept() an SSL connection.
-    struct addrinfo hints;             // input (family / socktype)
-    struct addrinfo *result_addrinfo;  // output (head of a linked list)
-    struct addrinfo *next_addrinfo;    // linked list iterator
-
-    memset(&hints, 0x0, sizeof(hints));
-    hints.ai_family = AF_UNSPEC;      // IPv6, IPv4, whatevah
-    hints.ai_socktype = SOCK_STREAM;  // TCP only
-
-    result =
-     getaddrinfo(client->server->config->destination_name,
-                client->server->config->destination_port, &hints,
-                &result_addrinfo);
-
-    if (result != 0) {
-        log(LOG_ERR, "getaddrinfo: %s", gai_strerror(result));
+
+    // Get a socket with this address:
+    client->dest_socket_fd =
+     socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+
+    if (client->dest_socket_fd == -1) {
+        log_client_err(client, "socket() failed.");  // Not a valid address and/or port.
         return -1;
     }
 
-    // loop through all the results and connect to the first we can
-    for (next_addrinfo = result_addrinfo; next_addrinfo != NULL;
-         next_addrinfo = next_addrinfo->ai_next) {
+    // libevent sockets must be non-blocking.  (This must happen before
+    // event_new(); libevent's debug mode asserts on it.)  connect() must
+    // not block the other clients on this thread, either:
+    evutil_make_socket_nonblocking(client->dest_socket_fd);
+
+    // Before connect(), so the buffer sizes set the window scale:
+    if (tunnel_socket_apply(client->dest_socket_fd, &config->backend_socket) != 0) {
+        log_client(LOG_DEBUG, client, "Some [backend_socket] options failed.");
+    }
+
+    result = connect(client->dest_socket_fd, address->ai_addr, address->ai_addrlen);
+    if (result == 0) {
+        return (finish_connect(client) == 0) ? 0 : -2;
+    }
 
-        // Get a socket with this address:
-        client->dest_socket_fd =
-         socket(next_addrinfo->ai_family, next_addrinfo->ai_socktype,
-               next_addrinfo->ai_protocol);
-        
-        if (client->dest_socket_fd == -1) {
-            log_err("socket() failed.");  // Not a valid address and/or port.
-            continue;
+    if (errno == EINPROGRESS) {
+        client->connect_dest_event =
+         event_new(client->thread->libevent_base, client->dest_socket_fd,
+                   EV_WRITE, on_connect_dest, client);
+        if (client->connect_dest_event != NULL) {
+            event_add(client->connect_dest_event,
+                      config->connect_timeout > 0 ? &timeout : NULL);
+            return 0;
         }
-        
-        result =
-         connect(client->dest_socket_fd, next_addrinfo->ai_addr,
-                next_addrinfo->ai_addrlen);
+        log_client(LOG_WARNING, client, "event_new() failed.");
+    } else {
+        log_client_err(client, "connect() attempt to %s failed.",
+                       client->connect_candidate->name);
+    }
+    close(client->dest_socket_fd);  // Free the socket resources
+    client->dest_socket_fd = -1;
+    return -1;
+}
+
+// Start connecting to the next address of the backend we're trying, or to
+// the next backend the balancer picks.  Returns 0 if a connect is under
+// way (or done), or non-zero (having logged why) if every backend has
+// failed:
+static int connect_next(TunnelClient *client)
+{
+    TunnelBackend *backend;
+    int result;
 
-        if (result == -1) {
-            log_err("connect() attempt failed.");
-            close(client->dest_socket_fd);  // Free the socket resources
-            continue;
+    for (;;) {
+        if (client->connect_address != NULL) {
+            client->connect_address = client->connect_address->ai_next;
         }
 
-        break; // Successful connect.  Note, next_addrinfo != NULL.
+        if (client->connect_address == NULL) {
+            // Out of addresses.  Was that a backend, or the start?
+            if (client->connect_candidate != NULL) {
+                tunnel_backend_failed(client->connect_candidate);
+            }
+
+            backend = tunnel_backend_pool_pick(client->connect_pool,
+                                               (struct sockaddr *)&client->sockaddr_ssl,
+                                               client->connect_tried_mask);
+            if (backend == NULL) {
+                client->connect_candidate = NULL;
+                log_client(LOG_ERR, client, "connect() failed on every backend.");
+                tunnel_trace(client, TRACE_DEST_CONNECT_END, -1);
+                return -1;
+            }
+            client->connect_tried_mask |= 1ULL << tunnel_backend_index(backend);
+            client->connect_candidate = backend;
+            client->connect_address = backend->addresses;
+            client->connect_begin_usec = tunnel_metrics_now_usec();
+        }
+
+        result = start_connect(client, client->connect_address);
+        if (result != -1) { return result; }
+    }
+}
+
+// Connect to a backend from 'pool'.  Returns 0 if the connect is under way
+// (client->connect_dest_event is set) or done, or non-zero if every backend
+// has failed:
+static int connect_backend(TunnelClient *client, TunnelBackendPool *pool)
+{
+    tunnel_trace(client, TRACE_DEST_CONNECT_BEGIN, 0);
+
+    client->connect_pool = pool;
+    client->connect_tried_mask = 0;
+    client->connect_candidate = NULL;
+    client->connect_address = NULL;
+    return connect_next(client);
+}
+
+// finish_connect() with thread->uring: register our buffers with it, and
+// start reading.  The socket goes back to blocking, so that io_uring waits
+// for it to be ready rather than handing us EAGAIN:
+static int start_uring(TunnelClient *client)
+{
+    char *buffers[2] = {client->from_ssl_buffer, client->from_dest_buffer};
+    int flags = fcntl(client->dest_socket_fd, F_GETFL);
+
+    if (flags == -1 ||
+        fcntl(client->dest_socket_fd, F_SETFL, flags & ~O_NONBLOCK) == -1) {
+        log_client_err(client, "fcntl() failed.");
+        return -3;
     }
 
-    freeaddrinfo(result_addrinfo);  // This was malloc()'d by getaddrinfo().
+    client->uring_buffer_pair = tunnel_uring_register(client->thread->uring,
+                                                      buffers, client->buffer_size);
+    start_dest_read(client);
+    return 0;
+}
 
-    if (next_addrinfo == NULL) {
-        log_err("connect() failed on all addrinfos for %s:%s.",
-                client->server->config->destination_name,
-                client->server->config->destination_port);
-        return -1;
+// dest_socket_fd is connected to connect_candidate: set up the destination
+// events.  Returns -1 if we can't:
+static int finish_connect(TunnelClient *client)
+{
+    short edge = client->thread->edge_triggered ? (EV_ET | EV_PERSIST) : 0;
+    TunnelBackend *backend = client->connect_candidate;
+
+    tunnel_backend_connected(backend,
+                             tunnel_metrics_now_usec() - client->connect_begin_usec);
+    client->backend = backend;
+    client->connect_candidate = NULL;
+    client->connect_address = NULL;
+    tunnel_trace(client, TRACE_DEST_CONNECT_END, 0);
+
+    if (client->thread->uring != NULL) {
+        return start_uring(client);
     }
-    
+
     // Set up our libevent callbacks for this socket:
     client->on_read_dest_event =
      event_new(client->thread->libevent_base, client->dest_socket_fd,
-              EV_READ | EV_PERSIST, on_read_dest, client);
+              EV_READ | EV_PERSIST | edge, on_read_dest, client);
 
     if (client->on_read_dest_event == NULL) { 
-        log(LOG_WARNING, "event_new() failed.");
-        tunnel_client_disconnect(client); // Free the socket resources
-        return -3; 
+        log_client(LOG_WARNING, client, "event_new() failed.");
+        return -1; 
     }
     
     // Write events are armed on-demand; they do not use EV_PERSIST.
+    // (Unless edge-triggered; see thread->edge_triggered.)
     client->on_write_dest_event =
      event_new(client->thread->libevent_base, client->dest_socket_fd,
-              EV_WRITE, on_write_dest, client);
+              EV_WRITE | edge, on_write_dest, client);
 
     if (client->on_write_dest_event == NULL) {
-        log(LOG_WARNING, "event_new() failed.");
-        tunnel_client_disconnect(client); // Free the socket resources
-        return -4;
+        log_client(LOG_WARNING, client, "event_new() failed.");
+        return -1;
+    }
+
+    event_add(client->on_read_dest_event, NULL);
+    if (edge) { event_add(client->on_write_dest_event, NULL); }
+    return 0;
+}
+
+static void on_connect_dest(int socket_fd, short event, void *arg)
+{
+    TunnelClient *client = (TunnelClient *)arg;
+    int error = ETIMEDOUT;
+    socklen_t error_size = sizeof(error);
+
+    event_free(client->connect_dest_event);
+    client->connect_dest_event = NULL;
+
+    if (!(event & EV_TIMEOUT) &&
+        getsockopt(socket_fd, SOL_SOCKET, SO_ERROR, &error, &error_size) != 0) {
+        error = errno;
     }
 
+    if (error == 0) {
+        if (finish_connect(client) != 0) {
+            tunnel_client_disconnect_and_free(client);
+            return;
+        }
+    } else {
+        errno = error;
+        log_client_err(client, "connect() attempt to %s failed.",
+                       client->connect_candidate->name);
+        close(client->dest_socket_fd);
+        client->dest_socket_fd = -1;
+
+        if (connect_next(client) != 0) {
+            tunnel_metrics_add(client->thread->metrics, METRIC_DEST_CONNECT_FAILURES, 1);
+            tunnel_client_disconnect_and_free(client);
+            return;
+        }
+        if (client->connect_dest_event != NULL) { return; }  // Still connecting
+    }
+
+    // Connected.  Carry on with the handshake, which waited for us:
+    if (!client->thread->edge_triggered) {
+        event_add(client->on_read_ssl_event, NULL);
+    }
+    event_active(client->on_read_ssl_event, EV_READ, 0);
+}
+
+
+// socket_fd must be the client socket back returned by accept().  It is
+// ours from here on; if we fail, we've closed it:
+int tunnel_client_connect(TunnelClient *client, int socket_fd, List *link)
+{
+    short edge = client->thread->edge_triggered ? (EV_ET | EV_PERSIST) : 0;
+
     client->ssl_socket_fd = socket_fd;
-    
+
+    if (tunnel_socket_apply(socket_fd, &client->context->config->client_socket) != 0) {
+        log_client(LOG_DEBUG, client, "Some [client_socket] options failed.");
+    }
+
+    // The hash balancer needs the client's address before we pick:
+    set_peer_name(client, socket_fd);
+
+    // Nothing else happens until the client sends its ClientHello.  Then
+    // start_session() allocates the SSL session and buffers, and
+    // handle_client_hello() connects to the backend, before CyaSSL_accept()
+    // reads a byte.  (With defer_accept on the listener, the ClientHello
+    // is usually here already.)  So a port scan or a half-open client
+    // costs us no more than this TunnelClient:
+    client->connect_usec = tunnel_metrics_now_usec();
+
     // libevent sockets must be non-blocking:
-    evutil_make_socket_nonblocking(client->ssl_socket_fd);
-    evutil_make_socket_nonblocking(client->dest_socket_fd);
-    
-    // Associate the SSL socket with CyaSSL:
-    CyaSSL_set_fd(client->cyassl, client->ssl_socket_fd);
-    CyaSSL_set_using_nonblock(client->cyassl, 1);
+    evutil_make_socket_nonblocking(socket_fd);
     
     // Set up our libevent callbacks for this socket, using the thread-wide
     // libevent event_base:
     client->on_read_ssl_event =
      event_new(client->thread->libevent_base, client->ssl_socket_fd,
-              EV_READ | EV_PERSIST, on_read_ssl, client);
+              EV_READ | EV_PERSIST | edge, on_read_ssl, client);
 
     if (client->on_read_ssl_event == NULL) { 
-        log(LOG_WARNING, "event_new() failed.");
+        log_client(LOG_WARNING, client, "event_new() failed.");
         tunnel_client_disconnect(client); // Free the socket resources
         return -3; 
     }
     
     // Write events are armed on-demand; they do not use EV_PERSIST.
+    // (Unless edge-triggered; see thread->edge_triggered.)
     client->on_write_ssl_event =
      event_new(client->thread->libevent_base, client->ssl_socket_fd,
-              EV_WRITE, on_write_ssl, client);
+              EV_WRITE | edge, on_write_ssl, client);
 
     if (client->on_write_ssl_event == NULL) {
-        log(LOG_WARNING, "event_new() failed.");
+        log_client(LOG_WARNING, client, "event_new() failed.");
         tunnel_client_disconnect(client); // Free the socket resources
         return -4;
     }
@@ -342,9 +596,23 @@ int tunnel_client_connect(TunnelClient *client, int socket_fd, List *link)
     client->link = link;
     
     // Write events are added on-demand when bytes are ready in the fifo.
-    event_add(client->on_read_dest_event, NULL);
     event_add(client->on_read_ssl_event, NULL);
+    if (edge) { event_add(client->on_write_ssl_event, NULL); }
+
+    client->handshake_pending = 1;
+    tunnel_thread_begin_handshake(client->thread);
+
+    // Without a handshake_timeout, the idle_timeout covers the handshake:
+    TunnelConfig *config = client->context->config;
+    int timeout = config->handshake_timeout ? config->handshake_timeout
+                                            : config->idle_timeout;
+    if (client->thread->timer_wheel != NULL && timeout > 0) {
+        mark_active(client);
+        timer_wheel_schedule(client->thread->timer_wheel, &client->timeout_entry,
+                             timeout);
+    }
 
+    tunnel_trace(client, TRACE_HANDSHAKE_BEGIN, 0);
     return 0;
 }
 
@@ -352,15 +620,24 @@ static void on_read_ssl(int socket_fd, short event, void *arg) {
 
     TunnelClient *client = (TunnelClient *)arg;
 
-    log(LOG_DEBUG, "Entered.");
+    log_client(LOG_DEBUG, client, "Entered.");
+
+    if (client->ssl_io != NULL) { tunnel_io_readable(client->ssl_io); }
     
     if (client->ssl_accept_state != SSL_SUCCESS) {
-        log(LOG_DEBUG, "SSL NOT accepted.");
-        handle_ssl_accept(client);
+        log_client(LOG_DEBUG, client, "SSL NOT accepted.");
+        if (!client->client_hello_seen &&
+            ((client->cyassl == NULL && start_session(client) != 0) ||
+             handle_client_hello(client) != 0)) {
+            return;  // It's been freed, or hasn't sent it all yet.
+        }
+        if (client->connect_dest_event != NULL) {
+            return;  // on_connect_dest() brings us back.
+        }
 
         // Now are we done?
-        if (client->ssl_accept_state != SSL_SUCCESS) {
-            // Nope, come back when ready.
+        if (handle_ssl_accept(client) != 0) {
+            // Nope, come back when ready.  (Or it failed, and was freed.)
             return;
         }
     }
@@ -368,9 +645,9 @@ static void on_read_ssl(int socket_fd, short event, void *arg) {
     // Before reading, make sure we have room in our buffer:
     if (fifo_bytes_free(client->from_ssl_fifo) == 0) {
         // The client is not draining bytes fast enough.  Take a breather.
-        struct timeval one_ms = {0,1000};
-        event_del(client->on_read_ssl_event);  // Halt these for a bit
-        event_add(client->read_ssl_timeout_event, &one_ms);
+        tunnel_metrics_add(client->thread->metrics, METRIC_FIFO_STALLS, 1);
+        tunnel_trace(client, TRACE_FIFO_STALL, 0);
+        pause_read(client, client->on_read_ssl_event, client->read_ssl_timeout_event);
         return;
     }
     
@@ -378,6 +655,7 @@ static void on_read_ssl(int socket_fd, short event, void *arg) {
     size_t write_index;
     char *buffer_addr;
     size_t buffer_size;
+    size_t bytes_read = 0;
 
     do {
         write_index = fifo_write_index(client->from_ssl_fifo);
@@ -391,49 +669,77 @@ static void on_read_ssl(int socket_fd, short event, void *arg) {
         // bytes in the FIFO:
         if (ssl_read_result > 0) {
             fifo_write(client->from_ssl_fifo, ssl_read_result);
+            bytes_read += ssl_read_result;
         }
         
     } while ( (ssl_read_result > 0) && (fifo_bytes_free(client->from_ssl_fifo) > 0) );
-    
-    // ssl_read_result finally reached <= 0.
-    ssl_error = CyaSSL_get_error(client->cyassl, 0);
 
+    if (bytes_read > 0 && client->bytes_from_ssl == 0) {
+        tunnel_trace(client, TRACE_FIRST_BYTE_FROM_SSL, bytes_read);
+    }
+    if (bytes_read > 0) {
+        mark_active(client);
+        client->request_pending = 1;
+    }
+    client->bytes_from_ssl += bytes_read;
+    tunnel_metrics_add(client->thread->metrics, METRIC_BYTES_FROM_SSL, bytes_read);
+
+    // (Reading can make CyaSSL write, an alert say; that's on_write_ssl's.)
+    if (client->ssl_io != NULL && tunnel_io_pending(client->ssl_io) > 0) {
+        schedule_write(client, client->on_write_ssl_event);
+    }
+    
     if (fifo_bytes_used(client->from_ssl_fifo) > 0) {
         // We have some pending bytes.  Wait for on_write_dest readiness:
-        log(LOG_DEBUG, "fifo_bytes_used(client->from_ssl_fifo): %ld.  Scheduling on_write_dest_event.", fifo_bytes_used(client->from_ssl_fifo));
-        event_add(client->on_write_dest_event, NULL);
+        log_client(LOG_DEBUG, client, "fifo_bytes_used(client->from_ssl_fifo): %ld.  Scheduling on_write_dest_event.", fifo_bytes_used(client->from_ssl_fifo));
+        schedule_dest_write(client);
+    }
+
+    // See if our buffer is full (so, ssl_read_result > 0).  If so, there
+    // is no SSL error to check, and CyaSSL may still hold decrypted bytes
+    // that won't make the socket readable again.  Take a breather; the
+    // timeout picks them up once the FIFO drains:
+    if (fifo_bytes_free(client->from_ssl_fifo) == 0) {
+        log_client(LOG_DEBUG, client, "Returning due to full buffer.");
+        tunnel_metrics_add(client->thread->metrics, METRIC_FIFO_STALLS, 1);
+        tunnel_trace(client, TRACE_FIFO_STALL, 0);
+        pause_read(client, client->on_read_ssl_event, client->read_ssl_timeout_event);
+        return;
     }
+
+    // ssl_read_result finally reached <= 0.
+    ssl_error = CyaSSL_get_error(client->cyassl, 0);
     
     if (ssl_error == SSL_ERROR_WANT_READ) {
-        log(LOG_DEBUG, "SSL_ERROR_WANT_READ: Returning.");
+        log_client(LOG_DEBUG, client, "SSL_ERROR_WANT_READ: Returning.");
         return;  // Success.
     }
 
     if (ssl_error == SSL_ERROR_WANT_WRITE) {
-        log(LOG_DEBUG, "SSL_ERROR_WANT_WRITE: Scheduling on_write_ssl_event, returning.");
+        log_client(LOG_DEBUG, client, "SSL_ERROR_WANT_WRITE: Scheduling on_write_ssl_event, returning.");
         event_add(client->on_write_ssl_event, NULL);
         return;  // Success.
     }
 
     // A real read error (or disconnect, or "close notify alert") occurred.
-    log(LOG_NOTICE, "%s",
+    log_client(LOG_NOTICE, client, "%s",
         CyaSSL_ERR_error_string(ssl_error, client->from_ssl_buffer));
         
     if (fifo_bytes_used(client->from_dest_fifo) > 0) {
         // We still have pending bytes to write; send them before
         // closing the SSL socket.
-        log(LOG_DEBUG,
+        log_client(LOG_DEBUG, client,
             "fifo_bytes_used(client->from_dest_fifo): %ld.  Scheduling on_write_ssl_event.",
             fifo_bytes_used(client->from_ssl_fifo));
-        event_add(client->on_write_ssl_event, NULL);
+        schedule_write(client, client->on_write_ssl_event);
     } else {
-        log(LOG_WARNING,
+        log_client(LOG_DEBUG, client,
             "fifo_bytes_used(client->from_dest_fifo) is zero. Closing SSL connection.");
         tunnel_client_disconnect_ssl(client);
 
         if (fifo_bytes_used(client->from_ssl_fifo) == 0) {
             // All bytes have been flushed.  Done.
-            log(LOG_NOTICE, "Closing all connections.");
+            log_client(LOG_NOTICE, client, "Closing all connections.");
             tunnel_client_disconnect_and_free(client);
             return;
         }
@@ -445,107 +751,183 @@ static void on_write_ssl(int socket_fd, short event, void *arg) {
 
     TunnelClient *client = (TunnelClient *)arg;
 
-    log(LOG_DEBUG, "Entered. fifo_bytes_used(client->from_dest_fifo): %ld",
+    log_client(LOG_DEBUG, client, "Entered. fifo_bytes_used(client->from_dest_fifo): %ld",
         fifo_bytes_used(client->from_dest_fifo));
 
     if (client->ssl_accept_state != SSL_SUCCESS) {
-        log(LOG_DEBUG, "SSL NOT accepted.");
-        handle_ssl_accept(client);
-        
+        // Edge-triggered, we get every writable edge, asked for or not:
+        if (client->thread->edge_triggered && !client->handshake_want_write) {
+            return;
+        }
+        log_client(LOG_DEBUG, client, "SSL NOT accepted.");
+
         // Now are we done?
-        if (client->ssl_accept_state != SSL_SUCCESS) {
-            // Nope, come back when ready.
+        if (handle_ssl_accept(client) != 0) {
+            // Nope, come back when ready.  (Or it failed, and was freed.)
             return;
         }
+
+        // Bytes that came in while we waited made their edge already:
+        if (client->thread->edge_triggered) {
+            event_active(client->on_read_ssl_event, EV_READ, 0);
+        }
     }
 
-    int ssl_write_result, ssl_error;
+    int ssl_write_result, ssl_error, flush_result;
     size_t read_index;
     char *buffer_addr;
     size_t buffer_size;
 
-    read_index = fifo_read_index(client->from_dest_fifo);
-    buffer_size = fifo_read_size(client->from_dest_fifo);
-    buffer_addr = &(client->from_dest_buffer[read_index]);
+    ssl_write_result = 0;
 
-    ssl_write_result = CyaSSL_write(client->cyassl, buffer_addr, buffer_size);
-    
-    while ( (ssl_write_result > 0) && (fifo_bytes_used(client->from_dest_fifo) > 0) ) {
-        // We just wrote bytes from the from_dest_fifo (with CyaSSL_write()).  
-        // Count those processed bytes with the FIFO index counter:
-        log(LOG_DEBUG, "wrote %d bytes", ssl_write_result);
-        fifo_read(client->from_dest_fifo, ssl_write_result);
-        
+    while (fifo_bytes_used(client->from_dest_fifo) > 0) {
         read_index = fifo_read_index(client->from_dest_fifo);
         buffer_size = fifo_read_size(client->from_dest_fifo);
         buffer_addr = &(client->from_dest_buffer[read_index]);
-        
+
         ssl_write_result = CyaSSL_write(client->cyassl, buffer_addr, buffer_size);
+        if (ssl_write_result <= 0) { break; }
+
+        // We just wrote bytes from the from_dest_fifo (with CyaSSL_write()).  
+        // Count those processed bytes with the FIFO index counter:
+        log_client(LOG_DEBUG, client, "wrote %d bytes", ssl_write_result);
+        fifo_read(client->from_dest_fifo, ssl_write_result);
     }
-    log(LOG_DEBUG, "Last ssl_write_result: %d", ssl_write_result);
-    
-    // ssl_write_result finally reached <= 0.
-    ssl_error = CyaSSL_get_error(client->cyassl, 0);
+    log_client(LOG_DEBUG, client, "Last ssl_write_result: %d", ssl_write_result);
 
-    if (ssl_error == SSL_ERROR_WANT_READ) {
-        log(LOG_DEBUG, "SSL_ERROR_WANT_READ");
-        
+    // Send all the records CyaSSL just wrote with one writev():
+    flush_result = (client->ssl_io != NULL) ? tunnel_io_flush(client->ssl_io) : 0;
+
+    // See if we drained the FIFO.  If so, there is no SSL error to check.
+    // (CyaSSL_get_error() would report whatever the last failed call set.)
+    if (fifo_bytes_used(client->from_dest_fifo) == 0 && flush_result == 0) {
         if (client->dest_socket_fd == -1) {
-            log(LOG_INFO, "Destination has closed, so closing SSL connection.");
+            log_client(LOG_INFO, client, "Destination has closed, so closing SSL connection.");
             tunnel_client_disconnect_and_free(client);
         }
         return;  // Success.
     }
+    
+    // ssl_write_result finally reached <= 0, or the socket is full:
+    if (flush_result < 0) {
+        ssl_error = SOCKET_ERROR_E;
+    } else if (fifo_bytes_used(client->from_dest_fifo) == 0) {
+        ssl_error = SSL_ERROR_WANT_WRITE;  // Only the flush is left
+    } else {
+        ssl_error = CyaSSL_get_error(client->cyassl, 0);
+    }
+
+    if (ssl_error == SSL_ERROR_WANT_READ) {
+        // (A renegotiation is waiting on the client.)
+        log_client(LOG_DEBUG, client, "SSL_ERROR_WANT_READ");
+        return;  // Success.
+    }
 
     if (ssl_error == SSL_ERROR_WANT_WRITE) {
-        log(LOG_DEBUG, "SSL_ERROR_WANT_WRITE");
+        log_client(LOG_DEBUG, client, "SSL_ERROR_WANT_WRITE");
+
+        // Edge-triggered, the next writable edge brings us back:
+        if (client->thread->edge_triggered) {
+            return;
+        }
 
         // If we are not draining bytes, we should take a breather first.
         if (fifo_bytes_used(client->from_dest_fifo) > 0) {
             // The client is not draining bytes fast enough.  Take a breather.
             struct timeval one_ms = {0, 1000};
-            log(LOG_DEBUG, "Scheduling write_ssl_timeout_event, returning.");
+            tunnel_metrics_add(client->thread->metrics, METRIC_THROTTLE_TIMEOUTS, 1);
+            tunnel_trace(client, TRACE_THROTTLE, 0);
+            log_client(LOG_DEBUG, client, "Scheduling write_ssl_timeout_event, returning.");
             event_add(client->write_ssl_timeout_event, &one_ms);
             return;
         }
-        log(LOG_DEBUG, "Scheduling on_write_ssl_event, returning.");
+        log_client(LOG_DEBUG, client, "Scheduling on_write_ssl_event, returning.");
         event_add(client->on_write_ssl_event, NULL);
         return;  // Success.
     }
 
     // A real write error or disconnect occurred.
-    log(LOG_NOTICE, "%s",
+    log_client(LOG_NOTICE, client, "%s",
         CyaSSL_ERR_error_string(ssl_error, client->from_ssl_buffer));
 
-    log(LOG_INFO, "Closing SSL connection.");
+    log_client(LOG_INFO, client, "Closing SSL connection.");
     tunnel_client_disconnect_ssl(client);
     
     if (fifo_bytes_used(client->from_ssl_fifo) == 0) {
         // All bytes have been flushed.  Done.
-        log(LOG_NOTICE, "Closing all connections.");
+        log_client(LOG_NOTICE, client, "Closing all connections.");
         tunnel_client_disconnect_and_free(client);
         return;
     } else {
          // We have some pending bytes.  Let on_write do the cleanup:
-        log(LOG_WARNING, "%ld pending bytes in from_ssl_fifo.  Adding on_write_dest_event.", fifo_bytes_used(client->from_ssl_fifo));
-        event_add(client->on_write_dest_event, NULL);
+        log_client(LOG_DEBUG, client, "%ld pending bytes in from_ssl_fifo.  Adding on_write_dest_event.", fifo_bytes_used(client->from_ssl_fifo));
+        schedule_dest_write(client);
         return;
    }
 }
 
 
-static void on_read_dest(int socket_fd, short event, void *arg) {
+// The rest of a destination read, by on_read_dest() or an io_uring
+// request: count the 'bytes_read' it put in the from_dest_fifo, and get
+// them to the SSL socket:
+static void read_dest_done(TunnelClient *client, size_t bytes_read)
+{
+    if (bytes_read > 0 && client->bytes_from_dest == 0) {
+        tunnel_trace(client, TRACE_FIRST_BYTE_FROM_DEST, bytes_read);
+    }
+    if (bytes_read > 0) {
+        mark_active(client);
+        client->request_pending = 0;
+    }
+    client->bytes_from_dest += bytes_read;
+    tunnel_metrics_add(client->thread->metrics, METRIC_BYTES_FROM_DEST, bytes_read);
+
+    // See if we need to write to the SSL socket:
+    if (fifo_bytes_used(client->from_dest_fifo) > 0) {
+        // We have some pending bytes.  Wait for on_write readiness:
+        log_client(LOG_DEBUG, client, "%ld pending bytes in from_dest_fifo.  Adding on_write_ssl_event.", fifo_bytes_used(client->from_dest_fifo));
+        schedule_write(client, client->on_write_ssl_event);
+    }
+}
+
+// A destination read hit the end (or an error).  Close the socket.  When
+// the FIFO is flushed, disconnect_and_free:
+static void dest_read_closed(TunnelClient *client)
+{
+    log_client(LOG_INFO, client, "Closing dest connection.");
+    tunnel_client_disconnect_dest(client);
 
-    log(LOG_DEBUG, "Entered.");
+    if (fifo_bytes_used(client->from_dest_fifo) == 0) {
+        // All bytes have been flushed.  Done.
+        log_client(LOG_INFO, client, "Closing all connections.");
+        tunnel_client_disconnect_and_free(client);
+    }
+}
+
+// A destination write failed for good.  Close the socket, and the client
+// if the SSL side is gone too:
+static void dest_write_failed(TunnelClient *client)
+{
+    log_client(LOG_NOTICE, client, "Closing dest connection.");
+    tunnel_client_disconnect_dest(client);
+    if (client->ssl_socket_fd == -1) {
+        log_client(LOG_NOTICE, client, "Closing all connections.");
+        tunnel_client_disconnect_and_free(client);
+    }
+}
+
+static void on_read_dest(int socket_fd, short event, void *arg) {
 
     TunnelClient *client = (TunnelClient *)arg;
+
+    log_client(LOG_DEBUG, client, "Entered.");
     
     // First, make sure we have room in our buffer:
     if (fifo_bytes_free(client->from_dest_fifo) == 0) {
         // The client is not draining bytes fast enough.  Take a breather.
-        struct timeval one_ms = {0, 1000};
-        event_del(client->on_read_dest_event);  // Halt these for a bit
-        event_add(client->read_dest_timeout_event, &one_ms);
+        tunnel_metrics_add(client->thread->metrics, METRIC_FIFO_STALLS, 1);
+        tunnel_trace(client, TRACE_FIFO_STALL, 1);
+        pause_read(client, client->on_read_dest_event, client->read_dest_timeout_event);
         return;
     }
 
@@ -553,6 +935,7 @@ static void on_read_dest(int socket_fd, short event, void *arg) {
     size_t write_index;
     char *buffer_addr;
     size_t buffer_size;
+    size_t bytes_read = 0;
     
     do {
         write_index = fifo_write_index(client->from_dest_fifo);
@@ -560,62 +943,56 @@ static void on_read_dest(int socket_fd, short event, void *arg) {
         buffer_addr = &(client->from_dest_buffer[write_index]);
 
         read_result = read(client->dest_socket_fd, buffer_addr, buffer_size);
-        log(LOG_DEBUG, "read_result: %d", read_result);
+        log_client(LOG_DEBUG, client, "read_result: %d", read_result);
         
         // We just read bytes from the dest socket (with read()) and 
         // put them into the client->from_dest_buffer.  Record those new
         // bytes in the FIFO:
         if (read_result > 0) {
             fifo_write(client->from_dest_fifo, read_result);
+            bytes_read += read_result;
         }
         
     } while ( (read_result > 0) && fifo_bytes_free(client->from_dest_fifo) > 0);
 
-    log(LOG_DEBUG,
+    log_client(LOG_DEBUG, client,
         "Done reading. read_result: %d, fifo_bytes_free(client->from_dest_fifo): %ld",
         read_result, fifo_bytes_free(client->from_dest_fifo));
-        
-    // See if we need to write to the SSL socket:
-    if (fifo_bytes_used(client->from_dest_fifo) > 0) {
-        // We have some pending bytes.  Wait for on_write readiness:
-        log(LOG_WARNING, "%ld pending bytes in from_dest_fifo.  Adding on_write_ssl_event.", fifo_bytes_used(client->from_dest_fifo));
-        event_add(client->on_write_ssl_event, NULL);
-    }
+
+    read_dest_done(client, bytes_read);
     
     // See if our buffer is full (so, read_result > 0).  If so, ignore errno
-    // and let the next on_read_dest_event schedule the timeout:
+    // and let the next on_read_dest_event schedule the timeout.  (Edge-
+    // triggered, there may be no next one; schedule it now.)
     if (fifo_bytes_free(client->from_dest_fifo) == 0) {
         // The client is not draining bytes fast enough.  Take a breather.
-        log(LOG_DEBUG, "Returning due to full buffer.  (Ignoring errno.)");
+        log_client(LOG_DEBUG, client, "Returning due to full buffer.  (Ignoring errno.)");
+        if (client->thread->edge_triggered) {
+            tunnel_metrics_add(client->thread->metrics, METRIC_FIFO_STALLS, 1);
+            tunnel_trace(client, TRACE_FIFO_STALL, 1);
+            pause_read(client, client->on_read_dest_event, client->read_dest_timeout_event);
+        }
         return;
     }
 
-    if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+    // (read_result == 0 means the dest closed; errno is stale then.)
+    if ((read_result < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK))) {
         // We can safely ignore EAGAIN or EWOULDBLOCK:
-        log(LOG_WARNING, "EAGAIN || EWOULDBLOCK; returning.");
+        log_client(LOG_DEBUG, client, "EAGAIN || EWOULDBLOCK; returning.");
         return;
     } else {
-        // A real read error or disconnect occurred.
-        log_err("read() returned %d.", read_result);
-        
-        // Close the socket.  When the FIFO is flushed, disconnect_and_free:
-        log(LOG_WARNING, "Closing dest connection.");
-        tunnel_client_disconnect_dest(client);
-        
-        if (fifo_bytes_used(client->from_dest_fifo) == 0) {
-            // All bytes have been flushed.  Done.
-            log(LOG_WARNING, "Closing all connections.");
-            tunnel_client_disconnect_and_free(client);
-            return;
+        // A real read error or disconnect occurred.  (errno is only
+        // meaningful for an error.)
+        if (read_result < 0) {
+            log_client_err(client, "read() returned %d.", read_result);
         }
+        
+        dest_read_closed(client);
     }
-
 }
 
 static void on_write_dest(int socket_fd, short event, void *arg) {
 
-    log(LOG_DEBUG, "Entered.");
-
     TunnelClient *client = (TunnelClient *)arg;
     int write_result;
         
@@ -623,13 +1000,20 @@ static void on_write_dest(int socket_fd, short event, void *arg) {
     char *buffer_addr;
     size_t buffer_size;
 
+    log_client(LOG_DEBUG, client, "Entered.");
+
+    // (Edge-triggered, we get every writable edge, with bytes or not.)
+    if (fifo_bytes_used(client->from_ssl_fifo) == 0) {
+        return;
+    }
+
     do {    
         read_index = fifo_read_index(client->from_ssl_fifo);
         buffer_size = fifo_read_size(client->from_ssl_fifo);
         buffer_addr = &(client->from_ssl_buffer[read_index]);
 
         write_result = write(client->dest_socket_fd, buffer_addr, buffer_size);
-        log(LOG_DEBUG, "write_result: %d", write_result);
+        log_client(LOG_DEBUG, client, "write_result: %d", write_result);
         
         // We just wrote bytes from the from_ssl_fifo (with write()).  
         // Record those processed bytes with the FIFO index counter:
@@ -639,9 +1023,15 @@ static void on_write_dest(int socket_fd, short event, void *arg) {
         
     } while ( (write_result > 0) && (fifo_bytes_used(client->from_ssl_fifo) > 0) );
 
-    log(LOG_DEBUG,
+    log_client(LOG_DEBUG, client,
         "Done writing. write_result: %d, fifo_bytes_used(client->from_ssl_fifo): %ld",
         write_result, fifo_bytes_used(client->from_ssl_fifo));
+
+    // See if we drained the FIFO (so, write_result > 0).  If so, errno is
+    // left over from some earlier call; ignore it:
+    if (write_result > 0) {
+        return;
+    }
     
     //
     // write_result <= 0
@@ -651,40 +1041,162 @@ static void on_write_dest(int socket_fd, short event, void *arg) {
     //
     if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
         // We can safely ignore EAGAIN or EWOULDBLOCK.
-        log(LOG_DEBUG, "(errno == EAGAIN) || (errno == EWOULDBLOCK)");
+        log_client(LOG_DEBUG, client, "(errno == EAGAIN) || (errno == EWOULDBLOCK)");
+
+        // Edge-triggered, the next writable edge brings us back:
+        if (client->thread->edge_triggered) {
+            return;
+        }
 
         // If we are not draining bytes, we should take a breather first.
         if (fifo_bytes_used(client->from_ssl_fifo) > 0) {
             // The client is not draining bytes fast enough.  Take a breather.
-            log(LOG_DEBUG, "Scheduling write_dest_timeout_event due to fifo_bytes_used(client->from_ssl_fifo): %ld", fifo_bytes_used(client->from_ssl_fifo));
+            log_client(LOG_DEBUG, client, "Scheduling write_dest_timeout_event due to fifo_bytes_used(client->from_ssl_fifo): %ld", fifo_bytes_used(client->from_ssl_fifo));
             struct timeval one_ms = {0, 1000};
+            tunnel_metrics_add(client->thread->metrics, METRIC_THROTTLE_TIMEOUTS, 1);
+            tunnel_trace(client, TRACE_THROTTLE, 1);
             event_add(client->write_dest_timeout_event, &one_ms);
             return;
         }
         // No need to schedule a write; the from_ssl_fifo is empty.
-        log(LOG_DEBUG, "fifo_bytes_used(client->from_ssl_fifo) == 0.  Returning.");
+        log_client(LOG_DEBUG, client, "fifo_bytes_used(client->from_ssl_fifo) == 0.  Returning.");
         return;
 
     } else {
         // A real write error or disconnect occurred.
-        log_err("write() result: %d.", write_result);
+        log_client_err(client, "write() result: %d.", write_result);
 
-        if (fifo_bytes_used(client->from_ssl_fifo) > 0) {
+        if (fifo_bytes_used(client->from_ssl_fifo) > 0 &&
+            !client->thread->edge_triggered) {
             // We still have some pending bytes.  Wait for on_dest_write:
-            log(LOG_DEBUG, "Pending bytes in from_ssl_fifo.  Adding on_write_dest_event.");
+            log_client(LOG_DEBUG, client, "Pending bytes in from_ssl_fifo.  Adding on_write_dest_event.");
             event_add(client->on_write_dest_event, NULL);
         } else {
-            // The FIFO is flushed.  Is the other end disconnected?
-            log(LOG_NOTICE, "Closing dest connection.");
-            tunnel_client_disconnect_dest(client);
-            if (client->ssl_socket_fd == -1) {
-                log(LOG_NOTICE, "Closing all connections.");
-                tunnel_client_disconnect_and_free(client);
-                return;
-            }
+            // The FIFO is flushed (or, edge-triggered, no edge will come
+            // to retry it).  Is the other end disconnected?
+            dest_write_failed(client);
+        }
+    }
+}
+
+
+// The destination socket with thread->uring.  Instead of on_read_dest()
+// and on_write_dest() running at readiness, a read into the from_dest
+// FIFO's free space and a write out of the from_ssl FIFO's used space are
+// kept in flight (one of each at most), and their completions do the FIFO
+// bookkeeping and the rest, as those do.  Closing is the same too, except
+// that tunnel_client_free() waits for the cancelled requests to complete.
+
+// Queue a read, unless one is in flight.  With the FIFO full, try again
+// in a millisecond, as on_read_dest() does:
+static void start_dest_read(TunnelClient *client)
+{
+    struct timeval one_ms = {0, 1000};
+    size_t write_index;
+
+    if (client->dest_read_op.in_flight || client->dest_socket_fd == -1) { return; }
+
+    if (fifo_bytes_free(client->from_dest_fifo) == 0) {
+        // The client is not draining bytes fast enough.  Take a breather.
+        if (!event_pending(client->read_dest_timeout_event, EV_TIMEOUT, NULL)) {
+            tunnel_metrics_add(client->thread->metrics, METRIC_FIFO_STALLS, 1);
+            tunnel_trace(client, TRACE_FIFO_STALL, 1);
+            event_add(client->read_dest_timeout_event, &one_ms);
         }
+        return;
+    }
+
+    write_index = fifo_write_index(client->from_dest_fifo);
+    if (tunnel_uring_read(client->thread->uring, &client->dest_read_op,
+                          client->dest_socket_fd,
+                          &client->from_dest_buffer[write_index],
+                          fifo_write_size(client->from_dest_fifo),
+                          client->uring_buffer_pair, 1) != 0) {
+        log_client(LOG_WARNING, client, "The io_uring is full; retrying.");
+        event_add(client->read_dest_timeout_event, &one_ms);
     }
 }
+
+static void on_dest_read_complete(TunnelUringOp *op, int result)
+{
+    TunnelClient *client = (TunnelClient *)op->arg;
+
+    log_client(LOG_DEBUG, client, "result: %d", result);
+
+    if (client->free_pending) {
+        tunnel_client_free(client);     // (If this was the last request)
+        return;
+    }
+    if (client->dest_socket_fd == -1) { return; }  // Cancelled
+
+    if (result > 0) {
+        fifo_write(client->from_dest_fifo, result);
+        read_dest_done(client, result);
+        start_dest_read(client);
+        return;
+    }
+    if (result == -EINTR || result == -EAGAIN) {
+        start_dest_read(client);
+        return;
+    }
+
+    // A real read error or disconnect occurred:
+    if (result < 0) {
+        errno = -result;
+        log_client_err(client, "read() failed.");
+    }
+    dest_read_closed(client);
+}
+
+// Queue a write, unless one is in flight or there's nothing to write:
+static void start_dest_write(TunnelClient *client)
+{
+    struct timeval one_ms = {0, 1000};
+    size_t read_index;
+
+    if (client->dest_write_op.in_flight || client->dest_socket_fd == -1 ||
+        fifo_bytes_used(client->from_ssl_fifo) == 0) {
+        return;
+    }
+
+    read_index = fifo_read_index(client->from_ssl_fifo);
+    if (tunnel_uring_write(client->thread->uring, &client->dest_write_op,
+                           client->dest_socket_fd,
+                           &client->from_ssl_buffer[read_index],
+                           fifo_read_size(client->from_ssl_fifo),
+                           client->uring_buffer_pair, 0) != 0) {
+        log_client(LOG_WARNING, client, "The io_uring is full; retrying.");
+        event_add(client->write_dest_timeout_event, &one_ms);
+    }
+}
+
+static void on_dest_write_complete(TunnelUringOp *op, int result)
+{
+    TunnelClient *client = (TunnelClient *)op->arg;
+
+    log_client(LOG_DEBUG, client, "result: %d", result);
+
+    if (client->free_pending) {
+        tunnel_client_free(client);     // (If this was the last request)
+        return;
+    }
+    if (client->dest_socket_fd == -1) { return; }  // Cancelled
+
+    if (result > 0) {
+        fifo_read(client->from_ssl_fifo, result);
+        start_dest_write(client);       // The rest, if any
+        return;
+    }
+    if (result == -EINTR || result == -EAGAIN) {
+        start_dest_write(client);
+        return;
+    }
+
+    // A real write error or disconnect occurred:
+    errno = (result < 0) ? -result : EPIPE;
+    log_client_err(client, "write() failed.");
+    dest_write_failed(client);
+}
  
 
 static void on_write_ssl_timeout(int socket_fd, short event, void *arg)
@@ -696,11 +1208,12 @@ static void on_write_ssl_timeout(int socket_fd, short event, void *arg)
         return;
     }
 
-    log(LOG_DEBUG, "fifo_bytes_used(client->from_dest_fifo): %ld",
+    log_client(LOG_DEBUG, client, "fifo_bytes_used(client->from_dest_fifo): %ld",
         fifo_bytes_used(client->from_dest_fifo));
     
-    if (fifo_bytes_used(client->from_dest_fifo) > 0) {
-        log(LOG_DEBUG, "Scheduling client->on_write_dest_event.");
+    if (fifo_bytes_used(client->from_dest_fifo) > 0 ||
+        (client->ssl_io != NULL && tunnel_io_pending(client->ssl_io) > 0)) {
+        log_client(LOG_DEBUG, client, "Scheduling client->on_write_dest_event.");
         event_add(client->on_write_ssl_event, NULL);
     }
     return;
@@ -716,12 +1229,12 @@ static void on_write_dest_timeout(int socket_fd, short event, void *arg)
         return;
     }
 
-    log(LOG_DEBUG, "fifo_bytes_used(client->from_ssl_fifo): %ld",
+    log_client(LOG_DEBUG, client, "fifo_bytes_used(client->from_ssl_fifo): %ld",
         fifo_bytes_used(client->from_ssl_fifo));
     
     if (fifo_bytes_used(client->from_ssl_fifo) > 0) {
-        log(LOG_DEBUG, "Scheduling client->on_write_dest_event.");
-        event_add(client->on_write_dest_event, NULL);
+        log_client(LOG_DEBUG, client, "Scheduling client->on_write_dest_event.");
+        schedule_dest_write(client);
     }
     return;
 }
@@ -737,15 +1250,25 @@ static void on_read_dest_timeout(int socket_fd, short event, void *arg)
         return;
     }
 
-    log(LOG_DEBUG, "fifo_bytes_free(client->from_dest_fifo): %ld",
+    if (client->thread->uring != NULL) {
+        start_dest_read(client);  // (Which waits longer if need be)
+        return;
+    }
+
+    log_client(LOG_DEBUG, client, "fifo_bytes_free(client->from_dest_fifo): %ld",
         fifo_bytes_free(client->from_dest_fifo));
     
     if (fifo_bytes_free(client->from_dest_fifo) > 0) {
-        log(LOG_DEBUG, "Restoring client->on_read_dest_event.");
-        event_add(client->on_read_dest_event, NULL);
+        log_client(LOG_DEBUG, client, "Restoring client->on_read_dest_event.");
+        if (client->thread->edge_triggered) {
+            // Still registered, but the bytes left waiting made no edge:
+            event_active(client->on_read_dest_event, EV_READ, 0);
+        } else {
+            event_add(client->on_read_dest_event, NULL);
+        }
     } else {
         // Still no room in the buffer; wait longer.
-        log(LOG_DEBUG, "Still no room; Waiting longer.");
+        log_client(LOG_DEBUG, client, "Still no room; Waiting longer.");
         event_add(client->read_dest_timeout_event, &one_ms);
     }
     return;
@@ -762,56 +1285,430 @@ static void on_read_ssl_timeout(int socket_fd, short event, void *arg)
         return;
     }
 
-    log(LOG_DEBUG, "fifo_bytes_free(client->from_ssl_fifo): %ld",
+    log_client(LOG_DEBUG, client, "fifo_bytes_free(client->from_ssl_fifo): %ld",
         fifo_bytes_free(client->from_ssl_fifo));
     
     if (fifo_bytes_free(client->from_ssl_fifo) > 0) {
-        log(LOG_DEBUG, "Restoring client->on_read_dest_event.");
+        log_client(LOG_DEBUG, client, "Restoring client->on_read_ssl_event.");
+        if (client->thread->edge_triggered) {
+            // Still registered, but the bytes left waiting made no edge:
+            event_active(client->on_read_ssl_event, EV_READ, 0);
+            return;
+        }
         event_add(client->on_read_ssl_event, NULL);
+
+        // Bytes CyaSSL already decrypted (or we already received) won't
+        // trigger the read event:
+        if (CyaSSL_pending(client->cyassl) > 0 ||
+            (client->ssl_io != NULL && tunnel_io_buffered(client->ssl_io) > 0)) {
+            event_active(client->on_read_ssl_event, EV_READ, 0);
+        }
     } else {
         // Still no room in the buffer; wait longer.
-        log(LOG_DEBUG, "Still no room; Waiting longer.");
+        log_client(LOG_DEBUG, client, "Still no room; Waiting longer.");
         event_add(client->read_ssl_timeout_event, &one_ms);
     }
     return;
 }
 
 
-static void handle_ssl_accept(TunnelClient *client)
+// Switch the connection to a [host]'s certificate.  CyaSSL hasn't read a
+// byte yet, so a fresh CYASSL is all it takes:
+static int use_host(TunnelClient *client, TunnelHost *host)
+{
+    CYASSL *cyassl = CyaSSL_new(host->cyassl_ctx);
+
+    if (cyassl == NULL) { return -1; }
+
+    CyaSSL_free(client->cyassl);
+    client->cyassl = cyassl;
+    CyaSSL_set_fd(client->cyassl, client->ssl_socket_fd);
+    CyaSSL_set_using_nonblock(client->cyassl, 1);
+    if (client->ssl_io != NULL) { tunnel_io_attach(client->ssl_io, client->cyassl); }
+    return 0;
+}
+
+// The client sent its first bytes: allocate its SSL session and buffers.
+// Returns 1 if nothing has come after all, and -1 if the client closed (or
+// we ran out of memory) and was freed:
+static int start_session(TunnelClient *client)
+{
+    TunnelContext *context = client->context;
+    ssize_t peek_result;
+    char byte;
+
+    peek_result = recv(client->ssl_socket_fd, &byte, 1, MSG_PEEK);
+    if (peek_result < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return 1;
+    }
+    if (peek_result <= 0) {
+        log_client(LOG_INFO, client, "Closed before sending anything.");
+        tunnel_metrics_add(client->thread->metrics, METRIC_EMPTY_CONNECTIONS, 1);
+        tunnel_client_disconnect_and_free(client);
+        return -1;
+    }
+
+    // New CYASSL * for this connection:
+    client->cyassl = CyaSSL_new(client->listener ? client->listener->cyassl_ctx
+                                                 : context->cyassl_ctx);
+    client->from_ssl_buffer = malloc(client->buffer_size);
+    client->from_dest_buffer = malloc(client->buffer_size);
+    if (context->config->ssl_io_buffer_size > 0) {
+        client->ssl_io = tunnel_io_new(client->ssl_socket_fd,
+                                       context->config->ssl_io_buffer_size);
+    }
+    if (client->cyassl == NULL || client->from_ssl_buffer == NULL ||
+        client->from_dest_buffer == NULL ||
+        (context->config->ssl_io_buffer_size > 0 && client->ssl_io == NULL)) {
+        log_client(LOG_WARNING, client, "Can't allocate the SSL session and buffers.");
+        free(client->from_ssl_buffer);      // (So free() doesn't count them)
+        free(client->from_dest_buffer);
+        client->from_ssl_buffer = client->from_dest_buffer = NULL;
+        tunnel_io_free(client->ssl_io);
+        client->ssl_io = NULL;
+        tunnel_client_disconnect_and_free(client);
+        return -1;
+    }
+    tunnel_metrics_add(client->thread->metrics, METRIC_BUFFER_BYTES_ALLOCATED,
+                       2 * client->buffer_size);
+    if (client->ssl_io != NULL) {
+        tunnel_metrics_add(client->thread->metrics, METRIC_BUFFER_BYTES_ALLOCATED,
+                           2 * client->ssl_io->buffer_size);
+    }
+
+    // Associate the SSL socket with CyaSSL:
+    CyaSSL_set_fd(client->cyassl, client->ssl_socket_fd);
+    CyaSSL_set_using_nonblock(client->cyassl, 1);
+    if (client->ssl_io != NULL) { tunnel_io_attach(client->ssl_io, client->cyassl); }
+    return 0;
+}
+
+// Look at the ClientHello before CyaSSL reads it: its server name picks the
+// [host] (and goes in a v2 PROXY header).  Then connect to the
+// backend; we want to be sure we can before we accept the SSL connection.
+// Returns 1 if the rest of the hello hasn't arrived yet (we're called again
+// when it might have) or the backend connect is under way, or -1 if the
+// client was closed, because no backend would take it.
+static int handle_client_hello(TunnelClient *client)
+{
+    TunnelContext *context = client->context;
+    TunnelHost *host = NULL;
+    ClientHello hello;
+    const char *server_name = NULL;
+    size_t server_name_size = 0;
+    ssize_t peek_result;
+    int result;
+
+    // A ClientHello is one record of at most 16K, plus the record header:
+    size_t peek_size = MIN(client->buffer_size, 16384 + 5);
+
+    // (A peek error is left for CyaSSL_accept() to see.)
+    if (context->host_bucket_count == 0 &&
+        client->proxy_protocol != TUNNEL_PROXY_V2) {
+        result = CLIENT_HELLO_INCOMPLETE;  // No need to look
+    } else {
+        peek_result = recv(client->ssl_socket_fd, client->from_ssl_buffer,
+                           peek_size, MSG_PEEK);
+        result = (peek_result <= 0) ? CLIENT_HELLO_INCOMPLETE
+                                    : client_hello_parse((unsigned char *)client->from_ssl_buffer,
+                                                         peek_result, &hello);
+
+        // A big hello often comes in several TCP segments.  Wait for the
+        // rest, until the handshake timeout.  Edge-triggered, its arrival
+        // brings us back.  Level-triggered, the bytes already here would
+        // make the read event spin, so we peek again every millisecond:
+        if (result == CLIENT_HELLO_INCOMPLETE && peek_result > 0 &&
+            (size_t)peek_result < peek_size) {
+            log_client(LOG_DEBUG, client, "Have %zd bytes of the ClientHello; waiting.",
+                peek_result);
+            if (!client->thread->edge_triggered) {
+                pause_read(client, client->on_read_ssl_event,
+                           client->read_ssl_timeout_event);
+            }
+            return 1;
+        }
+    }
+    client->client_hello_seen = 1;
+
+    if (result == CLIENT_HELLO_OK) {
+        server_name_size = client_hello_server_name(&hello, &server_name);
+        client->proxy_server_name = server_name;
+        client->proxy_server_name_size = server_name_size;
+        tunnel_trace(client, TRACE_CLIENT_HELLO, hello.record_size);
+    } else {
+        log_client(LOG_DEBUG, client, "client_hello_parse() result: %d.  Using the defaults.",
+            result);
+    }
+
+    if (context->host_bucket_count != 0) {
+        host = tunnel_context_find_host(context, server_name, server_name_size);
+        if (host != NULL) {
+            log_client(LOG_DEBUG, client, "SNI \"%.*s\": [host %s].",
+                (int)server_name_size, server_name, host->config->server_name);
+        } else {
+            log_client(LOG_DEBUG, client, "SNI \"%.*s\": no [host]; using the defaults.",
+                (int)server_name_size, server_name ? server_name : "");
+        }
+    }
+
+    if ((host != NULL && use_host(client, host) != 0) ||
+        connect_backend(client, (host && host->owns_backends) ? host->backends
+                                : client->listener ? client->listener->backends
+                                : context->backends) != 0) {
+        tunnel_metrics_add(client->thread->metrics, METRIC_DEST_CONNECT_FAILURES, 1);
+        tunnel_client_disconnect_and_free(client);
+        return -1;
+    }
+
+    // The hello waits in the socket until the backend is connected.
+    // Level-triggered, it would make the read event spin meanwhile:
+    if (client->connect_dest_event != NULL) {
+        if (!client->thread->edge_triggered) {
+            event_del(client->on_read_ssl_event);
+        }
+        return 1;
+    }
+    return 0;
+}
+
+// Take the handshake a step further.  Returns 0 once it's complete, 1 if
+// it's waiting on the client, or -1 if it failed and the client was freed:
+static int handle_ssl_accept(TunnelClient *client)
 {
     // New connection: Resume non-blocking calls to CyaSSL_accept():
     int ssl_accept_result = CyaSSL_accept(client->cyassl);
     int ssl_error = CyaSSL_get_error(client->cyassl, 0);
 
+    client->handshake_want_write = 0;
+
+    // Send the handshake messages CyaSSL just wrote, in one writev().  If
+    // the socket is full, on_write_ssl sends the rest:
+    if (client->ssl_io != NULL) {
+        int flush_result = tunnel_io_flush(client->ssl_io);
+
+        if (flush_result < 0) {
+            ssl_accept_result = SSL_FATAL_ERROR;
+            ssl_error = SOCKET_ERROR_E;
+        } else if (flush_result > 0) {
+            client->handshake_want_write = 1;
+            event_add(client->on_write_ssl_event, NULL);
+        }
+    }
+
     // See if this is a real error, or just a WANT for more data:
     if (ssl_accept_result != SSL_SUCCESS) {
     
+        tunnel_trace(client, TRACE_HANDSHAKE_STEP, ssl_error);
+
         if (ssl_error == SSL_ERROR_WANT_READ) {
-            log(LOG_DEBUG, "SSL_ERROR_WANT_READ (handshake not complete).");
-            return;
+            log_client(LOG_DEBUG, client, "SSL_ERROR_WANT_READ (handshake not complete).");
+            return 1;
         }
 
         if (ssl_error == SSL_ERROR_WANT_WRITE) {
-            log(LOG_DEBUG,
+            log_client(LOG_DEBUG, client,
                 "SSL_ERROR_WANT_WRITE (handshake not complete). "
                 "Scheduling on_write_ssl_event.");
+            client->handshake_want_write = 1;
             event_add(client->on_write_ssl_event, NULL);
-            return;
+            return 1;
         }
 
         // There was a real error during the SSL handshake.
-        log(LOG_NOTICE, "%s",
+        tunnel_metrics_add(client->thread->metrics, METRIC_HANDSHAKE_FAILURES, 1);
+        tunnel_trace(client, TRACE_HANDSHAKE_END, ssl_error);
+        log_client(LOG_NOTICE, client, "%s",
             CyaSSL_ERR_error_string(ssl_error, client->from_ssl_buffer));
 
-        log(LOG_INFO, "Closing SSL connection.");
+        log_client(LOG_INFO, client, "Closing SSL connection.");
         tunnel_client_disconnect_and_free(client);
-        return;
+        return -1;
 
     } else {
         // SSL_SUCCESS!  Continue by tunneling bytes.
-        log(LOG_DEBUG, "SSL connected.");
+        log_client(LOG_INFO, client, "SSL connected: %s, %s.",
+            CyaSSL_get_version(client->cyassl), CyaSSL_get_cipher(client->cyassl));
         client->ssl_accept_state = SSL_SUCCESS;
-        return;
+        tunnel_trace(client, TRACE_HANDSHAKE_END, 0);
+
+        client->handshake_pending = 0;
+        tunnel_thread_end_handshake(client->thread);
+
+        // Swap the handshake timeout for the idle timeout:
+        if (client->thread->timer_wheel != NULL) {
+            mark_active(client);
+            if (client->context->config->idle_timeout > 0) {
+                timer_wheel_schedule(client->thread->timer_wheel,
+                                     &client->timeout_entry,
+                                     client->context->config->idle_timeout);
+            } else {
+                timer_wheel_cancel(&client->timeout_entry);
+            }
+        }
+
+        tunnel_metrics_add(client->thread->metrics, METRIC_HANDSHAKES_COMPLETED, 1);
+        tunnel_metrics_observe(client->thread->metrics, METRIC_HANDSHAKE_USEC,
+                               tunnel_metrics_now_usec() - client->connect_usec);
+
+        if (client->proxy_protocol != TUNNEL_PROXY_OFF) {
+            queue_proxy_header(client);
+        }
+
+        // A server-speaks-first backend may have sent its greeting already:
+        if (fifo_bytes_used(client->from_dest_fifo) > 0) {
+            schedule_write(client, client->on_write_ssl_event);
+        }
+        return 0;
     }        
 }
 
+// Put the PROXY header in the front of the (still empty) from_ssl_fifo, so
+// the backend gets it before the client's first byte.  tunnel_config_new()
+// made sure the buffer is big enough:
+static void queue_proxy_header(TunnelClient *client)
+{
+    struct sockaddr_storage local_address;
+    socklen_t address_size = sizeof(local_address);
+    size_t header_size;
+
+    if (getsockname(client->ssl_socket_fd, (struct sockaddr *)&local_address,
+                    &address_size) != 0) {
+        local_address.ss_family = AF_UNSPEC;
+    }
+
+    header_size = tunnel_proxy_header(
+        &client->from_ssl_buffer[fifo_write_index(client->from_ssl_fifo)],
+        fifo_write_size(client->from_ssl_fifo), client->proxy_protocol,
+        (struct sockaddr *)&client->sockaddr_ssl, (struct sockaddr *)&local_address,
+        client->proxy_server_name, client->proxy_server_name_size,
+        CyaSSL_get_version(client->cyassl), CyaSSL_get_cipher(client->cyassl));
+    client->proxy_server_name = NULL;
+
+    if (header_size == 0) {
+        log_client(LOG_ERR, client, "The PROXY header doesn't fit in the buffer.");
+        return;
+    }
+    log_client(LOG_DEBUG, client, "Queued a %zu byte PROXY header.", header_size);
+    fifo_write(client->from_ssl_fifo, header_size);
+    schedule_dest_write(client);
+}
+
+
+// Fetch the address of the client on 'socket_fd', and format it for
+// log_client().  Clients of a dual-stack listener come from ::ffff:a.b.c.d;
+// those are stored as the plain IPv4 address, so the logs and the hash
+// balancing treat them alike:
+static void set_peer_name(TunnelClient *client, int socket_fd)
+{
+    socklen_t address_size = sizeof(client->sockaddr_ssl);
+    struct sockaddr_in *address4 = (struct sockaddr_in *)&client->sockaddr_ssl;
+    struct sockaddr_in6 *address6 = (struct sockaddr_in6 *)&client->sockaddr_ssl;
+    char address[INET6_ADDRSTRLEN];
+
+    if (getpeername(socket_fd, (struct sockaddr *)&client->sockaddr_ssl,
+                    &address_size) != 0) {
+        return;  // Leave it as "-".
+    }
+
+    if (client->sockaddr_ssl.ss_family == AF_INET6 &&
+        IN6_IS_ADDR_V4MAPPED(&address6->sin6_addr)) {
+        struct sockaddr_in mapped;
+
+        memset(&mapped, 0, sizeof(mapped));
+        mapped.sin_family = AF_INET;
+        mapped.sin_port = address6->sin6_port;
+        memcpy(&mapped.sin_addr, &address6->sin6_addr.s6_addr[12], 4);
+        memcpy(&client->sockaddr_ssl, &mapped, sizeof(mapped));
+    }
+
+    if (client->sockaddr_ssl.ss_family == AF_INET &&
+        inet_ntop(AF_INET, &address4->sin_addr, address, sizeof(address)) != NULL) {
+        snprintf(client->peer_name, sizeof(client->peer_name), "%s:%u",
+                 address, ntohs(address4->sin_port));
+    } else if (client->sockaddr_ssl.ss_family == AF_INET6 &&
+               inet_ntop(AF_INET6, &address6->sin6_addr, address,
+                         sizeof(address)) != NULL) {
+        snprintf(client->peer_name, sizeof(client->peer_name), "[%s]:%u",
+                 address, ntohs(address6->sin6_port));
+    }
+}
+
+
+// Bytes are waiting for 'write_event''s socket.  Level-triggered, that is
+// an event_add().  Edge-triggered, the event is always registered, but a
+// socket that was writable all along makes no edge; run it in this pass:
+static void schedule_write(TunnelClient *client, struct event *write_event)
+{
+    if (client->thread->edge_triggered) {
+        event_active(write_event, EV_WRITE, 0);
+    } else {
+        event_add(write_event, NULL);
+    }
+}
+
+
+// Bytes are waiting in the from_ssl_fifo for the destination socket:
+static void schedule_dest_write(TunnelClient *client)
+{
+    if (client->thread->uring != NULL) {
+        start_dest_write(client);
+    } else {
+        schedule_write(client, client->on_write_dest_event);
+    }
+}
+
+
+// A read filled its FIFO: stop reading for a millisecond.  Level-triggered,
+// the read event is taken out meanwhile.  Edge-triggered, it stays (so
+// there's no epoll_ctl()), and more edges don't push the timeout back:
+static void pause_read(TunnelClient *client, struct event *read_event,
+                       struct event *timeout_event)
+{
+    struct timeval one_ms = {0, 1000};
+
+    if (!client->thread->edge_triggered) {
+        event_del(read_event);  // Halt these for a bit
+    } else if (event_pending(timeout_event, EV_TIMEOUT, NULL)) {
+        return;
+    }
+    event_add(timeout_event, &one_ms);
+}
+
+
+// Push back the idle timeout.  This is one store; the timer_wheel entry
+// itself only moves when it expires (see tunnel_client_timeout()):
+static void mark_active(TunnelClient *client)
+{
+    if (client->thread->timer_wheel != NULL) {
+        client->last_active_tick = client->thread->timer_wheel->tick;
+    }
+}
+
+
+void tunnel_client_timeout(TunnelClient *client)
+{
+    TunnelConfig *config = client->context->config;
+    TimerWheel *timer_wheel = client->thread->timer_wheel;
+    uint64_t idle_ticks;
+
+    if (client->ssl_accept_state != SSL_SUCCESS && config->handshake_timeout > 0) {
+        log_client(LOG_INFO, client, "Handshake timed out after %d seconds.",
+                   config->handshake_timeout);
+        tunnel_metrics_add(client->thread->metrics, METRIC_HANDSHAKE_TIMEOUTS, 1);
+        tunnel_client_disconnect_and_free(client);
+        return;
+    }
+
+    // If we read anything since this was scheduled, wait out the rest:
+    idle_ticks = timer_wheel->tick - client->last_active_tick;
+    if (idle_ticks < (uint64_t)config->idle_timeout) {
+        timer_wheel_schedule(timer_wheel, &client->timeout_entry,
+                             config->idle_timeout - idle_ticks);
+        return;
+    }
+
+    log_client(LOG_INFO, client, "Idle for %lu seconds; closing.",
+               (unsigned long)idle_ticks);
+    tunnel_metrics_add(client->thread->metrics, METRIC_IDLE_TIMEOUTS, 1);
+    tunnel_client_disconnect_and_free(client);
+}
@@ -10,12 +10,42 @@ typedef struct TunnelClient {
     
     int dest_socket_fd;     // Tunnel socket to destination (in plaintext)
     int ssl_socket_fd;      // Client socket (in SSL)
-    struct sockaddr_in sockaddr_ssl;
+    struct sockaddr_storage sockaddr_ssl;  // The client's address (an
+                                           // IPv4-mapped one as AF_INET)
     
-    CYASSL *cyassl;         // SSL session info
+    uint64_t id;            // Unique per process; for log_client()
+    char peer_name[INET6_ADDRSTRLEN + 8];  // "address:port" or "[address]:port"
+    int traced;             // If set, tunnel_trace() records our events
+    
+    CYASSL *cyassl;         // SSL session info (see from_ssl_buffer)
+    TunnelIO *ssl_io;       // Its socket buffers, or NULL (see tunnel_io.h)
     int ssl_accept_state;   // Set to SSL_SUCCESS when the handshake is complete
+    int client_hello_seen;  // Set once we've peek()ed at the whole ClientHello
+    int handshake_pending;  // Counted in thread->pending_handshakes
+    int handshake_want_write; // CyaSSL_accept() is waiting on on_write_ssl
     
-    struct TunnelServer *server;   // Has shared CA/cert and config data    
+    struct TunnelServer *server;
+    struct TunnelContext *context; // The CA/cert and config we were accepted under
+    struct TunnelBackend *backend; // Where dest_socket_fd goes, once connected
+
+    // The backend connect under way (see connect_backend()).  The event is
+    // non-NULL while it is:
+    struct TunnelBackendPool *connect_pool;
+    struct TunnelBackend *connect_candidate;   // The backend we're trying
+    struct addrinfo *connect_address;          // Its address we're trying
+    uint64_t connect_tried_mask;               // By tunnel_backend_index()
+    uint64_t connect_begin_usec;
+    struct event *connect_dest_event;
+
+    // The [listener] we were accepted on (in context), or NULL for [main]:
+    struct TunnelHost *listener;
+    size_t buffer_size;            // Its buffer_size, or [main]'s
+    int proxy_protocol;            // Its proxy_protocol, or [main]'s
+
+    // For a v2 PROXY header: the SNI server name, in the ClientHello still
+    // sitting in from_ssl_buffer from handle_client_hello()'s peek, or NULL:
+    const char *proxy_server_name;
+    size_t proxy_server_name_size;
     struct TunnelThread *thread;   // Has this thread's eventbase for event registration
 
     // The libevent 'events' used to listen for socket readiness:
@@ -31,7 +61,8 @@ typedef struct TunnelClient {
     struct event *write_ssl_timeout_event;
     struct event *write_dest_timeout_event;
     
-    // Buffers for reading/writing bytes between sockets:
+    // Buffers for reading/writing bytes between sockets.  NULL (as is
+    // cyassl) until the client sends its first byte:
     char *from_ssl_buffer;
     char *from_dest_buffer;
     
@@ -43,16 +74,56 @@ typedef struct TunnelClient {
     // Pointer to our entry in thread->client_list.
     List *link;
 
+    // With thread->uring, the destination socket's read and write requests
+    // (instead of on_read_dest_event and on_write_dest_event), our buffers'
+    // registered pair there (or -1), and whether tunnel_client_free() is
+    // waiting for the requests in flight:
+    TunnelUringOp dest_read_op;
+    TunnelUringOp dest_write_op;
+    int uring_buffer_pair;
+    int free_pending;
+
+    // Our handshake or idle timeout in thread->timer_wheel, and the wheel's
+    // tick when we last read any bytes:
+    TimerWheelEntry timeout_entry;
+    uint64_t last_active_tick;
+
+    // bytes_from_ssl + bytes_from_dest at the last drain pass, and the
+    // passes (seconds) since that last changed:
+    uint64_t drain_byte_count;
+    int drain_quiet_seconds;
+
+    // Set while the client has sent bytes that the backend hasn't answered
+    // yet, i.e. while a request may be outstanding:
+    int request_pending;
+
+    // Per-connection statistics (see also thread->metrics):
+    uint64_t connect_usec;      // When tunnel_client_connect() succeeded, or 0
+    uint64_t bytes_from_ssl;
+    uint64_t bytes_from_dest;
+
 } TunnelClient;
 
 
 // Allocate:
 TunnelClient *tunnel_client_new(struct TunnelThread *thread,
-                                struct TunnelServer *server);
+                                struct TunnelServer *server,
+                                struct TunnelContext *context,
+                                int listener_index);
 
-// Connect and register socket event callbacks:
+// Take the accepted socket and register its event callbacks.  The backend
+// connect waits for the ClientHello.  The client owns socket_fd even if this
+// fails (it's closed by then):
 int tunnel_client_connect(TunnelClient *client, int socket_fd, List *link);
 
+// Called by thread->timer_wheel when our timeout_entry expires.  Closes and
+// frees the client, or reschedules the idle timeout if it was active:
+void tunnel_client_timeout(TunnelClient *client);
+
+// Send a TLS close_notify (if the handshake is done), then disconnect and
+// free.  Anything still in the FIFOs is dropped:
+void tunnel_client_close(TunnelClient *client);
+
 // Convenience function:
 void tunnel_client_disconnect_and_free(TunnelClient *client);
 
@@ -13,11 +13,173 @@ static bool is_match(const char *section, const char *name,
            (strcmp(name, target_name) == 0);
 }
 
+static void free_backend_list(List *backend_list)
+{
+    while (backend_list != NULL) {
+        free(list_user_data(backend_list));
+        backend_list = list_delete_link(backend_list, backend_list);
+    }
+}
+
+static void host_config_free(TunnelHostConfig *host)
+{
+    if (host->server_name != NULL) { free(host->server_name); }
+    if (host->certificate_file != NULL) { free(host->certificate_file); }
+    if (host->PrivateKey_file != NULL) { free(host->PrivateKey_file); }
+    free_backend_list(host->backend_list);
+    if (host->balance != NULL) { free(host->balance); }
+    free(host);
+}
+
+static void listener_config_free(TunnelListenerConfig *listener)
+{
+    if (listener->ssl_server_name != NULL) { free(listener->ssl_server_name); }
+    host_config_free(listener->host);
+    free(listener);
+}
+
+// The keys [host] and [listener] sections have in common:
+static int parse_host_key(TunnelHostConfig *host, const char *name,
+                          const char *value)
+{
+    char *backend;
+
+    if (strcmp(name, "certificate_file") == 0) {
+        host->certificate_file = strdup(value);
+    } else if (strcmp(name, "PrivateKey_file") == 0) {
+        host->PrivateKey_file = strdup(value);
+    } else if (strcmp(name, "backend") == 0) {
+        backend = strdup(value);
+        if (backend == NULL) { return 0; }
+        host->backend_list = list_append(host->backend_list, backend);
+    } else if (strcmp(name, "balance") == 0) {
+        host->balance = strdup(value);
+    } else {
+        return 0;  /* unknown name, error */
+    }
+    return 1;
+}
+
+static TunnelHostConfig *host_config_new(const char *server_name)
+{
+    TunnelHostConfig *host = calloc(1, sizeof(*host));
+
+    if (host == NULL) { return NULL; }
+    host->server_name = strdup(server_name);
+    if (host->server_name == NULL) {
+        free(host);
+        return NULL;
+    }
+    return host;
+}
+
+// A key in a [host <server_name>] section.  inih hands us the keys in file
+// order, so a section's keys always go to the last host in the list:
+static int parse_host(TunnelConfig *config, const char *server_name,
+                      const char *name, const char *value)
+{
+    List *last = list_last(config->host_list);
+    TunnelHostConfig *host = (last != NULL) ? list_user_data(last) : NULL;
+
+    if (host == NULL || strcasecmp(host->server_name, server_name) != 0) {
+        host = host_config_new(server_name);
+        if (host == NULL) { return 0; }
+        config->host_list = list_append(config->host_list, host);
+    }
+    return parse_host_key(host, name, value);
+}
+
+// Set '*proxy_protocol' from 'value'.  Returns 0, leaving it alone, if
+// 'value' isn't a version:
+static int parse_proxy_protocol(int *proxy_protocol, const char *value)
+{
+    int version = tunnel_proxy_version_from_name(value);
+
+    if (version < 0) {
+        log(LOG_ERR, "Unknown proxy_protocol \"%s\"; use off, v1 or v2.", value);
+        return 0;
+    }
+    *proxy_protocol = version;
+    return 1;
+}
+
+// The PROXY header is built in the front of an empty buffer, so it has to
+// fit.  Returns -1 (having logged why) if one of the listeners' won't:
+static int check_proxy_buffer_size(TunnelConfig *config)
+{
+    TunnelListenerConfig *listener;
+    List *link;
+    int proxy_protocol;
+    size_t buffer_size;
+
+    if (config->proxy_protocol != TUNNEL_PROXY_OFF &&
+        config->buffer_size < TUNNEL_PROXY_HEADER_MAX) {
+        log(LOG_ERR, "proxy_protocol needs a buffer_size of at least %d.",
+            TUNNEL_PROXY_HEADER_MAX);
+        return -1;
+    }
+
+    for (link = config->listener_list; link != NULL; link = list_next(link)) {
+        listener = list_user_data(link);
+        proxy_protocol = (listener->proxy_protocol >= 0) ? listener->proxy_protocol
+                                                         : config->proxy_protocol;
+        buffer_size = listener->buffer_size ? listener->buffer_size
+                                            : config->buffer_size;
+        if (proxy_protocol != TUNNEL_PROXY_OFF &&
+            buffer_size < TUNNEL_PROXY_HEADER_MAX) {
+            log(LOG_ERR, "[listener %s]: proxy_protocol needs a buffer_size of "
+                "at least %d.", listener->host->server_name, TUNNEL_PROXY_HEADER_MAX);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// A key in a [listener <name>] section.  The same goes:
+static int parse_listener(TunnelConfig *config, const char *listener_name,
+                          const char *name, const char *value)
+{
+    List *last = list_last(config->listener_list);
+    TunnelListenerConfig *listener = (last != NULL) ? list_user_data(last) : NULL;
+
+    if (listener == NULL || strcmp(listener->host->server_name, listener_name) != 0) {
+        listener = calloc(1, sizeof(*listener));
+        if (listener == NULL) { return 0; }
+        listener->proxy_protocol = -1;
+        listener->host = host_config_new(listener_name);
+        if (listener->host == NULL) {
+            free(listener);
+            return 0;
+        }
+        config->listener_list = list_append(config->listener_list, listener);
+    }
+
+    if (strcmp(name, "ssl_server_name") == 0) {
+        listener->ssl_server_name = strdup(value);
+    } else if (strcmp(name, "ssl_server_port") == 0) {
+        listener->ssl_server_port = (uint16_t)atoi(value);
+    } else if (strcmp(name, "buffer_size") == 0) {
+        listener->buffer_size = MAX((size_t)atol(value), 1);
+    } else if (strcmp(name, "proxy_protocol") == 0) {
+        return parse_proxy_protocol(&listener->proxy_protocol, value);
+    } else {
+        return parse_host_key(listener->host, name, value);
+    }
+    return 1;
+}
+
 static int ini_parse_handler(void* user, const char* section, const char* name,
                    const char* value)
 {
     TunnelConfig *config = (TunnelConfig *)user;
 
+    if (strncmp(section, "host ", 5) == 0) {
+        return parse_host(config, section + 5, name, value);
+    }
+    if (strncmp(section, "listener ", 9) == 0) {
+        return parse_listener(config, section + 9, name, value);
+    }
+
     if (is_match(section, name, "main", "ssl_server_name")) {
         config->ssl_server_name = strdup(value);
     } else if (is_match(section, name, "main", "ssl_server_port")) {
@@ -36,12 +198,64 @@ static int ini_parse_handler(void* user, const char* section, const char* name,
         config->buffer_size = (size_t)atol(value);
         // We need at least 1 byte of buffer space:
         config->buffer_size = MAX(config->buffer_size, 1);
+    } else if (is_match(section, name, "main", "ssl_io_buffer_size")) {
+        config->ssl_io_buffer_size = (size_t)MAX(atol(value), 0);
+    } else if (is_match(section, name, "main", "proxy_protocol")) {
+        return parse_proxy_protocol(&config->proxy_protocol, value);
+    } else if (is_match(section, name, "main", "admin_socket")) {
+        config->admin_socket = strdup(value);
+    } else if (is_match(section, name, "main", "upgrade_socket")) {
+        config->upgrade_socket = strdup(value);
+    } else if (is_match(section, name, "main", "log_level")) {
+        config->log_level = tunnel_log_level_from_name(value);
+        if (config->log_level < 0) {
+            log(LOG_ERR, "Unknown log_level \"%s\".", value);
+            return 0;
+        }
+    } else if (is_match(section, name, "main", "trace_sample_rate")) {
+        config->trace_sample_rate = MAX(atoi(value), 0);
+    } else if (is_match(section, name, "main", "edge_triggered")) {
+        config->edge_triggered = atoi(value);
+    } else if (is_match(section, name, "main", "io_engine")) {
+        config->io_engine = tunnel_io_engine_from_name(value);
+        if (config->io_engine < 0) {
+            log(LOG_ERR, "Unknown io_engine \"%s\"; use libevent or io_uring.", value);
+            return 0;
+        }
+    } else if (is_match(section, name, "main", "max_pending_handshakes")) {
+        config->max_pending_handshakes = MAX(atoi(value), 0);
+    } else if (is_match(section, name, "main", "handshake_timeout")) {
+        config->handshake_timeout = MAX(atoi(value), 0);
+    } else if (is_match(section, name, "main", "idle_timeout")) {
+        config->idle_timeout = MAX(atoi(value), 0);
+    } else if (is_match(section, name, "main", "connect_timeout")) {
+        config->connect_timeout = MAX(atoi(value), 0);
+    } else if (is_match(section, name, "main", "drain_timeout")) {
+        config->drain_timeout = MAX(atoi(value), 0);
+    } else if (is_match(section, name, "main", "drain_quiet_time")) {
+        config->drain_quiet_time = MAX(atoi(value), 0);
+    } else if (is_match(section, name, "backends", "backend")) {
+        char *backend = strdup(value);
+        if (backend == NULL) { return 0; }
+        config->backend_list = list_append(config->backend_list, backend);
+    } else if (is_match(section, name, "backends", "balance")) {
+        config->balance = strdup(value);
+    } else if (is_match(section, name, "backends", "health_check_interval")) {
+        config->health_check_interval = MAX(atoi(value), 0);
+    } else if (is_match(section, name, "backends", "eject_after")) {
+        config->eject_after = MAX(atoi(value), 1);
+    } else if (strcmp(section, "client_socket") == 0) {
+        return tunnel_socket_parse(&config->client_socket, 1, name, value);
+    } else if (strcmp(section, "backend_socket") == 0) {
+        return tunnel_socket_parse(&config->backend_socket, 0, name, value);
     } else if (is_match(section, name, "ssl", "verify_locations")) {
         config->verify_locations = strdup(value);
     } else if (is_match(section, name, "ssl", "certificate_file")) {
         config->certificate_file = strdup(value);
     } else if (is_match(section, name, "ssl", "PrivateKey_file")) {
         config->PrivateKey_file = strdup(value);
+    } else if (is_match(section, name, "ssl", "cipher_list")) {
+        config->cipher_list = strdup(value);
     } else {
         return 0;  /* unknown section/name, error */
     }
@@ -57,6 +271,15 @@ TunnelConfig *tunnel_config_new(const char *filename)
     config = calloc(1, sizeof(*config));
     if (config == NULL) { return NULL; }
     
+    config->log_level = LOG_NOTICE;
+    config->health_check_interval = 5;
+    config->eject_after = 3;
+    config->connect_timeout = 5;
+    config->drain_quiet_time = 5;
+    config->client_socket.nodelay = 1;
+    config->client_socket.defer_accept = 5;
+    config->backend_socket.nodelay = 1;
+
     config->filename = strdup(filename);
     if (config->filename == NULL) { 
         free(config);
@@ -72,9 +295,37 @@ TunnelConfig *tunnel_config_new(const char *filename)
         return NULL;
     }
 
+    if (check_proxy_buffer_size(config) != 0) {
+        tunnel_config_free(config);
+        return NULL;
+    }
+
     return config;
 }
 
+void tunnel_config_listener_address(TunnelConfig *config, int index,
+                                    const char **listener_name,
+                                    const char **name, uint16_t *port)
+{
+    TunnelListenerConfig *listener_config;
+    List *link = config->listener_list;
+
+    if (listener_name != NULL) { *listener_name = "main"; }
+    *name = config->ssl_server_name;
+    *port = config->ssl_server_port;
+    if (index == 0) { return; }
+
+    while (--index > 0 && link != NULL) { link = list_next(link); }
+    if (link == NULL) { return; }
+
+    listener_config = list_user_data(link);
+    if (listener_name != NULL) { *listener_name = listener_config->host->server_name; }
+    if (listener_config->ssl_server_name != NULL) {
+        *name = listener_config->ssl_server_name;
+    }
+    *port = listener_config->ssl_server_port;
+}
+
 void tunnel_config_free(TunnelConfig *config) {
     if (config == NULL) { return; }
     
@@ -82,8 +333,24 @@ void tunnel_config_free(TunnelConfig *config) {
     if (config->ssl_server_name != NULL) { free(config->ssl_server_name); }
     if (config->destination_name != NULL) { free(config->destination_name); }
     if (config->destination_port != NULL) { free(config->destination_port); }
+    free_backend_list(config->backend_list);
+    while (config->host_list != NULL) {
+        host_config_free(list_user_data(config->host_list));
+        config->host_list =
+         list_delete_link(config->host_list, config->host_list);
+    }
+    while (config->listener_list != NULL) {
+        listener_config_free(list_user_data(config->listener_list));
+        config->listener_list =
+         list_delete_link(config->listener_list, config->listener_list);
+    }
+    if (config->balance != NULL) { free(config->balance); }
+    if (config->verify_locations != NULL) { free(config->verify_locations); }
     if (config->certificate_file != NULL) { free(config->certificate_file); }
     if (config->PrivateKey_file != NULL) { free(config->PrivateKey_file); }
+    if (config->admin_socket != NULL) { free(config->admin_socket); }
+    if (config->upgrade_socket != NULL) { free(config->upgrade_socket); }
+    if (config->cipher_list != NULL) { free(config->cipher_list); }
     free(config);
 }
 
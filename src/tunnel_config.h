@@ -6,25 +6,72 @@
 
 #include "tunnel.h"
 
+// One [host <server name>] section: a name the clients ask for with SNI
+// (exactly, or as "*.example.com" for any one label), with its own
+// certificate and backends.  What it leaves out comes from [ssl] and
+// [backends]:
+typedef struct TunnelHostConfig {
+    char *server_name;
+    char *certificate_file;
+    char *PrivateKey_file;
+    List *backend_list;      // As in [backends], or NULL for those
+    char *balance;           // NULL for the [backends] balance
+} TunnelHostConfig;
+
+// One [listener <name>] section: another address to accept on, with its own
+// certificate, backends, buffer size and proxy_protocol.  (The [main]
+// ssl_server_name and ssl_server_port are always the first listener.)  What
+// it leaves out comes from [main], [ssl] and [backends]; [host] sections
+// apply to it as well:
+typedef struct TunnelListenerConfig {
+    char *ssl_server_name;      // NULL for [main]'s
+    uint16_t ssl_server_port;
+    size_t buffer_size;         // 0 for [main]'s
+    int proxy_protocol;         // -1 for [main]'s
+    TunnelHostConfig *host;     // The certificate and backends.  Its
+                                // server_name is the listener's name.
+} TunnelListenerConfig;
+
 typedef struct TunnelConfig {
 
     // The name of the .ini file that was loaded:
     char *filename;
     
-    // Host name / interface address to bind to:
+    // Interface address to bind to (IPv4 or IPv6), or "*" for all of them:
     char *ssl_server_name;
 
     // FIXME: Use char * and gethostaddr() instead of inet_pton() w/short:
     uint16_t ssl_server_port;
     
-    // The remote server to tunnel all traffic to:
+    // The remote server to tunnel all traffic to, if there's no [backends]
+    // section:
     char *destination_name;
     char *destination_port;
+
+    // The [backends] section (see tunnel_backend.h).  The "host:port
+    // [weight]" strings, in order, how to pick among them ("least_conn",
+    // "hash" or "ewma"; NULL for least_conn), the seconds between active
+    // health checks (0 for none), and the connect failures in a row that
+    // take a backend out of rotation:
+    List *backend_list;
+    char *balance;
+    int health_check_interval;
+    int eject_after;
+
+    // The TunnelHostConfig of each [host ...] section, in order:
+    List *host_list;
+
+    // The TunnelListenerConfig of each [listener ...] section, in order:
+    List *listener_list;
     
     // The SSL Cert, Key, and CA Cert ("verify_locations") to use:
     char *verify_locations;  // For CyaSSL_CTX_load_verify_locations()
     char *certificate_file;  // For CyaSSL_CTX_use_certificate_file()
     char *PrivateKey_file;   // For CyaSSL_CTX_use_PrivateKey_file()
+
+    // Colon-separated cipher suites in order of preference, or NULL to
+    // use the CyaSSL defaults.  For CyaSSL_CTX_set_cipher_list():
+    char *cipher_list;
     
     // The number of worker threads to launch:
     int thread_count;
@@ -32,11 +79,75 @@ typedef struct TunnelConfig {
     // The size of the read/write buffers in RAM:
     size_t buffer_size;
 
+    // The size of each client's SSL socket receive and send buffers, for
+    // our own CyaSSL I/O callbacks (see tunnel_io.h).  0 to leave the
+    // socket I/O to CyaSSL:
+    size_t ssl_io_buffer_size;
+
+    // The TCP options for the client sockets (and listeners), and for the
+    // backend sockets; the [client_socket] and [backend_socket] sections:
+    TunnelSocketConfig client_socket;
+    TunnelSocketConfig backend_socket;
+
+    // The PROXY protocol header to send each backend first:
+    // TUNNEL_PROXY_OFF, _V1 or _V2 (see tunnel_proxy.h):
+    int proxy_protocol;
+
+    // The Unix domain socket for the stats endpoint, or NULL for none:
+    char *admin_socket;
+
+    // The Unix domain socket for handing the listener to a new process on
+    // an upgrade, or NULL for none (see tunnel_upgrade.h):
+    char *upgrade_socket;
+
+    // The syslog level to log up to (log_level = debug, info, notice, ...):
+    int log_level;
+
+    // Trace one connection in this many (see tunnel_trace.h), or 0 for none:
+    int trace_sample_rate;
+
+    // If non-zero, the clients' socket events are edge-triggered (see
+    // thread->edge_triggered).  Takes a restart:
+    int edge_triggered;
+
+    // TUNNEL_IO_ENGINE_LIBEVENT, or _URING for the backend sockets to use
+    // an io_uring per thread (see thread->uring).  Takes a restart:
+    int io_engine;
+
+    // The most handshakes a worker thread runs at once, or 0 for no limit.
+    // (See on_accept_dispatch() and on_accept().)
+    int max_pending_handshakes;
+
+    // Seconds a client gets to finish its SSL handshake, and seconds a
+    // connection may go without reading a byte from either side, before
+    // it is closed.  0 for no limit:
+    int handshake_timeout;
+    int idle_timeout;
+
+    // Seconds to wait for each backend connect() before trying the next
+    // address or backend.  0 for no limit:
+    int connect_timeout;
+
+    // On SIGTERM, the seconds to let open connections finish before they
+    // are closed anyway.  0 to close them right away, as on SIGINT:
+    int drain_timeout;
+
+    // While draining, the seconds a connection must move no bytes, with no
+    // request outstanding, before it is closed early:
+    int drain_quiet_time;
+
 } TunnelConfig;
 
 
 TunnelConfig *tunnel_config_new(const char *filename);
 void tunnel_config_free(TunnelConfig *config);
 
+// The name ("main" for listener 0, or the [listener] section's), bind
+// address and port of listener 'index'.  A [listener] without an
+// ssl_server_name binds to [main]'s.  'listener_name' may be NULL:
+void tunnel_config_listener_address(TunnelConfig *config, int index,
+                                    const char **listener_name,
+                                    const char **name, uint16_t *port);
+
 
 #endif	/* TUNNEL_CONFIG_H */
@@ -0,0 +1,412 @@
+/**
+ * Copyright (c) 2014 Derek Simkowiak
+ */
+
+#include "tunnel_context.h"
+#include <ctype.h>
+
+static void tunnel_context_free(TunnelContext *context);
+static TunnelHost *find_exact_host(TunnelContext *context,
+                                   const char *server_name, size_t size);
+
+// Create a CYASSL_CTX with the [ssl] CA file and cipher list, and the given
+// certificate and key:
+static CYASSL_CTX *new_cyassl_ctx(TunnelConfig *config,
+                                  const char *certificate_file,
+                                  const char *PrivateKey_file)
+{
+    CYASSL_CTX *cyassl_ctx;
+    int result;
+
+    cyassl_ctx = CyaSSL_CTX_new(CyaSSLv23_server_method());
+    if (cyassl_ctx == NULL) { return NULL; }
+
+    // Load CA certificates into CYASSL_CTX:
+    result =
+     CyaSSL_CTX_load_verify_locations(cyassl_ctx, config->verify_locations, 0);
+    if (result != SSL_SUCCESS) {
+        log(LOG_ERR, "Error loading %s.", config->verify_locations);
+        CyaSSL_CTX_free(cyassl_ctx);
+        return NULL;
+    }
+
+    result =
+     CyaSSL_CTX_use_certificate_file(cyassl_ctx, certificate_file,
+                                    SSL_FILETYPE_PEM);
+    if (result != SSL_SUCCESS) {
+        log(LOG_ERR, "Error loading %s.", certificate_file);
+        CyaSSL_CTX_free(cyassl_ctx);
+        return NULL;
+    }
+
+    result =
+     CyaSSL_CTX_use_PrivateKey_file(cyassl_ctx, PrivateKey_file,
+                                   SSL_FILETYPE_PEM);
+    if (result != SSL_SUCCESS) {
+        log(LOG_ERR, "Error loading %s.", PrivateKey_file);
+        CyaSSL_CTX_free(cyassl_ctx);
+        return NULL;
+    }
+
+    // Restrict the negotiable cipher suites, if configured.  CyaSSL picks
+    // the first suite in this list that the client also supports:
+    if (config->cipher_list != NULL) {
+        result = CyaSSL_CTX_set_cipher_list(cyassl_ctx, config->cipher_list);
+        if (result != SSL_SUCCESS) {
+            log(LOG_ERR, "No usable cipher suites in cipher_list \"%s\".",
+                config->cipher_list);
+            CyaSSL_CTX_free(cyassl_ctx);
+            return NULL;
+        }
+    }
+
+    // Our receive and send buffers instead of CyaSSL's socket I/O:
+    if (config->ssl_io_buffer_size > 0) {
+        tunnel_io_use(cyassl_ctx);
+    }
+
+    return cyassl_ctx;
+}
+
+// 32-bit FNV-1a of the lowercased name:
+static uint32_t hash_server_name(const char *server_name, size_t size)
+{
+    uint32_t hash = 0x811c9dc5;
+
+    while (size-- > 0) {
+        hash ^= (unsigned char)tolower((unsigned char)*server_name++);
+        hash *= 0x01000193;
+    }
+    return hash;
+}
+
+static void host_free(TunnelHost *host)
+{
+    if (host->cyassl_ctx != NULL) { CyaSSL_CTX_free(host->cyassl_ctx); }
+    if (host->owns_backends) { tunnel_backend_pool_free(host->backends); }
+    free(host);
+}
+
+// 'section' is "host" or "listener", for the logs:
+static TunnelHost *host_new(TunnelContext *context, TunnelHostConfig *host_config,
+                            const char *section)
+{
+    TunnelConfig *config = context->config;
+    TunnelHost *host;
+
+    host = calloc(1, sizeof(*host));
+    if (host == NULL) { return NULL; }
+    host->config = host_config;
+
+    host->cyassl_ctx =
+     new_cyassl_ctx(config,
+                    host_config->certificate_file ? host_config->certificate_file
+                                                  : config->certificate_file,
+                    host_config->PrivateKey_file ? host_config->PrivateKey_file
+                                                 : config->PrivateKey_file);
+    if (host->cyassl_ctx == NULL) {
+        log(LOG_ERR, "Can't set up [%s %s].", section, host_config->server_name);
+        host_free(host);
+        return NULL;
+    }
+
+    if (host_config->backend_list != NULL) {
+        host->backends =
+         tunnel_backend_pool_new(config, host_config->backend_list,
+                                 host_config->balance ? host_config->balance
+                                                      : config->balance);
+        if (host->backends == NULL) {
+            log(LOG_ERR, "Can't set up [%s %s].", section, host_config->server_name);
+            host_free(host);
+            return NULL;
+        }
+        host->owns_backends = 1;
+    } else {
+        host->backends = context->backends;
+    }
+    return host;
+}
+
+static int add_hosts(TunnelContext *context)
+{
+    TunnelHost *host;
+    List *link;
+    size_t count = 0, bucket;
+
+    for (link = context->config->host_list; link != NULL; link = list_next(link)) {
+        count++;
+    }
+    if (count == 0) { return 0; }
+
+    // At most half full:
+    context->host_bucket_count = 1;
+    while (context->host_bucket_count < count * 2) {
+        context->host_bucket_count *= 2;
+    }
+    context->host_buckets =
+     calloc(context->host_bucket_count, sizeof(*context->host_buckets));
+    if (context->host_buckets == NULL) { return -1; }
+
+    for (link = context->config->host_list; link != NULL; link = list_next(link)) {
+        TunnelHostConfig *host_config = list_user_data(link);
+
+        if (find_exact_host(context, host_config->server_name,
+                            strlen(host_config->server_name)) != NULL) {
+            log(LOG_WARNING, "[host %s] is listed twice; using the first.",
+                host_config->server_name);
+            continue;
+        }
+
+        host = host_new(context, host_config, "host");
+        if (host == NULL) { return -1; }
+
+        bucket = hash_server_name(host_config->server_name,
+                                  strlen(host_config->server_name)) &
+                 (context->host_bucket_count - 1);
+        host->next = context->host_buckets[bucket];
+        context->host_buckets[bucket] = host;
+    }
+
+    log(LOG_NOTICE, "%zu [host] sections.", count);
+    return 0;
+}
+
+static int add_listeners(TunnelContext *context)
+{
+    TunnelListenerConfig *listener_config;
+    List *link;
+    int count = 0;
+
+    for (link = context->config->listener_list; link != NULL; link = list_next(link)) {
+        count++;
+    }
+    if (count == 0) { return 0; }
+    if (count + 1 > TUNNEL_LISTENER_MAX) {
+        log(LOG_ERR, "Too many [listener] sections (%d); the most is %d.", count,
+            TUNNEL_LISTENER_MAX - 1);
+        return -1;
+    }
+
+    context->listeners = calloc(count, sizeof(*context->listeners));
+    if (context->listeners == NULL) { return -1; }
+
+    for (link = context->config->listener_list; link != NULL; link = list_next(link)) {
+        listener_config = list_user_data(link);
+
+        if (listener_config->ssl_server_port == 0) {
+            log(LOG_ERR, "[listener %s] has no ssl_server_port.",
+                listener_config->host->server_name);
+            return -1;
+        }
+
+        context->listeners[context->listener_count] =
+         host_new(context, listener_config->host, "listener");
+        if (context->listeners[context->listener_count] == NULL) { return -1; }
+
+        context->listeners[context->listener_count]->buffer_size =
+         listener_config->buffer_size;
+        context->listeners[context->listener_count]->proxy_protocol =
+         listener_config->proxy_protocol;
+        context->listener_count++;
+    }
+    return 0;
+}
+
+TunnelHost *tunnel_context_listener(TunnelContext *context, int index)
+{
+    if (index <= 0 || index > context->listener_count) { return NULL; }
+    return context->listeners[index - 1];
+}
+
+static TunnelHost *find_exact_host(TunnelContext *context,
+                                   const char *server_name, size_t size)
+{
+    TunnelHost *host;
+    size_t bucket = hash_server_name(server_name, size) &
+                    (context->host_bucket_count - 1);
+
+    for (host = context->host_buckets[bucket]; host != NULL; host = host->next) {
+        if (strlen(host->config->server_name) == size &&
+            strncasecmp(host->config->server_name, server_name, size) == 0) {
+            return host;
+        }
+    }
+    return NULL;
+}
+
+TunnelHost *tunnel_context_find_host(TunnelContext *context,
+                                     const char *server_name, size_t size)
+{
+    TunnelHost *host;
+    const char *dot;
+    char wildcard[256];
+
+    if (context->host_bucket_count == 0 || size == 0) { return NULL; }
+
+    host = find_exact_host(context, server_name, size);
+    if (host != NULL) { return host; }
+
+    // "www.example.com" also matches "*.example.com":
+    dot = memchr(server_name, '.', size);
+    if (dot == NULL || size - (dot - server_name) + 1 > sizeof(wildcard)) {
+        return NULL;
+    }
+    wildcard[0] = '*';
+    memcpy(&wildcard[1], dot, size - (dot - server_name));
+    return find_exact_host(context, wildcard, size - (dot - server_name) + 1);
+}
+
+static void append_socket_option(const char *name, int value, void *arg)
+{
+    char *line = (char *)arg;
+    size_t length = strlen(line);
+
+    snprintf(line + length, 256 - length, " %s=%d", name, value);
+}
+
+static void log_socket_options(const char *section, TunnelSocketConfig *effective)
+{
+    char line[256] = "";
+
+    tunnel_socket_foreach(effective, append_socket_option, line);
+    log(LOG_NOTICE, "[%s]:%s", section, line);
+}
+
+TunnelContext *tunnel_context_new(const char *ini_filename)
+{
+    TunnelContext *context;
+    TunnelConfig *config;
+
+    context = calloc(1, sizeof(*context));
+    if (context == NULL) { return NULL; }
+
+    config = context->config = tunnel_config_new(ini_filename);
+    if (config == NULL) {
+        tunnel_context_free(context);
+        return NULL;
+    }
+
+    context->cyassl_ctx =
+     new_cyassl_ctx(config, config->certificate_file, config->PrivateKey_file);
+    if (context->cyassl_ctx == NULL) {
+        tunnel_context_free(context);
+        return NULL;
+    }
+
+    log(LOG_NOTICE, "Cipher list: %s",
+        config->cipher_list ? config->cipher_list : "(CyaSSL defaults)");
+
+    context->backends =
+     tunnel_backend_pool_new(config, config->backend_list, config->balance);
+    if (context->backends == NULL) {
+        tunnel_context_free(context);
+        return NULL;
+    }
+
+    if (add_hosts(context) != 0 || add_listeners(context) != 0) {
+        tunnel_context_free(context);
+        return NULL;
+    }
+
+    if (tunnel_socket_effective(&config->client_socket, &context->client_socket) == 0) {
+        log_socket_options("client_socket", &context->client_socket);
+    }
+    if (tunnel_socket_effective(&config->backend_socket, &context->backend_socket) == 0) {
+        log_socket_options("backend_socket", &context->backend_socket);
+    }
+
+    context->ref_count = 1;
+    return context;
+}
+
+void tunnel_context_start_health_checks(TunnelContext *context,
+                                        struct event_base *base)
+{
+    TunnelHost *host;
+    size_t bucket;
+    int index;
+
+    tunnel_backend_pool_start_health_checks(context->backends, base);
+
+    for (index = 0; index < context->listener_count; index++) {
+        if (context->listeners[index]->owns_backends) {
+            tunnel_backend_pool_start_health_checks(context->listeners[index]->backends,
+                                                    base);
+        }
+    }
+
+    for (bucket = 0; bucket < context->host_bucket_count; bucket++) {
+        for (host = context->host_buckets[bucket]; host != NULL; host = host->next) {
+            if (host->owns_backends) {
+                tunnel_backend_pool_start_health_checks(host->backends, base);
+            }
+        }
+    }
+}
+
+void tunnel_context_stop_health_checks(TunnelContext *context)
+{
+    TunnelHost *host;
+    size_t bucket;
+    int index;
+
+    tunnel_backend_pool_stop_health_checks(context->backends);
+
+    for (index = 0; index < context->listener_count; index++) {
+        if (context->listeners[index]->owns_backends) {
+            tunnel_backend_pool_stop_health_checks(context->listeners[index]->backends);
+        }
+    }
+
+    for (bucket = 0; bucket < context->host_bucket_count; bucket++) {
+        for (host = context->host_buckets[bucket]; host != NULL; host = host->next) {
+            if (host->owns_backends) {
+                tunnel_backend_pool_stop_health_checks(host->backends);
+            }
+        }
+    }
+}
+
+void tunnel_context_ref(TunnelContext *context)
+{
+    if (context == NULL) { return; }
+    __atomic_add_fetch(&context->ref_count, 1, __ATOMIC_RELAXED);
+}
+
+void tunnel_context_unref(TunnelContext *context)
+{
+    if (context == NULL) { return; }
+
+    // The last unref may come from any thread, so it must see every other
+    // thread's use of the context before it frees it:
+    if (__atomic_sub_fetch(&context->ref_count, 1, __ATOMIC_ACQ_REL) == 0) {
+        tunnel_context_free(context);
+    }
+}
+
+static void tunnel_context_free(TunnelContext *context)
+{
+    TunnelHost *host;
+    size_t bucket;
+    int index;
+
+    if (context == NULL) { return; }
+
+    for (bucket = 0; bucket < context->host_bucket_count; bucket++) {
+        while ((host = context->host_buckets[bucket]) != NULL) {
+            context->host_buckets[bucket] = host->next;
+            host_free(host);
+        }
+    }
+    free(context->host_buckets);
+
+    for (index = 0; index < context->listener_count; index++) {
+        host_free(context->listeners[index]);
+    }
+    free(context->listeners);
+
+    if (context->cyassl_ctx != NULL) { CyaSSL_CTX_free(context->cyassl_ctx); }
+    tunnel_backend_pool_free(context->backends);
+    tunnel_config_free(context->config);
+    free(context);
+}
@@ -0,0 +1,77 @@
+/**
+ * Copyright (c) 2014 Derek Simkowiak
+ */
+#ifndef TUNNEL_CONTEXT_H
+#define TUNNEL_CONTEXT_H
+
+// A TunnelConfig and the CYASSL_CTX, backend pool and virtual hosts built
+// from it, as one reference-counted unit.  The main thread owns the current
+// one (server->context) and builds a new one on SIGHUP.  Every connection
+// holds a reference to the context it was accepted under, so the old
+// certificate and settings stay alive until the last connection using them
+// closes.
+//
+// A context is never changed after tunnel_context_new().  The reference
+// count is atomic; the main thread refs, and the worker threads unref.
+
+#include "tunnel.h"
+
+// A [host] or [listener] section, ready to use.  A client whose SNI server
+// name matches a [host] (or who connects to a [listener]) gets its
+// certificate and backends instead of the defaults:
+typedef struct TunnelHost {
+    struct TunnelHostConfig *config;
+    CYASSL_CTX *cyassl_ctx;
+    struct TunnelBackendPool *backends;   // Shares context->backends if the
+    int owns_backends;                    // section has no backend lines
+    size_t buffer_size;                   // A [listener]'s, or 0
+    int proxy_protocol;                   // A [listener]'s, or -1
+
+    struct TunnelHost *next;   // In the same hash bucket
+} TunnelHost;
+
+typedef struct TunnelContext {
+    struct TunnelConfig *config;
+    CYASSL_CTX *cyassl_ctx;
+    struct TunnelBackendPool *backends;
+
+    // config->client_socket and ->backend_socket, as the kernel took them:
+    TunnelSocketConfig client_socket;
+    TunnelSocketConfig backend_socket;
+
+    // The TunnelHosts, hashed by lowercase server name.  A power of two
+    // buckets, or 0 if there are no [host] sections:
+    TunnelHost **host_buckets;
+    size_t host_bucket_count;
+
+    // The TunnelHost of each [listener] section, in order:
+    TunnelHost **listeners;
+    int listener_count;     // Not counting [main]
+
+    unsigned int ref_count;
+} TunnelContext;
+
+
+// Parse 'ini_filename', load its certificate, key and CA file, and resolve
+// its backends.  Returns NULL (having logged why) on any error:
+TunnelContext *tunnel_context_new(const char *ini_filename);
+
+// The TunnelHost for an SNI 'server_name' (not NUL-terminated), trying
+// "*.<parent domain>" if there's no exact match.  NULL if neither matches:
+TunnelHost *tunnel_context_find_host(TunnelContext *context,
+                                     const char *server_name, size_t size);
+
+// The TunnelHost of listener 'index' (see TunnelServer), or NULL for
+// listener 0, [main], which uses the context's own certificate and backends:
+TunnelHost *tunnel_context_listener(TunnelContext *context, int index);
+
+// Start (or stop) the health checks of every backend pool.  Main thread
+// only (see tunnel_backend_pool_start_health_checks()):
+void tunnel_context_start_health_checks(TunnelContext *context,
+                                        struct event_base *base);
+void tunnel_context_stop_health_checks(TunnelContext *context);
+
+void tunnel_context_ref(TunnelContext *context);
+void tunnel_context_unref(TunnelContext *context);
+
+#endif  // TUNNEL_CONTEXT_H
@@ -0,0 +1,160 @@
+/**
+ * Copyright (c) 2014 Derek Simkowiak
+ */
+#include "tunnel_io.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/param.h>    // for MIN()
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+TunnelIO *tunnel_io_new(int socket_fd, size_t buffer_size)
+{
+    TunnelIO *io = calloc(1, sizeof(*io));
+
+    if (io == NULL) { return NULL; }
+
+    io->socket_fd = socket_fd;
+    io->buffer_size = buffer_size;
+    io->recv_buffer = malloc(buffer_size);
+    io->send_buffer = malloc(buffer_size);
+    io->send_fifo = fifo_new(buffer_size);
+    if (io->recv_buffer == NULL || io->send_buffer == NULL ||
+        io->send_fifo == NULL) {
+        tunnel_io_free(io);
+        return NULL;
+    }
+    return io;
+}
+
+void tunnel_io_free(TunnelIO *io)
+{
+    if (io == NULL) { return; }
+
+    fifo_free(io->send_fifo);
+    free(io->send_buffer);
+    free(io->recv_buffer);
+    free(io);
+}
+
+// The CyaSSL error for a failed recv() or send():
+static int cbio_error(int error)
+{
+    switch (error) {
+    case EAGAIN:
+#if EWOULDBLOCK != EAGAIN
+    case EWOULDBLOCK:
+#endif
+        return CYASSL_CBIO_ERR_WANT_READ;   // (The same as _WANT_WRITE)
+    case ECONNRESET:
+        return CYASSL_CBIO_ERR_CONN_RST;
+    case EINTR:
+        return CYASSL_CBIO_ERR_ISR;
+    case ECONNABORTED:
+    case EPIPE:
+        return CYASSL_CBIO_ERR_CONN_CLOSE;
+    default:
+        return CYASSL_CBIO_ERR_GENERAL;
+    }
+}
+
+static int on_recv(CYASSL *cyassl, char *buffer, int size, void *ctx)
+{
+    TunnelIO *io = (TunnelIO *)ctx;
+    size_t copy_size;
+    ssize_t result;
+
+    if (io->recv_start == io->recv_end) {
+        if (io->recv_drained) { return CYASSL_CBIO_ERR_WANT_READ; }
+
+        result = recv(io->socket_fd, io->recv_buffer, io->buffer_size, 0);
+        if (result < 0) { return cbio_error(errno); }
+        if (result == 0) { return CYASSL_CBIO_ERR_CONN_CLOSE; }
+
+        io->recv_start = 0;
+        io->recv_end = result;
+        // Anything that arrives after this makes a new readiness event:
+        io->recv_drained = ((size_t)result < io->buffer_size);
+    }
+
+    copy_size = MIN((size_t)size, io->recv_end - io->recv_start);
+    memcpy(buffer, &io->recv_buffer[io->recv_start], copy_size);
+    io->recv_start += copy_size;
+    return (int)copy_size;
+}
+
+static int on_send(CYASSL *cyassl, char *buffer, int size, void *ctx)
+{
+    TunnelIO *io = (TunnelIO *)ctx;
+    size_t copy_size, copied = 0;
+
+    // Full: make room, or have CyaSSL hold on to the rest:
+    if (fifo_bytes_free(io->send_fifo) == 0 && tunnel_io_flush(io) < 0) {
+        return cbio_error(errno);
+    }
+    if (fifo_bytes_free(io->send_fifo) == 0) {
+        return CYASSL_CBIO_ERR_WANT_WRITE;
+    }
+
+    while (copied < (size_t)size && fifo_bytes_free(io->send_fifo) > 0) {
+        copy_size = MIN((size_t)size - copied, fifo_write_size(io->send_fifo));
+        memcpy(&io->send_buffer[fifo_write_index(io->send_fifo)],
+               &buffer[copied], copy_size);
+        fifo_write(io->send_fifo, copy_size);
+        copied += copy_size;
+    }
+    return (int)copied;
+}
+
+void tunnel_io_use(CYASSL_CTX *cyassl_ctx)
+{
+    CyaSSL_SetIORecv(cyassl_ctx, on_recv);
+    CyaSSL_SetIOSend(cyassl_ctx, on_send);
+}
+
+void tunnel_io_attach(TunnelIO *io, CYASSL *cyassl)
+{
+    CyaSSL_SetIOReadCtx(cyassl, io);
+    CyaSSL_SetIOWriteCtx(cyassl, io);
+}
+
+void tunnel_io_readable(TunnelIO *io)
+{
+    io->recv_drained = 0;
+}
+
+size_t tunnel_io_buffered(TunnelIO *io)
+{
+    return io->recv_end - io->recv_start;
+}
+
+size_t tunnel_io_pending(TunnelIO *io)
+{
+    return fifo_bytes_used(io->send_fifo);
+}
+
+int tunnel_io_flush(TunnelIO *io)
+{
+    struct iovec iov[2];
+    size_t used_size;
+    int iov_count;
+    ssize_t result;
+
+    while ((used_size = fifo_bytes_used(io->send_fifo)) > 0) {
+        // The pending bytes, and the part that wrapped around, if any:
+        iov[0].iov_base = &io->send_buffer[fifo_read_index(io->send_fifo)];
+        iov[0].iov_len = fifo_read_size(io->send_fifo);
+        iov[1].iov_base = io->send_buffer;
+        iov[1].iov_len = used_size - iov[0].iov_len;
+        iov_count = iov[1].iov_len ? 2 : 1;
+
+        result = writev(io->socket_fd, iov, iov_count);
+        if (result < 0) {
+            if (errno == EINTR) { continue; }
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 1 : -1;
+        }
+        fifo_read(io->send_fifo, result);
+    }
+    return 0;
+}
@@ -0,0 +1,64 @@
+/**
+ * Copyright (c) 2014 Derek Simkowiak
+ */
+#ifndef TUNNEL_IO_H
+#define TUNNEL_IO_H
+
+// CyaSSL's socket I/O, done by us (with ssl_io_buffer_size in tunnel.ini).
+//
+// Left to itself, CyaSSL recv()s each record twice, once for the 5-byte
+// header and once for the body, and then once more to see EAGAIN; and it
+// send()s each record it writes on its own.  With these callbacks
+// installed on the CYASSL_CTX, CyaSSL reads from a per-connection receive
+// buffer instead, which one large recv() fills with as many records as
+// have arrived.  A recv() that comes back short has emptied the socket, so
+// the next read waits for the next readiness event (tunnel_io_readable())
+// without a syscall.  What CyaSSL writes is queued in a send FIFO, and
+// goes out with one writev() when tunnel_io_flush() is called (once per
+// on_write_ssl pass, or after a handshake step).
+
+#include "fifo.h"
+#include <cyassl/ssl.h>
+
+typedef struct TunnelIO {
+    int socket_fd;
+    size_t buffer_size;         // Of each of the two buffers
+
+    // Received bytes CyaSSL hasn't read yet are recv_buffer[recv_start]
+    // up to recv_buffer[recv_end]:
+    char *recv_buffer;
+    size_t recv_start;
+    size_t recv_end;
+    int recv_drained;           // The last recv() emptied the socket
+
+    // Bytes CyaSSL wrote that haven't been sent yet:
+    char *send_buffer;
+    FIFO *send_fifo;
+} TunnelIO;
+
+// Allocate the buffers for 'socket_fd'.  NULL if out of memory:
+TunnelIO *tunnel_io_new(int socket_fd, size_t buffer_size);
+void tunnel_io_free(TunnelIO *io);
+
+// Have every CYASSL made from 'cyassl_ctx' do its I/O with us.  Each of
+// them must then be given a TunnelIO with tunnel_io_attach():
+void tunnel_io_use(CYASSL_CTX *cyassl_ctx);
+
+// Use 'io' for 'cyassl'.  Call it after CyaSSL_set_fd(), which resets it:
+void tunnel_io_attach(TunnelIO *io, CYASSL *cyassl);
+
+// The socket is readable again (a read event); let CyaSSL recv() again:
+void tunnel_io_readable(TunnelIO *io);
+
+// Received bytes CyaSSL hasn't read yet.  (Like CyaSSL_pending(), these
+// won't make the socket readable again.)
+size_t tunnel_io_buffered(TunnelIO *io);
+
+// Bytes CyaSSL wrote that haven't been sent yet:
+size_t tunnel_io_pending(TunnelIO *io);
+
+// Send the pending bytes with writev().  Returns 0 once they're all sent,
+// 1 if the socket is full (EAGAIN), or -1 on an error (errno is set):
+int tunnel_io_flush(TunnelIO *io);
+
+#endif  // TUNNEL_IO_H
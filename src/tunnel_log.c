@@ -0,0 +1,209 @@
+/**
+ * Copyright (c) 2014 Derek Simkowiak
+ */
+#include "tunnel_log.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdarg.h>
+#include <strings.h>
+#include <pthread.h>
+#include <time.h>
+
+typedef struct {
+    int level;
+    char message[TUNNEL_LOG_MESSAGE_SIZE];
+} LogRecord;
+
+// One thread's ring.  'head' is only written by the owning thread and
+// 'tail' only by the writer thread; they live on separate cache lines.
+typedef struct LogRing {
+    uint64_t head __attribute__((aligned(64)));
+    uint64_t dropped;
+
+    uint64_t tail __attribute__((aligned(64)));
+    uint64_t dropped_reported;
+
+    struct LogRing *next;  // The next ring in the registry
+
+    LogRecord records[TUNNEL_LOG_RING_SIZE];
+} LogRing;
+
+int tunnel_log_level = LOG_NOTICE;
+
+#ifdef __linux__
+__thread long tunnel_log_cached_tid = 0;
+#endif
+
+// This thread's ring, once it has logged something:
+static __thread LogRing *thread_ring = NULL;
+
+// All the rings.  The mutex is only taken by the writer, and by each
+// thread once, the first time it logs:
+static LogRing *ring_registry = NULL;
+static pthread_mutex_t ring_registry_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_t writer_thread;
+static int writer_running = 0;
+
+static const struct {
+    const char *name;
+    int level;
+} level_names[] = {
+    {"emerg", LOG_EMERG}, {"alert", LOG_ALERT}, {"crit", LOG_CRIT},
+    {"err", LOG_ERR}, {"error", LOG_ERR}, {"warning", LOG_WARNING},
+    {"notice", LOG_NOTICE}, {"info", LOG_INFO}, {"debug", LOG_DEBUG},
+};
+
+
+static LogRing *ring_register(void)
+{
+    LogRing *ring;
+
+    if (posix_memalign((void **)&ring, 64, sizeof(*ring)) != 0) { return NULL; }
+    memset(ring, 0x0, sizeof(*ring));
+
+    pthread_mutex_lock(&ring_registry_mutex);
+    ring->next = ring_registry;
+    ring_registry = ring;
+    pthread_mutex_unlock(&ring_registry_mutex);
+
+    thread_ring = ring;
+    return ring;
+}
+
+
+void tunnel_log_write(int level, const char *fmt, ...)
+{
+    LogRing *ring = thread_ring;
+    LogRecord *record;
+    uint64_t head, tail;
+    va_list args;
+
+    if (!__atomic_load_n(&writer_running, __ATOMIC_ACQUIRE)) {
+        // No writer thread; log synchronously:
+        va_start(args, fmt);
+        vsyslog(level, fmt, args);
+        va_end(args);
+        return;
+    }
+
+    if (ring == NULL) {
+        ring = ring_register();
+        if (ring == NULL) { return; }
+    }
+
+    head = ring->head;
+    tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    if (head - tail >= TUNNEL_LOG_RING_SIZE) {
+        // Full.  The writer will report how many we dropped:
+        __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    record = &ring->records[head % TUNNEL_LOG_RING_SIZE];
+    record->level = level;
+    va_start(args, fmt);
+    vsnprintf(record->message, sizeof(record->message), fmt, args);
+    va_end(args);
+
+    // Publish the record to the writer:
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+
+static void ring_drain(LogRing *ring)
+{
+    uint64_t tail = ring->tail;
+    uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    uint64_t dropped;
+    LogRecord *record;
+
+    while (tail != head) {
+        record = &ring->records[tail % TUNNEL_LOG_RING_SIZE];
+        syslog(record->level, "%s", record->message);
+        tail++;
+        __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+    }
+
+    dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+    if (dropped != ring->dropped_reported) {
+        syslog(LOG_WARNING, "Log ring full; dropped %lu messages.",
+               (unsigned long)(dropped - ring->dropped_reported));
+        ring->dropped_reported = dropped;
+    }
+}
+
+
+static void drain_all(void)
+{
+    LogRing *ring;
+
+    pthread_mutex_lock(&ring_registry_mutex);
+    for (ring = ring_registry; ring != NULL; ring = ring->next) {
+        ring_drain(ring);
+    }
+    pthread_mutex_unlock(&ring_registry_mutex);
+}
+
+
+static void *writer_task(void *arg)
+{
+    struct timespec interval = {0, TUNNEL_LOG_DRAIN_USEC * 1000};
+
+    while (__atomic_load_n(&writer_running, __ATOMIC_ACQUIRE)) {
+        drain_all();
+        nanosleep(&interval, NULL);
+    }
+
+    // Final drain, after tunnel_log_stop():
+    drain_all();
+    return NULL;
+}
+
+
+int tunnel_log_start(void)
+{
+    int result;
+
+    __atomic_store_n(&writer_running, 1, __ATOMIC_RELEASE);
+
+    result = pthread_create(&writer_thread, NULL, writer_task, NULL);
+    if (result != 0) {
+        __atomic_store_n(&writer_running, 0, __ATOMIC_RELEASE);
+        syslog(LOG_WARNING, "Can't start the log writer; logging synchronously.");
+    }
+    return result;
+}
+
+
+void tunnel_log_stop(void)
+{
+    if (!__atomic_load_n(&writer_running, __ATOMIC_ACQUIRE)) { return; }
+
+    __atomic_store_n(&writer_running, 0, __ATOMIC_RELEASE);
+    pthread_join(writer_thread, NULL);
+
+    // The rings stay allocated: other threads may still hold theirs.
+}
+
+
+void tunnel_log_set_level(int level)
+{
+    tunnel_log_level = level;
+    setlogmask(LOG_UPTO(level));
+}
+
+
+int tunnel_log_level_from_name(const char *name)
+{
+    size_t index;
+
+    for (index = 0; index < sizeof(level_names) / sizeof(level_names[0]); index++) {
+        if (strcasecmp(name, level_names[index].name) == 0) {
+            return level_names[index].level;
+        }
+    }
+    return -1;
+}
@@ -0,0 +1,75 @@
+/**
+ * Copyright (c) 2014 Derek Simkowiak
+ */
+#ifndef TUNNEL_LOG_H
+#define TUNNEL_LOG_H
+
+// Backend for the log() and log_err() macros in tunnel.h.
+//
+// Log levels are filtered twice, before any arguments are evaluated:
+//
+//   - At compile time, against TUNNEL_LOG_LEVEL.  Calls above it compile
+//     to nothing.  (Build with -DTUNNEL_LOG_LEVEL=LOG_DEBUG to get the
+//     debug logging back.)
+//   - At run time, against tunnel_log_level (log_level in tunnel.ini).
+//
+// Messages that pass are formatted into a lock-free ring owned by the
+// calling thread (one producer, one consumer), and a background writer
+// thread drains all the rings into syslog().  So logging never makes a
+// syscall on the data path.  If a ring is full the message is dropped and
+// counted; the writer reports the count.
+//
+// Before tunnel_log_start() and after tunnel_log_stop(), messages go
+// straight to syslog().
+
+#include <syslog.h>
+
+#ifdef __linux__
+  #include <unistd.h>
+  #include <sys/syscall.h>
+#endif
+
+#ifndef TUNNEL_LOG_LEVEL
+  #define TUNNEL_LOG_LEVEL LOG_INFO
+#endif
+
+// The messages per thread that can wait for the writer:
+#define TUNNEL_LOG_RING_SIZE 256
+
+// The longest message; longer ones are truncated:
+#define TUNNEL_LOG_MESSAGE_SIZE 512
+
+// How often the writer drains the rings:
+#define TUNNEL_LOG_DRAIN_USEC 10000
+
+extern int tunnel_log_level;
+
+#ifdef __linux__
+// The calling thread's Linux LWP id.  gettid() is only called the first
+// time each thread logs:
+extern __thread long tunnel_log_cached_tid;
+
+static inline long tunnel_log_thread_id(void)
+{
+    if (tunnel_log_cached_tid == 0) {
+        tunnel_log_cached_tid = syscall(SYS_gettid);
+    }
+    return tunnel_log_cached_tid;
+}
+#endif
+
+// Start/stop the background writer thread.  Stopping drains all rings:
+int tunnel_log_start(void);
+void tunnel_log_stop(void);
+
+// Set tunnel_log_level, and the syslog mask to match:
+void tunnel_log_set_level(int level);
+
+// Parse "debug", "info", "notice", "warning", "err", ...  Returns -1 if
+// the name is not a syslog level:
+int tunnel_log_level_from_name(const char *name);
+
+void tunnel_log_write(int level, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+#endif  // TUNNEL_LOG_H
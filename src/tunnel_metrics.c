@@ -0,0 +1,84 @@
+/**
+ * Copyright (c) 2014 Derek Simkowiak
+ */
+#include "tunnel_metrics.h"
+#include <stdlib.h>
+#include <string.h>
+
+static const char *counter_names[METRIC_COUNTER_COUNT] = {
+    [METRIC_CONNECTIONS_ACCEPTED]  = "connections_accepted",
+    [METRIC_CONNECTIONS_CLOSED]    = "connections_closed",
+    [METRIC_DEST_CONNECT_FAILURES] = "dest_connect_failures",
+    [METRIC_HANDSHAKES_COMPLETED]  = "handshakes_completed",
+    [METRIC_HANDSHAKE_FAILURES]    = "handshake_failures",
+    [METRIC_BYTES_FROM_SSL]        = "bytes_from_ssl",
+    [METRIC_BYTES_FROM_DEST]       = "bytes_from_dest",
+    [METRIC_FIFO_STALLS]           = "fifo_stalls",
+    [METRIC_THROTTLE_TIMEOUTS]     = "throttle_timeouts",
+    [METRIC_CONNECTIONS_REJECTED]  = "connections_rejected",
+    [METRIC_HANDSHAKE_TIMEOUTS]    = "handshake_timeouts",
+    [METRIC_IDLE_TIMEOUTS]         = "idle_timeouts",
+    [METRIC_EMPTY_CONNECTIONS]     = "empty_connections",
+    [METRIC_BUFFER_BYTES_ALLOCATED] = "buffer_bytes_allocated",
+    [METRIC_BUFFER_BYTES_FREED]    = "buffer_bytes_freed",
+    [METRIC_URING_SUBMITS]         = "uring_submits",
+    [METRIC_URING_COMPLETIONS]     = "uring_completions",
+};
+
+static const char *histogram_names[METRIC_HISTOGRAM_COUNT] = {
+    [METRIC_HANDSHAKE_USEC]           = "handshake_usec",
+    [METRIC_CONNECTION_LIFETIME_MSEC] = "connection_lifetime_msec",
+};
+
+TunnelMetrics *tunnel_metrics_new(void)
+{
+    void *metrics = NULL;
+
+    if (posix_memalign(&metrics, METRICS_CACHE_LINE_SIZE,
+                       sizeof(TunnelMetrics)) != 0) {
+        return NULL;
+    }
+    memset(metrics, 0x0, sizeof(TunnelMetrics));
+    return (TunnelMetrics *)metrics;
+}
+
+void tunnel_metrics_free(TunnelMetrics *metrics)
+{
+    if (metrics == NULL) { return; }
+    free(metrics);
+}
+
+static uint64_t load(const uint64_t *value)
+{
+    return __atomic_load_n(value, __ATOMIC_RELAXED);
+}
+
+void tunnel_metrics_sum(TunnelMetrics *total, const TunnelMetrics *metrics)
+{
+    int index, bucket;
+
+    for (index = 0; index < METRIC_COUNTER_COUNT; index++) {
+        total->counters[index] += load(&metrics->counters[index]);
+    }
+
+    for (index = 0; index < METRIC_HISTOGRAM_COUNT; index++) {
+        const TunnelHistogram *from = &metrics->histograms[index];
+        TunnelHistogram *to = &total->histograms[index];
+
+        for (bucket = 0; bucket < METRICS_HISTOGRAM_BUCKETS; bucket++) {
+            to->buckets[bucket] += load(&from->buckets[bucket]);
+        }
+        to->count += load(&from->count);
+        to->sum += load(&from->sum);
+    }
+}
+
+const char *tunnel_metrics_counter_name(MetricCounter counter)
+{
+    return counter_names[counter];
+}
+
+const char *tunnel_metrics_histogram_name(MetricHistogram histogram)
+{
+    return histogram_names[histogram];
+}
@@ -0,0 +1,112 @@
+/**
+ * Copyright (c) 2014 Derek Simkowiak
+ */
+#ifndef TUNNEL_METRICS_H
+#define TUNNEL_METRICS_H
+
+// Counters and histograms for one TunnelThread.
+//
+// Every TunnelThread owns one TunnelMetrics block (and the TunnelServer
+// one more, for the main thread), and only that thread ever writes to it.
+// So there are no locks and no atomic read-modify-write instructions on the
+// hot path: an update is a plain load and a relaxed store.  Each block is
+// aligned and padded to whole cache lines so that two threads' blocks never
+// share a line.
+//
+// Any other thread (e.g. the main thread) may read a block at any time with
+// tunnel_metrics_sum().  Each value it reads is consistent on its own, but
+// a snapshot is not atomic across values.
+
+#include <stdint.h>
+#include <time.h>
+
+#define METRICS_CACHE_LINE_SIZE 64
+
+// Histogram bucket N counts values in [2^(N-1), 2^N), bucket 0 counts 0:
+#define METRICS_HISTOGRAM_BUCKETS 40
+
+typedef enum {
+    METRIC_CONNECTIONS_ACCEPTED,     // Sockets handed to this thread
+    METRIC_CONNECTIONS_CLOSED,       // TunnelClients freed
+    METRIC_DEST_CONNECT_FAILURES,    // Couldn't connect to the destination
+    METRIC_HANDSHAKES_COMPLETED,
+    METRIC_HANDSHAKE_FAILURES,
+    METRIC_BYTES_FROM_SSL,           // Plaintext bytes decrypted from clients
+    METRIC_BYTES_FROM_DEST,          // Plaintext bytes read from destinations
+    METRIC_FIFO_STALLS,              // Reads paused because a FIFO was full
+    METRIC_THROTTLE_TIMEOUTS,        // Writes paused because a peer was slow
+    METRIC_CONNECTIONS_REJECTED,     // Reset on accept: too many handshakes
+    METRIC_HANDSHAKE_TIMEOUTS,       // Closed by config->handshake_timeout
+    METRIC_IDLE_TIMEOUTS,            // Closed by config->idle_timeout
+    METRIC_EMPTY_CONNECTIONS,        // Closed before sending a byte
+    METRIC_BUFFER_BYTES_ALLOCATED,   // Client buffers, allocated on the
+    METRIC_BUFFER_BYTES_FREED,       // first byte from the client
+    METRIC_URING_SUBMITS,            // io_uring_enter()s (io_engine = io_uring)
+    METRIC_URING_COMPLETIONS,        // Requests they completed
+    METRIC_COUNTER_COUNT
+} MetricCounter;
+
+typedef enum {
+    METRIC_HANDSHAKE_USEC,           // Accept to SSL_SUCCESS (so including
+                                     // the wait for the ClientHello)
+    METRIC_CONNECTION_LIFETIME_MSEC, // Accept to free()
+    METRIC_HISTOGRAM_COUNT
+} MetricHistogram;
+
+typedef struct {
+    uint64_t buckets[METRICS_HISTOGRAM_BUCKETS];
+    uint64_t count;
+    uint64_t sum;
+} TunnelHistogram;
+
+typedef struct TunnelMetrics {
+    uint64_t counters[METRIC_COUNTER_COUNT];
+    TunnelHistogram histograms[METRIC_HISTOGRAM_COUNT];
+} __attribute__((aligned(METRICS_CACHE_LINE_SIZE))) TunnelMetrics;
+
+
+// Allocate a zeroed, cache-line aligned block:
+TunnelMetrics *tunnel_metrics_new(void);
+void tunnel_metrics_free(TunnelMetrics *metrics);
+
+// Add every value in 'metrics' into 'total'.  Safe to call from any thread:
+void tunnel_metrics_sum(TunnelMetrics *total, const TunnelMetrics *metrics);
+
+// Names for export, e.g. "connections_accepted":
+const char *tunnel_metrics_counter_name(MetricCounter counter);
+const char *tunnel_metrics_histogram_name(MetricHistogram histogram);
+
+// A monotonic timestamp for measuring latencies (not wall-clock time):
+static inline uint64_t tunnel_metrics_now_usec(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+// These may only be called by the thread that owns 'metrics'.  The
+// relaxed stores keep concurrent readers from seeing torn values:
+static inline void tunnel_metrics_add(TunnelMetrics *metrics,
+                                      MetricCounter counter, uint64_t count)
+{
+    __atomic_store_n(&metrics->counters[counter],
+                     metrics->counters[counter] + count, __ATOMIC_RELAXED);
+}
+
+static inline void tunnel_metrics_observe(TunnelMetrics *metrics,
+                                          MetricHistogram histogram,
+                                          uint64_t value)
+{
+    TunnelHistogram *h = &metrics->histograms[histogram];
+    int bucket = (value == 0) ? 0 : 64 - __builtin_clzll(value);
+
+    if (bucket >= METRICS_HISTOGRAM_BUCKETS) {
+        bucket = METRICS_HISTOGRAM_BUCKETS - 1;
+    }
+
+    __atomic_store_n(&h->buckets[bucket], h->buckets[bucket] + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&h->count, h->count + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&h->sum, h->sum + value, __ATOMIC_RELAXED);
+}
+
+#endif  // TUNNEL_METRICS_H
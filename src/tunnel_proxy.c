@@ -0,0 +1,204 @@
+/**
+ * Copyright (c) 2014 Derek Simkowiak
+ */
+#include "tunnel_proxy.h"
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/param.h>    // for MIN()
+#include <arpa/inet.h>
+
+static const unsigned char v2_signature[12] = {
+    0x0D, 0x0A, 0x0D, 0x0A, 0x00, 0x0D, 0x0A, 0x51, 0x55, 0x49, 0x54, 0x0A
+};
+
+#define V2_VERSION_PROXY   0x21   // Version 2, PROXY command
+#define V2_FAMILY_UNSPEC   0x00
+#define V2_FAMILY_TCP4     0x11
+#define V2_FAMILY_TCP6     0x21
+
+#define V2_HEADER_SIZE     16
+
+#define PP2_TYPE_AUTHORITY        0x02
+#define PP2_TYPE_SSL              0x20
+#define PP2_SUBTYPE_SSL_VERSION   0x21
+#define PP2_SUBTYPE_SSL_CIPHER    0x23
+#define PP2_CLIENT_SSL            0x01
+
+// Longest names we pass on; these keep the header within
+// TUNNEL_PROXY_HEADER_MAX:
+#define SERVER_NAME_MAX   255
+#define TLS_VERSION_MAX   32
+#define CIPHER_MAX        64
+
+int tunnel_proxy_version_from_name(const char *name)
+{
+    if (strcasecmp(name, "off") == 0 || strcmp(name, "0") == 0) {
+        return TUNNEL_PROXY_OFF;
+    }
+    if (strcasecmp(name, "v1") == 0 || strcmp(name, "1") == 0) {
+        return TUNNEL_PROXY_V1;
+    }
+    if (strcasecmp(name, "v2") == 0 || strcmp(name, "2") == 0) {
+        return TUNNEL_PROXY_V2;
+    }
+    return -1;
+}
+
+// The family of 'address', and pointers to its IP address bytes and port
+// (in network order).  An IPv4-mapped IPv6 address counts as AF_INET:
+static int address_parts(const struct sockaddr *address,
+                         const unsigned char **ip, const unsigned char **port)
+{
+    if (address == NULL) { return AF_UNSPEC; }
+
+    if (address->sa_family == AF_INET) {
+        const struct sockaddr_in *address4 = (const struct sockaddr_in *)address;
+        *ip = (const unsigned char *)&address4->sin_addr;
+        *port = (const unsigned char *)&address4->sin_port;
+        return AF_INET;
+    }
+    if (address->sa_family == AF_INET6) {
+        const struct sockaddr_in6 *address6 = (const struct sockaddr_in6 *)address;
+        *port = (const unsigned char *)&address6->sin6_port;
+        if (IN6_IS_ADDR_V4MAPPED(&address6->sin6_addr)) {
+            *ip = &address6->sin6_addr.s6_addr[12];
+            return AF_INET;
+        }
+        *ip = address6->sin6_addr.s6_addr;
+        return AF_INET6;
+    }
+    return AF_UNSPEC;
+}
+
+static size_t v1_header(char *buffer, size_t buffer_size, int family,
+                        const unsigned char *source_ip,
+                        const unsigned char *source_port,
+                        const unsigned char *destination_ip,
+                        const unsigned char *destination_port)
+{
+    char source[INET6_ADDRSTRLEN], destination[INET6_ADDRSTRLEN];
+    int length;
+
+    if (family == AF_UNSPEC) {
+        length = snprintf(buffer, buffer_size, "PROXY UNKNOWN\r\n");
+    } else {
+        inet_ntop(family, source_ip, source, sizeof(source));
+        inet_ntop(family, destination_ip, destination, sizeof(destination));
+        length = snprintf(buffer, buffer_size, "PROXY %s %s %s %u %u\r\n",
+                          (family == AF_INET) ? "TCP4" : "TCP6",
+                          source, destination,
+                          (source_port[0] << 8) | source_port[1],
+                          (destination_port[0] << 8) | destination_port[1]);
+    }
+    return (length < 0 || (size_t)length >= buffer_size) ? 0 : (size_t)length;
+}
+
+static unsigned char *put_tlv_header(unsigned char *out, int type, size_t length)
+{
+    out[0] = type;
+    out[1] = (length >> 8) & 0xff;
+    out[2] = length & 0xff;
+    return out + 3;
+}
+
+static unsigned char *put_tlv(unsigned char *out, int type, const char *value,
+                              size_t length)
+{
+    out = put_tlv_header(out, type, length);
+    memcpy(out, value, length);
+    return out + length;
+}
+
+static size_t v2_header(unsigned char *buffer, size_t buffer_size, int family,
+                        const unsigned char *source_ip,
+                        const unsigned char *source_port,
+                        const unsigned char *destination_ip,
+                        const unsigned char *destination_port,
+                        const char *server_name, size_t server_name_size,
+                        const char *tls_version, const char *cipher)
+{
+    size_t ip_size = (family == AF_INET) ? 4 : (family == AF_INET6) ? 16 : 0;
+    size_t address_size = ip_size ? 2 * ip_size + 4 : 0;
+    size_t version_size = tls_version ? MIN(strlen(tls_version), TLS_VERSION_MAX) : 0;
+    size_t cipher_size = cipher ? MIN(strlen(cipher), CIPHER_MAX) : 0;
+    size_t ssl_size = 5 + (version_size ? 3 + version_size : 0) +
+                          (cipher_size ? 3 + cipher_size : 0);
+    size_t total_size, rest_size;
+    unsigned char *out;
+
+    if (server_name == NULL) { server_name_size = 0; }
+    server_name_size = MIN(server_name_size, SERVER_NAME_MAX);
+
+    total_size = V2_HEADER_SIZE + address_size +
+                 (server_name_size ? 3 + server_name_size : 0) + 3 + ssl_size;
+    if (total_size > buffer_size) { return 0; }
+
+    // The server name first, since it may be in the way of everything else:
+    out = buffer + V2_HEADER_SIZE + address_size;
+    if (server_name_size) {
+        memmove(out + 3, server_name, server_name_size);
+        out = put_tlv_header(out, PP2_TYPE_AUTHORITY, server_name_size);
+        out += server_name_size;
+    }
+
+    out = put_tlv_header(out, PP2_TYPE_SSL, ssl_size);
+    *out++ = PP2_CLIENT_SSL;
+    // 'verify' is non-zero unless a client certificate was verified, and
+    // we never ask for one:
+    out[0] = out[1] = out[2] = 0;
+    out[3] = 1;
+    out += 4;
+    if (version_size) {
+        out = put_tlv(out, PP2_SUBTYPE_SSL_VERSION, tls_version, version_size);
+    }
+    if (cipher_size) {
+        out = put_tlv(out, PP2_SUBTYPE_SSL_CIPHER, cipher, cipher_size);
+    }
+
+    memcpy(buffer, v2_signature, sizeof(v2_signature));
+    buffer[12] = V2_VERSION_PROXY;
+    buffer[13] = (family == AF_INET) ? V2_FAMILY_TCP4
+               : (family == AF_INET6) ? V2_FAMILY_TCP6 : V2_FAMILY_UNSPEC;
+    rest_size = total_size - V2_HEADER_SIZE;
+    buffer[14] = (rest_size >> 8) & 0xff;
+    buffer[15] = rest_size & 0xff;
+
+    if (ip_size) {
+        out = buffer + V2_HEADER_SIZE;
+        memcpy(out, source_ip, ip_size);
+        memcpy(out + ip_size, destination_ip, ip_size);
+        memcpy(out + 2 * ip_size, source_port, 2);
+        memcpy(out + 2 * ip_size + 2, destination_port, 2);
+    }
+    return total_size;
+}
+
+size_t tunnel_proxy_header(char *buffer, size_t buffer_size, int version,
+                           const struct sockaddr *source,
+                           const struct sockaddr *destination,
+                           const char *server_name, size_t server_name_size,
+                           const char *tls_version, const char *cipher)
+{
+    const unsigned char *source_ip = NULL, *source_port = NULL;
+    const unsigned char *destination_ip = NULL, *destination_port = NULL;
+    int family;
+
+    // Both ends must be the same family, or we can't say (UNKNOWN/UNSPEC):
+    family = address_parts(source, &source_ip, &source_port);
+    if (address_parts(destination, &destination_ip, &destination_port) != family) {
+        family = AF_UNSPEC;
+    }
+
+    if (version == TUNNEL_PROXY_V1) {
+        return v1_header(buffer, buffer_size, family, source_ip, source_port,
+                         destination_ip, destination_port);
+    }
+    if (version == TUNNEL_PROXY_V2) {
+        return v2_header((unsigned char *)buffer, buffer_size, family,
+                         source_ip, source_port, destination_ip, destination_port,
+                         server_name, server_name_size, tls_version, cipher);
+    }
+    return 0;
+}
@@ -0,0 +1,48 @@
+/**
+ * Copyright (c) 2014 Derek Simkowiak
+ */
+#ifndef TUNNEL_PROXY_H
+#define TUNNEL_PROXY_H
+
+// The PROXY protocol header (haproxy.org/download/1.8/doc/proxy-protocol.txt)
+// that tells a backend who the client really is.  Without it, every
+// connection a backend sees comes from the tunnel host.
+//
+// With proxy_protocol = v1 or v2 in tunnel.ini, the header is the first
+// thing written to the backend, once the handshake is done and before any
+// client data.  It is built in place at the front of the client's empty
+// from_ssl_buffer, so it costs no allocation and no extra write().  v1 is
+// one line of text with the addresses; v2 is binary, and also carries the
+// SNI server name (PP2_TYPE_AUTHORITY) and the TLS version and cipher
+// (PP2_TYPE_SSL).
+
+#include <stddef.h>
+#include <sys/socket.h>
+
+#define TUNNEL_PROXY_OFF  0
+#define TUNNEL_PROXY_V1   1
+#define TUNNEL_PROXY_V2   2
+
+// The longest header tunnel_proxy_header() writes.  (A v2 header with an
+// IPv6 address and a 255-byte server name is 420 bytes.)  buffer_size
+// must be at least this when proxy_protocol is on:
+#define TUNNEL_PROXY_HEADER_MAX 512
+
+// TUNNEL_PROXY_OFF, _V1 or _V2 for "off", "v1" or "v2"; -1 if unknown:
+int tunnel_proxy_version_from_name(const char *name);
+
+// Write a 'version' header for a connection from 'source' to 'destination'
+// (the client's address, and ours) into 'buffer'.  IPv4-mapped IPv6
+// addresses are sent as IPv4.  'server_name' (not NUL-terminated; may be
+// NULL) and the TLS 'tls_version' and 'cipher' names only go in a v2
+// header.  'server_name' may point into 'buffer' itself (at the peeked
+// ClientHello, say); it is moved into place before the rest is written.
+//
+// Returns the header's length, or 0 if it won't fit in 'buffer_size':
+size_t tunnel_proxy_header(char *buffer, size_t buffer_size, int version,
+                           const struct sockaddr *source,
+                           const struct sockaddr *destination,
+                           const char *server_name, size_t server_name_size,
+                           const char *tls_version, const char *cipher);
+
+#endif  // TUNNEL_PROXY_H
@@ -3,10 +3,25 @@
  */
 
 #include "tunnel_server.h"
+#include <signal.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+  #include <cpuid.h>    // for __get_cpuid() and bit_AES
+#endif
 
 static void on_accept(int socket_fd, short event, void *arg);
 static void on_shutdown(int socket_fd, short event, void *arg);
+static void on_drain(int socket_fd, short event, void *arg);
+static void on_drain_deadline(int socket_fd, short event, void *arg);
+static void on_reload(int socket_fd, short event, void *arg);
+static void on_signal(int signal_number, short event, void *arg);
+static void dispatch_socket(TunnelServer *server, int client_socket_fd,
+                            int listener_index);
 static void tunnel_server_free(TunnelServer *server);
+static void free_listeners(TunnelServer *server);
+static void stop_threads(TunnelServer *server);
+static int accept_queue_is_full(TunnelServer *server);
+static int cpu_has_aesni(void);
 
 TunnelServer *tunnel_server_new(const char *ini_filename)
 {
@@ -17,54 +32,34 @@ TunnelServer *tunnel_server_new(const char *ini_filename)
     server = calloc(1, sizeof(*server));
     if (server == NULL) { return NULL; }
 
+    // The caller's reference; each worker thread takes another:
+    server->ref_count = 1;
+
     server->ini_filename = strdup(ini_filename);
     if (server->ini_filename == NULL) {
         tunnel_server_free(server);
         return NULL;
     }
 
-    server->config = tunnel_config_new(server->ini_filename);
-    if (server->config == NULL) {
-        tunnel_server_free(server);
-        return NULL;
-    }
-
-    // Create the CYASSL_CTX:
-    server->cyassl_ctx = CyaSSL_CTX_new(CyaSSLv23_server_method());
-    if ( server->cyassl_ctx == NULL) {
-        tunnel_server_free(server);
-        return NULL;
-    }
-
-    // Load CA certificates into CYASSL_CTX:
-    result =
-     CyaSSL_CTX_load_verify_locations(server->cyassl_ctx,
-                                      server->config->verify_locations, 0);
-    if (result != SSL_SUCCESS) {
-        log(LOG_ERR, "Error loading %s.", server->config->verify_locations);
-        tunnel_server_free(server);
-        return NULL;
-    }
-
-    result =
-     CyaSSL_CTX_use_certificate_file(server->cyassl_ctx,
-                                    server->config->certificate_file,
-                                    SSL_FILETYPE_PEM);
-    if (result != SSL_SUCCESS) {
-        log(LOG_ERR, "Error loading %s.", server->config->certificate_file);
-        tunnel_server_free(server);
-        return NULL;
-    }
-
-    result =
-     CyaSSL_CTX_use_PrivateKey_file(server->cyassl_ctx,
-                                   server->config->PrivateKey_file,
-                                   SSL_FILETYPE_PEM);
-    if (result != SSL_SUCCESS) {
-        log(LOG_ERR, "Error loading %s.", server->config->PrivateKey_file);
+    // The config, and the CYASSL_CTX built from it:
+    server->context = tunnel_context_new(server->ini_filename);
+    if (server->context == NULL) {
         tunnel_server_free(server);
         return NULL;
     }
+    server->config = server->context->config;
+    tunnel_log_set_level(server->config->log_level);
+
+#ifdef CYASSL_AESNI
+    log(LOG_NOTICE, "AES-NI: CyaSSL built with CYASSL_AESNI; CPU support %s.",
+        cpu_has_aesni() ? "detected" : "NOT detected");
+#else
+    log(LOG_NOTICE, "AES-NI: CyaSSL built without CYASSL_AESNI (CPU support %s).",
+        cpu_has_aesni() ? "detected" : "not detected");
+#endif
+#ifndef HAVE_AESGCM
+    log(LOG_NOTICE, "AES-GCM: CyaSSL built without HAVE_AESGCM.");
+#endif
 
     // Create the pthreads mutex and conditional for the worker's job queue:
     server->pending_socket_mutex = calloc(1, sizeof(*(server->pending_socket_mutex)));
@@ -103,24 +98,81 @@ TunnelServer *tunnel_server_new(const char *ini_filename)
         return NULL;
     }
 
+    // The software-only 'event' used to start (and finish) draining:
+    server->on_drain_event =
+     event_new(server->libevent_base, -1 /* dummy fd */,
+              EV_PERSIST, on_drain, server);
+
+    server->drain_deadline_event =
+     evtimer_new(server->libevent_base, on_drain_deadline, server);
+
+    if (server->on_drain_event == NULL || server->drain_deadline_event == NULL) {
+        tunnel_server_free(server);
+        return NULL;
+    }
+
+    // The software-only 'event' used to reload the config:
+    server->on_reload_event =
+     event_new(server->libevent_base, -1 /* dummy fd */,
+              EV_PERSIST, on_reload, server);
+
+    if (server->on_reload_event == NULL) {
+        tunnel_server_free(server);
+        return NULL;
+    }
+
+    // The signals that trigger the three events above:
+    server->on_sigint_event =
+     evsignal_new(server->libevent_base, SIGINT, on_signal, server);
+    server->on_sigterm_event =
+     evsignal_new(server->libevent_base, SIGTERM, on_signal, server);
+    server->on_sighup_event =
+     evsignal_new(server->libevent_base, SIGHUP, on_signal, server);
+
+    if (server->on_sigint_event == NULL || server->on_sigterm_event == NULL ||
+        server->on_sighup_event == NULL) {
+        tunnel_server_free(server);
+        return NULL;
+    }
+
+    // Counters kept by the main thread itself (e.g. rejected connections):
+    server->metrics = tunnel_metrics_new();
+    if (server->metrics == NULL) {
+        tunnel_server_free(server);
+        return NULL;
+    }
+
     server->last_thread_link = NULL;
 
     return server;
 }
 
+// Returns non-zero if the CPU has the AES-NI instructions.  This is the same
+// CPUID check CyaSSL does internally (see ctaocrypt/src/aes.c):
+static int cpu_has_aesni(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    unsigned int eax, ebx, ecx, edx;
+
+    if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) == 0) { return 0; }
+    return (ecx & bit_AES) != 0;
+#else
+    return 0;
+#endif
+}
+
 void tunnel_server_ref(TunnelServer *server)
 {
     if (server == NULL) { return; }
-    server->ref_count++;
+    __atomic_add_fetch(&server->ref_count, 1, __ATOMIC_RELAXED);
 }
 
 void tunnel_server_unref(TunnelServer *server)
 {
     if (server == NULL) { return; }
 
-    server->ref_count--;
-
-    if (server->ref_count == 0) {
+    // The worker threads drop theirs as they exit, concurrently:
+    if (__atomic_sub_fetch(&server->ref_count, 1, __ATOMIC_ACQ_REL) == 0) {
         tunnel_server_free(server);
     }
 }
@@ -129,83 +181,288 @@ static void tunnel_server_free(TunnelServer *server)
 {
     if (server == NULL) { return; }
     
-    // Note: server->on_accept_event is normally free()'d in serve_forever().
-    if (server->on_accept_event != NULL) { event_free(server->on_accept_event); }
+    // Note: the listeners are normally closed and freed in serve_forever().
+    free_listeners(server);
 
     // Free the server and its resources:
     if (server->on_shutdown_event != NULL) { event_free(server->on_shutdown_event); }
+    if (server->on_drain_event != NULL) { event_free(server->on_drain_event); }
+    if (server->on_reload_event != NULL) { event_free(server->on_reload_event); }
+    if (server->on_sigint_event != NULL) { event_free(server->on_sigint_event); }
+    if (server->on_sigterm_event != NULL) { event_free(server->on_sigterm_event); }
+    if (server->on_sighup_event != NULL) { event_free(server->on_sighup_event); }
+    if (server->drain_deadline_event != NULL) { event_free(server->drain_deadline_event); }
     if (server->libevent_base != NULL) { event_base_free(server->libevent_base); }
     if (server->pending_socket_cond != NULL) { free(server->pending_socket_cond); }
     if (server->pending_socket_mutex != NULL) { free(server->pending_socket_mutex); }
-    if (server->cyassl_ctx != NULL) { CyaSSL_CTX_free(server->cyassl_ctx); }
-    if (server->config != NULL) { tunnel_config_free(server->config); }
+    tunnel_context_unref(server->context);
+    tunnel_metrics_free(server->metrics);
     if (server->ini_filename) { free(server->ini_filename); }
     free(server);
 }
 
-void tunnel_server_serve_forever(TunnelServer *server)
+// Parse a listener's address into 'bind_address'.  "*" is the dual-stack
+// wildcard: [::], which also takes IPv4 connections (as ::ffff:a.b.c.d), or
+// 0.0.0.0 if 'ipv6' is 0.  IPv6 addresses may be in brackets:
+static int make_bind_address(const char *name, uint16_t port, int ipv6,
+                             struct sockaddr_storage *bind_address,
+                             socklen_t *address_size)
 {
-    //
-    // Get the listening socket:
-    //
-    int listen_fd;
+    struct sockaddr_in *address4 = (struct sockaddr_in *)bind_address;
+    struct sockaddr_in6 *address6 = (struct sockaddr_in6 *)bind_address;
+    char address[INET6_ADDRSTRLEN];
+    size_t length = strlen(name);
 
-    listen_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (listen_fd < 0) {
-        log_err("socket() failed (result: %d).", listen_fd);
-        return;
+    memset(bind_address, 0, sizeof(*bind_address));
+
+    // Strip the brackets from "[::1]":
+    if (length >= 2 && name[0] == '[' && name[length - 1] == ']') {
+        name++;
+        length -= 2;
+    }
+    if (length >= sizeof(address)) { length = sizeof(address) - 1; }
+    memcpy(address, name, length);
+    address[length] = '\0';
+
+    if (strcmp(address, "*") == 0) {
+        if (ipv6) {
+            address6->sin6_family = AF_INET6;
+            address6->sin6_addr = in6addr_any;
+        } else {
+            address4->sin_family = AF_INET;
+            address4->sin_addr.s_addr = htonl(INADDR_ANY);
+        }
+    } else if (inet_pton(AF_INET, address, &address4->sin_addr) == 1) {
+        address4->sin_family = AF_INET;
+    } else if (inet_pton(AF_INET6, address, &address6->sin6_addr) == 1) {
+        address6->sin6_family = AF_INET6;
+    } else {
+        log(LOG_WARNING, "Unable to parse \"%s\" as an IPv4 or IPv6 address.",
+            name);
+        return -1;
     }
 
-    // libevent sockets must be non-blocking:
-    evutil_make_socket_nonblocking(listen_fd);
+    if (bind_address->ss_family == AF_INET6) {
+        address6->sin6_port = htons(port);
+        *address_size = sizeof(*address6);
+    } else {
+        address4->sin_port = htons(port);
+        *address_size = sizeof(*address4);
+    }
+    return 0;
+}
 
-    //
-    // Bind to the server address:
-    //
-    struct sockaddr_in bind_address;
-    int result;
-    
-    memset(&bind_address, 0, sizeof(bind_address));
+static int is_wildcard_address(const struct sockaddr_storage *address)
+{
+    if (address->ss_family == AF_INET) {
+        return ((const struct sockaddr_in *)address)->sin_addr.s_addr ==
+               htonl(INADDR_ANY);
+    }
+    return address->ss_family == AF_INET6 &&
+           IN6_IS_ADDR_UNSPECIFIED(&((const struct sockaddr_in6 *)address)->sin6_addr);
+}
 
-    bind_address.sin_family = AF_INET;
+static uint16_t address_port(const struct sockaddr_storage *address)
+{
+    if (address->ss_family == AF_INET6) {
+        return ntohs(((const struct sockaddr_in6 *)address)->sin6_port);
+    }
+    return ntohs(((const struct sockaddr_in *)address)->sin_port);
+}
 
-    // Get the bind IP address (or INADDR_ANY if it's "*"):
-    if (strncmp("*", server->config->ssl_server_name, 1) == 0) {
-        bind_address.sin_addr.s_addr = INADDR_ANY;
-    } else {
-        // Try to parse the user-supplied ssl_server_addr:
-        result = inet_pton(AF_INET, server->config->ssl_server_name,
-              &bind_address.sin_addr.s_addr);
-
-        if (result != 1) {
-            // Unable to parse the address.
-            log(LOG_WARNING, "inet_pton() failed to parse \"%s\" (result: %d).",
-                server->config->ssl_server_name, result);
-            close(listen_fd);
-            return;
-        }
+// Does the socket 'bound' serve the listener address 'wanted'?  A "*"
+// socket of either family does, so we can take over from a process that
+// bound 0.0.0.0:
+static int is_same_address(const struct sockaddr_storage *bound,
+                           const struct sockaddr_storage *wanted)
+{
+    if (address_port(bound) != address_port(wanted)) { return 0; }
+    if (is_wildcard_address(wanted)) { return is_wildcard_address(bound); }
+    if (bound->ss_family != wanted->ss_family) { return 0; }
+
+    if (wanted->ss_family == AF_INET) {
+        return ((const struct sockaddr_in *)bound)->sin_addr.s_addr ==
+               ((const struct sockaddr_in *)wanted)->sin_addr.s_addr;
     }
-    bind_address.sin_port = htons(server->config->ssl_server_port);
+    return memcmp(&((const struct sockaddr_in6 *)bound)->sin6_addr,
+                  &((const struct sockaddr_in6 *)wanted)->sin6_addr,
+                  sizeof(struct in6_addr)) == 0;
+}
 
-    result = bind(listen_fd, (struct sockaddr *)&bind_address, sizeof(bind_address));
-    if (result < 0) {
-        log_err("bind() failed.");
-        close(listen_fd);
-        return;
+// Create and bind a listening socket.  Returns -1 on failure:
+static int bind_listener(const char *name, uint16_t port,
+                         const TunnelSocketConfig *profile)
+{
+    struct sockaddr_storage bind_address;
+    socklen_t address_size;
+    int listen_fd, result;
+
+    if (make_bind_address(name, port, 1, &bind_address, &address_size) != 0) {
+        return -1;
+    }
+
+    listen_fd = socket(bind_address.ss_family, SOCK_STREAM, 0);
+    if (listen_fd < 0 && errno == EAFNOSUPPORT && is_wildcard_address(&bind_address)) {
+        // No IPv6 on this host; "*" means all the IPv4 interfaces, then:
+        make_bind_address(name, port, 0, &bind_address, &address_size);
+        listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    }
+    if (listen_fd < 0) {
+        log_err("socket() failed (result: %d).", listen_fd);
+        return -1;
     }
 
     // Set the SO_REUSEADDR flag to true; this prevents the
     // "address is already is use" error when restarting the server quickly.
+    // (It only has an effect if it is set before bind().)
     int reuseaddr_flag = 0x1;
     setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &reuseaddr_flag,
                sizeof(reuseaddr_flag));
 
+    // The [client_socket] buffer sizes, defer_accept and fastopen.  (Those
+    // that need it must be set before listen(); the buffer sizes also set
+    // the window scale the SYN-ACK offers.)
+    if (tunnel_socket_apply_listener(listen_fd, profile) != 0) {
+        log_err("Some [client_socket] options failed on %s:%u.", name, port);
+    }
+
+    // Take IPv4 connections on [::] too, whatever net.ipv6.bindv6only says:
+    if (bind_address.ss_family == AF_INET6) {
+        int v6only_flag = 0;
+        setsockopt(listen_fd, IPPROTO_IPV6, IPV6_V6ONLY, &v6only_flag,
+                   sizeof(v6only_flag));
+    }
+
+    result = bind(listen_fd, (struct sockaddr *)&bind_address, address_size);
+    if (result < 0) {
+        log_err("bind() failed for %s:%u.", name, port);
+        close(listen_fd);
+        return -1;
+    }
+
+    return listen_fd;
+}
+
+// Give each listener a socket handed over by the old process, where one is
+// bound to the same address.  Sockets we have no listener for are closed.
+static void adopt_listeners(TunnelServer *server, int *listen_fds, int fd_count)
+{
+    struct sockaddr_storage bound_address, bind_address;
+    socklen_t address_size;
+    const char *name;
+    uint16_t port;
+    int fd_index, index;
+
+    for (fd_index = 0; fd_index < fd_count; fd_index++) {
+        address_size = sizeof(bound_address);
+        if (getsockname(listen_fds[fd_index], (struct sockaddr *)&bound_address,
+                        &address_size) != 0 ||
+            (bound_address.ss_family != AF_INET &&
+             bound_address.ss_family != AF_INET6)) {
+            memset(&bound_address, 0, sizeof(bound_address));
+        }
+
+        for (index = 0; index < server->listener_count; index++) {
+            tunnel_config_listener_address(server->config, index, NULL, &name, &port);
+            if (server->listeners[index].listen_fd == -1 &&
+                bound_address.ss_family != AF_UNSPEC &&
+                make_bind_address(name, port, 1, &bind_address, &address_size) == 0 &&
+                is_same_address(&bound_address, &bind_address)) {
+                server->listeners[index].listen_fd = listen_fds[fd_index];
+                break;
+            }
+        }
+        if (index == server->listener_count) {
+            log(LOG_WARNING, "The old process listened on port %u, which isn't "
+                "in our config; closing it.", address_port(&bound_address));
+            close(listen_fds[fd_index]);
+        }
+    }
+}
+
+// Bind the listeners that have no socket yet.  Returns -1 if one fails:
+static int bind_listeners(TunnelServer *server)
+{
+    const char *name;
+    uint16_t port;
+    int index;
+
+    for (index = 0; index < server->listener_count; index++) {
+        if (server->listeners[index].listen_fd != -1) { continue; }
+
+        tunnel_config_listener_address(server->config, index, NULL, &name, &port);
+        server->listeners[index].listen_fd = bind_listener(name, port,
+                                                          &server->config->client_socket);
+        if (server->listeners[index].listen_fd == -1) { return -1; }
+    }
+    return 0;
+}
+
+// Close the listeners' sockets (unless a drain already did), and free them:
+static void free_listeners(TunnelServer *server)
+{
+    int index;
+
+    for (index = 0; index < server->listener_count; index++) {
+        TunnelListener *listener = &server->listeners[index];
+
+        if (listener->on_accept_event != NULL) { event_free(listener->on_accept_event); }
+        if (listener->listen_fd != -1) { close(listener->listen_fd); }
+    }
+    free(server->listeners);
+    server->listeners = NULL;
+    server->listener_count = 0;
+}
+
+// Stop accepting on all listeners:
+static void stop_accepting(TunnelServer *server)
+{
+    int index;
+
+    for (index = 0; index < server->listener_count; index++) {
+        if (server->listeners[index].on_accept_event != NULL) {
+            event_del(server->listeners[index].on_accept_event);
+        }
+    }
+}
+
+void tunnel_server_serve_forever(TunnelServer *server)
+{
+    //
+    // Get the listening sockets.  If we're replacing a running process, we
+    // take its sockets, but only once our threads are up: it stops
+    // accepting as soon as it hands them over.
+    //
+    int listen_fds[TUNNEL_LISTENER_MAX];
+    int upgrade_fd = -1;
+    int fd_count;
+    int result;
+
+    server->listener_count = 1 + server->context->listener_count;
+    server->listeners = calloc(server->listener_count, sizeof(*server->listeners));
+    if (server->listeners == NULL) {
+        server->listener_count = 0;
+        return;
+    }
+    for (result = 0; result < server->listener_count; result++) {
+        server->listeners[result].index = result;
+        server->listeners[result].listen_fd = -1;
+        server->listeners[result].server = server;
+    }
+
+    if (server->config->upgrade_socket != NULL) {
+        upgrade_fd = tunnel_upgrade_connect(server->config->upgrade_socket);
+    }
+    if (upgrade_fd == -1 && bind_listeners(server) != 0) {
+        free_listeners(server);
+        return;
+    }
+
     //
     // Launch the worker threads:
     //
     TunnelThread *thread = NULL;
     int index;
-
     for(index = 0 ; index < server->config->thread_count; index++) {
 
         thread = tunnel_thread_new(server);
@@ -217,21 +474,17 @@ void tunnel_server_serve_forever(TunnelServer *server)
         if (thread == NULL || result != 0) {
             // Allocation or launching of the thread failed.
             log(LOG_ERR, "tunnel_thread_[new()/launch()] failed.");
+            tunnel_thread_unref(thread);
 
-            // Free all previously-allocated threads:
-            while(server->thread_list != NULL) {
-
-                thread = list_user_data(server->thread_list);
-                tunnel_thread_unref(thread);
-
-                server->thread_list =
-                 list_delete_link(server->thread_list, server->thread_list);
-            }
+            // Stop all previously-launched threads:
+            stop_threads(server);
 
             break;  // Break out with no threads in the server->thread_list.
         }
 
-        // Success; store and launch the thread instance:
+        // Success; store the thread instance.  The thread_list holds a
+        // reference, so stop_threads() can wait for it:
+        tunnel_thread_ref(thread);
         server->thread_list = list_prepend(server->thread_list, thread);
         
         // FIXME: The reentrant call to event_base_dispatch causes a bug on launch:
@@ -244,41 +497,92 @@ void tunnel_server_serve_forever(TunnelServer *server)
     // Make sure we launched some threads:
     if (server->thread_list == NULL) {
         log(LOG_WARNING, "Launching threads failed.");
-        close(listen_fd);
+        if (upgrade_fd != -1) { close(upgrade_fd); }
+        free_listeners(server);
         return;
     }
-    
+
+    if (upgrade_fd != -1) {
+        fd_count = tunnel_upgrade_receive(upgrade_fd, listen_fds, TUNNEL_LISTENER_MAX);
+        if (fd_count == -1) {
+            // The old process keeps serving; we leave it to it:
+            log(LOG_ERR, "Listener handoff failed.");
+            stop_threads(server);
+            free_listeners(server);
+            return;
+        }
+        adopt_listeners(server, listen_fds, fd_count);
+
+        // Any listeners the old process didn't have:
+        if (bind_listeners(server) != 0) {
+            stop_threads(server);
+            free_listeners(server);
+            return;
+        }
+    }
+
     // Set the last_thread_link to a non-NULL value so we can iterate over it:
     server->last_thread_link = server->thread_list;
 
-    // Allocate an EV_READ event to be notified when a client connects.
-    server->on_accept_event =
-     event_new(server->libevent_base, listen_fd, EV_READ | EV_PERSIST, on_accept,
-              (void *)server);
+    for (index = 0; index < server->listener_count; index++) {
+        TunnelListener *listener = &server->listeners[index];
 
-    if (server->on_accept_event == NULL) {
-        log(LOG_WARNING, "event_new() failed.");
-        close(listen_fd);
-        return;
-    }
+        // libevent sockets must be non-blocking:
+        evutil_make_socket_nonblocking(listener->listen_fd);
 
-    // Add the on_shutdown_event to our event_base:
-    event_add(server->on_accept_event, NULL);
+        // Allocate an EV_READ event to be notified when a client connects.
+        listener->on_accept_event =
+         event_new(server->libevent_base, listener->listen_fd,
+                   EV_READ | EV_PERSIST, on_accept, listener);
+
+        if (listener->on_accept_event == NULL) {
+            log(LOG_WARNING, "event_new() failed.");
+            stop_threads(server);
+            free_listeners(server);
+            return;
+        }
+
+        // Listen to the socket:
+        result = listen(listener->listen_fd, SOMAXCONN);
+        if (result < 0) {
+            log_err("listen() failed.");
+            stop_threads(server);
+            free_listeners(server);
+            return;
+        }
+        event_add(listener->on_accept_event, NULL);
+    }
 
     // Add the on_shutdown_event to our event_base:
     // Bug: software-only events require a timeout, or else they get ignored
     // by libevent (even though event_add() returns zero).
     event_add(server->on_shutdown_event, NULL);
 
-    // Finally, listen to the socket and wait for events:
-    result = listen(listen_fd, SOMAXCONN);
-    if (result < 0) {
-        log_err("listen() failed.");
-        event_free(server->on_accept_event);
-        close(listen_fd);
-        return;
+    // Until now, SIGINT and SIGTERM just end the process:
+    event_add(server->on_sigint_event, NULL);
+    event_add(server->on_sigterm_event, NULL);
+    event_add(server->on_sighup_event, NULL);
+
+
+    // Start the stats endpoint.  It runs on our event_base:
+    if (server->config->admin_socket != NULL) {
+        server->admin = tunnel_admin_new(server, server->config->admin_socket);
+        if (server->admin == NULL) {
+            log(LOG_WARNING, "Can't start the admin endpoint; continuing without it.");
+        }
     }
-    
+
+    // And the socket the next process takes the listeners from:
+    if (server->config->upgrade_socket != NULL) {
+        server->upgrade = tunnel_upgrade_new(server, server->config->upgrade_socket);
+        if (server->upgrade == NULL) {
+            log(LOG_WARNING, "Can't start the upgrade socket; continuing without it.");
+        }
+    }
+
+    tunnel_context_start_health_checks(server->context, server->libevent_base);
+
+    server->start_usec = tunnel_metrics_now_usec();
     log(LOG_NOTICE, "TunnelServer running.");
     
     // Start the event loop for new connections.  This will block
@@ -288,25 +592,52 @@ void tunnel_server_serve_forever(TunnelServer *server)
     // We're back; clean up:
     log(LOG_NOTICE, "TunnelServer stopped.");
 
-    event_free(server->on_accept_event);
-    server->on_accept_event = NULL;
+    tunnel_admin_free(server->admin);
+    server->admin = NULL;
+
+    tunnel_upgrade_free(server->upgrade);
+    server->upgrade = NULL;
+
+    // on_shutdown() told the worker threads to stop; wait until they have:
+    stop_threads(server);
 
-    // Close the listener socket:
-    close(listen_fd);
-//    close(server->listen_fd);
-//    server->listen_fd = -1;
+    // Close the listener sockets, unless a drain already did:
+    free_listeners(server);
+}
+
+// Tell the worker threads to stop (again, if on_shutdown() already did),
+// wait for them to exit, and drop the thread_list's references:
+static void stop_threads(TunnelServer *server)
+{
+    TunnelThread *thread;
+    List *list;
+
+    for (list = server->thread_list; list != NULL; list = list_next(list)) {
+        thread = list_user_data(list);
+        event_active(thread->on_shutdown_event, EV_WRITE, 0);
+    }
+
+    while (server->thread_list != NULL) {
+        thread = list_user_data(server->thread_list);
+        pthread_join(*thread->pthread, NULL);
+        tunnel_thread_unref(thread);
+
+        server->thread_list =
+         list_delete_link(server->thread_list, server->thread_list);
+    }
+    server->last_thread_link = NULL;
 }
 
 
 
 static void on_accept(int socket_fd, short event, void *arg) {
-    TunnelServer *server = (TunnelServer *)arg;
+    TunnelListener *listener = (TunnelListener *)arg;
 
     //
     // accept() the connection:
     //
     int client_socket_fd;
-    struct sockaddr_in client_addr;
+    struct sockaddr_storage client_addr;
     socklen_t client_len = sizeof(client_addr);
 
     client_socket_fd = accept(socket_fd, (struct sockaddr *)&client_addr, &client_len);
@@ -315,18 +646,48 @@ static void on_accept(int socket_fd, short event, void *arg) {
         return;
     }
 
+    dispatch_socket(listener->server, client_socket_fd, listener->index);
+}
+
+// Dispatch a new socket_fd to one of the worker threads:
+static void dispatch_socket(TunnelServer *server, int client_socket_fd,
+                            int listener_index)
+{
     // libevent sockets must be non-blocking:
     evutil_make_socket_nonblocking(client_socket_fd);
 
-    //
-    // Dispatch this new socket_fd to one of the worker threads.
-    //
+    // During a reconnect storm, reset what the workers can't get to soon.
+    // That is much cheaper for everyone than a handshake that times out:
+    if (accept_queue_is_full(server)) {
+        struct linger reset = {1, 0};
+
+        log(LOG_INFO, "Accept queue full; resetting socket %d.", client_socket_fd);
+        setsockopt(client_socket_fd, SOL_SOCKET, SO_LINGER, &reset, sizeof(reset));
+        close(client_socket_fd);
+        tunnel_metrics_add(server->metrics, METRIC_CONNECTIONS_REJECTED, 1);
+        return;
+    }
+
+    PendingSocket *pending = malloc(sizeof(*pending));
+    if (pending == NULL) {
+        log(LOG_WARNING, "Can't allocate a PendingSocket; closing socket %d.",
+            client_socket_fd);
+        close(client_socket_fd);
+        return;
+    }
+    pending->socket_fd = client_socket_fd;
+    pending->context = server->context;
+    tunnel_context_ref(pending->context);
+    pending->listener_index = listener_index;
+    pending->accept_usec =
+     server->config->trace_sample_rate ? tunnel_metrics_now_usec() : 0;
 
     // Start critical section.  We manipulate the shared queue (linked list).
     pthread_mutex_lock(server->pending_socket_mutex);
 
     server->pending_socket_list =
-     list_prepend(server->pending_socket_list, (void *)((long)client_socket_fd));
+     list_prepend(server->pending_socket_list, pending);
+    server->pending_socket_count++;
 
     // End critical section.
     pthread_mutex_unlock(server->pending_socket_mutex);
@@ -336,19 +697,60 @@ static void on_accept(int socket_fd, short event, void *arg) {
     // in a threadsafe way. This depends on evthread_use_pthreads() or similar.
     //
     // We are forced to choose which event_base -- and thus, which worker
-    // thread -- we want to use.  So we do a simple round-robin scheduler.
-    List *thread_link = list_next(server->last_thread_link);
-    if (thread_link == NULL) {
-        // Reached the end of the thread list; start over at the head:
-        thread_link = server->thread_list;
-    }
+    // thread -- we want to use.  So we do a simple round-robin scheduler,
+    // skipping threads that are already at max_pending_handshakes.  (If
+    // they all are, the socket waits for the first handshake to finish.)
+    List *thread_link = server->last_thread_link;
+    TunnelThread *thread;
+    int tries = 0;
+
+    do {
+        thread_link = list_next(thread_link);
+        if (thread_link == NULL) {
+            // Reached the end of the thread list; start over at the head:
+            thread_link = server->thread_list;
+        }
+        thread = list_user_data(thread_link);
+    } while (tunnel_thread_is_full(thread) &&
+             ++tries < server->config->thread_count);
 
-    TunnelThread *thread = list_user_data(thread_link);
+    server->last_thread_link = thread_link;
     
     log(LOG_INFO, "Notifying thread 0x%p of accepted socket %d.", thread, client_socket_fd);
     event_active(thread->on_accept_dispatch_event, EV_WRITE, 0);
 }
 
+// Non-zero if max_pending_handshakes is set and the pending_socket_list
+// already holds that many sockets per thread:
+static int accept_queue_is_full(TunnelServer *server)
+{
+    int max_pending_handshakes = server->config->max_pending_handshakes;
+    int full;
+
+    if (max_pending_handshakes == 0) { return 0; }
+
+    pthread_mutex_lock(server->pending_socket_mutex);
+    full = server->pending_socket_count >=
+            max_pending_handshakes * server->config->thread_count;
+    pthread_mutex_unlock(server->pending_socket_mutex);
+
+    return full;
+}
+
+void tunnel_server_get_metrics(TunnelServer *server, TunnelMetrics *total)
+{
+    TunnelThread *thread;
+    List *list = server->thread_list;
+
+    tunnel_metrics_sum(total, server->metrics);
+
+    while (list != NULL) {
+        thread = list_user_data(list);
+        tunnel_metrics_sum(total, thread->metrics);
+        list = list_next(list);
+    }
+}
+
 void tunnel_server_shutdown(TunnelServer *server)
 {
     // Interrupt the main accept() loop to invoke on_shutdown:
@@ -373,8 +775,20 @@ static void on_shutdown(int socket_fd, short event, void *arg) {
 
     // Remove the server's on_accept and on_shutdown events.  When all
     // events are event_del()'d, the event_base_dispatch() loop will exit.
-    event_del(server->on_accept_event);
+    stop_accepting(server);
     event_del(server->on_shutdown_event);
+    event_del(server->on_sigint_event);
+    event_del(server->on_sigterm_event);
+    event_del(server->on_sighup_event);
+    event_del(server->drain_deadline_event);
+    tunnel_context_stop_health_checks(server->context);
+    if (server->admin != NULL) { event_del(server->admin->on_accept_event); }
+    if (server->upgrade != NULL) {
+        event_del(server->upgrade->on_accept_event);
+        if (server->upgrade->on_request_event != NULL) {
+            event_del(server->upgrade->on_request_event);
+        }
+    }
 
 #if 0
     // Redundant call to kill the server accept loop.  If the events were
@@ -383,3 +797,233 @@ static void on_shutdown(int socket_fd, short event, void *arg) {
 #endif
 }
 
+
+// SIGINT stops right away; SIGTERM drains (see drain_timeout); SIGHUP
+// re-reads the .ini file and certificates:
+static void on_signal(int signal_number, short event, void *arg) {
+    TunnelServer *server = (TunnelServer *)arg;
+
+    log(LOG_NOTICE, "Received signal %d.", signal_number);
+
+    switch (signal_number) {
+    case SIGINT:
+        tunnel_server_shutdown(server);
+        break;
+    case SIGTERM:
+        tunnel_server_drain(server);
+        break;
+    case SIGHUP:
+        tunnel_server_reload(server);
+        break;
+    }
+}
+
+
+void tunnel_server_handoff(TunnelServer *server)
+{
+    // Stop now, rather than on the next loop iteration; from here on each
+    // accept() we make is one the new process didn't get:
+    stop_accepting(server);
+    server->handed_off = 1;
+    tunnel_server_drain(server);
+}
+
+void tunnel_server_drain(TunnelServer *server)
+{
+    // Interrupt the main accept() loop to invoke on_drain:
+    event_active(server->on_drain_event, EV_WRITE, 0);
+}
+
+static void on_drain(int socket_fd, short event, void *arg) {
+    TunnelServer *server = (TunnelServer *)arg;
+    TunnelThread *thread;
+    List *list;
+    int client_socket_fd, drained, index;
+
+    if (!server->draining) {
+        server->draining = 1;
+
+        if (server->config->drain_timeout == 0) {
+            tunnel_server_shutdown(server);
+            return;
+        }
+        log(LOG_NOTICE, "Draining: no new connections; waiting up to %d seconds "
+            "for open ones.", server->config->drain_timeout);
+
+        // Closing a listener would reset the connections still in its
+        // backlog, so take those first.  (Unless they were handed off; then
+        // the backlogs are the new process's.)
+        stop_accepting(server);
+        for (index = 0; index < server->listener_count; index++) {
+            TunnelListener *listener = &server->listeners[index];
+
+            if (listener->listen_fd == -1) { continue; }
+            while (!server->handed_off &&
+                   (client_socket_fd = accept(listener->listen_fd, NULL, NULL)) >= 0) {
+                dispatch_socket(server, client_socket_fd, index);
+            }
+            close(listener->listen_fd);
+            listener->listen_fd = -1;
+        }
+
+        for (list = server->thread_list; list != NULL; list = list_next(list)) {
+            thread = list_user_data(list);
+            event_active(thread->on_drain_event, EV_WRITE, 0);
+        }
+
+        struct timeval deadline = {server->config->drain_timeout, 0};
+        event_add(server->drain_deadline_event, &deadline);
+        return;
+    }
+
+    // A worker thread ran out of clients.  Are they all out, with nothing
+    // left in the pending_socket_list?  (Workers clear 'drained' under the
+    // mutex when they take a socket.)
+    pthread_mutex_lock(server->pending_socket_mutex);
+
+    drained = (server->pending_socket_count == 0);
+    for (list = server->thread_list; list != NULL && drained; list = list_next(list)) {
+        thread = list_user_data(list);
+        drained = __atomic_load_n(&thread->drained, __ATOMIC_RELAXED);
+    }
+
+    pthread_mutex_unlock(server->pending_socket_mutex);
+
+    if (drained) {
+        log(LOG_NOTICE, "Drained; shutting down.");
+        tunnel_server_shutdown(server);
+    }
+}
+
+static void on_drain_deadline(int socket_fd, short event, void *arg) {
+    TunnelServer *server = (TunnelServer *)arg;
+
+    log(LOG_NOTICE, "drain_timeout reached; closing the remaining connections.");
+    tunnel_server_shutdown(server);
+}
+
+
+void tunnel_server_reload(TunnelServer *server)
+{
+    // Interrupt the main accept() loop to invoke on_reload:
+    event_active(server->on_reload_event, EV_WRITE, 0);
+}
+
+// Copy a setting that needs a restart from the running config into the new
+// one, with a warning if it was changed:
+static void keep_int(const char *name, int *new_value, int old_value)
+{
+    if (*new_value != old_value) {
+        log(LOG_WARNING, "Reload: %s can't change without a restart; "
+            "keeping %d.", name, old_value);
+        *new_value = old_value;
+    }
+}
+
+// Returns -1 if a string can't be copied:
+static int keep_string(const char *name, char **new_value, const char *old_value)
+{
+    if (*new_value == old_value) { return 0; }  // Both NULL
+    if (*new_value != NULL && old_value != NULL &&
+        strcmp(*new_value, old_value) == 0) { return 0; }
+
+    log(LOG_WARNING, "Reload: %s can't change without a restart; "
+        "keeping \"%s\".", name, old_value ? old_value : "");
+    free(*new_value);
+    *new_value = NULL;
+    if (old_value == NULL) { return 0; }
+
+    *new_value = strdup(old_value);
+    return (*new_value == NULL) ? -1 : 0;
+}
+
+// The listeners are bound once, and a PendingSocket names its listener by
+// index, so a reload can't add, remove, reorder or move [listener]s:
+static int same_listeners(TunnelConfig *old_config, TunnelConfig *new_config)
+{
+    TunnelListenerConfig *old_listener, *new_listener;
+    List *old_link = old_config->listener_list, *new_link = new_config->listener_list;
+    const char *old_name, *new_name;
+    uint16_t old_port, new_port;
+    int index = 1;
+
+    for (; old_link != NULL && new_link != NULL;
+         old_link = list_next(old_link), new_link = list_next(new_link), index++) {
+        old_listener = list_user_data(old_link);
+        new_listener = list_user_data(new_link);
+        tunnel_config_listener_address(old_config, index, NULL, &old_name, &old_port);
+        tunnel_config_listener_address(new_config, index, NULL, &new_name, &new_port);
+
+        if (strcmp(old_listener->host->server_name, new_listener->host->server_name) != 0 ||
+            strcmp(old_name, new_name) != 0 || old_port != new_port) {
+            return 0;
+        }
+    }
+    return old_link == NULL && new_link == NULL;
+}
+
+static void on_reload(int socket_fd, short event, void *arg) {
+    TunnelServer *server = (TunnelServer *)arg;
+    TunnelContext *context, *old_context = server->context;
+    TunnelConfig *old_config = old_context->config;
+    int ssl_server_port;
+
+    log(LOG_NOTICE, "Reloading %s.", server->ini_filename);
+
+    // This loads the certificate and key files.  It blocks the accept()
+    // loop for a moment, but not the worker threads:
+    context = tunnel_context_new(server->ini_filename);
+    if (context == NULL) {
+        log(LOG_ERR, "Reload failed; keeping the running config.");
+        return;
+    }
+
+    // These are set up once, by serve_forever() and tunnel_thread_new():
+    ssl_server_port = context->config->ssl_server_port;
+    keep_int("ssl_server_port", &ssl_server_port, old_config->ssl_server_port);
+    context->config->ssl_server_port = ssl_server_port;
+    keep_int("thread_count", &context->config->thread_count,
+             old_config->thread_count);
+    keep_int("max_pending_handshakes", &context->config->max_pending_handshakes,
+             old_config->max_pending_handshakes);
+    keep_int("trace_sample_rate", &context->config->trace_sample_rate,
+             old_config->trace_sample_rate);
+    keep_int("edge_triggered", &context->config->edge_triggered,
+             old_config->edge_triggered);
+    keep_int("io_engine", &context->config->io_engine, old_config->io_engine);
+    // (And these are set on the listening sockets, by bind_listeners():)
+    keep_int("[client_socket] defer_accept",
+             &context->config->client_socket.defer_accept,
+             old_config->client_socket.defer_accept);
+    keep_int("[client_socket] fastopen",
+             &context->config->client_socket.fastopen,
+             old_config->client_socket.fastopen);
+    if (keep_string("ssl_server_name", &context->config->ssl_server_name,
+                    old_config->ssl_server_name) != 0 ||
+        keep_string("admin_socket", &context->config->admin_socket,
+                    old_config->admin_socket) != 0 ||
+        keep_string("upgrade_socket", &context->config->upgrade_socket,
+                    old_config->upgrade_socket) != 0) {
+        log(LOG_ERR, "Reload failed; keeping the running config.");
+        tunnel_context_unref(context);
+        return;
+    }
+    if (!same_listeners(old_config, context->config)) {
+        log(LOG_ERR, "Adding, removing or moving a [listener] needs a restart.  "
+            "Reload failed; keeping the running config.");
+        tunnel_context_unref(context);
+        return;
+    }
+
+    // Publish it.  Sockets accepted from here on take a reference to the
+    // new context (see dispatch_socket()); the old one is freed when the
+    // last connection that holds it closes:
+    server->context = context;
+    server->config = context->config;
+    tunnel_log_set_level(server->config->log_level);
+    tunnel_context_stop_health_checks(old_context);
+    tunnel_context_start_health_checks(context, server->libevent_base);
+    tunnel_context_unref(old_context);
+
+    log(LOG_NOTICE, "Reloaded %s.", server->ini_filename);
+}
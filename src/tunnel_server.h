@@ -7,24 +7,73 @@
 
 #include "tunnel.h"
 
-typedef struct TunnelServer {
+// A socket accept()ed by the main thread, waiting in pending_socket_list
+// for a worker thread:
+typedef struct {
+    int socket_fd;
+    uint64_t accept_usec;   // Only set if tracing is on (see tunnel_trace.h)
+    struct TunnelContext *context;  // A reference to the server->context it got
+    int listener_index;             // The TunnelListener it came in on
+} PendingSocket;
+
+// The most listeners ([main] and the [listener] sections).  They're all
+// handed over in one SCM_RIGHTS message on an upgrade:
+#define TUNNEL_LISTENER_MAX 64
+
+// One address the main thread accepts on.  listeners[0] is the [main]
+// ssl_server_name:ssl_server_port, and listeners[i] the i'th [listener]
+// section (see tunnel_context_listener()):
+typedef struct TunnelListener {
+    int index;
+    int listen_fd;          // -1 once closed
+
+    // The event that notifies us of new clients connecting:
+    struct event *on_accept_event;
+
+    struct TunnelServer *server;
+} TunnelListener;
 
-    int listen_fd;
+typedef struct TunnelServer {
 
     // The event_base for accept() and shutdown events:
     struct event_base *libevent_base;
 
-    // The event that notifies us of new clients connecting:
-    struct event *on_accept_event;
+    // What we accept on; set up by serve_forever():
+    TunnelListener *listeners;
+    int listener_count;
 
-    // A software-triggered event from a system signal, for shutdown:
+    // A software-triggered event from SIGINT, for shutdown:
     struct event *on_shutdown_event;
 
+    // A software-triggered event from SIGTERM, to start draining, and from
+    // the worker threads, once they have no clients left:
+    struct event *on_drain_event;
+
+    // A software-triggered event from SIGHUP, to reload the .ini file:
+    struct event *on_reload_event;
+
+    // SIGINT, SIGTERM and SIGHUP, delivered by libevent (outside of signal
+    // context), once serve_forever() is running:
+    struct event *on_sigint_event;
+    struct event *on_sigterm_event;
+    struct event *on_sighup_event;
+
+    // Fires config->drain_timeout seconds into a drain:
+    struct event *drain_deadline_event;
+
+    // Set once a drain has started (see tunnel_server_drain()):
+    int draining;
+
+    // Set once the listeners were handed to a new process (see
+    // tunnel_upgrade.h):
+    int handed_off;
+
     // The last thread that was scheduled to accept a new connection:
     List *last_thread_link;
 
-    // The list of sockets which need to be accept()ed by a worker thread:
+    // The PendingSockets which need to be accept()ed by a worker thread:
     List *pending_socket_list;
+    int pending_socket_count;
 
     // Used to safely hand off socket_fds to worker threads:
     pthread_mutex_t *pending_socket_mutex;
@@ -35,13 +84,26 @@ typedef struct TunnelServer {
     // The list of worker threads for this server:
     List *thread_list;
 
-    // The CyaSSL context shared by all threads:
-    CYASSL_CTX *cyassl_ctx;
-
     char *ini_filename;
 
-    // A struct with the parsed .ini file:
-    struct TunnelConfig *config;
+    // The config and CYASSL_CTX that new connections get.  Only the main
+    // thread reads these; a worker thread uses its client's own context
+    // reference.  (See tunnel_context.h.)
+    struct TunnelContext *context;
+    struct TunnelConfig *config;   // The same as context->config
+
+    // The stats endpoint, or NULL if config->admin_socket isn't set:
+    struct TunnelAdmin *admin;
+
+    // The listener handoff socket, or NULL if config->upgrade_socket isn't
+    // set:
+    struct TunnelUpgrade *upgrade;
+
+    // Counters for the main thread.  Only the main thread writes to them:
+    TunnelMetrics *metrics;
+
+    // When serve_forever() started (from tunnel_metrics_now_usec()):
+    uint64_t start_usec;
 
     unsigned int ref_count;
 
@@ -52,6 +114,24 @@ TunnelServer *tunnel_server_new(const char *ini_filename);
 void tunnel_server_serve_forever(TunnelServer *server);
 void tunnel_server_shutdown(TunnelServer *server);
 
+// Stop accepting, and shut down once the open connections have finished
+// (or after config->drain_timeout seconds):
+void tunnel_server_drain(TunnelServer *server);
+
+// Stop accepting, and drain, leaving the listen backlogs to the process
+// the listeners were handed to:
+void tunnel_server_handoff(TunnelServer *server);
+
+// Re-read the .ini file and the files it names.  New connections get the
+// new settings; open ones keep theirs.  Settings that can't change without
+// a restart (the listening address, thread_count, ...) are kept, with a
+// warning.  If anything fails to load, the old settings stay:
+void tunnel_server_reload(TunnelServer *server);
+
+// Add up the metrics of all worker threads into 'total' (which the caller
+// should zero first).  Call this from the main thread:
+void tunnel_server_get_metrics(TunnelServer *server, TunnelMetrics *total);
+
 void tunnel_server_ref(TunnelServer *server);
 void tunnel_server_unref(TunnelServer *server);
 
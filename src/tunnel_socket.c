@@ -0,0 +1,197 @@
+/**
+ * Copyright (c) 2014 Derek Simkowiak
+ */
+#include "tunnel.h"
+#include <stddef.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+// Which sockets an option is set on:
+#define ON_CONNECTION  0x1
+#define ON_LISTENER    0x2
+
+typedef struct {
+    const char *name;
+    size_t offset;        // Of the int in TunnelSocketConfig
+    int level;            // -1 if this platform doesn't have it
+    int option;
+    int flags;
+} SocketOption;
+
+#define OPTION(name, level, option, flags) \
+    { #name, offsetof(TunnelSocketConfig, name), level, option, flags }
+#define MISSING(name, flags) \
+    { #name, offsetof(TunnelSocketConfig, name), -1, 0, flags }
+
+static const SocketOption socket_options[] = {
+    OPTION(nodelay, IPPROTO_TCP, TCP_NODELAY, ON_CONNECTION),
+#ifdef TCP_QUICKACK
+    OPTION(quickack, IPPROTO_TCP, TCP_QUICKACK, ON_CONNECTION),
+#else
+    MISSING(quickack, ON_CONNECTION),
+#endif
+    OPTION(sndbuf, SOL_SOCKET, SO_SNDBUF, ON_CONNECTION | ON_LISTENER),
+    OPTION(rcvbuf, SOL_SOCKET, SO_RCVBUF, ON_CONNECTION | ON_LISTENER),
+    // (SO_KEEPALIVE is switched on along with this; see set_option().)
+#ifdef TCP_KEEPIDLE
+    OPTION(keepalive, IPPROTO_TCP, TCP_KEEPIDLE, ON_CONNECTION),
+#else
+    OPTION(keepalive, SOL_SOCKET, SO_KEEPALIVE, ON_CONNECTION),
+#endif
+#ifdef TCP_KEEPINTVL
+    OPTION(keepalive_interval, IPPROTO_TCP, TCP_KEEPINTVL, ON_CONNECTION),
+    OPTION(keepalive_count, IPPROTO_TCP, TCP_KEEPCNT, ON_CONNECTION),
+#else
+    MISSING(keepalive_interval, ON_CONNECTION),
+    MISSING(keepalive_count, ON_CONNECTION),
+#endif
+#ifdef TCP_DEFER_ACCEPT
+    OPTION(defer_accept, IPPROTO_TCP, TCP_DEFER_ACCEPT, ON_LISTENER),
+#else
+    MISSING(defer_accept, ON_LISTENER),
+#endif
+#ifdef TCP_FASTOPEN
+    OPTION(fastopen, IPPROTO_TCP, TCP_FASTOPEN, ON_LISTENER),
+#else
+    MISSING(fastopen, ON_LISTENER),
+#endif
+};
+
+#define SOCKET_OPTION_COUNT (sizeof(socket_options) / sizeof(socket_options[0]))
+
+static int *option_value(const TunnelSocketConfig *profile,
+                         const SocketOption *option)
+{
+    return (int *)((char *)profile + option->offset);
+}
+
+int tunnel_socket_parse(TunnelSocketConfig *profile, int listener,
+                        const char *name, const char *value)
+{
+    size_t index;
+
+    for (index = 0; index < SOCKET_OPTION_COUNT; index++) {
+        const SocketOption *option = &socket_options[index];
+
+        if (strcmp(option->name, name) != 0) { continue; }
+        if (option->flags == ON_LISTENER && !listener) { return 0; }
+
+        *option_value(profile, option) = MAX(atoi(value), 0);
+        if (option->level == -1 && *option_value(profile, option) != 0) {
+            log(LOG_WARNING, "%s isn't supported on this platform; ignoring it.",
+                name);
+        }
+        return 1;
+    }
+    return 0;
+}
+
+static int set_option(int socket_fd, const SocketOption *option, int value)
+{
+    int result = 0, on = 1;
+
+    if (option->level == -1) { return 0; }
+
+    if (option->offset == offsetof(TunnelSocketConfig, keepalive)) {
+        result = setsockopt(socket_fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
+        if (option->option == SO_KEEPALIVE) { return result; }
+    }
+    if (setsockopt(socket_fd, option->level, option->option, &value,
+                   sizeof(value)) != 0) {
+        result = -1;
+    }
+    return result;
+}
+
+static int apply(int socket_fd, const TunnelSocketConfig *profile, int flags)
+{
+    int result = 0, saved_errno = 0;
+    size_t index;
+
+    for (index = 0; index < SOCKET_OPTION_COUNT; index++) {
+        const SocketOption *option = &socket_options[index];
+        int value = *option_value(profile, option);
+
+        if (value == 0 || (option->flags & flags) == 0) { continue; }
+        if (set_option(socket_fd, option, value) != 0) {
+            saved_errno = errno;
+            result = -1;
+        }
+    }
+    if (result != 0) { errno = saved_errno; }
+    return result;
+}
+
+int tunnel_socket_apply(int socket_fd, const TunnelSocketConfig *profile)
+{
+    return apply(socket_fd, profile, ON_CONNECTION);
+}
+
+int tunnel_socket_apply_listener(int socket_fd, const TunnelSocketConfig *profile)
+{
+    return apply(socket_fd, profile, ON_LISTENER);
+}
+
+int tunnel_socket_effective(const TunnelSocketConfig *profile,
+                            TunnelSocketConfig *effective)
+{
+    int socket_fd, value, keepalive = 0;
+    socklen_t value_size;
+    size_t index;
+
+    memset(effective, 0, sizeof(*effective));
+
+    socket_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (socket_fd < 0) {
+        log_err("socket() failed.");
+        return -1;
+    }
+
+    if (apply(socket_fd, profile, ON_CONNECTION | ON_LISTENER) != 0) {
+        log_err("Some socket options could not be set.");
+    }
+
+    value_size = sizeof(keepalive);
+    getsockopt(socket_fd, SOL_SOCKET, SO_KEEPALIVE, &keepalive, &value_size);
+
+    for (index = 0; index < SOCKET_OPTION_COUNT; index++) {
+        const SocketOption *option = &socket_options[index];
+
+        value = 0;
+        value_size = sizeof(value);
+        if (option->level == -1 ||
+            getsockopt(socket_fd, option->level, option->option, &value,
+                       &value_size) != 0) {
+            continue;
+        }
+        // The keepalive timings are meaningless with keepalive off:
+        if (option->offset == offsetof(TunnelSocketConfig, keepalive) ||
+            option->offset == offsetof(TunnelSocketConfig, keepalive_interval) ||
+            option->offset == offsetof(TunnelSocketConfig, keepalive_count)) {
+            if (!keepalive) { value = 0; }
+        }
+        // TCP_QUICKACK reads back the socket's current mode, which isn't
+        // what we set; report what was asked for:
+        if (option->offset == offsetof(TunnelSocketConfig, quickack)) {
+            value = profile->quickack;
+        }
+        *option_value(effective, option) = value;
+    }
+
+    close(socket_fd);
+    return 0;
+}
+
+void tunnel_socket_foreach(const TunnelSocketConfig *profile,
+                           void (*callback)(const char *name, int value,
+                                            void *arg),
+                           void *arg)
+{
+    size_t index;
+
+    for (index = 0; index < SOCKET_OPTION_COUNT; index++) {
+        callback(socket_options[index].name,
+                 *option_value(profile, &socket_options[index]), arg);
+    }
+}
@@ -0,0 +1,59 @@
+/**
+ * Copyright (c) 2014 Derek Simkowiak
+ */
+#ifndef TUNNEL_SOCKET_H
+#define TUNNEL_SOCKET_H
+
+// TCP socket options for each side of a connection: the [client_socket]
+// profile for the accepted SSL sockets (and the listeners), and the
+// [backend_socket] profile for the plaintext sockets to the backends.
+//
+// Options a platform lacks (everything but TCP_NODELAY, SO_SNDBUF,
+// SO_RCVBUF and SO_KEEPALIVE is Linux-specific) are skipped.  The kernel
+// may also round or cap what we ask for, so tunnel_socket_effective()
+// reads the values back from a scratch socket; those are what the admin
+// endpoint reports.
+
+// One profile.  0 leaves an option at the kernel's default:
+typedef struct TunnelSocketConfig {
+    int nodelay;                // TCP_NODELAY: no Nagle delay on small writes
+    int quickack;               // TCP_QUICKACK once connected.  (The kernel
+                                // may go back to delayed ACKs later.)
+    int sndbuf;                 // SO_SNDBUF/SO_RCVBUF in bytes.  Setting one
+    int rcvbuf;                 // turns off the kernel's autotuning of it.
+    int keepalive;              // Idle seconds before keepalive probes
+    int keepalive_interval;     // Seconds between probes
+    int keepalive_count;        // Unanswered probes before the reset
+
+    // Listening sockets only ([client_socket]):
+    int defer_accept;           // TCP_DEFER_ACCEPT: seconds to wait for data
+    int fastopen;               // TCP_FASTOPEN: the pending SYN queue length
+} TunnelSocketConfig;
+
+// Set a [client_socket] or [backend_socket] key in 'profile' from 'value'.
+// Returns 0 if 'name' isn't one (or is listener-only, and 'listener' is 0):
+int tunnel_socket_parse(TunnelSocketConfig *profile, int listener,
+                        const char *name, const char *value);
+
+// Apply 'profile' to a connected (or connecting) socket.  Call it before
+// connect() for sndbuf and rcvbuf to size the TCP window.  Returns -1 if an
+// option failed; errno is set, and the rest were still tried:
+int tunnel_socket_apply(int socket_fd, const TunnelSocketConfig *profile);
+
+// Apply the options that matter on a listening socket, before listen():
+// the buffer sizes (accepted sockets inherit them), defer_accept and
+// fastopen.  Returns -1 like tunnel_socket_apply():
+int tunnel_socket_apply_listener(int socket_fd, const TunnelSocketConfig *profile);
+
+// What the kernel actually makes of 'profile', read back from a scratch
+// TCP socket into 'effective'.  Returns -1 (and logs) if it can't tell:
+int tunnel_socket_effective(const TunnelSocketConfig *profile,
+                            TunnelSocketConfig *effective);
+
+// Call 'callback' with each option's name and value in 'profile':
+void tunnel_socket_foreach(const TunnelSocketConfig *profile,
+                           void (*callback)(const char *name, int value,
+                                            void *arg),
+                           void *arg);
+
+#endif  // TUNNEL_SOCKET_H
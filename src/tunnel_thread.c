@@ -12,6 +12,9 @@ static void *tunnel_thread_task(void *ptr);
 // libevent callbacks:
 static void on_shutdown(int socket_fd, short event, void *arg);
 static void on_accept_dispatch(int socket_fd, short event, void *arg);
+static void on_drain(int socket_fd, short event, void *arg);
+static void on_timer_tick(int socket_fd, short event, void *arg);
+static void on_client_timeout(TimerWheelEntry *entry, void *arg);
 
 TunnelThread *tunnel_thread_new(TunnelServer *server)
 {
@@ -45,7 +48,6 @@ TunnelThread *tunnel_thread_new(TunnelServer *server)
               EV_PERSIST, on_accept_dispatch, thread);
 
     if (thread->on_accept_dispatch_event == NULL) {
-        tunnel_server_unref(server);
         event_base_free(thread->libevent_base);
         free(thread->pthread);
         free(thread);
@@ -60,7 +62,6 @@ TunnelThread *tunnel_thread_new(TunnelServer *server)
 
     if (thread->on_shutdown_event == NULL) {
         event_free(thread->on_accept_dispatch_event);
-        tunnel_server_unref(server);
         event_base_free(thread->libevent_base);
         free(thread->pthread);
         free(thread);
@@ -68,6 +69,89 @@ TunnelThread *tunnel_thread_new(TunnelServer *server)
         return NULL;
     }
 
+    // The software-only 'event' used to drain.  It is event_active()'d by
+    // the main thread, and then adds itself:
+    thread->on_drain_event =
+     event_new(thread->libevent_base, -1 /* dummy fd */ ,
+               EV_PERSIST, on_drain, thread);
+
+    if (thread->on_drain_event == NULL) {
+        event_free(thread->on_shutdown_event);
+        event_free(thread->on_accept_dispatch_event);
+        event_base_free(thread->libevent_base);
+        free(thread->pthread);
+        free(thread);
+
+        return NULL;
+    }
+
+    thread->metrics = tunnel_metrics_new();
+    if (thread->metrics == NULL) {
+        event_free(thread->on_drain_event);
+        event_free(thread->on_shutdown_event);
+        event_free(thread->on_accept_dispatch_event);
+        event_base_free(thread->libevent_base);
+        free(thread->pthread);
+        free(thread);
+
+        return NULL;
+    }
+
+    if (server->config->trace_sample_rate > 0) {
+        thread->trace = tunnel_trace_new();
+        if (thread->trace == NULL) {
+            tunnel_metrics_free(thread->metrics);
+            event_free(thread->on_drain_event);
+            event_free(thread->on_shutdown_event);
+            event_free(thread->on_accept_dispatch_event);
+            event_base_free(thread->libevent_base);
+            free(thread->pthread);
+            free(thread);
+
+            return NULL;
+        }
+    }
+
+    // Always there, since a reload may turn the timeouts on:
+    thread->timer_wheel = timer_wheel_new();
+    thread->on_timer_tick_event =
+     event_new(thread->libevent_base, -1 /* dummy fd */,
+               EV_PERSIST, on_timer_tick, thread);
+
+    if (thread->timer_wheel == NULL || thread->on_timer_tick_event == NULL) {
+        if (thread->on_timer_tick_event != NULL) {
+            event_free(thread->on_timer_tick_event);
+        }
+        timer_wheel_free(thread->timer_wheel);
+        tunnel_trace_free(thread->trace);
+        tunnel_metrics_free(thread->metrics);
+        event_free(thread->on_drain_event);
+        event_free(thread->on_shutdown_event);
+        event_free(thread->on_accept_dispatch_event);
+        event_base_free(thread->libevent_base);
+        free(thread->pthread);
+        free(thread);
+
+        return NULL;
+    }
+
+    // This can't change on a reload, and we read it from any thread:
+    thread->max_pending_handshakes = server->config->max_pending_handshakes;
+    thread->edge_triggered = server->config->edge_triggered;
+    if (thread->edge_triggered &&
+        !(event_base_get_features(thread->libevent_base) & EV_FEATURE_ET)) {
+        log(LOG_WARNING, "The %s event method can't do edge_triggered; ignoring it.",
+            event_base_get_method(thread->libevent_base));
+        thread->edge_triggered = 0;
+    }
+
+    if (server->config->io_engine == TUNNEL_IO_ENGINE_URING) {
+        thread->uring = tunnel_uring_new(thread->libevent_base, thread->metrics);
+        if (thread->uring == NULL) {
+            log(LOG_WARNING, "No io_uring; the backend sockets use libevent.");
+        }
+    }
+
     // Grab and reference the passed-in server:
     thread->server = server;
     tunnel_server_ref(thread->server);
@@ -112,10 +196,15 @@ static void tunnel_thread_free(TunnelThread *thread)
 {
     if (thread == NULL) { return; }
 
-    // Drop our reference to the TunnelServer:
-    tunnel_server_unref(thread->server);
-
-    // Free the event_base for this thread:
+    // Free our events and the event_base for this thread:
+    if (thread->on_timer_tick_event != NULL) {
+        event_free(thread->on_timer_tick_event);
+    }
+    timer_wheel_free(thread->timer_wheel);
+    tunnel_uring_free(thread->uring);
+    event_free(thread->on_drain_event);
+    event_free(thread->on_shutdown_event);
+    event_free(thread->on_accept_dispatch_event);
     event_base_free(thread->libevent_base);
 
     // Dereference the server instance:
@@ -127,6 +216,9 @@ static void tunnel_thread_free(TunnelThread *thread)
         log(LOG_WARNING, "TunnelThread 0x%p: client_list not NULL on free().", thread);
     }
 
+    tunnel_metrics_free(thread->metrics);
+    tunnel_trace_free(thread->trace);
+
     // Free the pthread:
     free(thread->pthread);
     thread->pthread = NULL;
@@ -156,6 +248,11 @@ static void *tunnel_thread_task(void *ptr) {
     result = event_add(thread->on_accept_dispatch_event, &one_day);
     result = event_add(thread->on_shutdown_event, &one_day);
 
+    if (thread->on_timer_tick_event != NULL) {
+        struct timeval one_second = {1, 0};
+        result = event_add(thread->on_timer_tick_event, &one_second);
+    }
+
     // Start the event loop.  This will block until killed with a signal.
     log(LOG_INFO, "Event loop started for TunnelThread 0x%p", thread);
 
@@ -176,52 +273,146 @@ static void on_accept_dispatch(int socket_fd, short event, void *arg) {
 
     TunnelThread *thread = (TunnelThread *)arg;
     
-    // The main thread told us there was a new pending socket.  Grab it.
-    // Start critical section.  We manipulate the shared queue (linked list).
+    // The main thread told us there are new pending sockets.  Grab them
+    // all: several event_active() calls made before we get to run are
+    // collapsed into this one callback.
     List *link = NULL;
-    int new_socket_fd = -1;
+    PendingSocket *pending;
+    int new_socket_fd;
+    uint64_t accept_usec = 0;
+    TunnelContext *context = NULL;
+    int listener_index = 0;
 
     log(LOG_INFO, "TunnelThread 0x%p received dispatch event.", thread);
-    pthread_mutex_lock(thread->server->pending_socket_mutex);
 
-    if (thread->server->pending_socket_list != NULL) {
-        // Grab the first link off the list:
-        link = thread->server->pending_socket_list;
+    for (;;) {
+        new_socket_fd = -1;
+
+        // Leave the rest queued for the other threads (or for us, when one
+        // of our handshakes finishes):
+        if (tunnel_thread_is_full(thread)) {
+            log(LOG_DEBUG, "TunnelThread 0x%p has %d pending handshakes.",
+                thread, thread->pending_handshakes);
+            return;
+        }
+
+        // Start critical section.  We manipulate the shared queue (linked list).
+        pthread_mutex_lock(thread->server->pending_socket_mutex);
+
+        if (thread->server->pending_socket_list != NULL) {
+            // Grab the first link off the list:
+            link = thread->server->pending_socket_list;
+
+            // Grab the socket_fd from that link:
+            pending = list_user_data(link);
+            new_socket_fd = pending->socket_fd;
+            accept_usec = pending->accept_usec;
+            context = pending->context;
+            listener_index = pending->listener_index;
+            free(pending);
+
+            // Now delete this link:
+            thread->server->pending_socket_list =
+             list_delete_link(thread->server->pending_socket_list, link);
+            thread->server->pending_socket_count--;
+
+            // We have a client again (see the main thread's on_drain()):
+            __atomic_store_n(&thread->drained, 0, __ATOMIC_RELAXED);
+        }
+
+        // End critical section.
+        pthread_mutex_unlock(thread->server->pending_socket_mutex);
+
+        // If we didn't get a new socket_fd, we're done.  (Another thread
+        // may have taken it.)
+        if (new_socket_fd == -1) { return; }
+
+        tunnel_metrics_add(thread->metrics, METRIC_CONNECTIONS_ACCEPTED, 1);
+
+        // We got a new socket, so connect a client to it.  The client takes
+        // its own reference to the context:
+        TunnelClient *client = tunnel_client_new(thread, thread->server, context,
+                                                 listener_index);
+        tunnel_context_unref(context);
+        if (client == NULL) {
+            log(LOG_WARNING, "Can't allocate a new TunnelClient instance.");
+            close(new_socket_fd);
+            continue;  // Can't work without a *client.
+        }
+
+        if (client->traced) {
+            tunnel_trace_record_at(thread->trace, client->id, TRACE_ACCEPT,
+                                   new_socket_fd, accept_usec);
+            tunnel_trace(client, TRACE_DISPATCH, new_socket_fd);
+        }
+
+        thread->client_list = list_prepend(thread->client_list, client);
+        // thread->client_list now points to the new list node.
+
+        // (The backend connect waits for the ClientHello; see
+        // handle_client_hello().)
+        int result = tunnel_client_connect(client, new_socket_fd, thread->client_list);
+        if (result != 0) {
+            log(LOG_WARNING, "Can't connect client.");
+
+            // The client never saved its link, so remove it ourselves.
+            // (It has already closed the socket.)
+            thread->client_list =
+             list_delete_link(thread->client_list, thread->client_list);
+            tunnel_client_free(client);
+            continue;
+        }
+    }
+}
 
-        // Grab the socket_fd from that link:
-        new_socket_fd = (long int)list_user_data(link);
 
-        // Now delete this link:
-        thread->server->pending_socket_list =
-         list_delete_link(thread->server->pending_socket_list, link);
-    }
+static void on_drain(int socket_fd, short event, void *arg) {
+    TunnelThread *thread = (TunnelThread *)arg;
+    TunnelClient *client;
+    List *link, *next_link;
+    uint64_t byte_count;
+    int first_pass = !thread->draining;
 
-    // End critical section.
-    pthread_mutex_unlock(thread->server->pending_socket_mutex);
+    if (first_pass) {
+        struct timeval one_second = {1, 0};
 
-    // If we didn't get a new socket_fd, just return:
-    if (new_socket_fd == -1) {
-        log(LOG_WARNING, "TunnelThread 0x%p did not find new_socket_fd.", thread);
-        return;
+        log(LOG_INFO, "TunnelThread 0x%p draining.", thread);
+        thread->draining = 1;
+        event_add(thread->on_drain_event, &one_second);
     }
 
-    // We got a new socket, so connect a client to it:
-    TunnelClient *client = tunnel_client_new(thread, thread->server);
-    if (client == NULL) {
-        log(LOG_WARNING, "Can't allocate a new TunnelClient instance.");
-        return;  // Can't work without a *client.
+    // Close the clients that have moved no bytes for drain_quiet_time
+    // seconds, have no request outstanding and have nothing buffered.
+    // (Handshakes are left to finish, or time out.)  The rest are left to
+    // finish, or to the server's drain_timeout:
+    for (link = thread->client_list; link != NULL; link = next_link) {
+        next_link = list_next(link);
+        client = list_user_data(link);
+        byte_count = client->bytes_from_ssl + client->bytes_from_dest;
+
+        if (first_pass || byte_count != client->drain_byte_count) {
+            client->drain_quiet_seconds = 0;
+        } else {
+            client->drain_quiet_seconds++;
+        }
+        client->drain_byte_count = byte_count;
+
+        if (client->drain_quiet_seconds >= client->context->config->drain_quiet_time &&
+            !client->request_pending &&
+            client->ssl_accept_state == SSL_SUCCESS &&
+            fifo_bytes_used(client->from_ssl_fifo) == 0 &&
+            fifo_bytes_used(client->from_dest_fifo) == 0) {
+            log_client(LOG_DEBUG, client, "Quiet; closing to drain.");
+            tunnel_client_close(client);
+            continue;
+        }
     }
 
-    thread->client_list = list_prepend(thread->client_list, client);
-    // thread->client_list now points to the new list node.
-
-    int result = tunnel_client_connect(client, new_socket_fd, thread->client_list);
-    if (result != 0) {
-        log(LOG_WARNING, "Can't connect client.");
-        tunnel_client_free(client);
-        return;
+    // Tell the main thread when we're empty:
+    if (thread->client_list == NULL) {
+        __atomic_store_n(&thread->drained, 1, __ATOMIC_RELAXED);
+        event_active(thread->server->on_drain_event, EV_WRITE, 0);
     }
-
 }
 
 
@@ -229,21 +420,27 @@ static void on_shutdown(int socket_fd, short event, void *arg) {
     // Bug: We ignore timeouts (forced on us by event_add()):
     if (event & EV_TIMEOUT) { return; }
 
-    // Tell all the clients to close connection and free themselves:
-    TunnelClient *client;
+    // Tell all the clients to close connection and free themselves.  Each
+    // one unlinks itself from the client_list.  (No close_notify here: a
+    // transfer cut short should look cut short.)
     TunnelThread *thread = (TunnelThread *)arg;
-    List *client_list = thread->client_list;
 
-    while (client_list != NULL) {
-        client = list_user_data(client_list);
-        // Close all sockets and free resources:
-        tunnel_client_disconnect_and_free(client);
-        client_list = list_next(client_list);
+    while (thread->client_list != NULL) {
+        tunnel_client_disconnect_and_free(list_user_data(thread->client_list));
     }
 
+    // Their cancelled io_uring requests still have to complete (which
+    // finishes freeing them):
+    tunnel_uring_stop(thread->uring);
+
     // Remove the thread's on_shutdown event.  When all events
     // are event_del()'d, the event_base_dispatch() loop will exit.
     event_del(thread->on_shutdown_event);
+    event_del(thread->on_accept_dispatch_event);
+    event_del(thread->on_drain_event);
+    if (thread->on_timer_tick_event != NULL) {
+        event_del(thread->on_timer_tick_event);
+    }
 
 #if 0
     // Redundant call to kill the worker loop.  If the shutdown event
@@ -253,3 +450,43 @@ static void on_shutdown(int socket_fd, short event, void *arg) {
 }
 
 
+void tunnel_thread_begin_handshake(TunnelThread *thread)
+{
+    __atomic_store_n(&thread->pending_handshakes,
+                     thread->pending_handshakes + 1, __ATOMIC_RELAXED);
+}
+
+
+void tunnel_thread_end_handshake(TunnelThread *thread)
+{
+    int was_full = tunnel_thread_is_full(thread);
+
+    __atomic_store_n(&thread->pending_handshakes,
+                     thread->pending_handshakes - 1, __ATOMIC_RELAXED);
+
+    // The main thread skipped us while we were full, so sockets may be
+    // waiting.  (An empty pending_socket_list costs one callback.)
+    if (was_full) {
+        event_active(thread->on_accept_dispatch_event, EV_WRITE, 0);
+    }
+}
+
+
+int tunnel_thread_is_full(TunnelThread *thread)
+{
+    return thread->max_pending_handshakes > 0 &&
+           __atomic_load_n(&thread->pending_handshakes, __ATOMIC_RELAXED)
+            >= thread->max_pending_handshakes;
+}
+
+
+static void on_timer_tick(int socket_fd, short event, void *arg) {
+    TunnelThread *thread = (TunnelThread *)arg;
+
+    timer_wheel_advance(thread->timer_wheel, on_client_timeout, thread);
+}
+
+
+static void on_client_timeout(TimerWheelEntry *entry, void *arg) {
+    tunnel_client_timeout((TunnelClient *)entry->user_data);
+}
@@ -10,7 +10,7 @@ typedef struct TunnelThread {
     pthread_t *pthread;
     struct event_base *libevent_base;
 
-    struct TunnelServer *server;   // Shared CA/cert / config for all threads
+    struct TunnelServer *server;   // Shared by all threads
     List *client_list;             // The list of clients running in this thread
 
     // A software-triggered event from the main thread, for new sockets:
@@ -19,6 +19,43 @@ typedef struct TunnelThread {
     // A software-triggered event from the main thread, for shutdown:
     struct event *on_shutdown_event;
 
+    // A software-triggered event from the main thread, to start draining.
+    // After that it fires once a second to close clients that went quiet:
+    struct event *on_drain_event;
+    int draining;
+    int drained;        // Set while draining with no clients left
+
+    // Counters for this thread.  Only this thread writes to them:
+    TunnelMetrics *metrics;
+
+    // Events for this thread's sampled clients, or NULL if tracing is off:
+    TunnelTrace *trace;
+
+    // Clients between tunnel_client_connect() and the end of their SSL
+    // handshake.  Only this thread writes it; the main thread reads it to
+    // skip full threads.  (See config->max_pending_handshakes.)
+    int pending_handshakes;
+    int max_pending_handshakes;
+
+    // Set if config->edge_triggered is on and the event_base can do it.
+    // Then each client socket's read and write events are EV_ET and
+    // EV_PERSIST, and are registered once, when the socket is: the
+    // callbacks run until EAGAIN and then wait for the next edge, instead
+    // of re-arming the write events with event_add() (an epoll_ctl()) for
+    // every write.  Bytes waiting on a socket that is already writable
+    // won't make an edge, so those writes are run with event_active():
+    int edge_triggered;
+
+    // Set if config->io_engine is io_uring and the kernel can do it.  Then
+    // the clients' destination sockets are read and written with requests
+    // on this ring, not readiness events (see tunnel_uring.h):
+    TunnelUring *uring;
+
+    // The handshake and idle timeouts of this thread's clients, advanced
+    // once a second by on_timer_tick_event:
+    TimerWheel *timer_wheel;
+    struct event *on_timer_tick_event;
+
     unsigned int ref_count;
 
 } TunnelThread;
@@ -27,6 +64,15 @@ typedef struct TunnelThread {
 TunnelThread *tunnel_thread_new(struct TunnelServer *server);
 int tunnel_thread_launch(TunnelThread *thread);
 
+// Count a client's handshake in or out of thread->pending_handshakes.  When
+// a slot frees up, the thread goes back for sockets it left queued:
+void tunnel_thread_begin_handshake(TunnelThread *thread);
+void tunnel_thread_end_handshake(TunnelThread *thread);
+
+// Non-zero if the thread is at config->max_pending_handshakes.  Safe to
+// call from any thread:
+int tunnel_thread_is_full(TunnelThread *thread);
+
 void tunnel_thread_ref(TunnelThread *thread);
 void tunnel_thread_unref(TunnelThread *thread);
 
@@ -0,0 +1,73 @@
+/**
+ * Copyright (c) 2014 Derek Simkowiak
+ */
+#include "tunnel_trace.h"
+#include <stdlib.h>
+
+static const struct {
+    const char *name;
+    char phase;
+} event_info[TRACE_EVENT_COUNT] = {
+    [TRACE_ACCEPT]               = {"connection", 'B'},
+    [TRACE_DISPATCH]             = {"dispatch", 'i'},
+    [TRACE_DEST_CONNECT_BEGIN]   = {"dest_connect", 'B'},
+    [TRACE_DEST_CONNECT_END]     = {"dest_connect", 'E'},
+    [TRACE_HANDSHAKE_BEGIN]      = {"handshake", 'B'},
+    [TRACE_CLIENT_HELLO]         = {"client_hello", 'i'},
+    [TRACE_HANDSHAKE_STEP]       = {"handshake_step", 'i'},
+    [TRACE_HANDSHAKE_END]        = {"handshake", 'E'},
+    [TRACE_FIRST_BYTE_FROM_SSL]  = {"first_byte_from_ssl", 'i'},
+    [TRACE_FIRST_BYTE_FROM_DEST] = {"first_byte_from_dest", 'i'},
+    [TRACE_FIFO_STALL]           = {"fifo_stall", 'i'},
+    [TRACE_THROTTLE]             = {"throttle", 'i'},
+    [TRACE_CLOSE]                = {"connection", 'E'},
+};
+
+TunnelTrace *tunnel_trace_new(void)
+{
+    return calloc(1, sizeof(TunnelTrace));
+}
+
+void tunnel_trace_free(TunnelTrace *trace)
+{
+    if (trace == NULL) { return; }
+    free(trace);
+}
+
+size_t tunnel_trace_snapshot(TunnelTrace *trace, TraceEvent *events)
+{
+    uint64_t first, head, index, oldest_intact;
+
+    head = __atomic_load_n(&trace->head, __ATOMIC_ACQUIRE);
+    first = (head > TUNNEL_TRACE_RING_SIZE) ? head - TUNNEL_TRACE_RING_SIZE : 0;
+
+    for (index = first; index < head; index++) {
+        events[index - first] = trace->events[index % TUNNEL_TRACE_RING_SIZE];
+    }
+
+    // The owner may have lapped us while we copied.  Its next write goes
+    // to the slot of event (new head - RING_SIZE), so only the events
+    // after that one are intact:
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    oldest_intact = __atomic_load_n(&trace->head, __ATOMIC_RELAXED);
+    oldest_intact = (oldest_intact >= TUNNEL_TRACE_RING_SIZE)
+                     ? oldest_intact - TUNNEL_TRACE_RING_SIZE + 1 : 0;
+
+    if (oldest_intact <= first) { return head - first; }
+    if (oldest_intact >= head) { return 0; }
+
+    memmove(events, &events[oldest_intact - first],
+            (head - oldest_intact) * sizeof(*events));
+    return head - oldest_intact;
+}
+
+
+const char *tunnel_trace_event_name(TraceEventType type)
+{
+    return event_info[type].name;
+}
+
+char tunnel_trace_event_phase(TraceEventType type)
+{
+    return event_info[type].phase;
+}
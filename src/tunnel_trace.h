@@ -0,0 +1,96 @@
+/**
+ * Copyright (c) 2014 Derek Simkowiak
+ */
+#ifndef TUNNEL_TRACE_H
+#define TUNNEL_TRACE_H
+
+// Sampled per-connection event timelines.
+//
+// With trace_sample_rate = N in tunnel.ini, one TunnelClient in N is
+// "traced": the callbacks in tunnel_client.c and tunnel_thread.c record
+// timestamped events for it (accept, dispatch, destination connect, each
+// handshake step, first bytes, stalls, close) into a ring owned by its
+// TunnelThread.  For every other client, tunnel_trace() is one
+// not-taken branch on client->traced.
+//
+// Only the owning thread writes to a ring.  Other threads read a copy with
+// tunnel_trace_snapshot(), which drops any events that were overwritten
+// while it was copying.  The admin endpoint serves the snapshot as Chrome
+// trace-event JSON ("GET /trace"; open it in chrome://tracing or Perfetto).
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include "tunnel_metrics.h"   // For tunnel_metrics_now_usec()
+
+// Events kept per thread; older ones are overwritten:
+#define TUNNEL_TRACE_RING_SIZE 4096
+
+typedef enum {
+    TRACE_ACCEPT,               // The main thread accept()ed the socket
+    TRACE_DISPATCH,             // A worker thread took the socket
+    TRACE_DEST_CONNECT_BEGIN,
+    TRACE_DEST_CONNECT_END,
+    TRACE_HANDSHAKE_BEGIN,      // Waiting for the ClientHello
+    TRACE_CLIENT_HELLO,         // arg: the record size
+    TRACE_HANDSHAKE_STEP,       // arg: the CyaSSL_accept() WANT error
+    TRACE_HANDSHAKE_END,        // arg: 0, or the CyaSSL error on failure
+    TRACE_FIRST_BYTE_FROM_SSL,
+    TRACE_FIRST_BYTE_FROM_DEST,
+    TRACE_FIFO_STALL,           // arg: 0 for from_ssl_fifo, 1 for from_dest
+    TRACE_THROTTLE,             // arg: 0 for the SSL socket, 1 for dest
+    TRACE_CLOSE,
+    TRACE_EVENT_COUNT
+} TraceEventType;
+
+typedef struct {
+    uint64_t usec;          // From tunnel_metrics_now_usec()
+    uint64_t client_id;     // TunnelClient->id
+    int32_t type;           // TraceEventType
+    int32_t arg;
+} TraceEvent;
+
+typedef struct TunnelTrace {
+    uint64_t head;          // The number of events ever recorded
+    TraceEvent events[TUNNEL_TRACE_RING_SIZE];
+} TunnelTrace;
+
+
+TunnelTrace *tunnel_trace_new(void);
+void tunnel_trace_free(TunnelTrace *trace);
+
+// Copy up to TUNNEL_TRACE_RING_SIZE of the newest events, oldest first,
+// into 'events'.  Safe to call from any thread.  Returns the count:
+size_t tunnel_trace_snapshot(TunnelTrace *trace, TraceEvent *events);
+
+// The event's name, and its Chrome trace-event phase ('B'egin, 'E'nd, or
+// 'i'nstant).  Begin/end events with the same name make one span:
+const char *tunnel_trace_event_name(TraceEventType type);
+char tunnel_trace_event_phase(TraceEventType type);
+
+// May only be called by the thread that owns 'trace':
+static inline void tunnel_trace_record_at(TunnelTrace *trace,
+                                          uint64_t client_id,
+                                          TraceEventType type, int arg,
+                                          uint64_t usec)
+{
+    TraceEvent *event = &trace->events[trace->head % TUNNEL_TRACE_RING_SIZE];
+
+    event->usec = usec;
+    event->client_id = client_id;
+    event->type = type;
+    event->arg = arg;
+
+    // Publish the event to tunnel_trace_snapshot():
+    __atomic_store_n(&trace->head, trace->head + 1, __ATOMIC_RELEASE);
+}
+
+// Record an event for a TunnelClient, if it is sampled:
+#define tunnel_trace(client, type, arg)  do { \
+    if (__builtin_expect((client)->traced, 0)) { \
+        tunnel_trace_record_at((client)->thread->trace, (client)->id, \
+                               (type), (arg), tunnel_metrics_now_usec()); \
+    } \
+} while (0)
+
+#endif  // TUNNEL_TRACE_H
@@ -0,0 +1,494 @@
+/**
+ * Copyright (c) 2014 Derek Simkowiak
+ */
+
+#define _GNU_SOURCE      // for struct ucred (SO_PEERCRED)
+#include "tunnel_upgrade.h"
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <libgen.h>      // for dirname()
+
+// The new process connects, and when it's ready to accept, sends one
+// UPGRADE_REQUEST byte.  The old process replies with one UpgradeHeader
+// with its listening sockets attached, then session_cache_size bytes from
+// CyaSSL_memsave_session_cache():
+#define UPGRADE_REQUEST 'U'
+#define UPGRADE_MAGIC 0x544e4c31   // "TNL1"
+
+typedef struct {
+    uint32_t magic;
+    int32_t session_cache_size;    // 0 if there is none
+} UpgradeHeader;
+
+// How long either side waits on the other's reply before giving up:
+#define UPGRADE_TIMEOUT_SEC 5
+
+// How long the old process waits for the request.  The new process sends
+// it once its worker threads are up:
+#define UPGRADE_REQUEST_TIMEOUT_SEC 120
+
+static void on_upgrade_accept(int socket_fd, short event, void *arg);
+static void on_upgrade_request(int socket_fd, short event, void *arg);
+static void close_request(TunnelUpgrade *upgrade);
+
+
+static int set_address(struct sockaddr_un *address, const char *socket_path)
+{
+    if (strlen(socket_path) >= sizeof(address->sun_path)) {
+        log(LOG_ERR, "upgrade_socket path is too long: %s", socket_path);
+        return -1;
+    }
+    memset(address, 0, sizeof(*address));
+    address->sun_family = AF_UNIX;
+    strcpy(address->sun_path, socket_path);
+    return 0;
+}
+
+// Whoever is on the other end of 'socket_fd' gets our listening sockets (or
+// gives us theirs), so it must be running as our user:
+static int is_our_user(int socket_fd)
+{
+    struct ucred credentials;
+    socklen_t size = sizeof(credentials);
+
+    if (getsockopt(socket_fd, SOL_SOCKET, SO_PEERCRED, &credentials, &size) != 0) {
+        log_err("getsockopt(SO_PEERCRED) failed.");
+        return 0;
+    }
+    if (credentials.uid != geteuid()) {
+        log(LOG_WARNING, "The process on the upgrade socket (pid %d) runs as uid "
+            "%d, not %d.", (int)credentials.pid, (int)credentials.uid,
+            (int)geteuid());
+        return 0;
+    }
+    return 1;
+}
+
+// Non-zero if 'socket_fd' is a listening TCP socket, i.e. something we can
+// accept() clients on:
+static int is_listening_socket(int socket_fd)
+{
+    struct sockaddr_storage address;
+    socklen_t size = sizeof(address);
+    int type = 0, listening = 0;
+    socklen_t option_size = sizeof(int);
+
+    if (getsockopt(socket_fd, SOL_SOCKET, SO_TYPE, &type, &option_size) != 0 ||
+        type != SOCK_STREAM) {
+        return 0;
+    }
+    option_size = sizeof(int);
+    if (getsockopt(socket_fd, SOL_SOCKET, SO_ACCEPTCONN, &listening,
+                   &option_size) != 0 || !listening) {
+        return 0;
+    }
+    if (getsockname(socket_fd, (struct sockaddr *)&address, &size) != 0) {
+        return 0;
+    }
+    return address.ss_family == AF_INET || address.ss_family == AF_INET6;
+}
+
+// The socket file's directory decides who can put a socket of their own in
+// its place, so it must be ours and writable only by us (e.g. not /tmp).
+// It's created if it doesn't exist yet:
+static int check_directory(const char *socket_path)
+{
+    struct stat directory_stat;
+    char *path, *directory;
+    int result = -1;
+
+    path = strdup(socket_path);
+    if (path == NULL) { return -1; }
+    directory = dirname(path);
+
+    if (mkdir(directory, S_IRWXU) != 0 && errno != EEXIST) {
+        log_err("Can't create the upgrade_socket directory %s.", directory);
+    } else if (stat(directory, &directory_stat) != 0) {
+        log_err("stat() failed for %s.", directory);
+    } else if (directory_stat.st_uid != geteuid() ||
+               (directory_stat.st_mode & (S_IWGRP | S_IWOTH)) != 0) {
+        log(LOG_ERR, "The upgrade_socket directory %s must belong to uid %d and "
+            "be writable only by it.", directory, (int)geteuid());
+    } else {
+        result = 0;
+    }
+
+    free(path);
+    return result;
+}
+
+static void set_timeouts(int socket_fd)
+{
+    struct timeval timeout = {UPGRADE_TIMEOUT_SEC, 0};
+
+    setsockopt(socket_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(socket_fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+}
+
+// Read exactly 'size' bytes.  Returns -1 on error or EOF:
+static int read_fully(int socket_fd, char *buffer, size_t size)
+{
+    ssize_t result;
+
+    while (size > 0) {
+        result = read(socket_fd, buffer, size);
+        if (result < 0 && errno == EINTR) { continue; }
+        if (result <= 0) { return -1; }
+        buffer += result;
+        size -= result;
+    }
+    return 0;
+}
+
+static int write_fully(int socket_fd, const char *buffer, size_t size)
+{
+    ssize_t result;
+
+    while (size > 0) {
+        result = write(socket_fd, buffer, size);
+        if (result < 0 && errno == EINTR) { continue; }
+        if (result <= 0) { return -1; }
+        buffer += result;
+        size -= result;
+    }
+    return 0;
+}
+
+
+int tunnel_upgrade_connect(const char *socket_path)
+{
+    struct sockaddr_un address;
+    int socket_fd;
+
+    if (set_address(&address, socket_path) != 0 ||
+        check_directory(socket_path) != 0) {
+        return -1;
+    }
+
+    socket_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (socket_fd < 0) {
+        log_err("socket() failed.");
+        return -1;
+    }
+    set_timeouts(socket_fd);
+
+    // Nobody there (ENOENT, ECONNREFUSED) is the normal case for a cold
+    // start:
+    if (connect(socket_fd, (struct sockaddr *)&address, sizeof(address)) != 0) {
+        close(socket_fd);
+        return -1;
+    }
+    if (!is_our_user(socket_fd)) {
+        close(socket_fd);
+        return -1;
+    }
+    log(LOG_NOTICE, "Found a running server on %s; taking over its listeners.",
+        socket_path);
+    return socket_fd;
+}
+
+int tunnel_upgrade_receive(int upgrade_fd, int *listen_fds, int max_fds)
+{
+    UpgradeHeader header;
+    char control[CMSG_SPACE(sizeof(int) * TUNNEL_LISTENER_MAX)];
+    struct iovec iov = {&header, sizeof(header)};
+    struct msghdr message;
+    struct cmsghdr *cmsg;
+    char *session_cache;
+    char request = UPGRADE_REQUEST;
+    int fd_count = 0, fd_index, received_count;
+
+    if (write_fully(upgrade_fd, &request, 1) != 0) {
+        log_err("Can't ask for the listeners.");
+        close(upgrade_fd);
+        return -1;
+    }
+
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+
+    if (recvmsg(upgrade_fd, &message, MSG_WAITALL) != (ssize_t)sizeof(header) ||
+        header.magic != UPGRADE_MAGIC) {
+        log(LOG_WARNING, "No listeners in the reply.");
+        close(upgrade_fd);
+        return -1;
+    }
+
+    for (cmsg = CMSG_FIRSTHDR(&message); cmsg != NULL;
+         cmsg = CMSG_NXTHDR(&message, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+            continue;
+        }
+        received_count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (fd_index = 0; fd_index < received_count; fd_index++) {
+            int listen_fd;
+
+            memcpy(&listen_fd, CMSG_DATA(cmsg) + fd_index * sizeof(int),
+                   sizeof(int));
+            if (!is_listening_socket(listen_fd)) {
+                log(LOG_WARNING, "The old process sent a socket that isn't a "
+                    "listening TCP socket; closing it.");
+                close(listen_fd);
+            } else if (fd_count < max_fds) {
+                listen_fds[fd_count++] = listen_fd;
+            } else {
+                close(listen_fd);
+            }
+        }
+    }
+    if (fd_count == 0) {
+        log(LOG_WARNING, "No listeners in the reply.");
+        close(upgrade_fd);
+        return -1;
+    }
+
+    // The session cache is a bonus; the listener is what matters.  (A
+    // cache from a differently-built CyaSSL is refused by its size check.)
+#ifdef PERSIST_SESSION_CACHE
+    if (header.session_cache_size > 0) {
+        session_cache = malloc(header.session_cache_size);
+        if (session_cache != NULL &&
+            read_fully(upgrade_fd, session_cache, header.session_cache_size) == 0 &&
+            CyaSSL_memrestore_session_cache(session_cache,
+                                            header.session_cache_size) == SSL_SUCCESS) {
+            log(LOG_NOTICE, "Restored the SSL session cache (%d bytes).",
+                header.session_cache_size);
+        } else {
+            log(LOG_WARNING, "Couldn't restore the SSL session cache.");
+        }
+        free(session_cache);
+    }
+#endif
+
+    close(upgrade_fd);
+    return fd_count;
+}
+
+
+TunnelUpgrade *tunnel_upgrade_new(TunnelServer *server, const char *socket_path)
+{
+    TunnelUpgrade *upgrade;
+    struct sockaddr_un bind_address;
+    struct stat socket_stat;
+    int result;
+
+    if (set_address(&bind_address, socket_path) != 0 ||
+        check_directory(socket_path) != 0) {
+        return NULL;
+    }
+
+    upgrade = calloc(1, sizeof(*upgrade));
+    if (upgrade == NULL) { return NULL; }
+
+    upgrade->server = server;
+    upgrade->listen_fd = -1;
+
+    upgrade->socket_path = strdup(socket_path);
+    if (upgrade->socket_path == NULL) {
+        tunnel_upgrade_free(upgrade);
+        return NULL;
+    }
+
+    upgrade->listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (upgrade->listen_fd < 0) {
+        log_err("socket() failed.");
+        tunnel_upgrade_free(upgrade);
+        return NULL;
+    }
+    evutil_make_socket_nonblocking(upgrade->listen_fd);
+
+    // Replace the socket file of the previous process (or a stale one):
+    unlink(upgrade->socket_path);
+
+    result = bind(upgrade->listen_fd, (struct sockaddr *)&bind_address,
+                  sizeof(bind_address));
+    if (result < 0 || stat(upgrade->socket_path, &socket_stat) != 0) {
+        log_err("bind() failed for %s.", upgrade->socket_path);
+        tunnel_upgrade_free(upgrade);
+        return NULL;
+    }
+    upgrade->socket_inode = socket_stat.st_ino;
+
+    // Only our user may connect (and is_our_user() checks who did):
+    chmod(upgrade->socket_path, S_IRUSR | S_IWUSR);
+
+    result = listen(upgrade->listen_fd, 4);
+    if (result < 0) {
+        log_err("listen() failed for %s.", upgrade->socket_path);
+        tunnel_upgrade_free(upgrade);
+        return NULL;
+    }
+
+    upgrade->on_accept_event =
+     event_new(server->libevent_base, upgrade->listen_fd, EV_READ | EV_PERSIST,
+               on_upgrade_accept, upgrade);
+    if (upgrade->on_accept_event == NULL) {
+        tunnel_upgrade_free(upgrade);
+        return NULL;
+    }
+    event_add(upgrade->on_accept_event, NULL);
+
+    log(LOG_NOTICE, "Upgrade socket listening on %s.", upgrade->socket_path);
+    return upgrade;
+}
+
+void tunnel_upgrade_free(TunnelUpgrade *upgrade)
+{
+    struct stat socket_stat;
+
+    if (upgrade == NULL) { return; }
+
+    if (upgrade->on_accept_event != NULL) { event_free(upgrade->on_accept_event); }
+    close_request(upgrade);
+
+    if (upgrade->listen_fd >= 0) {
+        close(upgrade->listen_fd);
+
+        // After a handoff, the file belongs to the new process:
+        if (stat(upgrade->socket_path, &socket_stat) == 0 &&
+            socket_stat.st_ino == upgrade->socket_inode) {
+            unlink(upgrade->socket_path);
+        }
+    }
+
+    if (upgrade->socket_path != NULL) { free(upgrade->socket_path); }
+    free(upgrade);
+}
+
+
+static void on_upgrade_accept(int socket_fd, short event, void *arg)
+{
+    TunnelUpgrade *upgrade = (TunnelUpgrade *)arg;
+    struct timeval timeout = {UPGRADE_REQUEST_TIMEOUT_SEC, 0};
+    int client_fd;
+
+    client_fd = accept(socket_fd, NULL, NULL);
+    if (client_fd < 0) { return; }
+
+    if (!is_our_user(client_fd)) {
+        close(client_fd);
+        return;
+    }
+
+    // One at a time:
+    if (upgrade->on_request_event != NULL) {
+        log(LOG_WARNING, "A new process is already taking over; refusing another.");
+        close(client_fd);
+        return;
+    }
+    log(LOG_NOTICE, "A new process connected to %s.", upgrade->socket_path);
+
+    // Keep accepting until it asks:
+    evutil_make_socket_nonblocking(client_fd);
+    upgrade->on_request_event =
+     event_new(upgrade->server->libevent_base, client_fd, EV_READ,
+               on_upgrade_request, upgrade);
+    if (upgrade->on_request_event == NULL) {
+        close(client_fd);
+        return;
+    }
+    event_add(upgrade->on_request_event, &timeout);
+}
+
+static void close_request(TunnelUpgrade *upgrade)
+{
+    if (upgrade->on_request_event == NULL) { return; }
+
+    close(event_get_fd(upgrade->on_request_event));
+    event_free(upgrade->on_request_event);
+    upgrade->on_request_event = NULL;
+}
+
+static void on_upgrade_request(int client_fd, short event, void *arg)
+{
+    TunnelUpgrade *upgrade = (TunnelUpgrade *)arg;
+    TunnelServer *server = upgrade->server;
+    UpgradeHeader header;
+    char control[CMSG_SPACE(sizeof(int) * TUNNEL_LISTENER_MAX)];
+    struct iovec iov = {&header, sizeof(header)};
+    struct msghdr message;
+    struct cmsghdr *cmsg;
+    char *session_cache = NULL;
+    char request = 0;
+    int listen_fds[TUNNEL_LISTENER_MAX];
+    int fd_count = 0, index;
+
+    if ((event & EV_TIMEOUT) || read(client_fd, &request, 1) != 1 ||
+        request != UPGRADE_REQUEST) {
+        log(LOG_NOTICE, "The new process went away without the listener.");
+        close_request(upgrade);
+        return;
+    }
+
+    // Already draining (or handed off): the new process binds its own.
+    for (index = 0; index < server->listener_count && fd_count < TUNNEL_LISTENER_MAX;
+         index++) {
+        if (server->listeners[index].listen_fd != -1) {
+            listen_fds[fd_count++] = server->listeners[index].listen_fd;
+        }
+    }
+    if (fd_count == 0) {
+        log(LOG_NOTICE, "A new process asked for the listeners, but they're closed.");
+        close_request(upgrade);
+        return;
+    }
+
+    // The rest is a one-off exchange, so a blocking socket with a timeout:
+    fcntl(client_fd, F_SETFL, fcntl(client_fd, F_GETFL) & ~O_NONBLOCK);
+    set_timeouts(client_fd);
+
+    header.magic = UPGRADE_MAGIC;
+    header.session_cache_size = 0;
+#ifdef PERSIST_SESSION_CACHE
+    header.session_cache_size = CyaSSL_get_session_cache_memsize();
+    if (header.session_cache_size > 0) {
+        session_cache = malloc(header.session_cache_size);
+        if (session_cache == NULL ||
+            CyaSSL_memsave_session_cache(session_cache,
+                                         header.session_cache_size) != SSL_SUCCESS) {
+            header.session_cache_size = 0;
+        }
+    }
+    if (header.session_cache_size < 0) { header.session_cache_size = 0; }
+#endif
+
+    memset(&message, 0, sizeof(message));
+    memset(control, 0, sizeof(control));
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = CMSG_SPACE(sizeof(int) * fd_count);
+
+    cmsg = CMSG_FIRSTHDR(&message);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fd_count);
+    memcpy(CMSG_DATA(cmsg), listen_fds, sizeof(int) * fd_count);
+
+    if (sendmsg(client_fd, &message, 0) != (ssize_t)sizeof(header)) {
+        log_err("sendmsg() failed; keeping the listeners.");
+        free(session_cache);
+        close_request(upgrade);
+        return;
+    }
+
+    // From here on the new process may be accept()ing too.  Failing to
+    // send the cache doesn't change that:
+    if (header.session_cache_size > 0 &&
+        write_fully(client_fd, session_cache, header.session_cache_size) != 0) {
+        log_err("Sending the session cache failed.");
+    }
+    free(session_cache);
+    close_request(upgrade);
+
+    log(LOG_NOTICE, "Handed %d listener(s) to a new process; draining.", fd_count);
+
+    // Nobody else will connect here; the new process has its own:
+    event_del(upgrade->on_accept_event);
+
+    tunnel_server_handoff(server);
+}
@@ -0,0 +1,67 @@
+/**
+ * Copyright (c) 2014 Derek Simkowiak
+ */
+#ifndef TUNNEL_UPGRADE_H
+#define TUNNEL_UPGRADE_H
+
+// Listener handoff, for replacing the binary without dropping connections
+// (config->upgrade_socket).
+//
+// A running server listens on a Unix domain socket.  A new process started
+// with the same upgrade_socket connects to it at startup, launches its
+// threads, and then asks for the listeners.  The old one sends back its
+// listening sockets (SCM_RIGHTS, in one message), and its CyaSSL session
+// cache if CyaSSL was built with --enable-savesession.  The new process
+// accepts on those sockets right away (matching each one to its own
+// listeners by address), and the old one stops accepting and drains (see
+// tunnel_server_drain()).  The kernel's listen backlog is never closed, so
+// no SYN is dropped in between.
+//
+// Each side checks that the other runs as the same user (SO_PEERCRED), and
+// the new process only adopts sockets that are listening on TCP.  The socket
+// file's directory must be private to that user.
+//
+// Like the admin endpoint, the old side runs entirely in the main thread,
+// on the TunnelServer's libevent_base.
+
+#include "tunnel.h"
+#include <sys/types.h>   // for ino_t
+
+struct TunnelServer;
+
+typedef struct TunnelUpgrade {
+    int listen_fd;
+    char *socket_path;
+    ino_t socket_inode;     // So we only unlink() our own socket file
+
+    // The event that notifies us of a new process connecting:
+    struct event *on_accept_event;
+
+    // The connected new process, waiting for it to ask for the listener.
+    // NULL if there's none:
+    struct event *on_request_event;
+
+    struct TunnelServer *server;
+} TunnelUpgrade;
+
+
+// Connect to a running server on 'socket_path'.  Returns the connection,
+// or -1 if there is no server there:
+int tunnel_upgrade_connect(const char *socket_path);
+
+// Ask the server on 'upgrade_fd' (from tunnel_upgrade_connect()) for its
+// listening sockets, store up to 'max_fds' of them in 'listen_fds', and
+// close 'upgrade_fd'.  Returns how many it stored, or -1 if the handoff
+// failed.  Also restores the old server's session cache.  The old server
+// stops accepting as soon as it has sent the sockets:
+int tunnel_upgrade_receive(int upgrade_fd, int *listen_fds, int max_fds);
+
+// Bind and listen on 'socket_path', to hand server->listeners to the next
+// process.  Returns NULL on failure:
+TunnelUpgrade *tunnel_upgrade_new(struct TunnelServer *server,
+                                  const char *socket_path);
+
+// Stop listening, remove the socket file (if it's still ours), and free:
+void tunnel_upgrade_free(TunnelUpgrade *upgrade);
+
+#endif  // TUNNEL_UPGRADE_H
@@ -0,0 +1,439 @@
+/**
+ * Copyright (c) 2014 Derek Simkowiak
+ */
+
+#include "tunnel.h"
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+
+#ifdef __NR_io_uring_setup
+  #include <linux/io_uring.h>
+  #define HAVE_IO_URING 1
+
+  #ifndef IORING_SQ_CQ_OVERFLOW
+    #define IORING_SQ_CQ_OVERFLOW (1U << 1)     // (5.8)
+  #endif
+#endif
+
+// Submission queue entries per thread.  (Each client has at most two
+// requests in flight, and a cancel for each.)  The completion queue is
+// URING_CQ_FACTOR times bigger; the kernel keeps what doesn't fit, too:
+#define URING_ENTRIES 1024
+#define URING_CQ_FACTOR 4
+
+// Registered buffer pairs per thread, so clients per thread that get them:
+#define URING_BUFFER_PAIRS 1024
+
+
+int tunnel_io_engine_from_name(const char *name)
+{
+    if (strcasecmp(name, "libevent") == 0) { return TUNNEL_IO_ENGINE_LIBEVENT; }
+    if (strcasecmp(name, "io_uring") == 0) { return TUNNEL_IO_ENGINE_URING; }
+    return -1;
+}
+
+
+#ifdef HAVE_IO_URING
+
+// libevent callbacks:
+static void on_completion(int socket_fd, short event, void *arg);
+static void on_submit(int socket_fd, short event, void *arg);
+
+static void *map_ring(TunnelUring *uring, size_t size, off_t offset)
+{
+    void *map = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, uring->fd, offset);
+    return (map == MAP_FAILED) ? NULL : map;
+}
+
+static void close_ring(TunnelUring *uring)
+{
+    if (uring->sqes != NULL) { munmap(uring->sqes, uring->sqes_size); }
+    if (uring->cq_ring != NULL) { munmap(uring->cq_ring, uring->cq_ring_size); }
+    if (uring->sq_ring != NULL) { munmap(uring->sq_ring, uring->sq_ring_size); }
+    if (uring->fd >= 0) { close(uring->fd); }
+    uring->fd = -1;
+}
+
+static int open_ring(TunnelUring *uring)
+{
+    struct io_uring_params params;
+    char *sq_ring, *cq_ring;
+
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = URING_ENTRIES * URING_CQ_FACTOR;
+
+    uring->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    if (uring->fd < 0) {
+        log_err("io_uring_setup() failed.");
+        return -1;
+    }
+
+    // Sockets must be polled by the kernel, not waited on by its worker
+    // threads (5.7), and completions must never be dropped (5.5):
+    if (!(params.features & IORING_FEAT_FAST_POLL) ||
+        !(params.features & IORING_FEAT_NODROP)) {
+        log(LOG_WARNING, "This kernel's io_uring is too old (it needs 5.7).");
+        close_ring(uring);
+        return -1;
+    }
+
+    uring->sq_entries = params.sq_entries;
+    uring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    uring->cq_ring_size = params.cq_off.cqes +
+                          params.cq_entries * sizeof(struct io_uring_cqe);
+    uring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    uring->sq_ring = map_ring(uring, uring->sq_ring_size, IORING_OFF_SQ_RING);
+    uring->cq_ring = map_ring(uring, uring->cq_ring_size, IORING_OFF_CQ_RING);
+    uring->sqes = map_ring(uring, uring->sqes_size, IORING_OFF_SQES);
+    if (uring->sq_ring == NULL || uring->cq_ring == NULL || uring->sqes == NULL) {
+        log_err("mmap() of the io_uring failed.");
+        close_ring(uring);
+        return -1;
+    }
+
+    sq_ring = uring->sq_ring;
+    uring->sq_tail = (unsigned *)(sq_ring + params.sq_off.tail);
+    uring->sq_mask = (unsigned *)(sq_ring + params.sq_off.ring_mask);
+    uring->sq_flags = (unsigned *)(sq_ring + params.sq_off.flags);
+    uring->sq_array = (unsigned *)(sq_ring + params.sq_off.array);
+    cq_ring = uring->cq_ring;
+    uring->cq_head = (unsigned *)(cq_ring + params.cq_off.head);
+    uring->cq_tail = (unsigned *)(cq_ring + params.cq_off.tail);
+    uring->cq_mask = (unsigned *)(cq_ring + params.cq_off.ring_mask);
+    uring->cqes = (struct io_uring_cqe *)(cq_ring + params.cq_off.cqes);
+    return 0;
+}
+
+// An empty table of URING_BUFFER_PAIRS pairs, for tunnel_uring_register()
+// to fill in.  Leaves pair_count at 0 if the kernel can't:
+static void register_buffer_table(TunnelUring *uring)
+{
+#ifdef IORING_RSRC_REGISTER_SPARSE
+    struct io_uring_rsrc_register table;
+    int pair;
+
+    uring->free_pairs = malloc(URING_BUFFER_PAIRS * sizeof(*uring->free_pairs));
+    if (uring->free_pairs == NULL) { return; }
+
+    memset(&table, 0, sizeof(table));
+    table.nr = 2 * URING_BUFFER_PAIRS;
+    table.flags = IORING_RSRC_REGISTER_SPARSE;
+    if (syscall(__NR_io_uring_register, uring->fd, IORING_REGISTER_BUFFERS2,
+                &table, sizeof(table)) != 0) {
+        log(LOG_INFO, "No registered buffers for io_uring: %s.", strerror(errno));
+        free(uring->free_pairs);
+        uring->free_pairs = NULL;
+        return;
+    }
+
+    uring->pair_count = URING_BUFFER_PAIRS;
+    for (pair = URING_BUFFER_PAIRS - 1; pair >= 0; pair--) {
+        uring->free_pairs[uring->free_pair_count++] = pair;
+    }
+#endif
+}
+
+TunnelUring *tunnel_uring_new(struct event_base *libevent_base,
+                              TunnelMetrics *metrics)
+{
+    TunnelUring *uring;
+
+    uring = calloc(1, sizeof(*uring));
+    if (uring == NULL) { return NULL; }
+    uring->fd = -1;
+    uring->metrics = metrics;
+
+    if (open_ring(uring) != 0) {
+        free(uring);
+        return NULL;
+    }
+    register_buffer_table(uring);
+
+    // The ring's fd is readable while completions are waiting.  (libevent
+    // wants it non-blocking; io_uring_enter() doesn't care.)
+    evutil_make_socket_nonblocking(uring->fd);
+    uring->on_completion_event =
+     event_new(libevent_base, uring->fd, EV_READ | EV_PERSIST, on_completion,
+               uring);
+
+    // The software-only 'event' that submits.  It is only ever
+    // event_active()'d from this thread, so it is never added:
+    uring->on_submit_event =
+     event_new(libevent_base, -1 /* dummy fd */, 0x0, on_submit, uring);
+
+    if (uring->on_completion_event == NULL || uring->on_submit_event == NULL ||
+        event_add(uring->on_completion_event, NULL) != 0) {
+        log(LOG_WARNING, "event_new() failed.");
+        tunnel_uring_free(uring);
+        return NULL;
+    }
+
+    return uring;
+}
+
+void tunnel_uring_free(TunnelUring *uring)
+{
+    if (uring == NULL) { return; }
+
+    tunnel_uring_stop(uring);
+    if (uring->on_completion_event != NULL) { event_free(uring->on_completion_event); }
+    if (uring->on_submit_event != NULL) { event_free(uring->on_submit_event); }
+
+    // (This also drops the registered buffers.)
+    close_ring(uring);
+    free(uring->free_pairs);
+    free(uring);
+}
+
+
+// Hand each waiting completion to its op's callback:
+static void reap(TunnelUring *uring)
+{
+    struct io_uring_cqe *cqe;
+    TunnelUringOp *op;
+    unsigned head;
+    int result;
+
+    for (;;) {
+        head = *uring->cq_head;
+        if (head == __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE)) {
+            // Completions that didn't fit wait in the kernel until we ask:
+            if (!(__atomic_load_n(uring->sq_flags, __ATOMIC_RELAXED) &
+                  IORING_SQ_CQ_OVERFLOW) ||
+                syscall(__NR_io_uring_enter, uring->fd, 0, 0,
+                        IORING_ENTER_GETEVENTS, NULL, 0) < 0 ||
+                head == __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE)) {
+                return;
+            }
+        }
+
+        cqe = &uring->cqes[head & *uring->cq_mask];
+        op = (TunnelUringOp *)(uintptr_t)cqe->user_data;
+        result = cqe->res;
+        __atomic_store_n(uring->cq_head, head + 1, __ATOMIC_RELEASE);
+
+        uring->in_flight--;
+        tunnel_metrics_add(uring->metrics, METRIC_URING_COMPLETIONS, 1);
+
+        // (A cancel's own completion has no op.)  The callback may free
+        // the op's owner, so it goes last:
+        if (op != NULL) {
+            op->in_flight = 0;
+            op->callback(op, result);
+        }
+    }
+}
+
+static void on_completion(int socket_fd, short event, void *arg) {
+    TunnelUring *uring = (TunnelUring *)arg;
+
+    reap(uring);
+}
+
+static void on_submit(int socket_fd, short event, void *arg) {
+    TunnelUring *uring = (TunnelUring *)arg;
+
+    tunnel_uring_submit(uring);
+}
+
+void tunnel_uring_submit(TunnelUring *uring)
+{
+    int result;
+
+    while (uring->to_submit > 0) {
+        result = syscall(__NR_io_uring_enter, uring->fd, uring->to_submit, 0, 0,
+                         NULL, 0);
+        if (result < 0 && errno == EINTR) { continue; }
+        if (result <= 0) {
+            // What's left goes with the next submit:
+            log_err("io_uring_enter() failed with %u requests queued.",
+                    uring->to_submit);
+            return;
+        }
+        tunnel_metrics_add(uring->metrics, METRIC_URING_SUBMITS, 1);
+        uring->to_submit -= result;
+    }
+}
+
+void tunnel_uring_stop(TunnelUring *uring)
+{
+    if (uring == NULL || uring->on_completion_event == NULL) { return; }
+
+    tunnel_uring_submit(uring);
+    while (uring->in_flight > 0) {
+        if (syscall(__NR_io_uring_enter, uring->fd, 0, 1,
+                    IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR) {
+            log_err("io_uring_enter() failed with %u requests in flight.",
+                    uring->in_flight);
+            break;
+        }
+        reap(uring);
+    }
+    event_del(uring->on_completion_event);
+}
+
+// The next free submission queue entry, cleared, or NULL if the queue is
+// full even after submitting.  The first one in a pass schedules the
+// submit:
+static struct io_uring_sqe *next_sqe(TunnelUring *uring)
+{
+    unsigned tail, index;
+
+    if (uring->to_submit == uring->sq_entries) {
+        tunnel_uring_submit(uring);
+        if (uring->to_submit == uring->sq_entries) { return NULL; }
+    }
+    if (uring->to_submit == 0) {
+        event_active(uring->on_submit_event, EV_WRITE, 0);
+    }
+
+    tail = *uring->sq_tail;
+    index = tail & *uring->sq_mask;
+    uring->sq_array[index] = index;
+    __atomic_store_n(uring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    uring->to_submit++;
+    uring->in_flight++;
+
+    memset(&uring->sqes[index], 0, sizeof(uring->sqes[index]));
+    return &uring->sqes[index];
+}
+
+static int queue_rw(TunnelUring *uring, TunnelUringOp *op, int opcode,
+                    int fixed_opcode, int fd, char *data, size_t size,
+                    int pair, int buffer)
+{
+    struct io_uring_sqe *sqe = next_sqe(uring);
+
+    if (sqe == NULL) { return -1; }
+
+    sqe->opcode = (pair >= 0) ? fixed_opcode : opcode;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t)data;
+    sqe->len = size;
+    if (pair >= 0) { sqe->buf_index = 2 * pair + buffer; }
+    sqe->user_data = (uintptr_t)op;
+    op->in_flight = 1;
+    return 0;
+}
+
+int tunnel_uring_read(TunnelUring *uring, TunnelUringOp *op, int fd,
+                      char *data, size_t size, int pair, int buffer)
+{
+    return queue_rw(uring, op, IORING_OP_READ, IORING_OP_READ_FIXED,
+                    fd, data, size, pair, buffer);
+}
+
+int tunnel_uring_write(TunnelUring *uring, TunnelUringOp *op, int fd,
+                       char *data, size_t size, int pair, int buffer)
+{
+    return queue_rw(uring, op, IORING_OP_WRITE, IORING_OP_WRITE_FIXED,
+                    fd, data, size, pair, buffer);
+}
+
+int tunnel_uring_cancel(TunnelUring *uring, TunnelUringOp *op)
+{
+    struct io_uring_sqe *sqe;
+
+    if (!op->in_flight) { return 0; }
+
+    // (next_sqe() has already submitted, and tried again:)
+    sqe = next_sqe(uring);
+    if (sqe == NULL) {
+        log(LOG_WARNING, "The io_uring is full; can't cancel.");
+        return -1;
+    }
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = (uintptr_t)op;
+    sqe->user_data = 0;
+    return 0;
+}
+
+int tunnel_uring_register(TunnelUring *uring, char *buffers[2], size_t size)
+{
+#ifdef IORING_RSRC_REGISTER_SPARSE
+    struct io_uring_rsrc_update2 update;
+    struct iovec iovecs[2];
+    int pair, result;
+
+    if (uring->free_pair_count == 0) { return -1; }
+    pair = uring->free_pairs[--uring->free_pair_count];
+
+    iovecs[0].iov_base = buffers[0];
+    iovecs[0].iov_len = size;
+    iovecs[1].iov_base = buffers[1];
+    iovecs[1].iov_len = size;
+    memset(&update, 0, sizeof(update));
+    update.offset = 2 * pair;
+    update.data = (uintptr_t)iovecs;
+    update.nr = 2;
+
+    // (It fails with ENOMEM past RLIMIT_MEMLOCK.)
+    result = syscall(__NR_io_uring_register, uring->fd,
+                     IORING_REGISTER_BUFFERS_UPDATE, &update, sizeof(update));
+    if (result == 2) { return pair; }
+
+    log(LOG_DEBUG, "Can't register buffers with io_uring: %s.",
+        (result < 0) ? strerror(errno) : "partly");
+    tunnel_uring_unregister(uring, pair);
+#endif
+    return -1;
+}
+
+void tunnel_uring_unregister(TunnelUring *uring, int pair)
+{
+#ifdef IORING_RSRC_REGISTER_SPARSE
+    struct io_uring_rsrc_update2 update;
+    struct iovec iovecs[2];
+
+    if (pair < 0) { return; }
+
+    // Empty slots.  Nothing may be in flight on them:
+    memset(iovecs, 0, sizeof(iovecs));
+    memset(&update, 0, sizeof(update));
+    update.offset = 2 * pair;
+    update.data = (uintptr_t)iovecs;
+    update.nr = 2;
+    if (syscall(__NR_io_uring_register, uring->fd,
+                IORING_REGISTER_BUFFERS_UPDATE, &update, sizeof(update)) < 0) {
+        log_err("Can't unregister io_uring buffers.");
+    }
+    uring->free_pairs[uring->free_pair_count++] = pair;
+#endif
+}
+
+#else  // HAVE_IO_URING
+
+TunnelUring *tunnel_uring_new(struct event_base *libevent_base,
+                              TunnelMetrics *metrics)
+{
+    log(LOG_WARNING, "io_uring isn't available on this platform.");
+    return NULL;
+}
+
+// (Never called without a TunnelUring.)
+void tunnel_uring_stop(TunnelUring *uring) {}
+void tunnel_uring_free(TunnelUring *uring) {}
+int tunnel_uring_register(TunnelUring *uring, char *buffers[2], size_t size)
+{
+    return -1;
+}
+void tunnel_uring_unregister(TunnelUring *uring, int pair) {}
+int tunnel_uring_read(TunnelUring *uring, TunnelUringOp *op, int fd,
+                      char *data, size_t size, int pair, int buffer)
+{
+    return -1;
+}
+int tunnel_uring_write(TunnelUring *uring, TunnelUringOp *op, int fd,
+                       char *data, size_t size, int pair, int buffer)
+{
+    return -1;
+}
+int tunnel_uring_cancel(TunnelUring *uring, TunnelUringOp *op) { return 0; }
+void tunnel_uring_submit(TunnelUring *uring) {}
+
+#endif  // HAVE_IO_URING
@@ -0,0 +1,120 @@
+/**
+ * Copyright (c) 2014 Derek Simkowiak
+ */
+#ifndef TUNNEL_URING_H
+#define TUNNEL_URING_H
+
+// A worker thread's io_uring, for its backend sockets (io_engine = io_uring
+// in tunnel.ini).
+//
+// With it, the plaintext side of each TunnelClient moves its bytes with
+// requests instead of readiness events: a read into the from_dest FIFO's
+// free space and a write out of the from_ssl FIFO's used space, at most one
+// of each in flight per client (see start_dest_read() in tunnel_client.c).
+// Requests queued during one pass of the event loop go to the kernel
+// together, with one io_uring_enter() from the on_submit_event at the end
+// of the pass.  The ring's fd is registered with the thread's event_base,
+// so the same loop that runs the SSL side reaps the completions, and hands
+// each one to its TunnelUringOp's callback.
+//
+// Each client's two buffers are registered with the ring (two slots of a
+// sparse table) when it connects to its backend, so the kernel doesn't pin
+// their pages for every request.  A kernel without sparse tables (before
+// 5.19), a full table, or RLIMIT_MEMLOCK just means plain reads and writes.
+//
+// The SSL side stays on libevent: CyaSSL does its own socket I/O.
+
+#include <stddef.h>
+#include "tunnel_metrics.h"
+
+struct event_base;
+
+// config->io_engine:
+#define TUNNEL_IO_ENGINE_LIBEVENT  0
+#define TUNNEL_IO_ENGINE_URING     1
+
+// "libevent" or "io_uring" (any case).  -1 for anything else:
+int tunnel_io_engine_from_name(const char *name);
+
+typedef struct TunnelUringOp TunnelUringOp;
+
+// 'result' is the request's: bytes moved, or -errno:
+typedef void (*TunnelUringCallback)(TunnelUringOp *op, int result);
+
+// One request at a time, embedded in its owner (a TunnelClient).  The
+// owner, and the buffer, must stay allocated while in_flight is set, even
+// if the request was cancelled: its completion still comes.
+struct TunnelUringOp {
+    TunnelUringCallback callback;
+    void *arg;
+    int in_flight;
+};
+
+typedef struct TunnelUring {
+    int fd;
+
+    // The mmap()ed submission and completion rings:
+    unsigned *sq_tail, *sq_mask, *sq_flags, *sq_array, sq_entries;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size, sqes_size;
+
+    unsigned to_submit;     // Queued since the last io_uring_enter()
+    unsigned in_flight;     // Submitted or queued, not yet reaped
+
+    // Registered buffer slots, in pairs (one pair per client).  The free
+    // pairs are a stack; pair_count is 0 if the kernel can't do it:
+    int pair_count;
+    int *free_pairs;
+    int free_pair_count;
+
+    // EV_READ on fd, when completions are waiting:
+    struct event *on_completion_event;
+
+    // A software-only event, activated by the first request queued in a
+    // pass of the event loop, to submit them all:
+    struct event *on_submit_event;
+
+    TunnelMetrics *metrics;     // The thread's
+} TunnelUring;
+
+
+// Set up a ring on 'libevent_base' and start reaping its completions.
+// Returns NULL (having logged why) if the kernel can't:
+TunnelUring *tunnel_uring_new(struct event_base *libevent_base,
+                              TunnelMetrics *metrics);
+
+// Wait for the requests still in flight (cancel them first), and stop
+// reaping, so the event loop can exit:
+void tunnel_uring_stop(TunnelUring *uring);
+
+// Stop, and close the ring:
+void tunnel_uring_free(TunnelUring *uring);
+
+// Register 'buffers[0]' and 'buffers[1]', each 'size' bytes.  Returns
+// their pair for tunnel_uring_read()/_write(), or -1 if they can't be:
+int tunnel_uring_register(TunnelUring *uring, char *buffers[2], size_t size);
+void tunnel_uring_unregister(TunnelUring *uring, int pair);
+
+// Queue a read (into) or write (out of) 'size' bytes at 'data', on 'fd',
+// for 'op'.  'data' lies in buffer 'buffer' (0 or 1) of registered 'pair',
+// or 'pair' is -1.  'fd' must be blocking: io_uring hands a non-blocking
+// socket's EAGAIN back instead of waiting.  Returns -1 if the submission
+// queue is full (and can't be submitted):
+int tunnel_uring_read(TunnelUring *uring, TunnelUringOp *op, int fd,
+                      char *data, size_t size, int pair, int buffer);
+int tunnel_uring_write(TunnelUring *uring, TunnelUringOp *op, int fd,
+                       char *data, size_t size, int pair, int buffer);
+
+// Cancel 'op', if it's in flight.  It still completes (with -ECANCELED,
+// or its result if it beat the cancel).  Returns -1 if the submission
+// queue is full (and can't be submitted), leaving 'op' running:
+int tunnel_uring_cancel(TunnelUring *uring, TunnelUringOp *op);
+
+// Submit what's queued now, not at the end of the pass.  A socket must not
+// be closed while a request for it is queued: the fd could be reused first:
+void tunnel_uring_submit(TunnelUring *uring);
+
+#endif  // TUNNEL_URING_H